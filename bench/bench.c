@@ -0,0 +1,154 @@
+/*
+ * bench.c
+ *
+ * Copyright (c) 2007+, Ingo Oppermann
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * -----------------------------------------------------------------------------
+ *
+ * End-to-end benchmark of the processing phases of yamdi. The phases are
+ * timed one by one on the given input files.
+ *
+ * Compile with:
+ * gcc bench.c -o bench -Wall -O2 -lpthread -lm
+ *
+ * -----------------------------------------------------------------------------
+ */
+
+#define YAMDI_NO_MAIN
+#include "../yamdi.c"
+
+#include "bench.h"
+
+void benchReport(const char *phase, double seconds, uint64_t bytes, size_t ntags);
+
+int main(int argc, char **argv) {
+	int c, i;
+	char *outfile;
+	double t;
+	off_t filesize;
+	FILE *fp, *out;
+	FLV_t flv;
+
+	outfile = "/dev/null";
+
+	while((c = getopt(argc, argv, "o:h")) != -1) {
+		switch(c) {
+			case 'o':
+				outfile = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage: bench [-o output file] file ...\n");
+				fprintf(stderr, "\tThe output file defaults to /dev/null.\n");
+				exit(YAMDI_ERROR);
+		}
+	}
+
+	if(optind == argc) {
+		fprintf(stderr, "Usage: bench [-o output file] file ...\n");
+		exit(YAMDI_ERROR);
+	}
+
+	printf("%-32s %-9s %10s %10s %14s\n", "file", "phase", "seconds", "MB/s", "tags/s");
+
+	for(i = optind; i < argc; i++) {
+		fp = fopen(argv[i], "rb");
+		if(fp == NULL) {
+			fprintf(stderr, "Couldn't open %s.\n", argv[i]);
+			exit(YAMDI_ERROR);
+		}
+
+		out = fopen(outfile, "wb");
+		if(out == NULL) {
+			fprintf(stderr, "Couldn't open %s.\n", outfile);
+			exit(YAMDI_ERROR);
+		}
+
+		initFLV(&flv);
+		flv.options.addonmetadata = 1;
+
+		fseeko(fp, 0, SEEK_END);
+		filesize = ftello(fp);
+
+		printf("%s (%" PRIu64 " bytes)\n", argv[i], (uint64_t)filesize);
+
+		t = benchNow();
+		if(validateFLV(fp) != YAMDI_OK) {
+			fprintf(stderr, "%s is not a valid FLV file.\n", argv[i]);
+			exit(YAMDI_ERROR);
+		}
+		benchReport("validate", benchNow() - t, 0, 0);
+
+		t = benchNow();
+		if(indexFLV(&flv, fp) != YAMDI_OK)
+			exit(YAMDI_ERROR);
+		benchReport("index", benchNow() - t, (uint64_t)filesize, flv.index.nflvtags);
+
+		t = benchNow();
+		if(analyzeFLV(&flv, fp) != YAMDI_OK)
+			exit(YAMDI_ERROR);
+		benchReport("analyze", benchNow() - t, (uint64_t)filesize, flv.index.nflvtags);
+
+		t = benchNow();
+		if(finalizeFLV(&flv, fp) != YAMDI_OK)
+			exit(YAMDI_ERROR);
+		benchReport("finalize", benchNow() - t, 0, flv.index.nflvtags);
+
+		t = benchNow();
+		if(writeFLV(out, &flv, fp) != YAMDI_OK)
+			exit(YAMDI_ERROR);
+		fflush(out);
+		benchReport("write", benchNow() - t, flv.filesize, flv.index.nflvtags);
+
+		printf("%-32s %-9s %" PRIu64 " tags, %" PRIu64 " keyframes, %ld kB peak RSS\n", "", "total", (uint64_t)flv.index.nflvtags, (uint64_t)flv.keyframes.nkeyframes, benchPeakRSS());
+
+		freeFLV(&flv);
+
+		fclose(out);
+		fclose(fp);
+	}
+
+	return YAMDI_OK;
+}
+
+void benchReport(const char *phase, double seconds, uint64_t bytes, size_t ntags) {
+	char mbs[32], tps[32];
+
+	if(bytes != 0 && seconds > 0.0)
+		snprintf(mbs, sizeof(mbs), "%.1f", (double)bytes / 1048576.0 / seconds);
+	else
+		snprintf(mbs, sizeof(mbs), "-");
+
+	if(ntags != 0 && seconds > 0.0)
+		snprintf(tps, sizeof(tps), "%.0f", (double)ntags / seconds);
+	else
+		snprintf(tps, sizeof(tps), "-");
+
+	printf("%-32s %-9s %10.4f %10s %14s\n", "", phase, seconds, mbs, tps);
+
+	return;
+}
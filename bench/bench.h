@@ -0,0 +1,95 @@
+/*
+ * bench.h
+ *
+ * Copyright (c) 2007+, Ingo Oppermann
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * -----------------------------------------------------------------------------
+ *
+ * Helpers shared by the benchmarks.
+ *
+ * -----------------------------------------------------------------------------
+ */
+
+#ifndef YAMDI_BENCH_H
+#define YAMDI_BENCH_H
+
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+// Wall clock time in seconds
+static inline double benchNow(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Peak resident set size of this process in kB
+static inline long benchPeakRSS(void) {
+	struct rusage ru;
+
+	if(getrusage(RUSAGE_SELF, &ru) != 0)
+		return 0;
+
+#ifdef __APPLE__
+	return ru.ru_maxrss / 1024;
+#else
+	return ru.ru_maxrss;
+#endif
+}
+
+// Parse a size like 512, 64K, 16M or 50G
+static inline uint64_t benchParseSize(const char *s) {
+	char *end;
+	uint64_t size;
+
+	size = (uint64_t)strtoull(s, &end, 10);
+
+	switch(*end) {
+		case 'k':
+		case 'K':
+			size *= 1024ULL;
+			break;
+		case 'm':
+		case 'M':
+			size *= 1024ULL * 1024ULL;
+			break;
+		case 'g':
+		case 'G':
+			size *= 1024ULL * 1024ULL * 1024ULL;
+			break;
+		default:
+			break;
+	}
+
+	return size;
+}
+
+#endif
@@ -0,0 +1,580 @@
+/*
+ * flvgen.c
+ *
+ * Copyright (c) 2007+, Ingo Oppermann
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * -----------------------------------------------------------------------------
+ *
+ * Deterministic generator of synthetic FLV files for the benchmarks.
+ *
+ * Compile with:
+ * gcc flvgen.c -o flvgen -Wall -O2
+ *
+ * -----------------------------------------------------------------------------
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "bench.h"
+
+#define FLVGEN_VIDEO_NONE		0
+#define FLVGEN_VIDEO_H263		2
+#define FLVGEN_VIDEO_VP6		4
+#define FLVGEN_VIDEO_H264		7
+
+#define FLVGEN_AUDIO_NONE		-1
+#define FLVGEN_AUDIO_MP3		2
+#define FLVGEN_AUDIO_AAC		10
+
+#define FLVGEN_FRAMEDURATION_VIDEO	40	// 25 fps
+#define FLVGEN_FRAMEDURATION_AUDIO	23	// ~1024 samples at 44.1 kHz
+
+typedef struct {
+	FILE *fp;
+	uint64_t size;			// Bytes written so far
+	uint64_t ntags;			// Tags written so far
+	uint32_t seed;			// State of the random number generator
+
+	unsigned char *payload;		// Random bytes the tag payloads are taken from
+	size_t payloadsize;
+} flvgen_t;
+
+typedef struct {
+	unsigned char bytes[64];
+	size_t byte;
+	int bit;
+} bitwriter_t;
+
+uint32_t flvgenRandom(flvgen_t *gen);
+size_t flvgenPayloadSize(flvgen_t *gen, size_t size);
+void flvgenWriteTag(flvgen_t *gen, int type, int timestamp, const unsigned char *header, size_t headersize, size_t payloadsize);
+void flvgenWriteScriptTag(flvgen_t *gen, const char *name, int timestamp);
+void flvgenWriteVideoTag(flvgen_t *gen, int codec, int timestamp, int keyframe, int width, int height, size_t payloadsize);
+void flvgenWriteAudioTag(flvgen_t *gen, int codec, int timestamp, size_t payloadsize);
+void flvgenWriteH264SequenceHeader(flvgen_t *gen, int width, int height);
+void flvgenWriteAACSequenceHeader(flvgen_t *gen);
+
+void writeBits(bitwriter_t *bw, int nbits, unsigned int value);
+void writeCodedUE(bitwriter_t *bw, unsigned int value);
+size_t finishBits(bitwriter_t *bw);
+
+void printUsage(void);
+
+int main(int argc, char **argv) {
+	int c, video, audio, gop, scriptinterval, width, height;
+	int videotimestamp, audiotimestamp, videoframe;
+	uint64_t size, ntags;
+	size_t payloadsize, i;
+	char *outfile;
+	flvgen_t gen;
+	unsigned char header[13] = {'F', 'L', 'V', 1, 0, 0, 0, 0, 9, 0, 0, 0, 0};
+
+	outfile = NULL;
+	size = 0;
+	ntags = 0;
+	video = FLVGEN_VIDEO_H264;
+	audio = FLVGEN_AUDIO_AAC;
+	gop = 50;
+	payloadsize = 2048;
+	scriptinterval = 0;
+	width = 1280;
+	height = 720;
+
+	memset(&gen, 0, sizeof(flvgen_t));
+	gen.seed = 1;
+
+	while((c = getopt(argc, argv, "o:s:n:v:a:g:p:S:r:W:H:h")) != -1) {
+		switch(c) {
+			case 'o':
+				outfile = optarg;
+				break;
+			case 's':
+				size = benchParseSize(optarg);
+				break;
+			case 'n':
+				ntags = (uint64_t)strtoull(optarg, NULL, 10);
+				break;
+			case 'v':
+				if(!strcmp(optarg, "h263"))
+					video = FLVGEN_VIDEO_H263;
+				else if(!strcmp(optarg, "vp6"))
+					video = FLVGEN_VIDEO_VP6;
+				else if(!strcmp(optarg, "h264"))
+					video = FLVGEN_VIDEO_H264;
+				else if(!strcmp(optarg, "none"))
+					video = FLVGEN_VIDEO_NONE;
+				else {
+					fprintf(stderr, "Unknown video codec: %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'a':
+				if(!strcmp(optarg, "mp3"))
+					audio = FLVGEN_AUDIO_MP3;
+				else if(!strcmp(optarg, "aac"))
+					audio = FLVGEN_AUDIO_AAC;
+				else if(!strcmp(optarg, "none"))
+					audio = FLVGEN_AUDIO_NONE;
+				else {
+					fprintf(stderr, "Unknown audio codec: %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'g':
+				gop = (int)strtol(optarg, NULL, 10);
+				break;
+			case 'p':
+				payloadsize = (size_t)benchParseSize(optarg);
+				break;
+			case 'S':
+				scriptinterval = (int)strtol(optarg, NULL, 10);
+				break;
+			case 'r':
+				gen.seed = (uint32_t)strtoul(optarg, NULL, 10);
+				break;
+			case 'W':
+				width = (int)strtol(optarg, NULL, 10);
+				break;
+			case 'H':
+				height = (int)strtol(optarg, NULL, 10);
+				break;
+			default:
+				printUsage();
+				exit(1);
+		}
+	}
+
+	if(outfile == NULL || (size == 0 && ntags == 0) || gop <= 0 || payloadsize < 16 || width <= 0 || height <= 0 || (video == FLVGEN_VIDEO_NONE && audio == FLVGEN_AUDIO_NONE)) {
+		printUsage();
+		exit(1);
+	}
+
+	if(!strcmp(outfile, "-"))
+		gen.fp = stdout;
+	else
+		gen.fp = fopen(outfile, "wb");
+
+	if(gen.fp == NULL) {
+		fprintf(stderr, "Couldn't open %s.\n", outfile);
+		exit(1);
+	}
+
+	setvbuf(gen.fp, NULL, _IOFBF, 1024 * 1024);
+
+	// The payloads are slices of a block of random bytes. Large enough for
+	// the keyframes, which are 4 times the average payload size.
+	gen.payloadsize = 8 * payloadsize + 4096;
+	gen.payload = (unsigned char *)malloc(gen.payloadsize);
+	if(gen.payload == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+
+	for(i = 0; i < gen.payloadsize; i++)
+		gen.payload[i] = (unsigned char)(flvgenRandom(&gen) >> 24);
+
+	// FLV header and PreviousTagSize0
+	if(audio != FLVGEN_AUDIO_NONE)
+		header[4] |= 0x4;
+
+	if(video != FLVGEN_VIDEO_NONE)
+		header[4] |= 0x1;
+
+	fwrite(header, sizeof(header), 1, gen.fp);
+	gen.size = sizeof(header);
+
+	// An old onMetaData event that will be replaced
+	flvgenWriteScriptTag(&gen, "onMetaData", 0);
+
+	if(video == FLVGEN_VIDEO_H264)
+		flvgenWriteH264SequenceHeader(&gen, width, height);
+
+	if(audio == FLVGEN_AUDIO_AAC)
+		flvgenWriteAACSequenceHeader(&gen);
+
+	// Interleave the video and audio frames by their timestamps
+	videotimestamp = 0;
+	audiotimestamp = 0;
+	videoframe = 0;
+
+	while((size == 0 || gen.size < size) && (ntags == 0 || gen.ntags < ntags)) {
+		if(video != FLVGEN_VIDEO_NONE && (audio == FLVGEN_AUDIO_NONE || videotimestamp <= audiotimestamp)) {
+			if((videoframe % gop) == 0)
+				flvgenWriteVideoTag(&gen, video, videotimestamp, 1, width, height, flvgenPayloadSize(&gen, 4 * payloadsize));
+			else
+				flvgenWriteVideoTag(&gen, video, videotimestamp, 0, width, height, flvgenPayloadSize(&gen, payloadsize));
+
+			videoframe++;
+			videotimestamp += FLVGEN_FRAMEDURATION_VIDEO;
+
+			if(scriptinterval > 0 && (videoframe % scriptinterval) == 0)
+				flvgenWriteScriptTag(&gen, "onCuePoint", videotimestamp);
+		}
+		else {
+			flvgenWriteAudioTag(&gen, audio, audiotimestamp, flvgenPayloadSize(&gen, payloadsize / 4));
+
+			audiotimestamp += FLVGEN_FRAMEDURATION_AUDIO;
+		}
+	}
+
+	if(gen.fp != stdout)
+		fclose(gen.fp);
+	else
+		fflush(gen.fp);
+
+	free(gen.payload);
+
+	fprintf(stderr, "%s: %" PRIu64 " bytes, %" PRIu64 " tags, %.2f s\n", outfile, gen.size, gen.ntags, (double)(videotimestamp > audiotimestamp ? videotimestamp : audiotimestamp) / 1000.0);
+
+	return 0;
+}
+
+uint32_t flvgenRandom(flvgen_t *gen) {
+	// Numerical Recipes LCG. Good enough and the same on every platform.
+	gen->seed = gen->seed * 1664525U + 1013904223U;
+
+	return gen->seed;
+}
+
+size_t flvgenPayloadSize(flvgen_t *gen, size_t size) {
+	// Between 50% and 150% of the given size
+	return size / 2 + (flvgenRandom(&*gen) >> 8) % (size + 1);
+}
+
+void flvgenWriteTag(flvgen_t *gen, int type, int timestamp, const unsigned char *header, size_t headersize, size_t payloadsize) {
+	size_t datasize, offset;
+	unsigned char bytes[11];
+
+	datasize = headersize + payloadsize;
+
+	bytes[ 0] = type;
+	bytes[ 1] = ((datasize >> 16) & 0xff);
+	bytes[ 2] = ((datasize >>  8) & 0xff);
+	bytes[ 3] = ((datasize >>  0) & 0xff);
+	bytes[ 4] = ((timestamp >> 16) & 0xff);
+	bytes[ 5] = ((timestamp >>  8) & 0xff);
+	bytes[ 6] = ((timestamp >>  0) & 0xff);
+	bytes[ 7] = ((timestamp >> 24) & 0xff);
+	bytes[ 8] = 0;
+	bytes[ 9] = 0;
+	bytes[10] = 0;
+
+	fwrite(bytes, sizeof(bytes), 1, gen->fp);
+
+	if(headersize != 0)
+		fwrite(header, headersize, 1, gen->fp);
+
+	if(payloadsize != 0) {
+		offset = (flvgenRandom(gen) >> 8) % (gen->payloadsize - payloadsize + 1);
+		fwrite(&gen->payload[offset], payloadsize, 1, gen->fp);
+	}
+
+	datasize += 11;
+
+	bytes[0] = ((datasize >> 24) & 0xff);
+	bytes[1] = ((datasize >> 16) & 0xff);
+	bytes[2] = ((datasize >>  8) & 0xff);
+	bytes[3] = ((datasize >>  0) & 0xff);
+
+	fwrite(bytes, 4, 1, gen->fp);
+
+	gen->size += datasize + 4;
+	gen->ntags++;
+
+	return;
+}
+
+void flvgenWriteScriptTag(flvgen_t *gen, const char *name, int timestamp) {
+	size_t len;
+	unsigned char data[64];
+
+	// SCRIPTDATASTRING name, followed by an empty ECMA array
+	len = strlen(name);
+
+	data[0] = 2;
+	data[1] = ((len >> 8) & 0xff);
+	data[2] = ((len >> 0) & 0xff);
+	memcpy(&data[3], name, len);
+	len += 3;
+
+	data[len++] = 8;
+	data[len++] = 0;
+	data[len++] = 0;
+	data[len++] = 0;
+	data[len++] = 0;
+	data[len++] = 0;
+	data[len++] = 0;
+	data[len++] = 9;
+
+	flvgenWriteTag(gen, 18, timestamp, data, len, 0);
+
+	return;
+}
+
+void flvgenWriteVideoTag(flvgen_t *gen, int codec, int timestamp, int keyframe, int width, int height, size_t payloadsize) {
+	size_t len = 0;
+	unsigned char data[32];
+	bitwriter_t bw;
+
+	// VIDEODATA: FrameType and CodecID
+	data[len++] = ((keyframe == 1 ? 1 : 2) << 4) | codec;
+
+	switch(codec) {
+		case FLVGEN_VIDEO_H263:
+			// Sorenson H.263 picture header with a custom 16 bit picture size
+			memset(&bw, 0, sizeof(bitwriter_t));
+			writeBits(&bw, 17, 1);				// PictureStartCode
+			writeBits(&bw, 5, 0);				// Version
+			writeBits(&bw, 8, timestamp / FLVGEN_FRAMEDURATION_VIDEO);	// TemporalReference
+			writeBits(&bw, 3, 1);				// PictureSize
+			writeBits(&bw, 16, width);
+			writeBits(&bw, 16, height);
+			writeBits(&bw, 2, keyframe == 1 ? 0 : 1);	// PictureType
+			writeBits(&bw, 1, 0);				// DeblockingFlag
+			writeBits(&bw, 5, 8);				// Quantizer
+			writeBits(&bw, 1, 0);				// ExtraInformationFlag
+			len += finishBits(&bw);
+			memcpy(&data[1], bw.bytes, len - 1);
+			break;
+		case FLVGEN_VIDEO_VP6:
+			// VP6FLVVIDEOPACKET: horizontal and vertical adjustment
+			data[len++] = (((16 - width % 16) % 16) << 4) | ((16 - height % 16) % 16);
+
+			if(keyframe == 1) {
+				data[len++] = (0 << 7) | (20 << 1) | 0;	// FrameMode, Quantizer, Marker
+				data[len++] = (6 << 3) | (3 << 1) | 0;	// Version, Version2, Interlace
+				data[len++] = (height + 15) / 16;	// Macroblock rows
+				data[len++] = (width + 15) / 16;	// Macroblock columns
+				data[len++] = (height + 15) / 16;	// Displayed macroblock rows
+				data[len++] = (width + 15) / 16;	// Displayed macroblock columns
+			}
+			else
+				data[len++] = (1 << 7) | (20 << 1) | 0;
+			break;
+		case FLVGEN_VIDEO_H264:
+			// AVCVIDEOPACKET with an access unit delimiter and one slice
+			data[len++] = 1;				// AVCPacketType
+			data[len++] = 0;				// CompositionTime
+			data[len++] = 0;
+			data[len++] = 0;
+
+			data[len++] = 0;				// AUD
+			data[len++] = 0;
+			data[len++] = 0;
+			data[len++] = 2;
+			data[len++] = 0x09;
+			data[len++] = 0xf0;
+
+			data[len++] = ((payloadsize + 1) >> 24) & 0xff;	// Slice
+			data[len++] = ((payloadsize + 1) >> 16) & 0xff;
+			data[len++] = ((payloadsize + 1) >>  8) & 0xff;
+			data[len++] = ((payloadsize + 1) >>  0) & 0xff;
+			data[len++] = (keyframe == 1) ? 0x65 : 0x41;
+			break;
+		default:
+			break;
+	}
+
+	flvgenWriteTag(gen, 9, timestamp, data, len, payloadsize);
+
+	return;
+}
+
+void flvgenWriteAudioTag(flvgen_t *gen, int codec, int timestamp, size_t payloadsize) {
+	size_t len = 0;
+	unsigned char data[2];
+
+	// AUDIODATA: 44 kHz, 16 bit, stereo
+	data[len++] = (codec << 4) | (3 << 2) | (1 << 1) | 1;
+
+	// AACPacketType: raw
+	if(codec == FLVGEN_AUDIO_AAC)
+		data[len++] = 1;
+
+	flvgenWriteTag(gen, 8, timestamp, data, len, payloadsize);
+
+	return;
+}
+
+void flvgenWriteH264SequenceHeader(flvgen_t *gen, int width, int height) {
+	size_t i, len, spslen;
+	int mbwidth, mbheight;
+	unsigned char data[128];
+	bitwriter_t bw;
+
+	mbwidth = (width + 15) / 16;
+	mbheight = (height + 15) / 16;
+
+	// Sequence parameter set (14496-10, 7.3.2.1), High profile
+	memset(&bw, 0, sizeof(bitwriter_t));
+	writeBits(&bw, 8, 100);				// profile_idc
+	writeBits(&bw, 8, 0);				// constraint flags
+	writeBits(&bw, 8, 31);				// level_idc
+	writeCodedUE(&bw, 0);				// seq_parameter_set_id
+	writeCodedUE(&bw, 1);				// chroma_format_idc
+	writeCodedUE(&bw, 0);				// bit_depth_luma_minus8
+	writeCodedUE(&bw, 0);				// bit_depth_chroma_minus8
+	writeBits(&bw, 1, 0);				// qpprime_y_zero_transform_bypass_flag
+	writeBits(&bw, 1, 0);				// seq_scaling_matrix_present_flag
+	writeCodedUE(&bw, 0);				// log2_max_frame_num_minus4
+	writeCodedUE(&bw, 0);				// pic_order_cnt_type
+	writeCodedUE(&bw, 0);				// log2_max_pic_order_cnt_lsb_minus4
+	writeCodedUE(&bw, 4);				// max_num_ref_frames
+	writeBits(&bw, 1, 0);				// gaps_in_frame_num_value_allowed_flag
+	writeCodedUE(&bw, mbwidth - 1);			// pic_width_in_mbs_minus1
+	writeCodedUE(&bw, mbheight - 1);		// pic_height_in_map_units_minus1
+	writeBits(&bw, 1, 1);				// frame_mbs_only_flag
+	writeBits(&bw, 1, 1);				// direct_8x8_inference_flag
+
+	if(mbwidth * 16 != width || mbheight * 16 != height) {
+		writeBits(&bw, 1, 1);			// frame_cropping_flag
+		writeCodedUE(&bw, 0);
+		writeCodedUE(&bw, (mbwidth * 16 - width) / 2);
+		writeCodedUE(&bw, 0);
+		writeCodedUE(&bw, (mbheight * 16 - height) / 2);
+	}
+	else
+		writeBits(&bw, 1, 0);
+
+	writeBits(&bw, 1, 0);				// vui_parameters_present_flag
+	writeBits(&bw, 1, 1);				// rbsp_stop_one_bit
+	spslen = finishBits(&bw);
+
+	// AVCVIDEOPACKET with an AVCDecoderConfigurationRecord
+	len = 0;
+	data[len++] = 0x17;
+	data[len++] = 0;
+	data[len++] = 0;
+	data[len++] = 0;
+	data[len++] = 0;
+
+	data[len++] = 1;				// configurationVersion
+	data[len++] = 100;				// AVCProfileIndication
+	data[len++] = 0;				// profile_compatibility
+	data[len++] = 31;				// AVCLevelIndication
+	data[len++] = 0xff;				// lengthSizeMinusOne = 3
+	data[len++] = 0xe1;				// numOfSequenceParameterSets = 1
+
+	i = len;
+	len += 2;
+	data[len++] = 0x67;
+
+	// Emulation prevention
+	for(spslen = 0; spslen < bw.byte; spslen++) {
+		if(len - i >= 5 && data[len - 1] == 0 && data[len - 2] == 0 && bw.bytes[spslen] <= 3)
+			data[len++] = 3;
+
+		data[len++] = bw.bytes[spslen];
+	}
+
+	data[i + 0] = ((len - i - 2) >> 8) & 0xff;
+	data[i + 1] = ((len - i - 2) >> 0) & 0xff;
+
+	data[len++] = 1;				// numOfPictureParameterSets
+	data[len++] = 0;
+	data[len++] = 4;
+	data[len++] = 0x68;
+	data[len++] = 0xce;
+	data[len++] = 0x38;
+	data[len++] = 0x80;
+
+	flvgenWriteTag(gen, 9, 0, data, len, 0);
+
+	return;
+}
+
+void flvgenWriteAACSequenceHeader(flvgen_t *gen) {
+	// AudioSpecificConfig: AAC LC, 44.1 kHz, stereo
+	unsigned char data[4] = {0xaf, 0x00, 0x12, 0x10};
+
+	flvgenWriteTag(gen, 8, 0, data, sizeof(data), 0);
+
+	return;
+}
+
+void writeBits(bitwriter_t *bw, int nbits, unsigned int value) {
+	int i;
+
+	for(i = nbits - 1; i >= 0; i--) {
+		if((value >> i) & 1)
+			bw->bytes[bw->byte] |= (0x80 >> bw->bit);
+
+		bw->bit++;
+		if(bw->bit == 8) {
+			bw->byte++;
+			bw->bit = 0;
+		}
+	}
+
+	return;
+}
+
+void writeCodedUE(bitwriter_t *bw, unsigned int value) {
+	int nbits = 0;
+	unsigned int v;
+
+	// Exp-Golomb (see 14496-10, 9.1)
+	value++;
+	for(v = value; v > 1; v >>= 1)
+		nbits++;
+
+	writeBits(bw, nbits, 0);
+	writeBits(bw, nbits + 1, value);
+
+	return;
+}
+
+size_t finishBits(bitwriter_t *bw) {
+	// Pad to the next byte
+	if(bw->bit != 0) {
+		bw->byte++;
+		bw->bit = 0;
+	}
+
+	return bw->byte;
+}
+
+void printUsage(void) {
+	fprintf(stderr, "Usage: flvgen -o file (-s size | -n tags) [-v h263|vp6|h264|none] [-a mp3|aac|none]\n");
+	fprintf(stderr, "              [-g gop] [-p payload] [-S script interval] [-W width] [-H height] [-r seed]\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\t-s\tStop after this many bytes, e.g. 64M or 50G.\n");
+	fprintf(stderr, "\t-n\tStop after this many tags.\n");
+	fprintf(stderr, "\t-g\tA keyframe every n video frames (default 50).\n");
+	fprintf(stderr, "\t-p\tAverage payload size of a video frame (default 2K). Audio\n");
+	fprintf(stderr, "\t\tframes are a quarter and keyframes 4 times that size.\n");
+	fprintf(stderr, "\t-S\tAn onCuePoint script tag every n video frames.\n");
+	fprintf(stderr, "\t-r\tSeed of the random number generator (default 1).\n");
+
+	return;
+}
@@ -0,0 +1,404 @@
+/*
+ * microbench.c
+ *
+ * Copyright (c) 2007+, Ingo Oppermann
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * -----------------------------------------------------------------------------
+ *
+ * Microbenchmarks of the inner kernels of yamdi, without any disk I/O.
+ *
+ * Compile with:
+ * gcc microbench.c -o microbench -Wall -O2 -lpthread -lm
+ *
+ * -----------------------------------------------------------------------------
+ */
+
+#define YAMDI_NO_MAIN
+#include "../yamdi.c"
+
+#include "bench.h"
+
+#define MICROBENCH_NKEYFRAMES		100000
+#define MICROBENCH_NTAGS		1000000
+#define MICROBENCH_NCODES		1000000
+#define MICROBENCH_BLOCKSIZE		(1024 * 1024)
+
+typedef struct {
+	const char *name;
+	void (*run)(void);		// One iteration of the kernel
+	uint64_t nops;			// # of operations per iteration
+	uint64_t nbytes;		// # of bytes per iteration
+	int iterations;
+} microbench_t;
+
+// Real sequence parameter sets of x264 and hardware encoders, with NALU header
+static const char *h264sps[] = {
+	"67 64 00 1f ac d9 40 50 05 bb 01 10 00 00 03 00 10 00 00 03 03 c0 f1 83 19 60",
+	"67 42 c0 1e d9 00 a0 3d a1 00 00 03 00 01 00 00 03 00 32 0f 16 2e 48",
+	"67 64 00 28 ac d9 40 78 02 27 e5 c0 44 00 00 03 00 04 00 00 03 00 c8 3c 60 c6 58",
+	"67 4d 40 1f e8 80 28 02 dd 80 b5 01 01 01 40 00 00 03 00 40 00 00 0c 03 c6 0c 44 80",
+	NULL
+};
+
+static struct {
+	buffer_t buffer;
+	buffer_t rbsp;
+
+	unsigned char sps[4][64];
+	int spslength[4];
+
+	unsigned char *codes;		// Exp-Golomb coded numbers
+	size_t codeslength;
+
+	unsigned char *tags;		// Packed tag headers
+	FLVTag_t flvtag;
+
+	FLV_t flv;
+	FILE *devnull;
+
+	unsigned char *block;		// Output bytes for the checksums
+	checksum_t checksum;
+
+	uint64_t sink;			// Keeps the compiler from removing the kernels
+} state;
+
+void setupMicrobench(void);
+void runMicrobench(microbench_t *bench, int repeats);
+
+void benchWriteDoubles(void);
+void benchAppendBytes(void);
+void benchReadH264SPS(void);
+void benchReadCodedUE(void);
+void benchReadBits(void);
+void benchTagHeaderMacros(void);
+void benchParseFLVTagHeader(void);
+void benchWriteXMLMetadata(void);
+void benchCRC32C(void);
+void benchCRC32CSoftware(void);
+void benchXXH64(void);
+void benchSHA256(void);
+
+int main(int argc, char **argv) {
+	int c, i, repeats;
+	double scale;
+
+	microbench_t benches[] = {
+		{"writeBufferFLVScriptDataValueDouble", benchWriteDoubles, 2 * MICROBENCH_NKEYFRAMES, 2 * MICROBENCH_NKEYFRAMES * 9, 20},
+		{"bufferAppendBytes (9 bytes)", benchAppendBytes, 2 * MICROBENCH_NKEYFRAMES, 2 * MICROBENCH_NKEYFRAMES * 9, 20},
+		{"readH264NALUnit (SPS)", benchReadH264SPS, 4, 0, 200000},
+		{"readCodedUE", benchReadCodedUE, MICROBENCH_NCODES, 0, 10},
+		{"readBits (1..32 bits)", benchReadBits, MICROBENCH_NCODES, 0, 10},
+		{"FLV_UI24/FLV_TIMESTAMP", benchTagHeaderMacros, MICROBENCH_NTAGS, MICROBENCH_NTAGS * FLV_SIZE_TAGHEADER, 10},
+		{"parseFLVTagHeader", benchParseFLVTagHeader, MICROBENCH_NTAGS, MICROBENCH_NTAGS * FLV_SIZE_TAGHEADER, 10},
+		{"writeXMLMetadata (per keyframe)", benchWriteXMLMetadata, MICROBENCH_NKEYFRAMES, 0, 5},
+		{"crc32cUpdate (1 MB)", benchCRC32C, 1, MICROBENCH_BLOCKSIZE, 200},
+		{"crc32cSoftware (1 MB)", benchCRC32CSoftware, 1, MICROBENCH_BLOCKSIZE, 50},
+		{"xxh64Update (1 MB)", benchXXH64, 1, MICROBENCH_BLOCKSIZE, 100},
+		{"sha256Update (1 MB)", benchSHA256, 1, MICROBENCH_BLOCKSIZE, 10},
+		{NULL, NULL, 0, 0, 0}
+	};
+
+	repeats = 5;
+	scale = 1.0;
+
+	while((c = getopt(argc, argv, "r:s:h")) != -1) {
+		switch(c) {
+			case 'r':
+				repeats = (int)strtol(optarg, NULL, 10);
+				break;
+			case 's':
+				scale = strtod(optarg, NULL);
+				break;
+			default:
+				fprintf(stderr, "Usage: microbench [-r repeats] [-s scale]\n");
+				fprintf(stderr, "\t-r\tRuns per kernel, the fastest run counts (default 5).\n");
+				fprintf(stderr, "\t-s\tScale the iteration counts (default 1.0).\n");
+				exit(YAMDI_ERROR);
+		}
+	}
+
+	if(repeats <= 0 || scale <= 0.0) {
+		fprintf(stderr, "Usage: microbench [-r repeats] [-s scale]\n");
+		exit(YAMDI_ERROR);
+	}
+
+	setupMicrobench();
+
+	printf("%-38s %12s %12s %10s\n", "kernel", "ns/op", "MB/s", "iterations");
+
+	for(i = 0; benches[i].name != NULL; i++) {
+		benches[i].iterations = (int)((double)benches[i].iterations * scale);
+		if(benches[i].iterations == 0)
+			benches[i].iterations = 1;
+
+		runMicrobench(&benches[i], repeats);
+	}
+
+	return YAMDI_OK;
+}
+
+void setupMicrobench(void) {
+	int i, j, nbits;
+	unsigned int x, value;
+	size_t bit, n;
+	const char *hex;
+
+	bufferInit(&state.buffer);
+	bufferInit(&state.rbsp);
+
+	for(i = 0; h264sps[i] != NULL; i++) {
+		hex = h264sps[i];
+		while(sscanf(hex, "%2x", &x) == 1) {
+			state.sps[i][state.spslength[i]++] = (unsigned char)x;
+
+			hex += 2;
+			while(*hex == ' ')
+				hex++;
+		}
+	}
+
+	// Exp-Golomb codes of small numbers, like in a slice header
+	state.codeslength = MICROBENCH_NCODES * 4 + 8;
+	state.codes = (unsigned char *)calloc(1, state.codeslength);
+
+	bit = 0;
+	for(n = 0; n < MICROBENCH_NCODES; n++) {
+		value = (((unsigned int)n * 2654435761U) >> 24) + 1;
+
+		for(nbits = 0, x = value; x > 1; x >>= 1)
+			nbits++;
+
+		bit += nbits;
+		for(j = nbits; j >= 0; j--, bit++) {
+			if((value >> j) & 1)
+				state.codes[bit >> 3] |= (0x80 >> (bit & 7));
+		}
+	}
+
+	// Tag headers back to back
+	state.tags = (unsigned char *)calloc(MICROBENCH_NTAGS, FLV_SIZE_TAGHEADER);
+	for(n = 0; n < MICROBENCH_NTAGS; n++) {
+		state.tags[n * FLV_SIZE_TAGHEADER + 0] = (n & 1) ? FLV_TAG_AUDIO : FLV_TAG_VIDEO;
+		state.tags[n * FLV_SIZE_TAGHEADER + 1] = (n >> 16) & 0xff;
+		state.tags[n * FLV_SIZE_TAGHEADER + 2] = (n >> 8) & 0xff;
+		state.tags[n * FLV_SIZE_TAGHEADER + 3] = n & 0xff;
+		state.tags[n * FLV_SIZE_TAGHEADER + 4] = ((n * 40) >> 16) & 0xff;
+		state.tags[n * FLV_SIZE_TAGHEADER + 5] = ((n * 40) >> 8) & 0xff;
+		state.tags[n * FLV_SIZE_TAGHEADER + 6] = (n * 40) & 0xff;
+		state.tags[n * FLV_SIZE_TAGHEADER + 7] = ((n * 40) >> 24) & 0xff;
+	}
+
+	// A file with a lot of keyframes
+	initFLV(&state.flv);
+	state.flv.hasvideo = 1;
+	state.flv.hasaudio = 1;
+	state.flv.haskeyframes = 1;
+	state.flv.keyframes.nkeyframes = MICROBENCH_NKEYFRAMES;
+	state.flv.keyframes.keyframelocations = (off_t *)calloc(MICROBENCH_NKEYFRAMES, sizeof(off_t));
+	state.flv.keyframes.keyframetimestamps = (int *)calloc(MICROBENCH_NKEYFRAMES, sizeof(int));
+
+	for(n = 0; n < MICROBENCH_NKEYFRAMES; n++) {
+		state.flv.keyframes.keyframelocations[n] = (off_t)(n * 524288 + 1034 + (n * 7919) % 4096);
+		state.flv.keyframes.keyframetimestamps[n] = (int)(n * 2000 + (n * 31) % 40);
+	}
+
+	// Pseudo random bytes for the checksums
+	checksumSetup();
+	checksumInit(&state.checksum, YAMDI_CHECKSUM_CRC32C | YAMDI_CHECKSUM_XXH64 | YAMDI_CHECKSUM_SHA256);
+
+	state.block = (unsigned char *)malloc(MICROBENCH_BLOCKSIZE);
+	for(n = 0, x = 1; n < MICROBENCH_BLOCKSIZE; n++) {
+		x = x * 1103515245 + 12345;
+		state.block[n] = (x >> 16) & 0xff;
+	}
+
+	state.devnull = fopen("/dev/null", "wb");
+	if(state.devnull == NULL) {
+		fprintf(stderr, "Couldn't open /dev/null.\n");
+		exit(YAMDI_ERROR);
+	}
+
+	return;
+}
+
+void runMicrobench(microbench_t *bench, int repeats) {
+	int r, i;
+	double t, best;
+	char mbs[32];
+
+	// Warm up
+	bench->run();
+
+	best = 0.0;
+	for(r = 0; r < repeats; r++) {
+		t = benchNow();
+		for(i = 0; i < bench->iterations; i++)
+			bench->run();
+		t = benchNow() - t;
+
+		if(r == 0 || t < best)
+			best = t;
+	}
+
+	if(bench->nbytes != 0)
+		snprintf(mbs, sizeof(mbs), "%.1f", (double)bench->nbytes * bench->iterations / 1048576.0 / best);
+	else
+		snprintf(mbs, sizeof(mbs), "-");
+
+	printf("%-38s %12.2f %12s %10d\n", bench->name, best * 1e9 / ((double)bench->nops * bench->iterations), mbs, bench->iterations);
+
+	return;
+}
+
+void benchWriteDoubles(void) {
+	size_t i;
+
+	// The keyframes object of onMetaData
+	bufferReset(&state.buffer);
+
+	for(i = 0; i < MICROBENCH_NKEYFRAMES; i++)
+		writeBufferFLVScriptDataValueDouble(&state.buffer, NULL, (double)state.flv.keyframes.keyframelocations[i]);
+
+	for(i = 0; i < MICROBENCH_NKEYFRAMES; i++)
+		writeBufferFLVScriptDataValueDouble(&state.buffer, NULL, (double)state.flv.keyframes.keyframetimestamps[i] / 1000.0);
+
+	state.sink += state.buffer.used;
+
+	return;
+}
+
+void benchAppendBytes(void) {
+	size_t i;
+	unsigned char bytes[9] = {0, 0x40, 0x8f, 0x40, 0, 0, 0, 0, 0};
+
+	bufferReset(&state.buffer);
+
+	for(i = 0; i < 2 * MICROBENCH_NKEYFRAMES; i++)
+		bufferAppendBytes(&state.buffer, bytes, sizeof(bytes));
+
+	state.sink += state.buffer.used;
+
+	return;
+}
+
+void benchReadH264SPS(void) {
+	int i;
+	h264data_t h264data;
+
+	for(i = 0; i < 4; i++) {
+		memset(&h264data, 0, sizeof(h264data_t));
+		readH264NALUnit(&h264data, &state.rbsp, state.sps[i], state.spslength[i]);
+
+		state.sink += h264data.width;
+	}
+
+	return;
+}
+
+void benchReadCodedUE(void) {
+	size_t n;
+	bitstream_t bitstream;
+
+	bitstreamInit(&bitstream, state.codes, state.codeslength);
+
+	for(n = 0; n < MICROBENCH_NCODES; n++)
+		state.sink += readCodedUE(&bitstream, NULL);
+
+	return;
+}
+
+void benchReadBits(void) {
+	size_t n;
+	bitstream_t bitstream;
+
+	bitstreamInit(&bitstream, state.codes, state.codeslength);
+
+	for(n = 0; n < MICROBENCH_NCODES; n++)
+		state.sink += readBits(&bitstream, (int)(n & 31) + 1) & 0xff;
+
+	return;
+}
+
+void benchTagHeaderMacros(void) {
+	size_t n;
+	unsigned char *buffer;
+
+	for(n = 0; n < MICROBENCH_NTAGS; n++) {
+		buffer = &state.tags[n * FLV_SIZE_TAGHEADER];
+
+		state.sink += FLV_UI8(buffer) + FLV_UI24(&buffer[1]) + FLV_TIMESTAMP(&buffer[4]);
+	}
+
+	return;
+}
+
+void benchParseFLVTagHeader(void) {
+	size_t n;
+
+	for(n = 0; n < MICROBENCH_NTAGS; n++) {
+		parseFLVTagHeader(&state.flvtag, &state.tags[n * FLV_SIZE_TAGHEADER], (off_t)n);
+
+		state.sink += state.flvtag.tagsize;
+	}
+
+	return;
+}
+
+void benchWriteXMLMetadata(void) {
+	writeXMLMetadata(state.devnull, "in.flv", "out.flv", &state.flv);
+
+	return;
+}
+
+void benchCRC32C(void) {
+	state.checksum.crc32c = crc32cUpdate(state.checksum.crc32c, state.block, MICROBENCH_BLOCKSIZE);
+	state.sink += state.checksum.crc32c;
+
+	return;
+}
+
+void benchCRC32CSoftware(void) {
+	state.checksum.crc32c = crc32cSoftware(state.checksum.crc32c, state.block, MICROBENCH_BLOCKSIZE);
+	state.sink += state.checksum.crc32c;
+
+	return;
+}
+
+void benchXXH64(void) {
+	xxh64Update(&state.checksum.xxh64, state.block, MICROBENCH_BLOCKSIZE);
+	state.sink += state.checksum.xxh64.v[0];
+
+	return;
+}
+
+void benchSHA256(void) {
+	sha256Update(&state.checksum.sha256, state.block, MICROBENCH_BLOCKSIZE);
+	state.sink += state.checksum.sha256.h[0];
+
+	return;
+}
@@ -0,0 +1,77 @@
+#!/bin/sh
+#
+# End-to-end benchmark of yamdi on synthetic FLV files. Every combination
+# of size and codecs is generated, benchmarked and removed again.
+#
+# BENCH_SIZES	Input sizes (default "1M 16M 256M"). Use e.g. "1M 1G 50G"
+#		for the large inputs, but mind the disk space in BENCH_DIR.
+# BENCH_CODECS	video:audio pairs (default "h263:mp3 vp6:mp3 h264:aac")
+# BENCH_PAYLOAD	Average video payload size (default 2K). Small payloads
+#		give many tiny tags, e.g. 16 for the tag count of a much
+#		larger file.
+# BENCH_GOP	Keyframe interval in video frames (default 50)
+# BENCH_SCRIPT	An onCuePoint script tag every n video frames (default 250)
+# BENCH_DIR	Where to put the generated files (default /tmp)
+# BENCH_OUTPUT	Where writeFLV() writes to (default /dev/null)
+#
+# The onMetaData of a part extracted with --start and --end is checked
+# against a normal run over the same tags, i.e. the only segment of
+# --split-duration over the same part.
+
+BENCH=`dirname $0`
+
+SIZES=${BENCH_SIZES:-"1M 16M 256M"}
+CODECS=${BENCH_CODECS:-"h263:mp3 vp6:mp3 h264:aac"}
+PAYLOAD=${BENCH_PAYLOAD:-2K}
+GOP=${BENCH_GOP:-50}
+SCRIPT=${BENCH_SCRIPT:-250}
+DIR=${BENCH_DIR:-/tmp}
+OUTPUT=${BENCH_OUTPUT:-/dev/null}
+YAMDI=$BENCH/../yamdi
+
+# The values of the XML output that describe the written tags
+metadata() {
+	grep -oE "<(duration|framerate|videodatarate|audiodatarate|datasize|videosize|audiosize|filesize)>[^<]*" $1
+}
+
+checkclip() {
+	rc=0
+	duration=`$YAMDI -i $1 -x - | sed -n 's/.*<duration>\([0-9]*\).*/\1/p'`
+	start=`expr $duration / 4`
+	end=`expr $duration / 2`
+
+	$YAMDI -i $1 -o $DIR/yamdi-clip.flv -x $DIR/yamdi-clip.xml --start $start --end $end || return 1
+	$YAMDI -i $1 -o $DIR/yamdi-part.flv -x $DIR/yamdi-part.xml --start $start --end $end --split-duration 1000000 || return 1
+
+	metadata $DIR/yamdi-clip.xml > $DIR/yamdi-clip.txt
+	metadata $DIR/yamdi-part.xml > $DIR/yamdi-part.txt
+
+	if ! cmp -s $DIR/yamdi-clip.txt $DIR/yamdi-part.txt; then
+		echo "The onMetaData of $start s to $end s of $1 differs from a normal run:"
+		diff $DIR/yamdi-clip.txt $DIR/yamdi-part.txt
+		rc=1
+	fi
+
+	rm -f $DIR/yamdi-clip.* $DIR/yamdi-part.* $DIR/yamdi-part-000.flv
+
+	return $rc
+}
+
+for size in $SIZES; do
+	for codecs in $CODECS; do
+		video=${codecs%%:*}
+		audio=${codecs##*:}
+		file=$DIR/yamdi-bench-$size-$video-$audio.flv
+
+		$BENCH/flvgen -o $file -s $size -v $video -a $audio -p $PAYLOAD -g $GOP -S $SCRIPT || exit 1
+		$BENCH/bench -o $OUTPUT $file
+		rc=$?
+
+		[ $rc -eq 0 ] && checkclip $file
+		rc=$?
+
+		rm -f $file
+
+		[ $rc -eq 0 ] || exit $rc
+	done
+done
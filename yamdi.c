@@ -31,18 +31,62 @@
  * -----------------------------------------------------------------------------
  *
  * Compile with:
- * gcc yamdi.c -o yamdi -Wall -O2
+ * gcc yamdi.c -o yamdi -Wall -O2 -lpthread -lm
  *
  * -----------------------------------------------------------------------------
  */
 
+#ifdef __linux__
+	#define _GNU_SOURCE		// O_DIRECT, fallocate() and sync_file_range()
+#endif
+
 #include <sys/types.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+
+#ifndef __MINGW32__
+	#include <pthread.h>
+	#include <sys/mman.h>
+	#include <sys/resource.h>
+	#include <sys/uio.h>
+	#include <sys/socket.h>
+	#include <sys/un.h>
+	#include <signal.h>
+	#include <dirent.h>
+#endif
+
+#ifdef __linux__
+	#include <sys/sendfile.h>
+	#include <sys/ioctl.h>
+	#include <linux/fs.h>
+	#include <sys/inotify.h>
+	#include <linux/fiemap.h>
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+	#include <nmmintrin.h>
+	#define YAMDI_CRC32C_SSE42
+#endif
+
+#if defined(__aarch64__) && defined(__linux__) && (defined(__clang__) || __GNUC__ >= 10)
+	#include <sys/auxv.h>
+	#include <arm_acle.h>
+	#define YAMDI_CRC32C_ARMV8
+
+	#ifndef HWCAP_CRC32
+		#define HWCAP_CRC32		(1 << 7)
+	#endif
+#endif
 
 #ifdef __MINGW32__
 	#define off_t _off64_t
@@ -50,6 +94,23 @@
 	#define ftello(stream) ftello64(stream)
 #endif
 
+#if defined(__GNUC__)
+	#define YAMDI_THREADLOCAL	__thread
+#else
+	#define YAMDI_THREADLOCAL	_Thread_local
+#endif
+
+// Counters that one thread adds to and another thread reads
+#if defined(__GNUC__)
+	#define YAMDI_ATOMIC_ADD(x, n)	__atomic_fetch_add(&(x), (n), __ATOMIC_RELAXED)
+	#define YAMDI_ATOMIC_LOAD(x)	__atomic_load_n(&(x), __ATOMIC_RELAXED)
+	#define YAMDI_ATOMIC_STORE(x, n)	__atomic_store_n(&(x), (n), __ATOMIC_RELAXED)
+#else
+	#define YAMDI_ATOMIC_ADD(x, n)	((x) += (n))
+	#define YAMDI_ATOMIC_LOAD(x)	(x)
+	#define YAMDI_ATOMIC_STORE(x, n)	((x) = (n))
+#endif
+
 #define YAMDI_VERSION			"1.9"
 
 #define YAMDI_OK			0
@@ -64,6 +125,123 @@
 #define YAMDI_H264_USELESS_NALU		9
 #define YAMDI_RENAME_OUTPUT		10
 #define YAMDI_INVALID_TAGTYPE		11
+#define YAMDI_LIMIT_EXCEEDED		12
+#define YAMDI_NERRORS			13
+
+#define YAMDI_OPTION_IDRKEYFRAMES	256
+#define YAMDI_OPTION_PROBE		257
+#define YAMDI_OPTION_INDEXMODE		258
+#define YAMDI_OPTION_THREADS		259
+#define YAMDI_OPTION_STATS		260
+#define YAMDI_OPTION_TRACE		261
+#define YAMDI_OPTION_PROGRESSFD		262
+#define YAMDI_OPTION_SEEKTABLE		263
+#define YAMDI_OPTION_START		264
+#define YAMDI_OPTION_END		265
+#define YAMDI_OPTION_SPLITDURATION	266
+#define YAMDI_OPTION_SPLITSIZE		267
+#define YAMDI_OPTION_REFLINK		268
+#define YAMDI_OPTION_MANIFEST		269
+#define YAMDI_OPTION_CHECKSUM		270
+#define YAMDI_OPTION_CHECKSUMFILE	271
+#define YAMDI_OPTION_PREALLOCATE	272
+#define YAMDI_OPTION_DIRECTIO		273
+#define YAMDI_OPTION_DROPCACHE		274
+#define YAMDI_OPTION_INMEMORY		275
+#define YAMDI_OPTION_INPLACE		276
+#define YAMDI_OPTION_SERVE		277
+#define YAMDI_OPTION_WATCH		278
+#define YAMDI_OPTION_REMOVEINPUT	279
+#define YAMDI_OPTION_PHYSICALORDER	280
+#define YAMDI_OPTION_DEVICEREADERS	281
+#define YAMDI_OPTION_TIMELIMIT		282
+#define YAMDI_OPTION_IOLIMIT		283
+#define YAMDI_OPTION_METRICS		284
+#define YAMDI_OPTION_METRICSINTERVAL	285
+
+#define YAMDI_PROBE_NTAGS		64
+
+#define YAMDI_INDEX_SERIAL		0
+#define YAMDI_INDEX_BIDIRECTIONAL	1
+#define YAMDI_INDEX_PARALLEL		2
+
+#define YAMDI_INDEX_CHUNKSIZE		(4 * 1024 * 1024)	// Minimum size of a chunk for the parallel index
+#define YAMDI_INDEX_SYNCTAGS		4			// # of consecutive tags that confirm a tag boundary
+
+#define YAMDI_STATS_NONE		0
+#define YAMDI_STATS_TEXT		1
+#define YAMDI_STATS_JSON		2
+
+#define YAMDI_PHASE_VALIDATE		0
+#define YAMDI_PHASE_PROBE		1
+#define YAMDI_PHASE_INDEX		2
+#define YAMDI_PHASE_ANALYZE		3
+#define YAMDI_PHASE_FINALIZE		4
+#define YAMDI_PHASE_WRITE		5
+#define YAMDI_PHASE_XML			6
+#define YAMDI_PHASE_JSON		7
+#define YAMDI_PHASE_SEEKTABLE		8
+#define YAMDI_PHASE_EXTRACT		9
+#define YAMDI_PHASE_SPLIT		10
+#define YAMDI_PHASE_MANIFEST		11
+#define YAMDI_PHASE_CHECKSUM		12
+#define YAMDI_PHASE_LOAD		13
+#define YAMDI_NPHASES			14
+
+#define YAMDI_SEEKTABLE_MAGIC		"YAMDISTB"
+#define YAMDI_SEEKTABLE_VERSION		1
+#define YAMDI_SEEKTABLE_HEADERSIZE	160
+
+#define YAMDI_TRACE_SPANTAGS		4096		// # of tags that are covered by one span in the trace
+#define YAMDI_TRACE_MAINTID		1
+
+#define YAMDI_PROGRESS_INTERVAL		0.5		// Minimum time in seconds between two progress records
+#define YAMDI_PROGRESS_CHECKTAGS	1024		// Only look at the clock every that many tags
+
+#define YAMDI_COPY_BUFFERSIZE		(64 * 1024)	// Buffer for copying tags if the kernel can't do it
+#define YAMDI_COPY_MAXCHUNK		(1024 * 1024 * 1024)	// Maximum # of bytes per sendfile() call
+
+#define YAMDI_WRITE_BUFFERSIZE		(1024 * 1024)	// writeFLVDescriptor() writes in pieces of about this size
+#define YAMDI_DIRECTIO_ALIGNMENT	4096		// Alignment of the buffers and file offsets for O_DIRECT
+#define YAMDI_DROPCACHE_INTERVAL	(8 * 1024 * 1024)	// Drop the page cache behind the cursors every that many bytes
+#define YAMDI_DROPCACHE_ALIGNMENT	(2 * 1024 * 1024)	// The page cache only drops a large folio as a whole, they are up to this size
+
+#define YAMDI_INMEMORY_DEFAULT		(8 * 1024 * 1024)	// Inputs up to this size are read at once and processed in memory
+#define YAMDI_INMEMORY_IOVECS		1024		// Ranges per writev(), the IOV_MAX of Linux and the BSDs
+
+#define YAMDI_INPLACE_SUFFIX		".journal"	// The journal of --in-place is next to the input file
+#define YAMDI_INPLACE_MAGIC		"YAMDIJNL"
+#define YAMDI_INPLACE_RECORDMAGIC	"YAMDIREC"
+#define YAMDI_INPLACE_VERSION		1
+#define YAMDI_INPLACE_HEADERSIZE	48
+#define YAMDI_INPLACE_RECORDHEADERSIZE	56
+#define YAMDI_INPLACE_BLOCKSIZE		(8 * 1024 * 1024)	// The tags are moved in blocks of this size
+#define YAMDI_INPLACE_RECORDSIZE	(YAMDI_INPLACE_RECORDHEADERSIZE + YAMDI_INPLACE_BLOCKSIZE + 4)
+#define YAMDI_INPLACE_FORWARD		1		// The passes of the rewrite
+#define YAMDI_INPLACE_BACKWARD		2
+#define YAMDI_INPLACE_BLOB		3
+
+#define YAMDI_SERVE_BACKLOG		64		// Connections that wait for a worker
+#define YAMDI_SERVE_MAXWORDS		64		// Words of a request
+#define YAMDI_SERVE_MAXREQUEST		(64 * 1024)	// Length of a request line
+#define YAMDI_WATCH_SUFFIX		".yamdi"	// The output of --watch is written to .<name>.yamdi first
+#define YAMDI_WATCH_BUFFERSIZE		(64 * 1024)	// Buffer for the inotify events
+
+#define YAMDI_METRICS_NBUCKETS		10		// Buckets of the histograms without +Inf
+#define YAMDI_METRICS_INTERVAL		15000		// Default of --metrics-interval in ms
+#define YAMDI_METRICS_SUFFIX		".tmp"		// The metrics file is written to <file>.tmp first
+
+#define YAMDI_BUDGET_NTAGS		256		// The loops over the tags check the limits of the job every this many tags
+
+#define YAMDI_WORKSPACE_MAXTAGS		(256 * 1024)	// Larger indexes are not kept for the next job of a worker
+
+#define YAMDI_REFLINK_MINFILLER		31		// Smallest onFiller tag: header, "onFiller", an empty long string and the PreviousTagSize
+#define YAMDI_REFLINK_MAXBLOCKSIZE	(1024 * 1024)
+
+#define YAMDI_CHECKSUM_CRC32C		0x01
+#define YAMDI_CHECKSUM_XXH64		0x02
+#define YAMDI_CHECKSUM_SHA256		0x04
+#define YAMDI_NCHECKSUMS		3
 
 #define FLV_SIZE_HEADER			9
 #define FLV_SIZE_PREVIOUSTAGSIZE	4
@@ -86,12 +264,41 @@
 #define FLV_UI8(x) (unsigned int)(*(x))
 #define FLV_TIMESTAMP(x) (int)(((*(x + 3)) << 24) + ((*(x)) << 16) + ((*(x + 1)) << 8) + (*(x + 2)))
 
+#define ALIGNDOWN(x, a) ((x) & ~((off_t)(a) - 1))
+#define ALIGNUP(x, a) ALIGNDOWN((x) + (off_t)(a) - 1, a)
+
 typedef struct {
 	unsigned char *data;
 	size_t size;
 	size_t used;
 } buffer_t;
 
+typedef struct {
+	uint64_t v[4];
+	uint64_t length;
+	unsigned char block[32];	// Bytes that don't fill a stripe yet
+	size_t used;
+} xxh64_t;
+
+typedef struct {
+	uint32_t h[8];
+	uint64_t length;
+	unsigned char block[64];	// Bytes that don't fill a block yet
+	size_t used;
+} sha256_t;
+
+typedef struct {
+	int algorithms;			// YAMDI_CHECKSUM_*, 0 if none
+
+	uint32_t crc32c;
+	xxh64_t xxh64;
+	sha256_t sha256;
+
+	// Valid after checksumFinal()
+	uint64_t xxh64digest;
+	unsigned char sha256digest[32];
+} checksum_t;
+
 typedef struct {
 	off_t offset;			// Offset from the beginning of the file
 
@@ -100,6 +307,8 @@ typedef struct {
 	size_t datasize;		// Size of the data contained in this tag
 	int timestamp;
 	short keyframe;			// Is this tag a keyframe?
+	short config;			// Is this tag an AVC or AAC sequence header?
+	short canonical;		// StreamID and PreviousTagSize are as yamdi writes them, the tag can be copied as it is
 
 	size_t tagsize;		// Size of the whole tag including header and data
 } FLVTag_t;
@@ -107,8 +316,105 @@ typedef struct {
 typedef struct {
 	size_t nflvtags;
 	FLVTag_t *flvtag;
+
+	size_t size;			// # of allocated tags, only used while growing the index
 } FLVIndex_t;
 
+typedef struct {
+	int fd;
+	const unsigned char *data;	// The mapped file, only for the parallel index
+	off_t start;			// Offset of the first tag (forward) or the end of the last tag (backward)
+	off_t end;			// Stop at this offset
+	off_t filesize;
+
+	off_t first;			// Offset of the first tag that has been found in a chunk, -1 if none
+	off_t next;			// Offset of the first tag that has not been scanned
+	int rv;
+
+	uint64_t nreads;		// # of pread() calls, merged into the stats after the scan
+	uint64_t bytesread;
+
+	double deadline;		// --time-limit, see limitFLVScanner(), 0.0 if never
+	uint64_t iolimit;		// This scanner's share of what is left of --io-limit, 0 if unlimited
+
+	int tid;			// Track in the trace
+
+	FLVIndex_t index;		// The scanned tags, in scan order
+} FLVScanner_t;
+
+typedef struct {
+	char creator[256];		// -c
+
+	short addonlastkeyframe;	// -k
+	short addonlastsecond;		// -s, -l (deprecated)
+	short addonmetadata;		// defaults to 1, -M does change it
+	short addaudiokeyframes;	// -a
+	int keyframedistance;		// -a
+
+	short keepmetadata;		// -m (not implemented)
+	short stripmetadata;		// -M
+
+	short xmlomitkeyframes;		// -X
+
+	short overwriteinput;		// -w
+
+	short idrkeyframes;		// --idr-keyframes
+	short probe;			// --probe
+	short indexmode;		// --index-mode
+	int threads;			// --threads
+	short stats;			// --stats
+	int start;			// --start in ms, 0 if from the beginning
+	int end;			// --end in ms, 0 if to the end
+	int splitduration;		// --split-duration in ms, 0 if not splitting by duration
+	uint64_t splitsize;		// --split-size in bytes, 0 if not splitting by size
+	short reflink;			// --reflink
+	int checksums;			// --checksum, YAMDI_CHECKSUM_*
+	short preallocate;		// --preallocate
+	short directio;			// --direct-io
+	short dropcache;		// --drop-cache
+	uint64_t inmemory;		// --in-memory in bytes, 0 if the input is never read at once
+	short inplace;			// --in-place
+	short removeinput;		// --remove-input
+	short physicalorder;		// --physical-order
+	int devicereaders;		// --device-readers, 0 if the files are processed one after the other
+	int timelimit;			// --time-limit in ms, 0 if there is no limit
+	uint64_t iolimit;		// --io-limit in bytes, 0 if there is no limit
+} FLVOptions_t;
+
+typedef struct {
+	short input;			// 1 if the bytes are in the input file, 0 if they are in the blob file (-o)
+	off_t offset;
+	off_t size;
+} FLVRange_t;
+
+typedef struct {
+	size_t nranges;
+	size_t size;			// # of allocated ranges
+	FLVRange_t *ranges;		// The output in the order of the bytes
+
+	off_t blob;			// # of bytes of the blob file that are covered by the ranges
+} FLVManifest_t;
+
+typedef struct {
+	FLVTag_t *flvtag;			// The index of the last file that fit
+	size_t ntags;				// # of tags it can hold
+
+	unsigned char *memory;			// The input of --in-memory
+	size_t memorysize;
+
+	buffer_t onmetadata;
+	buffer_t onlastkeyframe;
+	buffer_t onlastsecond;
+	buffer_t onfiller;
+	buffer_t rbsp;
+} FLVWorkspace_t;
+
+typedef struct {
+	double deadline;			// Wall clock time at which the job is aborted, 0.0 if never
+	uint64_t iolimit;			// Bytes that the job may read and write, 0 if unlimited
+	uint64_t iostart;			// Bytes read and written by this thread before the job
+} FLVBudget_t;
+
 typedef struct {
 	FLVIndex_t index;
 
@@ -147,6 +453,8 @@ typedef struct {
 		int height;
 		int width;
 
+		int nalulengthsize;		// Size of the NALU length field in AVC video packets
+
 		// Calculated values
 		size_t ntags;			// # of video tags
 		double framerate;		// ntags / duration
@@ -161,7 +469,7 @@ typedef struct {
 	short haskeyframes;
 	struct {
 		size_t lastkeyframeindex;
-		int lastkeyframetimestamp;
+		int lastkeyframetimestamp;	// -1 if --probe didn't find it
 		off_t lastkeyframelocation;
 
 		size_t nkeyframes;		// # of key frames
@@ -172,37 +480,188 @@ typedef struct {
 	uint64_t datasize;			// Size of all audio and video tags (header + data + FLV_SIZE_PREVIOUSTAGSIZE)
 	uint64_t filesize;			// [sic!]
 
+	int firsttimestamp;			// The first timestamp of a part of the file, see --start, 0 otherwise
 	int lasttimestamp;
 
 	int lastsecond;
 	size_t lastsecondindex;
 
+	FLVOptions_t options;
+
+	buffer_t onmetadata;
+	buffer_t onlastkeyframe;
+	buffer_t onlastsecond;
+	buffer_t onfiller;			// Pads the output up to a block boundary for --reflink
+
 	struct {
-		char creator[256];		// -c
+		size_t blocksize;		// Block size of the output, 0 if the tags are not cloned
+		off_t first;			// Offset of the first audio or video tag in the input
+		off_t offset;			// The input is cloned from this block boundary to the end
+		off_t filesize;			// Size of the input
+	} reflink;
 
-		short addonlastkeyframe;	// -k
-		short addonlastsecond;		// -s, -l (deprecated)
-		short addonmetadata;		// defaults to 1, -M does change it
-		short addaudiokeyframes;	// -a
+	FLVManifest_t *manifest;		// --manifest, NULL if the tags are copied into the output
 
-		short keepmetadata;		// -m (not implemented)
-		short stripmetadata;		// -M
+	struct {
+		unsigned char *data;		// The whole input if it is small enough, NULL if it is read from the file
+		size_t size;
+	} memory;
 
-		short xmlomitkeyframes;		// -X
+	checksum_t checksum;			// Of the output, --checksum
 
-		short overwriteinput;		// -w
-	} options;
+	buffer_t rbsp;				// Scratch buffer for unescaping H.264 NAL units
 
-	buffer_t onmetadata;
-	buffer_t onlastkeyframe;
-	buffer_t onlastsecond;
+	FLVWorkspace_t *workspace;		// The allocations are kept for the next file (--serve), NULL if none
+
+	FLVBudget_t budget;			// --time-limit and --io-limit
 } FLV_t;
 
 typedef struct {
-	unsigned char *bytes;
+	int fd;					// The journal file
+	off_t headersize;			// The records follow the header
+	uint64_t sequence;			// # of the last record
+
+	off_t filesize;				// Size of the file before the rewrite
+	off_t newsize;				// Size of the file after the rewrite
+	FLVManifest_t manifest;			// The new file as ranges of the old file and of the blob
+	off_t *offsets;				// Offset of every range in the new file
+	unsigned char *blob;			// The bytes that are not in the old file
+	size_t blobsize;
+
+	unsigned char *block;			// The next record and the block that is moved
+} FLVJournal_t;
+
+typedef struct {
+	int pass;				// YAMDI_INPLACE_*, 0 if there is no record
+	size_t range;
+	off_t position;				// Where the block begins (forward) or ends (backward) in the old file
+	off_t size;
+	unsigned char *data;			// Copy of the block, NULL if it can be read from the file
+	unsigned char *copy;
+} FLVJournalRecord_t;
+
+typedef struct {
+	const char *infile;
+	const char *outfile;			// -o, NULL if none
+	const char *finalfile;			// -w, the output is renamed to it when it is done, NULL if it isn't
+	const char *seektablefile;		// --seektable, NULL if none
+	const char *manifestfile;		// --manifest, NULL if none
+	const char *journalfile;		// --in-place, NULL if the input is not rewritten in place
+	buffer_t *xml;				// -x, the <flv> element is appended, NULL if none
+	buffer_t *json;				// -j, the file object is appended, NULL if none
+	buffer_t *checksums;			// --checksum-file, the lines are appended, NULL if none
+	FLVWorkspace_t *workspace;		// --serve, the allocations of the worker, NULL if none
+	int rv;					// What processFLV() returned for this file
+} FLVJob_t;
+
+typedef struct {
+	uint64_t nreads;
+	uint64_t bytesread;
+	uint64_t nwrites;
+	uint64_t byteswritten;
+} iostats_t;
+
+typedef struct {
+	FLV_t flv;				// The tags of this segment with the rebased timestamps
+	char *outfile;
+	int rv;
+
+	iostats_t io;				// Merged into the stats after all segments are written
+} FLVSegment_t;
+
+typedef struct {
+	int fd;
+	short direct;				// O_DIRECT is set on fd (--direct-io)
+	short dropcache;			// --drop-cache
+	unsigned char *staging;			// Aligned copy of the bytes for O_DIRECT, NULL if none
+
+	off_t offset;				// Position in the file
+	off_t flushed;				// The writeback of the bytes before this offset has been started (--drop-cache)
+	off_t dropped;				// The bytes before this offset have been dropped from the page cache (--drop-cache)
+
+	checksum_t *checksum;			// NULL if none
+
+	uint64_t nwrites;
+	uint64_t byteswritten;
+} FLVOutput_t;
+
+typedef struct {
+	int fd;					// The input file, shared by all writers
+	FLVSegment_t *segments;
+	size_t nsegments;
+	size_t next;				// The next segment that has not been taken by a writer
+	size_t ndone;				// # of written segments and their size for the progress
+	uint64_t bytesdone;
+
+#ifndef __MINGW32__
+	pthread_mutex_t lock;
+#endif
+} FLVSplitter_t;
+
+typedef struct {
+	FLVSplitter_t *splitter;
+	int tid;				// Track in the trace
+} FLVSplitWriter_t;
+
+typedef struct {
+	int fd;					// The listening socket
+	FLVOptions_t *options;			// The defaults for every request
+
+	int connections[YAMDI_SERVE_BACKLOG];	// Accepted connections that wait for a worker
+	size_t first;
+	size_t nconnections;
+	int *active;				// The connection of every worker, -1 if it waits
+	short stop;
+
+#ifndef __MINGW32__
+	pthread_mutex_t lock;
+	pthread_cond_t ready;			// A connection has been queued or the server stops
+	pthread_cond_t room;			// A connection has been taken from the queue
+#endif
+} FLVServer_t;
+
+typedef struct {
+	const char *spooldir;
+	const char *outdir;
+	FLVOptions_t *options;			// The options for every file
+
+	char **names;				// Files that wait for a worker, from first to first + nnames
+	size_t first;
+	size_t nnames;
+	size_t size;				// # of allocated names
+	char **active;				// The file of every worker, NULL if it waits
+	short *requeue;				// The file of every worker has been completed again while it was processed
+	size_t nworkers;
+	short stop;
+
+#ifndef __MINGW32__
+	pthread_mutex_t lock;
+	pthread_cond_t ready;			// A file has been queued or the watch stops
+#endif
+} FLVWatcher_t;
+
+typedef struct {
+	FLVWatcher_t *watcher;
+	int id;
+
+	FLVWorkspace_t workspace;		// Kept from one file to the next
+} FLVWatchWorker_t;
+
+typedef struct {
+	FLVServer_t *server;
+	int id;
+
+	FLVWorkspace_t workspace;		// Kept from one request to the next
+	buffer_t json;
+	buffer_t response;
+} FLVServeWorker_t;
+
+typedef struct {
+	const unsigned char *bytes;
 	size_t length;
-	size_t byte;
-	short bit;
+	size_t byte;			// Next byte to load into the cache
+	uint64_t cache;			// Not yet consumed bits, MSB first
+	int bits;			// # of valid bits in the cache
 } bitstream_t;
 
 typedef struct {
@@ -211,20 +670,237 @@ typedef struct {
 	int height;
 } h264data_t;
 
+typedef struct {
+	struct {
+		double wall;		// Wall clock time in seconds
+		double cpu;		// CPU time of all threads in seconds
+		double startwall;
+		double startcpu;
+	} phase[YAMDI_NPHASES];
+
+	// Calls into readBytes(), seekBytes() and writeBytes() and the pread()s of the index scanners
+	uint64_t nreads;
+	uint64_t nseeks;
+	uint64_t nwrites;
+	uint64_t bytesread;
+	uint64_t byteswritten;
+	uint64_t bytesmapped;		// Size of the mapped input for the parallel index
+	uint64_t bytescopied;		// Written bytes that the kernel copied directly from the input
+	uint64_t bytescloned;		// Bytes of the output that share their blocks with the input (--reflink)
+	uint64_t bytesloaded;		// Size of the inputs that have been read into memory at once (--in-memory)
+
+	uint64_t ntags;			// # of tags of all processed files
+	uint64_t indexbytes;		// Largest index of all processed files
+} stats_t;
+
+YAMDI_THREADLOCAL stats_t stats;		// Every thread that processes files has its own
+
+typedef struct {
+	size_t job;				// Index of the job on the command line
+	dev_t device;
+	short mapped;				// 1 if position is the physical offset of the first extent, 0 if it is the inode
+	uint64_t position;
+} FLVLayout_t;
+
+typedef struct {
+	FLVLayout_t *layout;			// The files on this device in physical order
+	size_t njobs;
+	size_t next;				// The next file that a reader takes
+
+#ifndef __MINGW32__
+	pthread_mutex_t lock;
+#endif
+} FLVDevice_t;
+
+typedef struct {
+	FLVDevice_t *device;
+	FLVOptions_t *options;
+	FLVJob_t *jobs;
+
+	FLVWorkspace_t workspace;		// Kept from one file to the next
+	stats_t stats;				// The stats of the reader thread, merged after it is done
+} FLVDeviceReader_t;
+
+const char *errornames[YAMDI_NERRORS] = {"OK", "ERROR", "FILE_TOO_SMALL", "INVALID_SIGNATURE", "INVALID_FLVVERSION", "INVALID_DATASIZE", "READ_ERROR", "INVALID_PREVIOUSTAGSIZE", "OUT_OF_MEMORY", "H264_USELESS_NALU", "RENAME_OUTPUT", "INVALID_TAGTYPE", "LIMIT_EXCEEDED"};
+
+const char *statsphases[YAMDI_NPHASES] = {"validate", "probe", "index", "analyze", "finalize", "write", "xml", "json", "seektable", "extract", "split", "manifest", "checksum", "load"};
+
+typedef struct {
+	const char *name;		// Only static strings
+	const char *cat;
+	int tid;
+	double start;			// Wall clock times in seconds
+	double end;
+	uint64_t ntags;
+	uint64_t nbytes;
+} traceevent_t;
+
+typedef struct {
+	short enabled;			// --trace
+	double start;			// Wall clock time of the beginning of the trace
+	int ntids;			// Highest track that has been used
+
+	size_t nevents;
+	size_t size;
+	traceevent_t *events;
+
+#ifndef __MINGW32__
+	pthread_mutex_t lock;		// The index scanners add events from their threads
+#endif
+} trace_t;
+
+typedef struct {
+	double start;
+	uint64_t ntags;
+	uint64_t nbytes;
+} tracespan_t;
+
+trace_t trace;
+
+typedef struct {
+	int fd;				// --progress-fd, -1 if there's no progress output
+	const char *phase;
+	double start;			// Wall clock time of the beginning of the phase
+	double last;			// Wall clock time of the last record
+	uint64_t totaltags;		// 0 if unknown
+	uint64_t totalbytes;
+} progress_t;
+
+progress_t progress = {-1, NULL, 0.0, 0.0, 0, 0};
+
+typedef struct threadmetrics_s {
+	// Only the thread itself adds to these, the exporter reads them with YAMDI_ATOMIC_LOAD()
+	uint64_t files[YAMDI_NERRORS];					// By what processFLV() returned
+	uint64_t bytesread;
+	uint64_t byteswritten;
+	uint64_t phase[YAMDI_NPHASES][YAMDI_METRICS_NBUCKETS + 1];	// Wall clock time of the phases of a file, the last bucket is +Inf
+	uint64_t phasesum[YAMDI_NPHASES];				// in ns
+	uint64_t throughput[YAMDI_METRICS_NBUCKETS + 1];		// Input bytes per second of the processed files
+	uint64_t throughputsum;
+	uint64_t indexbytes;						// Index of the file that is processed right now
+
+	struct threadmetrics_s *next;
+} threadmetrics_t;
+
+typedef struct {
+	const char *file;		// --metrics, NULL if there are no metrics
+	int interval;			// --metrics-interval in ms
+	threadmetrics_t *threads;	// Every thread that has processed a file
+	uint64_t queue;			// Files or connections that wait for a thread
+	short stop;
+
+#ifndef __MINGW32__
+	pthread_t thread;		// Writes the file every interval
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+#endif
+} metrics_t;
+
+metrics_t metrics;
+
+YAMDI_THREADLOCAL threadmetrics_t *threadmetrics = NULL;
+
+const double metricsphasebuckets[YAMDI_METRICS_NBUCKETS] = {0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1.0, 5.0, 10.0, 60.0};
+const double metricsthroughputbuckets[YAMDI_METRICS_NBUCKETS] = {1e6, 5e6, 1e7, 5e7, 1e8, 2.5e8, 5e8, 1e9, 2.5e9, 5e9};
+
+YAMDI_THREADLOCAL checksum_t *outputchecksum = NULL;	// writeBytes() and copyBytes() feed the bytes of the output into it, NULL if none
+
+#ifndef __MINGW32__
+volatile sig_atomic_t servestop = 0;	// Set by SIGINT and SIGTERM, --serve and --watch stop taking new files
+#endif
+
+const char *checksumnames[YAMDI_NCHECKSUMS] = {"crc32c", "xxh64", "sha256"};
+
+uint32_t crc32ctable[8][256];
+uint32_t (*crc32cUpdate)(uint32_t crc, const unsigned char *bytes, size_t nbytes);
+
+int processFLV(FLVOptions_t *options, FLVJob_t *job);
+char *batchPath(const char *dir, const char *infile, const char *suffix);
+const char *batchBasename(const char *infile);
+int batchFLV(FLVOptions_t *options, FLVJob_t *jobs, size_t njobs);
+int layoutFLV(const char *file, FLVLayout_t *layout);
+int compareFLVLayout(const void *a, const void *b);
+void *readDeviceFLV(void *arg);
+int serveFLV(const char *socketfile, FLVOptions_t *options);
+void *serveFLVWorker(void *arg);
+int serveFLVRequest(FLVServeWorker_t *worker, char *line, buffer_t *response);
+int splitRequest(char *line, char **words, int maxwords);
+int writeDescriptor(int fd, const unsigned char *bytes, size_t size);
+void serveSignal(int signum);
+int watchFLV(const char *spooldir, const char *outdir, FLVOptions_t *options);
+void *watchFLVWorker(void *arg);
+int processWatchedFLV(FLVWatchWorker_t *worker, const char *name);
+int queueWatchedFLV(FLVWatcher_t *watcher, const char *name);
+int scanWatchedFLV(FLVWatcher_t *watcher);
+int writeBufferToFile(buffer_t *buffer, const char *file);
 int validateFLV(FILE *fp);
 int initFLV(FLV_t *flv);
+void lendFLVWorkspace(FLV_t *flv, FLVWorkspace_t *workspace);
+void returnFLVWorkspace(FLV_t *flv);
+void freeFLVWorkspace(FLVWorkspace_t *workspace);
+FLVTag_t *allocFLVIndex(FLV_t *flv, size_t nflvtags);
+int checkFLVBudget(FLV_t *flv, iostats_t *io);
+void limitFLVScanner(FLV_t *flv, FLVScanner_t *scanner, int nscanners);
+int checkFLVScanner(FLVScanner_t *scanner);
+int loadFLV(FLV_t *flv, FILE **fp);
 int indexFLV(FLV_t *flv, FILE *fp);
+int probeFLV(FLV_t *flv, FILE *fp);
+int indexFLVBidirectional(FLV_t *flv, FILE *fp);
+void *scanFLVForward(void *arg);
+void *scanFLVBackward(void *arg);
+int indexFLVParallel(FLV_t *flv, FILE *fp);
+void *scanFLVChunk(void *arg);
+void walkFLVChunk(FLVScanner_t *scanner, off_t offset);
+int isFLVTagBoundary(const unsigned char *data, off_t filesize, off_t offset);
+int appendFLVIndex(FLVIndex_t *index, FLVTag_t *flvtag);
+int clipFLV(FLV_t *flv);
+size_t searchFLVIndex(FLVIndex_t *index, size_t first, int timestamp);
 int finalizeFLV(FLV_t *flv, FILE *fp);
 int writeFLV(FILE *out, FLV_t *flv, FILE *fp);
+int writeFLVRun(FILE *out, FLV_t *flv, FLVTag_t *first, FLVTag_t *last, FILE *fp);
+int copyFLVRange(FILE *out, FLV_t *flv, FILE *fp, off_t offset, off_t size);
+int appendFLVManifest(FLVManifest_t *manifest, short input, off_t offset, off_t size);
+int syncFLVManifest(FILE *out, FLVManifest_t *manifest);
+int prepareFLVReflink(FLV_t *flv, FILE *fp, FILE *out);
+int writeFLVReflink(FILE *out, FLV_t *flv, FILE *fp);
+int rewriteFLVInPlace(FLV_t *flv, FILE *fp, const char *journalfile);
+int recoverFLVInPlace(const char *file, const char *journalfile);
+int readFLVJournal(FLVJournal_t *journal, FLVJournalRecord_t *record, const char *journalfile);
+int replayFLVJournal(int fd, FLVJournal_t *journal, FLVJournalRecord_t *record);
+int moveFLVJournalBlock(int fd, FLVJournal_t *journal, int pass, size_t k, off_t position, off_t size);
+int appendFLVJournal(FLVJournal_t *journal, int pass, size_t k, off_t position, off_t size, int copy);
+int finishFLVJournal(FLVJournal_t *journal, const char *journalfile);
+void freeFLVJournal(FLVJournal_t *journal);
+int readFLVJournalBlock(int fd, off_t offset, unsigned char *bytes, size_t size);
+int writeFLVJournalBlock(int fd, off_t offset, const unsigned char *bytes, size_t size);
+int pwriteBytes(int fd, const unsigned char *bytes, size_t size, off_t offset);
+int syncDirectory(const char *file);
 int freeFLV(FLV_t *flv);
 
+int splitFLV(FLV_t *flv, FLVJob_t *job, FILE *fp);
+char *segmentPath(const char *outfile, size_t n);
+void *writeFLVSegments(void *arg);
+int writeFLVSegment(FLVSegment_t *segment, int fd);
+int writeFLVDescriptor(int out, FLV_t *flv, int fd, iostats_t *io);
+void initFLVOutput(FLVOutput_t *output, int fd, FLV_t *flv);
+int writeFLVOutput(FLVOutput_t *output, const unsigned char *bytes, size_t size, size_t *written);
+int finishFLVOutput(FLVOutput_t *output, const unsigned char *bytes, size_t size);
+void dropFLVOutput(FLVOutput_t *output, int wait);
+void dropCache(int fd, off_t offset, off_t size);
+int preallocateFile(int fd, off_t size);
+int writeFLVMemory(int out, FLV_t *flv, iostats_t *io);
+int appendFLVMemory(FLVManifest_t *ranges, buffer_t *buffer, off_t offset, off_t size);
+void rewriteFLVTag(unsigned char *bytes, FLVTag_t *flvtag);
+
 void storeFLVFromStdin(FILE *fp);
 int readFLVTag(FLVTag_t *flvtag, off_t offset, FILE *fp);
+int parseFLVTagHeader(FLVTag_t *flvtag, const unsigned char *buffer, off_t offset);
 int readFLVTagData(unsigned char *ptr, size_t size, FLVTag_t *flvtag, FILE *stream);
 
 int analyzeFLV(FLV_t *flv, FILE *fp);
 int analyzeFLVH263VideoPacket(FLV_t *flv, FLVTag_t *flvtag, FILE *fp);
 int analyzeFLVH264VideoPacket(FLV_t *flv, FLVTag_t *flvtag, FILE *fp);
+int analyzeFLVH264Keyframe(FLV_t *flv, FLVTag_t *flvtag, int keyframe, FILE *fp);
 int analyzeFLVScreenVideoPacket(FLV_t *flv, FLVTag_t *flvtag, FILE *fp);
 int analyzeFLVVP6VideoPacket(FLV_t *flv, FLVTag_t *flvtag, FILE *fp);
 int analyzeFLVVP6AlphaVideoPacket(FLV_t *flv, FLVTag_t *flvtag, FILE *fp);
@@ -232,6 +908,7 @@ int analyzeFLVVP6AlphaVideoPacket(FLV_t *flv, FLVTag_t *flvtag, FILE *fp);
 int createFLVEvents(FLV_t *flv);
 int createFLVEventOnMetaData(FLV_t *flv);
 int createFLVEventOnLastKeyframe(FLV_t *flv);
+int createFLVEventOnFiller(FLV_t *flv, size_t size);
 int createFLVEventOnLastSecond(FLV_t *flv);
 
 int writeBufferFLVScriptDataTag(buffer_t *buffer, int timestamp, size_t datasize);
@@ -250,20 +927,108 @@ int writeBufferFLVBool(buffer_t *buffer, int value);
 int writeBufferFLVDouble(buffer_t *buffer, double v);
 
 int writeFLVHeader(FILE *fp, int hasaudio, int hasvideo);
+int writeBufferFLVHeader(buffer_t *buffer, int hasaudio, int hasvideo);
 int writeFLVDataTag(FILE *fp, int type, int timestamp, size_t datasize);
+int writeBufferFLVDataTag(buffer_t *buffer, int type, int timestamp, size_t datasize);
 int writeFLVPreviousTagSize(FILE *fp, size_t tagsize);
 
 void writeXMLMetadata(FILE *fp, const char *infile, const char *outfile, FLV_t *flv);
+int writeBufferXMLHeader(buffer_t *buffer);
+int writeBufferXMLFooter(buffer_t *buffer);
+int writeBufferXMLMetadata(buffer_t *buffer, const char *infile, const char *outfile, FLV_t *flv);
+int writeBufferXMLBool(buffer_t *buffer, const char *name, int value);
+int writeBufferXMLInt(buffer_t *buffer, const char *name, int value);
+int writeBufferXMLUInt64(buffer_t *buffer, const char *name, uint64_t value);
+int writeBufferXMLDouble(buffer_t *buffer, const char *name, double value);
+
+int writeBufferJSONHeader(buffer_t *buffer);
+int writeBufferJSONFooter(buffer_t *buffer);
+int writeBufferJSONMetadata(buffer_t *buffer, const char *infile, const char *outfile, FLV_t *flv);
+int writeBufferJSONString(buffer_t *buffer, const char *s);
+int writeBufferJSONName(buffer_t *buffer, const char *name);
+int writeBufferJSONBool(buffer_t *buffer, const char *name, int value);
+int writeBufferJSONInt(buffer_t *buffer, const char *name, int value);
+int writeBufferJSONUInt64(buffer_t *buffer, const char *name, uint64_t value);
+int writeBufferJSONDouble(buffer_t *buffer, const char *name, double value);
+
+int writeBufferSeekTable(buffer_t *buffer, FLV_t *flv);
+int writeBufferManifest(buffer_t *buffer, const char *infile, const char *blobfile, FLVManifest_t *manifest);
+int bufferAppendLE(buffer_t *dst, uint64_t value, int nbytes);
+uint64_t readLE(const unsigned char *bytes, int nbytes);
+
+int writeBufferChecksumXML(buffer_t *buffer, checksum_t *checksum);
+int writeBufferChecksumJSON(buffer_t *buffer, checksum_t *checksum);
+int writeBufferChecksumLines(buffer_t *buffer, const char *name, checksum_t *checksum);
+int writeBufferChecksumHex(buffer_t *buffer, checksum_t *checksum, int algorithm);
+
+void checksumSetup(void);
+int parseChecksums(const char *list);
+void checksumInit(checksum_t *checksum, int algorithms);
+void checksumUpdate(checksum_t *checksum, const unsigned char *bytes, size_t nbytes);
+void checksumFinal(checksum_t *checksum);
+
+uint32_t crc32cSoftware(uint32_t crc, const unsigned char *bytes, size_t nbytes);
+#ifdef YAMDI_CRC32C_SSE42
+uint32_t crc32cSSE42(uint32_t crc, const unsigned char *bytes, size_t nbytes);
+#endif
+#ifdef YAMDI_CRC32C_ARMV8
+uint32_t crc32cARMv8(uint32_t crc, const unsigned char *bytes, size_t nbytes);
+#endif
 
-int readBytes(unsigned char *ptr, size_t size, FILE *stream);
+void xxh64Init(xxh64_t *xxh64);
+void xxh64Update(xxh64_t *xxh64, const unsigned char *bytes, size_t nbytes);
+uint64_t xxh64Final(xxh64_t *xxh64);
 
-int readH264NALUnit(h264data_t *h264data, unsigned char *nalu, int length);
+void sha256Init(sha256_t *sha256);
+void sha256Update(sha256_t *sha256, const unsigned char *bytes, size_t nbytes);
+void sha256Final(sha256_t *sha256, unsigned char *digest);
+void sha256Transform(uint32_t *h, const unsigned char *block);
+
+int readBytes(unsigned char *ptr, size_t size, FILE *stream);
+int copyBytes(FILE *out, FILE *in, off_t offset, off_t size);
+int seekBytes(FILE *stream, off_t offset, int whence);
+int writeBytes(const unsigned char *ptr, size_t size, FILE *stream);
+
+double wallClock(void);
+void statsClock(double *wall, double *cpu);
+void statsBegin(int phase);
+void statsEnd(int phase);
+void statsAddFLV(FLV_t *flv);
+void statsMerge(stats_t *part);
+void printStats(FILE *fp, int format);
+
+void traceInit(void);
+void traceEvent(const char *name, const char *cat, int tid, double start, double end, uint64_t ntags, uint64_t nbytes);
+void traceSpanBegin(tracespan_t *span);
+void traceSpanStep(tracespan_t *span, const char *name, int tid, uint64_t nbytes);
+void traceSpanEnd(tracespan_t *span, const char *name, int tid);
+void writeTrace(FILE *fp);
+void freeTrace(void);
+
+void metricsStart(void);
+void metricsStop(void);
+void *metricsWorker(void *arg);
+threadmetrics_t *metricsThread(void);
+void metricsAddFLV(stats_t *before, int rv, uint64_t insize, double wall);
+void metricsIndex(uint64_t indexbytes);
+void metricsQueue(int64_t n);
+int writeMetrics(void);
+int metricsBucket(const double *buckets, double value);
+
+void progressBegin(const char *phase, uint64_t totaltags, uint64_t totalbytes);
+void progressUpdate(uint64_t ntags, uint64_t nbytes);
+void progressEnd(uint64_t ntags, uint64_t nbytes);
+void writeProgress(uint64_t ntags, uint64_t nbytes, double now, int done);
+
+int readH264NALUnit(h264data_t *h264data, buffer_t *rbsp, unsigned char *nalu, int length);
 void readH264SPS(h264data_t *h264data, bitstream_t *bitstream);
 
 unsigned int readCodedU(bitstream_t *bitstream, int nbits, const char *name);
 unsigned int readCodedUE(bitstream_t *bitstream, const char *name);
 int readCodedSE(bitstream_t *bitstream, const char *name);
 
+void bitstreamInit(bitstream_t *bitstream, const unsigned char *bytes, size_t length);
+void bitstreamRefill(bitstream_t *bitstream);
 int readBits(bitstream_t *bitstream, int nbits);
 int readBit(bitstream_t *bitstream);
 
@@ -273,16 +1038,62 @@ int bufferReset(buffer_t *buffer);
 int bufferAppendBuffer(buffer_t *dst, buffer_t *src);
 int bufferAppendString(buffer_t *dst, const unsigned char *string);
 int bufferAppendBytes(buffer_t *dst, const unsigned char *bytes, size_t nbytes);
+int bufferAppendUInt64(buffer_t *dst, uint64_t value);
+int bufferAppendFixed2(buffer_t *dst, double value);
+int bufferReserve(buffer_t *buffer, size_t size);
 
 int isBigEndian(void);
+int parseSize(const char *s, uint64_t *size);
 
 void printUsage(void);
 
+// The benchmarks include this file and bring their own main()
+#ifndef YAMDI_NO_MAIN
 int main(int argc, char **argv) {
-	FILE *fp_infile = NULL, *fp_outfile = NULL, *fp_xmloutfile = NULL;
-	int c, unlink_infile = 0;
-	char *infile, *outfile, *xmloutfile, *tempfile;
-	FLV_t flv;
+	FILE *fp_infile = NULL, *fp_tracefile = NULL;
+	int c, i, j, rv, exitcode, ninfiles, nprocessed, unlink_infile;
+	char **infiles, *infile, *outfile, *xmloutfile, *jsonoutfile, *seektablefile, *manifestfile, *checksumfile, *tempfile, *tracefile, *socketfile, *spooldir;
+	double seconds;
+	char *end;
+	struct stat st, spool;
+	FLVOptions_t options;
+	FLVJob_t *jobs, *job;
+	buffer_t xml, json, checksums, *xmlparts = NULL, *jsonparts = NULL, *checksumparts = NULL;
+	short reorder;
+
+	static struct option longoptions[] = {
+		{"idr-keyframes", no_argument, NULL, YAMDI_OPTION_IDRKEYFRAMES},
+		{"probe", no_argument, NULL, YAMDI_OPTION_PROBE},
+		{"index-mode", required_argument, NULL, YAMDI_OPTION_INDEXMODE},
+		{"threads", required_argument, NULL, YAMDI_OPTION_THREADS},
+		{"stats", optional_argument, NULL, YAMDI_OPTION_STATS},
+		{"trace", required_argument, NULL, YAMDI_OPTION_TRACE},
+		{"progress-fd", required_argument, NULL, YAMDI_OPTION_PROGRESSFD},
+		{"seektable", required_argument, NULL, YAMDI_OPTION_SEEKTABLE},
+		{"start", required_argument, NULL, YAMDI_OPTION_START},
+		{"end", required_argument, NULL, YAMDI_OPTION_END},
+		{"split-duration", required_argument, NULL, YAMDI_OPTION_SPLITDURATION},
+		{"split-size", required_argument, NULL, YAMDI_OPTION_SPLITSIZE},
+		{"reflink", no_argument, NULL, YAMDI_OPTION_REFLINK},
+		{"manifest", required_argument, NULL, YAMDI_OPTION_MANIFEST},
+		{"checksum", required_argument, NULL, YAMDI_OPTION_CHECKSUM},
+		{"checksum-file", required_argument, NULL, YAMDI_OPTION_CHECKSUMFILE},
+		{"preallocate", no_argument, NULL, YAMDI_OPTION_PREALLOCATE},
+		{"direct-io", no_argument, NULL, YAMDI_OPTION_DIRECTIO},
+		{"drop-cache", no_argument, NULL, YAMDI_OPTION_DROPCACHE},
+		{"in-memory", required_argument, NULL, YAMDI_OPTION_INMEMORY},
+		{"in-place", no_argument, NULL, YAMDI_OPTION_INPLACE},
+		{"serve", required_argument, NULL, YAMDI_OPTION_SERVE},
+		{"watch", required_argument, NULL, YAMDI_OPTION_WATCH},
+		{"remove-input", no_argument, NULL, YAMDI_OPTION_REMOVEINPUT},
+		{"physical-order", no_argument, NULL, YAMDI_OPTION_PHYSICALORDER},
+		{"device-readers", required_argument, NULL, YAMDI_OPTION_DEVICEREADERS},
+		{"time-limit", required_argument, NULL, YAMDI_OPTION_TIMELIMIT},
+		{"io-limit", required_argument, NULL, YAMDI_OPTION_IOLIMIT},
+		{"metrics", required_argument, NULL, YAMDI_OPTION_METRICS},
+		{"metrics-interval", required_argument, NULL, YAMDI_OPTION_METRICSINTERVAL},
+		{NULL, 0, NULL, 0}
+	};
 
 #ifdef DEBUG
 	fprintf(stderr, "[core] sizeof size_t = %d\n", (int)sizeof(size_t));
@@ -294,17 +1105,31 @@ int main(int argc, char **argv) {
 
 	opterr = 0;
 
-	infile = NULL;
+	// -i may be given more than once
+	infiles = (char **)calloc(argc, sizeof(char *));
+	if(infiles == NULL)
+		exit(YAMDI_ERROR);
+
+	ninfiles = 0;
 	outfile = NULL;
 	xmloutfile = NULL;
+	jsonoutfile = NULL;
+	seektablefile = NULL;
+	manifestfile = NULL;
+	checksumfile = NULL;
 	tempfile = NULL;
+	tracefile = NULL;
+	socketfile = NULL;
+	spooldir = NULL;
 
-	initFLV(&flv);
+	memset(&options, 0, sizeof(FLVOptions_t));
 
-	while((c = getopt(argc, argv, ":i:o:x:t:c:a:lskMXwh")) != -1) {
+	options.inmemory = YAMDI_INMEMORY_DEFAULT;
+
+	while((c = getopt_long(argc, argv, ":i:o:x:j:t:c:a:lskMXwh", longoptions, NULL)) != -1) {
 		switch(c) {
 			case 'i':
-				infile = optarg;
+				infiles[ninfiles++] = optarg;
 				break;
 			case 'o':
 				outfile = optarg;
@@ -312,40 +1137,212 @@ int main(int argc, char **argv) {
 			case 'x':
 				xmloutfile = optarg;
 				break;
+			case 'j':
+				jsonoutfile = optarg;
+				break;
 			case 't':
 				tempfile = optarg;
 				break;
 			case 'c':
-				strncpy(flv.options.creator, optarg, sizeof(flv.options.creator));
+				strncpy(options.creator, optarg, sizeof(options.creator));
 				break;
 			case 'l':
 			case 's':
-				flv.options.addonlastsecond = 1;
+				options.addonlastsecond = 1;
 				break;
 			case 'k':
-				flv.options.addonlastkeyframe = 1;
+				options.addonlastkeyframe = 1;
 				break;
 			case 'a':
-				flv.options.addaudiokeyframes = 1;
-				flv.audio.keyframedistance = (int)strtol(optarg, (char **)NULL, 10);
-				if(flv.audio.keyframedistance <= 0) {
-					flv.audio.keyframedistance = 0;
-					flv.options.addaudiokeyframes = 0;
+				options.addaudiokeyframes = 1;
+				options.keyframedistance = (int)strtol(optarg, (char **)NULL, 10);
+				if(options.keyframedistance <= 0) {
+					options.keyframedistance = 0;
+					options.addaudiokeyframes = 0;
 				}
 				break;
 /*
 			case 'm':
-				flv.options.keepmetadata = 1;
+				options.keepmetadata = 1;
 				break;
 */
 			case 'M':
-				flv.options.stripmetadata = 1;
+				options.stripmetadata = 1;
 				break;
 			case 'X':
-				flv.options.xmlomitkeyframes = 1;
+				options.xmlomitkeyframes = 1;
 				break;
 			case 'w':
-				flv.options.overwriteinput = 1;
+				options.overwriteinput = 1;
+				break;
+			case YAMDI_OPTION_IDRKEYFRAMES:
+				options.idrkeyframes = 1;
+				break;
+			case YAMDI_OPTION_PROBE:
+				options.probe = 1;
+				break;
+			case YAMDI_OPTION_INDEXMODE:
+				if(!strcmp(optarg, "serial"))
+					options.indexmode = YAMDI_INDEX_SERIAL;
+				else if(!strcmp(optarg, "bidirectional"))
+					options.indexmode = YAMDI_INDEX_BIDIRECTIONAL;
+				else if(!strcmp(optarg, "parallel"))
+					options.indexmode = YAMDI_INDEX_PARALLEL;
+				else {
+					fprintf(stderr, "Unknown index mode: %s. -h for help.\n", optarg);
+					exit(YAMDI_ERROR);
+				}
+				break;
+			case YAMDI_OPTION_THREADS:
+				options.threads = (int)strtol(optarg, (char **)NULL, 10);
+				if(options.threads <= 0) {
+					fprintf(stderr, "The number of threads must be positive. -h for help.\n");
+					exit(YAMDI_ERROR);
+				}
+				break;
+			case YAMDI_OPTION_STATS:
+				if(optarg == NULL || !strcmp(optarg, "text"))
+					options.stats = YAMDI_STATS_TEXT;
+				else if(!strcmp(optarg, "json"))
+					options.stats = YAMDI_STATS_JSON;
+				else {
+					fprintf(stderr, "Unknown stats format: %s. -h for help.\n", optarg);
+					exit(YAMDI_ERROR);
+				}
+				break;
+			case YAMDI_OPTION_TRACE:
+				tracefile = optarg;
+				break;
+			case YAMDI_OPTION_SEEKTABLE:
+				seektablefile = optarg;
+				break;
+			case YAMDI_OPTION_START:
+			case YAMDI_OPTION_END:
+				seconds = strtod(optarg, &end);
+				if(end == optarg || *end != '\0' || !(seconds >= 0.0 && seconds < 2147483.0)) {
+					fprintf(stderr, "Invalid time: %s. -h for help.\n", optarg);
+					exit(YAMDI_ERROR);
+				}
+
+				if(c == YAMDI_OPTION_START)
+					options.start = (int)(seconds * 1000.0 + 0.5);
+				else {
+					options.end = (int)(seconds * 1000.0 + 0.5);
+					if(options.end == 0) {
+						fprintf(stderr, "The end must be after the beginning of the file. -h for help.\n");
+						exit(YAMDI_ERROR);
+					}
+				}
+				break;
+			case YAMDI_OPTION_SPLITDURATION:
+				seconds = strtod(optarg, &end);
+				if(end == optarg || *end != '\0' || !(seconds > 0.0 && seconds < 2147483.0) || (int)(seconds * 1000.0 + 0.5) == 0) {
+					fprintf(stderr, "Invalid time: %s. -h for help.\n", optarg);
+					exit(YAMDI_ERROR);
+				}
+
+				options.splitduration = (int)(seconds * 1000.0 + 0.5);
+				break;
+			case YAMDI_OPTION_SPLITSIZE:
+				if(parseSize(optarg, &options.splitsize) != YAMDI_OK || options.splitsize == 0) {
+					fprintf(stderr, "Invalid size: %s. -h for help.\n", optarg);
+					exit(YAMDI_ERROR);
+				}
+				break;
+			case YAMDI_OPTION_REFLINK:
+				options.reflink = 1;
+				break;
+			case YAMDI_OPTION_MANIFEST:
+				manifestfile = optarg;
+				break;
+			case YAMDI_OPTION_CHECKSUM:
+				options.checksums = parseChecksums(optarg);
+				if(options.checksums == 0) {
+					fprintf(stderr, "Invalid checksum: %s. Use crc32c, xxh64 and sha256, separated by commas.\n", optarg);
+					exit(YAMDI_ERROR);
+				}
+				break;
+			case YAMDI_OPTION_CHECKSUMFILE:
+				checksumfile = optarg;
+				break;
+			case YAMDI_OPTION_PREALLOCATE:
+				options.preallocate = 1;
+				break;
+			case YAMDI_OPTION_DIRECTIO:
+				options.directio = 1;
+				break;
+			case YAMDI_OPTION_DROPCACHE:
+				options.dropcache = 1;
+				break;
+			case YAMDI_OPTION_INMEMORY:
+				if(parseSize(optarg, &options.inmemory) != YAMDI_OK) {
+					fprintf(stderr, "Invalid size: %s. -h for help.\n", optarg);
+					exit(YAMDI_ERROR);
+				}
+				break;
+			case YAMDI_OPTION_INPLACE:
+				options.inplace = 1;
+				break;
+			case YAMDI_OPTION_SERVE:
+				socketfile = optarg;
+				break;
+			case YAMDI_OPTION_WATCH:
+				spooldir = optarg;
+				break;
+			case YAMDI_OPTION_REMOVEINPUT:
+				options.removeinput = 1;
+				break;
+			case YAMDI_OPTION_PHYSICALORDER:
+				options.physicalorder = 1;
+				break;
+			case YAMDI_OPTION_DEVICEREADERS:
+				options.devicereaders = (int)strtol(optarg, (char **)NULL, 10);
+				if(options.devicereaders <= 0) {
+					fprintf(stderr, "The number of readers per device must be positive. -h for help.\n");
+					exit(YAMDI_ERROR);
+				}
+				break;
+			case YAMDI_OPTION_TIMELIMIT:
+				seconds = strtod(optarg, &end);
+				if(end == optarg || *end != '\0' || !(seconds > 0.0 && seconds < 2147483.0) || (int)(seconds * 1000.0 + 0.5) == 0) {
+					fprintf(stderr, "Invalid time: %s. -h for help.\n", optarg);
+					exit(YAMDI_ERROR);
+				}
+
+				options.timelimit = (int)(seconds * 1000.0 + 0.5);
+				break;
+			case YAMDI_OPTION_IOLIMIT:
+				if(parseSize(optarg, &options.iolimit) != YAMDI_OK || options.iolimit == 0) {
+					fprintf(stderr, "Invalid size: %s. -h for help.\n", optarg);
+					exit(YAMDI_ERROR);
+				}
+				break;
+			case YAMDI_OPTION_METRICS:
+				metrics.file = optarg;
+				break;
+			case YAMDI_OPTION_METRICSINTERVAL:
+				seconds = strtod(optarg, &end);
+				if(end == optarg || *end != '\0' || !(seconds > 0.0 && seconds < 2147483.0) || (int)(seconds * 1000.0 + 0.5) == 0) {
+					fprintf(stderr, "Invalid time: %s. -h for help.\n", optarg);
+					exit(YAMDI_ERROR);
+				}
+
+				metrics.interval = (int)(seconds * 1000.0 + 0.5);
+				break;
+			case YAMDI_OPTION_PROGRESSFD:
+				progress.fd = (int)strtol(optarg, (char **)NULL, 10);
+#ifndef __MINGW32__
+				if(progress.fd < 0 || fcntl(progress.fd, F_GETFD) == -1) {
+#else
+				if(progress.fd < 0) {
+#endif
+					fprintf(stderr, "The file descriptor %s for the progress is not open. -h for help.\n", optarg);
+					exit(YAMDI_ERROR);
+				}
+#ifndef __MINGW32__
+				// A reader that goes away mustn't kill us
+				signal(SIGPIPE, SIG_IGN);
+#endif
 				break;
 			case 'h':
 				printUsage();
@@ -366,1961 +1363,8746 @@ int main(int argc, char **argv) {
 		}
 	}
 
-	if(infile == NULL) {
-		fprintf(stderr, "Please use -i to provide an input file. -h for help.\n");
-		exit(YAMDI_ERROR);
-	}
+	if(metrics.file != NULL) {
+		if(!strcmp(metrics.file, "-")) {
+			fprintf(stderr, "Please use --metrics with a file name. -h for help.\n");
+			exit(YAMDI_ERROR);
+		}
 
-	if(outfile == NULL && xmloutfile == NULL) {
-		fprintf(stderr, "Please use -o or -x to provide at least one output file. -h for help.\n");
-		exit(YAMDI_ERROR);
+		metricsStart();
 	}
-
-	if(tempfile == NULL && !strcmp(infile, "-")) {
-		fprintf(stderr, "Please use -t to specify a temporary file. -h for help.\n");
+	else if(metrics.interval != 0) {
+		fprintf(stderr, "Please use --metrics-interval only together with --metrics. -h for help.\n");
 		exit(YAMDI_ERROR);
 	}
 
-	// Check input file
-	if(!strcmp(infile, "-")) {		// Read from stdin
-		// tempfile is available
-		// Check if the possible outfiles collide with the tempfile
-		if(outfile != NULL) {
-			if(!strcmp(tempfile, outfile)) {
-				fprintf(stderr, "The temporary file and the output file must not be the same.\n");
-				exit(YAMDI_ERROR);
-			}
+	// The files come with the requests, the options given here are the defaults for all of them
+	if(socketfile != NULL) {
+		if(ninfiles != 0 || outfile != NULL || seektablefile != NULL || options.overwriteinput == 1 || options.start != 0 || options.end != 0) {
+			fprintf(stderr, "Please give -i, -o, -w, --seektable, --start and --end with the requests to --serve. -h for help.\n");
+			exit(YAMDI_ERROR);
 		}
 
-		if(xmloutfile != NULL) {
-			if(!strcmp(tempfile, xmloutfile)) {
-				fprintf(stderr, "The temporary file and the XML output file must not be the same.\n");
-				exit(YAMDI_ERROR);
-			}
+		if(xmloutfile != NULL || jsonoutfile != NULL || tempfile != NULL || options.probe == 1 || options.splitduration != 0 || options.splitsize != 0 || manifestfile != NULL || options.checksums != 0 || checksumfile != NULL || options.inplace == 1 || options.stats != YAMDI_STATS_NONE || tracefile != NULL || progress.fd != -1 || options.physicalorder == 1 || options.devicereaders != 0) {
+			fprintf(stderr, "Please don't use -x, -j, -t, --probe, --split-duration, --split-size, --manifest, --checksum, --checksum-file, --in-place, --stats, --trace, --progress-fd, --physical-order or --device-readers together with --serve. -h for help.\n");
+			exit(YAMDI_ERROR);
 		}
+
+		free(infiles);
+
+		rv = serveFLV(socketfile, &options);
+		metricsStop();
+
+		exit(rv);
 	}
-	else {					// Read from file
-		// infile is available
-		// Check if the possible outfile collide with the infile
-		if(outfile != NULL) {
-			if(!strcmp(infile, outfile)) {
-				fprintf(stderr, "The input file and the output file must not be the same.\n");
-				exit(YAMDI_ERROR);
-			}
+
+	// Every file that is completed in the spool directory goes into the output directory
+	if(spooldir != NULL) {
+		if(ninfiles != 0 || xmloutfile != NULL || jsonoutfile != NULL || seektablefile != NULL || tempfile != NULL || options.overwriteinput == 1 || options.start != 0 || options.end != 0) {
+			fprintf(stderr, "Please don't use -i, -x, -j, -t, -w, --seektable, --start or --end together with --watch. -h for help.\n");
+			exit(YAMDI_ERROR);
 		}
 
-		if(xmloutfile != NULL) {
-			if(!strcmp(infile, xmloutfile)) {
-				fprintf(stderr, "The input file and the XML output file must not be the same.\n");
-				exit(YAMDI_ERROR);
-			}
+		if(options.probe == 1 || options.splitduration != 0 || options.splitsize != 0 || manifestfile != NULL || options.checksums != 0 || checksumfile != NULL || options.inplace == 1 || options.stats != YAMDI_STATS_NONE || tracefile != NULL || progress.fd != -1 || options.physicalorder == 1 || options.devicereaders != 0) {
+			fprintf(stderr, "Please don't use --probe, --split-duration, --split-size, --manifest, --checksum, --checksum-file, --in-place, --stats, --trace, --progress-fd, --physical-order or --device-readers together with --watch. -h for help.\n");
+			exit(YAMDI_ERROR);
 		}
-	}
 
-	// Check output file
-	if(outfile != NULL) {
-		if(xmloutfile != NULL) {
-			if(!strcmp(outfile, xmloutfile)) {
-				fprintf(stderr, "The output file and the XML output file must not be the same.\n");
-				exit(YAMDI_ERROR);
-			}
+		if(stat(spooldir, &spool) != 0 || !S_ISDIR(spool.st_mode)) {
+			fprintf(stderr, "Please use --watch with a directory. -h for help.\n");
+			exit(YAMDI_ERROR);
 		}
-	}
 
-	// All checks are done. Open the files.
+		if(outfile == NULL || !strcmp(outfile, "-") || stat(outfile, &st) != 0 || !S_ISDIR(st.st_mode)) {
+			fprintf(stderr, "Please use -o with a directory together with --watch. -h for help.\n");
+			exit(YAMDI_ERROR);
+		}
 
-	// Open the inputfile
-	// Store data to tempfile if inputfile is stdin
-	if(!strcmp(infile, "-")) {
-		fp_infile = fopen(tempfile, "wb");
-		if(fp_infile == NULL) {
-			fprintf(stderr, "Couldn't open the tempfile %s.\n", tempfile);
+		// The same directory may be written in many ways, e.g. spool/ or ./spool
+#ifndef __MINGW32__
+		if(st.st_dev == spool.st_dev && st.st_ino == spool.st_ino) {
+#else
+		if(!strcmp(spooldir, outfile)) {
+#endif
+			fprintf(stderr, "The spool directory and the output directory must not be the same.\n");
 			exit(YAMDI_ERROR);
 		}
 
-		// Store stdin to temporary file
-		storeFLVFromStdin(fp_infile);
+		if(options.stripmetadata == 1) {
+			options.addonlastkeyframe = 0;
+			options.addonlastsecond = 0;
+			options.addonmetadata = 0;
+		}
+		else
+			options.addonmetadata = 1;
+
+		free(infiles);
 
-		// Close temporary file
-		fclose(fp_infile);
+		rv = watchFLV(spooldir, outfile, &options);
+		metricsStop();
 
-		// Mimic normal input file, but don't forget to remove the temporary file
-		infile = tempfile;
-		unlink_infile = 1;
+		exit(rv);
 	}
 
-	fp_infile = fopen(infile, "rb");
-	if(fp_infile == NULL) {
-		if(unlink_infile == 1)
-			unlink(infile);
+	if(options.removeinput == 1) {
+		fprintf(stderr, "Please use --remove-input only together with --watch. -h for help.\n");
+		exit(YAMDI_ERROR);
+	}
 
+	if(ninfiles == 0) {
+		fprintf(stderr, "Please use -i to provide an input file. -h for help.\n");
 		exit(YAMDI_ERROR);
 	}
 
-	// Check if we have a valid FLV file
-	if(validateFLV(fp_infile) != YAMDI_OK) {
-		fclose(fp_infile);
+	if(outfile == NULL && xmloutfile == NULL && jsonoutfile == NULL && seektablefile == NULL && options.inplace == 0) {
+		fprintf(stderr, "Please use -o, -x, -j or --seektable to provide at least one output file. -h for help.\n");
+		exit(YAMDI_ERROR);
+	}
 
-		if(unlink_infile == 1)
-			unlink(infile);
+	if(options.probe == 1 && (outfile != NULL || options.inplace == 1 || (xmloutfile == NULL && jsonoutfile == NULL && seektablefile == NULL))) {
+		fprintf(stderr, "Please use only -x, -j or --seektable together with --probe. -h for help.\n");
+		exit(YAMDI_ERROR);
+	}
 
+	if(options.probe == 1 && (options.start != 0 || options.end != 0)) {
+		fprintf(stderr, "Please don't use --start or --end together with --probe. -h for help.\n");
 		exit(YAMDI_ERROR);
 	}
 
-	// Open the outfile
-	fp_outfile = NULL;
-	if(outfile != NULL) {
-		if(strcmp(outfile, "-")) {
-			fp_outfile = fopen(outfile, "wb");
-			if(fp_outfile == NULL) {
-				fprintf(stderr, "Couldn't open %s.\n", outfile);
+	if(options.end != 0 && options.end <= options.start) {
+		fprintf(stderr, "The end must be after the start. -h for help.\n");
+		exit(YAMDI_ERROR);
+	}
 
-				if(unlink_infile == 1)
-					unlink(infile);
+	// The input file is the output file
+	if(options.inplace == 1) {
+		if(outfile != NULL || options.overwriteinput == 1) {
+			fprintf(stderr, "Please don't use -o or -w together with --in-place. -h for help.\n");
+			exit(YAMDI_ERROR);
+		}
+
+		if(options.splitduration != 0 || options.splitsize != 0 || options.reflink == 1 || manifestfile != NULL || checksumfile != NULL || options.checksums != 0) {
+			fprintf(stderr, "Please don't use --split-duration, --split-size, --reflink, --manifest or --checksum together with --in-place. -h for help.\n");
+			exit(YAMDI_ERROR);
+		}
 
+		for(i = 0; i < ninfiles; i++) {
+			if(!strcmp(infiles[i], "-")) {
+				fprintf(stderr, "Only a file can be rewritten in place, not stdin.\n");
 				exit(YAMDI_ERROR);
 			}
 		}
-		else
-			fp_outfile = stdout;
+
+		// The journal is protected by CRC-32C
+		checksumSetup();
 	}
 
-	// Open the XML outputfile
-	fp_xmloutfile = NULL;
-	if(xmloutfile != NULL) {
-		if(strcmp(xmloutfile, "-")) {
-			fp_xmloutfile = fopen(xmloutfile, "wb");
-			if(fp_xmloutfile == NULL) {
-				fprintf(stderr, "Couldn't open %s.\n", xmloutfile);
+	// A checksum file alone means SHA-256
+	if(checksumfile != NULL && options.checksums == 0)
+		options.checksums = YAMDI_CHECKSUM_SHA256;
 
-				if(unlink_infile == 1)
-					unlink(infile);
+	if(options.checksums != 0) {
+		if(outfile == NULL) {
+			fprintf(stderr, "Please use -o together with --checksum or --checksum-file. -h for help.\n");
+			exit(YAMDI_ERROR);
+		}
 
-				exit(YAMDI_ERROR);
-			}
+		if(options.reflink == 1 || manifestfile != NULL) {
+			fprintf(stderr, "Please don't use --reflink or --manifest together with --checksum or --checksum-file. -h for help.\n");
+			exit(YAMDI_ERROR);
 		}
-		else
-			fp_xmloutfile = stdout;
+
+		checksumSetup();
 	}
 
-	// Check the options
-	if(flv.options.stripmetadata == 1) {
-		flv.options.addonlastkeyframe = 0;
-		flv.options.addonlastsecond = 0;
-		flv.options.addonmetadata = 0;
+	if(options.preallocate == 1 || options.directio == 1 || options.dropcache == 1) {
+		if(outfile == NULL) {
+			fprintf(stderr, "Please use -o together with --preallocate, --direct-io or --drop-cache. -h for help.\n");
+			exit(YAMDI_ERROR);
+		}
+
+		if(options.reflink == 1 || manifestfile != NULL) {
+			fprintf(stderr, "Please don't use --reflink or --manifest together with --preallocate, --direct-io or --drop-cache. -h for help.\n");
+			exit(YAMDI_ERROR);
+		}
 	}
-	else
-		flv.options.addonmetadata = 1;
 
-	// Create an index of the FLV file
-	if(indexFLV(&flv, fp_infile) != YAMDI_OK) {
-		fclose(fp_infile);
+	if(manifestfile != NULL) {
+		if(outfile == NULL || !strcmp(outfile, "-")) {
+			fprintf(stderr, "Please use -o with a file name for the blob file together with --manifest. -h for help.\n");
+			exit(YAMDI_ERROR);
+		}
 
-		if(unlink_infile == 1)
-			unlink(infile);
+		if(options.overwriteinput == 1 || options.reflink == 1 || options.splitduration != 0 || options.splitsize != 0) {
+			fprintf(stderr, "Please don't use -w, --reflink, --split-duration or --split-size together with --manifest. -h for help.\n");
+			exit(YAMDI_ERROR);
+		}
 
-		exit(YAMDI_ERROR);
+		for(i = 0; i < ninfiles; i++) {
+			if(!strcmp(infiles[i], "-")) {
+				fprintf(stderr, "The manifest refers to the input file, it can't be read from stdin.\n");
+				exit(YAMDI_ERROR);
+			}
+		}
 	}
 
-	if(analyzeFLV(&flv, fp_infile) != YAMDI_OK) {
-		fclose(fp_infile);
+	if(options.splitduration != 0 || options.splitsize != 0) {
+		if(outfile == NULL || !strcmp(outfile, "-")) {
+			fprintf(stderr, "Please use -o with a file name for the segments together with --split-duration or --split-size. -h for help.\n");
+			exit(YAMDI_ERROR);
+		}
 
-		if(unlink_infile == 1)
-			unlink(infile);
+		if(options.probe == 1 || options.overwriteinput == 1 || seektablefile != NULL || options.reflink == 1) {
+			fprintf(stderr, "Please don't use --probe, -w, --seektable or --reflink together with --split-duration or --split-size. -h for help.\n");
+			exit(YAMDI_ERROR);
+		}
+	}
 
+	// The readers of the devices work at the same time, the trace and the progress are made for one file after the other
+	if(options.devicereaders != 0 && (tracefile != NULL || progress.fd != -1)) {
+		fprintf(stderr, "Please don't use --trace or --progress-fd together with --device-readers. -h for help.\n");
 		exit(YAMDI_ERROR);
 	}
 
-	if(finalizeFLV(&flv, fp_infile) != YAMDI_OK) {
-		fclose(fp_infile);
+	if(ninfiles > 1) {
+		// Batch mode. Every input file gets its own output file in the output directory.
+		for(i = 0; i < ninfiles; i++) {
+			if(!strcmp(infiles[i], "-")) {
+				fprintf(stderr, "Reading from stdin is only possible with a single input file.\n");
+				exit(YAMDI_ERROR);
+			}
 
-		if(unlink_infile == 1)
-			unlink(infile);
+			if(xmloutfile != NULL && !strcmp(infiles[i], xmloutfile)) {
+				fprintf(stderr, "The input file and the XML output file must not be the same.\n");
+				exit(YAMDI_ERROR);
+			}
+		}
 
-		exit(YAMDI_ERROR);
-	}
+		if(outfile != NULL) {
+			if(!strcmp(outfile, "-") || stat(outfile, &st) != 0 || !S_ISDIR(st.st_mode)) {
+				fprintf(stderr, "Please use -o with a directory for more than one input file. -h for help.\n");
+				exit(YAMDI_ERROR);
+			}
+		}
 
-#ifdef DEBUG
-	fprintf(stderr, "[FLV] onmetadata = %d bytes (%d bytes allocated)\n", flv.onmetadata.used, flv.onmetadata.size);
-	fprintf(stderr, "[FLV] onlastsecond = %d bytes (%d bytes allocated)\n", flv.onlastsecond.used, flv.onlastsecond.size);
-	fprintf(stderr, "[FLV] onlastkeyframe = %d bytes (%d bytes allocated)\n", flv.onlastkeyframe.used, flv.onlastkeyframe.size);
-#endif
+		if(seektablefile != NULL) {
+			if(!strcmp(seektablefile, "-") || stat(seektablefile, &st) != 0 || !S_ISDIR(st.st_mode)) {
+				fprintf(stderr, "Please use --seektable with a directory for more than one input file. -h for help.\n");
+				exit(YAMDI_ERROR);
+			}
+		}
 
-	if(fp_outfile != NULL)
-		writeFLV(fp_outfile, &flv, fp_infile);
+		if(manifestfile != NULL) {
+			if(!strcmp(manifestfile, "-") || stat(manifestfile, &st) != 0 || !S_ISDIR(st.st_mode)) {
+				fprintf(stderr, "Please use --manifest with a directory for more than one input file. -h for help.\n");
+				exit(YAMDI_ERROR);
+			}
+		}
 
-	if(fp_xmloutfile != NULL)
-		writeXMLMetadata(fp_xmloutfile, infile, outfile, &flv);
+		// The output files are named after the input files, two of the same name would overwrite each other
+		if(outfile != NULL || seektablefile != NULL || manifestfile != NULL) {
+			for(i = 1; i < ninfiles; i++) {
+				for(j = 0; j < i; j++) {
+					if(!strcmp(batchBasename(infiles[i]), batchBasename(infiles[j]))) {
+						fprintf(stderr, "The input files %s and %s have the same name, their output files would be the same.\n", infiles[j], infiles[i]);
+						exit(YAMDI_ERROR);
+					}
+				}
+			}
+		}
+	}
+	else {
+		infile = infiles[0];
 
-	fclose(fp_infile);
+		if(tempfile == NULL && !strcmp(infile, "-")) {
+			fprintf(stderr, "Please use -t to specify a temporary file. -h for help.\n");
+			exit(YAMDI_ERROR);
+		}
 
-	// Remove the input file if it is the temporary file
-	if(unlink_infile == 1)
-		unlink(infile);
+		// Check input file
+		if(!strcmp(infile, "-")) {		// Read from stdin
+			// tempfile is available
+			// Check if the possible outfiles collide with the tempfile
+			if(outfile != NULL) {
+				if(!strcmp(tempfile, outfile)) {
+					fprintf(stderr, "The temporary file and the output file must not be the same.\n");
+					exit(YAMDI_ERROR);
+				}
+			}
 
-	if(fp_outfile != NULL && fp_outfile != stdout)
-		fclose(fp_outfile);
+			if(xmloutfile != NULL) {
+				if(!strcmp(tempfile, xmloutfile)) {
+					fprintf(stderr, "The temporary file and the XML output file must not be the same.\n");
+					exit(YAMDI_ERROR);
+				}
+			}
+		}
+		else {					// Read from file
+			// infile is available
+			// Check if the possible outfile collide with the infile
+			if(outfile != NULL) {
+				if(!strcmp(infile, outfile)) {
+					fprintf(stderr, "The input file and the output file must not be the same.\n");
+					exit(YAMDI_ERROR);
+				}
+			}
 
-	if(fp_xmloutfile != NULL && fp_xmloutfile != stdout)
-		fclose(fp_xmloutfile);
+			if(xmloutfile != NULL) {
+				if(!strcmp(infile, xmloutfile)) {
+					fprintf(stderr, "The input file and the XML output file must not be the same.\n");
+					exit(YAMDI_ERROR);
+				}
+			}
+		}
+	}
 
-	if(flv.options.overwriteinput == 1 && strcmp(infile, "-") && outfile != NULL && strcmp(outfile, "-")) {
-		if(rename(outfile, infile) != 0)
-			exit(YAMDI_RENAME_OUTPUT);
+	// Check output file
+	if(outfile != NULL) {
+		if(xmloutfile != NULL) {
+			if(!strcmp(outfile, xmloutfile)) {
+				fprintf(stderr, "The output file and the XML output file must not be the same.\n");
+				exit(YAMDI_ERROR);
+			}
+		}
 	}
 
-	freeFLV(&flv);
+	// Check JSON and seek table file
+	for(i = 0; i < ninfiles; i++) {
+		if(jsonoutfile != NULL && !strcmp(infiles[i], jsonoutfile)) {
+			fprintf(stderr, "The input file and the JSON output file must not be the same.\n");
+			exit(YAMDI_ERROR);
+		}
 
-	return YAMDI_OK;
-}
+		if(seektablefile != NULL && !strcmp(infiles[i], seektablefile)) {
+			fprintf(stderr, "The input file and the seek table file must not be the same.\n");
+			exit(YAMDI_ERROR);
+		}
 
-int validateFLV(FILE *fp) {
-	unsigned char buffer[FLV_SIZE_HEADER + FLV_SIZE_PREVIOUSTAGSIZE];
-	off_t filesize;
+		if(manifestfile != NULL && !strcmp(infiles[i], manifestfile)) {
+			fprintf(stderr, "The input file and the manifest file must not be the same.\n");
+			exit(YAMDI_ERROR);
+		}
 
-	fseeko(fp, 0, SEEK_END);
-	filesize = ftello(fp);
+		if(checksumfile != NULL && !strcmp(infiles[i], checksumfile)) {
+			fprintf(stderr, "The input file and the checksum file must not be the same.\n");
+			exit(YAMDI_ERROR);
+		}
+	}
 
-	// Check for minimal FLV file length
-	if(filesize < (FLV_SIZE_HEADER + FLV_SIZE_PREVIOUSTAGSIZE))
-		return YAMDI_FILE_TOO_SMALL;
+	if(jsonoutfile != NULL) {
+		if((tempfile != NULL && !strcmp(tempfile, jsonoutfile)) || (outfile != NULL && !strcmp(outfile, jsonoutfile)) || (xmloutfile != NULL && !strcmp(xmloutfile, jsonoutfile))) {
+			fprintf(stderr, "The JSON output file must not be the same as any other file.\n");
+			exit(YAMDI_ERROR);
+		}
+	}
 
-	rewind(fp);
+	if(seektablefile != NULL) {
+		if((tempfile != NULL && !strcmp(tempfile, seektablefile)) || (outfile != NULL && !strcmp(outfile, seektablefile)) || (xmloutfile != NULL && !strcmp(xmloutfile, seektablefile)) || (jsonoutfile != NULL && !strcmp(jsonoutfile, seektablefile))) {
+			fprintf(stderr, "The seek table file must not be the same as any other file.\n");
+			exit(YAMDI_ERROR);
+		}
+	}
 
-	if(readBytes(buffer, FLV_SIZE_HEADER + FLV_SIZE_PREVIOUSTAGSIZE, fp) != YAMDI_OK)
-		return YAMDI_READ_ERROR;
+	if(manifestfile != NULL) {
+		if((outfile != NULL && !strcmp(outfile, manifestfile)) || (xmloutfile != NULL && !strcmp(xmloutfile, manifestfile)) || (jsonoutfile != NULL && !strcmp(jsonoutfile, manifestfile)) || (seektablefile != NULL && !strcmp(seektablefile, manifestfile))) {
+			fprintf(stderr, "The manifest file must not be the same as any other file.\n");
+			exit(YAMDI_ERROR);
+		}
+	}
 
-	// Check the FLV signature
-	if(buffer[0] != 'F' || buffer[1] != 'L' || buffer[2] != 'V')
-		return YAMDI_INVALID_SIGNATURE;
+	if(checksumfile != NULL) {
+		if((tempfile != NULL && !strcmp(tempfile, checksumfile)) || (outfile != NULL && !strcmp(outfile, checksumfile)) || (xmloutfile != NULL && !strcmp(xmloutfile, checksumfile)) || (jsonoutfile != NULL && !strcmp(jsonoutfile, checksumfile)) || (seektablefile != NULL && !strcmp(seektablefile, checksumfile))) {
+			fprintf(stderr, "The checksum file must not be the same as any other file.\n");
+			exit(YAMDI_ERROR);
+		}
+	}
 
-	// Check the FLV version
-	if(FLV_UI8(&buffer[3]) != 1)
-		return YAMDI_INVALID_FLVVERSION;
+	// Check trace file
+	if(tracefile != NULL) {
+		for(i = 0; i < ninfiles; i++) {
+			if(!strcmp(tracefile, infiles[i])) {
+				fprintf(stderr, "The trace file must be a file on its own.\n");
+				exit(YAMDI_ERROR);
+			}
+		}
 
-	// Check the DataOffset
-	if(FLV_UI32(&buffer[5]) != FLV_SIZE_HEADER)
-		return YAMDI_INVALID_DATASIZE;
+		if(!strcmp(tracefile, "-") || (tempfile != NULL && !strcmp(tracefile, tempfile)) || (outfile != NULL && !strcmp(tracefile, outfile)) || (xmloutfile != NULL && !strcmp(tracefile, xmloutfile)) || (jsonoutfile != NULL && !strcmp(tracefile, jsonoutfile)) || (seektablefile != NULL && !strcmp(tracefile, seektablefile)) || (manifestfile != NULL && !strcmp(tracefile, manifestfile)) || (checksumfile != NULL && !strcmp(tracefile, checksumfile))) {
+			fprintf(stderr, "The trace file must be a file on its own.\n");
+			exit(YAMDI_ERROR);
+		}
 
-	// Check the PreviousTagSize0 value
-	if(FLV_UI32(&buffer[FLV_SIZE_HEADER]) != 0)
-		return YAMDI_INVALID_PREVIOUSTAGSIZE;
+		fp_tracefile = fopen(tracefile, "wb");
+		if(fp_tracefile == NULL) {
+			fprintf(stderr, "Couldn't open %s.\n", tracefile);
+			exit(YAMDI_ERROR);
+		}
 
-	return YAMDI_OK;
-}
+		traceInit();
+	}
 
-int initFLV(FLV_t *flv) {
-	if(flv == NULL)
-		return YAMDI_ERROR;
+	// Check the options
+	if(options.stripmetadata == 1) {
+		options.addonlastkeyframe = 0;
+		options.addonlastsecond = 0;
+		options.addonmetadata = 0;
+	}
+	else
+		options.addonmetadata = 1;
+
+	// All checks are done. The XML and the JSON of all input files go into one document each.
+	bufferInit(&xml);
+	if(xmloutfile != NULL)
+		writeBufferXMLHeader(&xml);
+
+	bufferInit(&json);
+	if(jsonoutfile != NULL)
+		writeBufferJSONHeader(&json);
+
+	bufferInit(&checksums);
+
+	exitcode = YAMDI_OK;
+	nprocessed = 0;
+
+	// Set up all jobs first, --physical-order and --device-readers process them in another order
+	jobs = (FLVJob_t *)calloc(ninfiles, sizeof(FLVJob_t));
+	if(jobs == NULL)
+		exit(YAMDI_OUT_OF_MEMORY);
+
+	// Then every file gets its own XML, JSON and checksums, they are joined in the order of the command line
+	reorder = (options.physicalorder == 1 || options.devicereaders != 0);
+	if(reorder == 1) {
+		xmlparts = (buffer_t *)calloc(ninfiles, sizeof(buffer_t));
+		jsonparts = (buffer_t *)calloc(ninfiles, sizeof(buffer_t));
+		checksumparts = (buffer_t *)calloc(ninfiles, sizeof(buffer_t));
+		if(xmlparts == NULL || jsonparts == NULL || checksumparts == NULL)
+			exit(YAMDI_OUT_OF_MEMORY);
+	}
 
-	memset(flv, 0, sizeof(FLV_t));
+	unlink_infile = 0;
 
-	return YAMDI_OK;
-}
+	for(i = 0; i < ninfiles; i++) {
+		infile = infiles[i];
 
-int indexFLV(FLV_t *flv, FILE *fp) {
-	off_t offset;
-	size_t nflvtags;
-	FLVTag_t flvtag;
+		// Store data to tempfile if inputfile is stdin
+		if(!strcmp(infile, "-")) {
+			fp_infile = fopen(tempfile, "wb");
+			if(fp_infile == NULL) {
+				fprintf(stderr, "Couldn't open the tempfile %s.\n", tempfile);
+				exit(YAMDI_ERROR);
+			}
 
-#ifdef DEBUG
-	fprintf(stderr, "[FLV] indexing file ...\n");
-#endif
+			// Store stdin to temporary file
+			storeFLVFromStdin(fp_infile);
 
-	// Count how many tags are there in this FLV
-	offset = FLV_SIZE_HEADER + FLV_SIZE_PREVIOUSTAGSIZE;
-	nflvtags = 0;
-	while(readFLVTag(&flvtag, offset, fp) == YAMDI_OK) {
-		offset += (flvtag.tagsize + FLV_SIZE_PREVIOUSTAGSIZE);
+			// Close temporary file
+			fclose(fp_infile);
 
-		nflvtags++;
-	}
+			// Mimic normal input file, but don't forget to remove the temporary file
+			infile = tempfile;
+			unlink_infile = 1;
+		}
 
-	flv->index.nflvtags = nflvtags;
+		job = &jobs[i];
 
-#ifdef DEBUG
-	fprintf(stderr, "[FLV] nflvtags = %d\n", flv->index.nflvtags);
-#endif
+		job->infile = infile;
+		job->outfile = outfile;
+		job->finalfile = (options.overwriteinput == 1 && unlink_infile == 0 && outfile != NULL && strcmp(outfile, "-")) ? infile : NULL;
+		job->seektablefile = seektablefile;
+		job->manifestfile = manifestfile;
+		job->journalfile = NULL;
 
-	if(nflvtags == 0)
-		return YAMDI_OK;
+		if(reorder == 1) {
+			job->xml = (xmloutfile != NULL) ? &xmlparts[i] : NULL;
+			job->json = (jsonoutfile != NULL) ? &jsonparts[i] : NULL;
+			job->checksums = (checksumfile != NULL) ? &checksumparts[i] : NULL;
+		}
+		else {
+			job->xml = (xmloutfile != NULL) ? &xml : NULL;
+			job->json = (jsonoutfile != NULL) ? &json : NULL;
+			job->checksums = (checksumfile != NULL) ? &checksums : NULL;
+		}
 
-	// Allocate memory for the tag metadata index
-	flv->index.flvtag = (FLVTag_t *)calloc(flv->index.nflvtags, sizeof(FLVTag_t));
-	if(flv->index.flvtag == NULL)
-		return YAMDI_OUT_OF_MEMORY;
+		// In batch mode -o and --seektable are directories
+		if(ninfiles > 1) {
+			if(outfile != NULL)
+				job->outfile = batchPath(outfile, infile, "");
 
-	// Store the tag metadata in the index
-	offset = FLV_SIZE_HEADER + FLV_SIZE_PREVIOUSTAGSIZE;
-	nflvtags = 0;
-	while(readFLVTag(&flvtag, offset, fp) == YAMDI_OK) {
-		flv->index.flvtag[nflvtags].offset = flvtag.offset;
-		flv->index.flvtag[nflvtags].tagtype = flvtag.tagtype;
-		flv->index.flvtag[nflvtags].datasize = flvtag.datasize;
-		flv->index.flvtag[nflvtags].timestamp = flvtag.timestamp;
-		flv->index.flvtag[nflvtags].tagsize = flvtag.tagsize;
+			if(seektablefile != NULL)
+				job->seektablefile = batchPath(seektablefile, infile, ".seek");
 
-		offset += (flv->index.flvtag[nflvtags].tagsize + FLV_SIZE_PREVIOUSTAGSIZE);
+			if(manifestfile != NULL)
+				job->manifestfile = batchPath(manifestfile, infile, ".manifest");
+		}
 
-		nflvtags++;
-#ifdef DEBUG
-		if((nflvtags % 100) == 0)
-			fprintf(stderr, "[FLV] storing metadata (tag %d of %d)\r", nflvtags, flv->index.nflvtags);
-#endif
+		if(options.inplace == 1) {
+			job->journalfile = (char *)malloc(strlen(infile) + strlen(YAMDI_INPLACE_SUFFIX) + 1);
+			if(job->journalfile == NULL)
+				exit(YAMDI_OUT_OF_MEMORY);
+
+			sprintf((char *)job->journalfile, "%s%s", infile, YAMDI_INPLACE_SUFFIX);
+		}
 	}
 
-#ifdef DEBUG
-	fprintf(stderr, "[FLV] storing metadata (tag %d of %d)\n", nflvtags, flv->index.nflvtags);
-#endif
+	metricsQueue(ninfiles);
 
-	return YAMDI_OK;
-}
+	if(reorder == 1)
+		batchFLV(&options, jobs, ninfiles);
+	else {
+		for(i = 0; i < ninfiles; i++) {
+			metricsQueue(-1);
+			jobs[i].rv = processFLV(&options, &jobs[i]);
+		}
+	}
 
-void storeFLVFromStdin(FILE *fp) {
-	char buf[4096];
-	size_t bytes;
+	metricsStop();
 
-	while((bytes = fread(buf, 1, sizeof(buf), stdin)) > 0)
-		fwrite(buf, 1, bytes, fp);
+	// Remove the input file if it is the temporary file
+	if(unlink_infile == 1)
+		unlink(tempfile);
 
-	return;
-}
+	for(i = 0; i < ninfiles; i++) {
+		job = &jobs[i];
 
-int freeFLV(FLV_t *flv) {
-	if(flv->index.nflvtags != 0)
-		free(flv->index.flvtag);
+		if(job->rv == YAMDI_OK) {
+			nprocessed++;
 
-	if(flv->keyframes.keyframelocations != NULL)
-		free(flv->keyframes.keyframelocations);
+			if(job->finalfile != NULL && unlink_infile == 0) {
+				if(rename(job->outfile, job->finalfile) != 0)
+					exitcode = YAMDI_RENAME_OUTPUT;
+			}
+		}
+		else if(job->rv == YAMDI_LIMIT_EXCEEDED) {
+			if(exitcode == YAMDI_OK)
+				exitcode = YAMDI_LIMIT_EXCEEDED;
+		}
+		else if(exitcode == YAMDI_OK || exitcode == YAMDI_LIMIT_EXCEEDED)
+			exitcode = YAMDI_ERROR;
 
-	if(flv->keyframes.keyframetimestamps != NULL)
-		free(flv->keyframes.keyframetimestamps);
+		if(reorder == 1) {
+			bufferAppendBuffer(&xml, &xmlparts[i]);
 
-	bufferFree(&flv->onmetadata);
-	bufferFree(&flv->onlastsecond);
-	bufferFree(&flv->onlastkeyframe);
+			// Separate the files in the fileset
+			if(jsonparts[i].used != 0 && json.data[json.used - 1] != '[')
+				bufferAppendBytes(&json, (unsigned char *)",", 1);
 
-	memset(flv, 0, sizeof(FLV_t));
+			bufferAppendBuffer(&json, &jsonparts[i]);
+			bufferAppendBuffer(&checksums, &checksumparts[i]);
 
-	return YAMDI_OK;
-}
+			bufferFree(&xmlparts[i]);
+			bufferFree(&jsonparts[i]);
+			bufferFree(&checksumparts[i]);
+		}
 
-int analyzeFLV(FLV_t *flv, FILE *fp) {
-	int rv;
-	size_t i, index;
-	unsigned char flags;
-	FLVTag_t *flvtag;
+		if(job->outfile != outfile)
+			free((char *)job->outfile);
 
-#ifdef DEBUG
-	fprintf(stderr, "[FLV] analyzing FLV ...\n");
-#endif
+		if(job->seektablefile != seektablefile)
+			free((char *)job->seektablefile);
 
-	for(i = 0; i < flv->index.nflvtags; i++) {
-		flvtag = &flv->index.flvtag[i];
+		if(job->manifestfile != manifestfile)
+			free((char *)job->manifestfile);
 
-		if(flvtag->tagtype == FLV_TAG_AUDIO) {
-			flv->hasaudio = 1;
+		free((char *)job->journalfile);
+	}
 
-			flv->audio.ntags++;
-			flv->audio.datasize += flvtag->datasize;
-			flv->audio.size += flvtag->tagsize;
+	free(jobs);
+	free(xmlparts);
+	free(jsonparts);
+	free(checksumparts);
 
-			flv->audio.lasttimestamp = flvtag->timestamp;
-			flv->audio.lastframeindex = i;
+	free(infiles);
 
-			readFLVTagData(&flags, 1, flvtag, fp);
+	// Write the XML and JSON output if at least one file has been processed
+	if(xmloutfile != NULL && nprocessed != 0) {
+		writeBufferXMLFooter(&xml);
 
-			if(flv->audio.analyzed == 0) {
-				// SoundFormat
-				flv->audio.codecid = (flags >> 4) & 0xf;
+		statsBegin(YAMDI_PHASE_XML);
+		rv = writeBufferToFile(&xml, xmloutfile);
+		statsEnd(YAMDI_PHASE_XML);
 
-				// SoundRate
-				flv->audio.samplerate = (flags >> 2) & 0x3;
+		if(rv != YAMDI_OK)
+			exit(YAMDI_ERROR);
+	}
 
-				// SoundSize
-				flv->audio.samplesize = (flags >> 1) & 0x1;
+	if(jsonoutfile != NULL && nprocessed != 0) {
+		writeBufferJSONFooter(&json);
 
-				// SoundType
-				flv->audio.stereo = flags & 0x1;
+		statsBegin(YAMDI_PHASE_JSON);
+		rv = writeBufferToFile(&json, jsonoutfile);
+		statsEnd(YAMDI_PHASE_JSON);
 
-				if(flv->audio.codecid == 4 || flv->audio.codecid == 5 || flv->audio.codecid == 6) {
-					// Nellymoser
-					flv->audio.stereo = 0;
-				}
-				else if(flv->audio.codecid == 10) {
-					// AAC
-					flv->audio.samplerate = 3;
-					flv->audio.stereo = 1;
-				}
+		if(rv != YAMDI_OK)
+			exit(YAMDI_ERROR);
+	}
 
-				flv->audio.analyzed = 1;
-			}
+	if(checksumfile != NULL && nprocessed != 0) {
+		statsBegin(YAMDI_PHASE_CHECKSUM);
+		rv = writeBufferToFile(&checksums, checksumfile);
+		statsEnd(YAMDI_PHASE_CHECKSUM);
+
+		if(rv != YAMDI_OK)
+			exit(YAMDI_ERROR);
+	}
+
+	bufferFree(&xml);
+	bufferFree(&json);
+	bufferFree(&checksums);
+
+	if(options.stats != YAMDI_STATS_NONE)
+		printStats(stderr, options.stats);
+
+	if(fp_tracefile != NULL) {
+		writeTrace(fp_tracefile);
+		fclose(fp_tracefile);
+
+		freeTrace();
+	}
+
+	if(exitcode != YAMDI_OK)
+		exit(exitcode);
+
+	return YAMDI_OK;
+}
+#endif
+
+int processFLV(FLVOptions_t *options, FLVJob_t *job) {
+	FILE *fp_infile = NULL, *fp_outfile = NULL;
+	int rv;
+	FLV_t flv;
+	FLVManifest_t manifest;
+	iostats_t io;
+	buffer_t seektable, b;
+	stats_t before;
+	struct stat st;
+	double start = 0.0;
+	uint64_t insize = 0;
+	const char *infile = job->infile, *outfile = job->outfile;
+	short split = (options->splitduration != 0 || options->splitsize != 0);
+	short removeoutput = 0;
+
+	// The metrics of this file are the difference to the stats of the thread
+	if(metrics.file != NULL) {
+		memcpy(&before, &stats, sizeof(stats_t));
+		start = wallClock();
+	}
+
+	initFLV(&flv);
+
+	memset(&manifest, 0, sizeof(FLVManifest_t));
+
+	flv.options = *options;
+	flv.audio.keyframedistance = options->keyframedistance;
+
+	// The limits count from the beginning of the job
+	if(options->timelimit != 0)
+		flv.budget.deadline = wallClock() + (double)options->timelimit / 1000.0;
+
+	flv.budget.iolimit = options->iolimit;
+	flv.budget.iostart = stats.bytesread + stats.bytesloaded + stats.byteswritten;
+
+	if(outfile != NULL && !strcmp(infile, outfile)) {
+		fprintf(stderr, "The input file and the output file must not be the same (%s).\n", infile);
+
+		rv = YAMDI_ERROR;
+		goto cleanup;
+	}
+
+	// Finish a rewrite in place that has been interrupted, the file is not valid before
+	if(job->journalfile != NULL && access(job->journalfile, F_OK) == 0) {
+		rv = recoverFLVInPlace(infile, job->journalfile);
+		if(rv != YAMDI_OK) {
+			fprintf(stderr, "Couldn't finish the interrupted rewrite of %s with %s.\n", infile, job->journalfile);
+			goto cleanup;
 		}
-		else if(flvtag->tagtype == FLV_TAG_VIDEO) {
-			flv->hasvideo = 1;
 
-			flv->video.ntags++;
-			flv->video.datasize += flvtag->datasize;
-			flv->video.size += flvtag->tagsize;
+		fprintf(stderr, "Finished the interrupted rewrite of %s.\n", infile);
+	}
 
-			flv->video.lasttimestamp = flvtag->timestamp;
-			flv->video.lastframeindex = i;
+	fp_infile = fopen(infile, (job->journalfile != NULL) ? "r+b" : "rb");
+	if(fp_infile == NULL) {
+		fprintf(stderr, "Couldn't open %s.\n", infile);
 
-			readFLVTagData(&flags, 1, flvtag, fp);
+		rv = YAMDI_READ_ERROR;
+		goto cleanup;
+	}
 
-			// Keyframes
-			flvtag->keyframe = (flags >> 4) & 0xf;
-			if(flvtag->keyframe == 1) {
-				flv->canseektoend = 1;
-				flv->keyframes.nkeyframes++;
-				flv->keyframes.lastkeyframeindex = i;
-			}
-			else
-				flv->canseektoend = 0;
+	if(metrics.file != NULL && fstat(fileno(fp_infile), &st) == 0)
+		insize = (uint64_t)st.st_size;
 
-			if(flvtag->keyframe == 1 && flv->video.analyzed == 0) {
-				// Video Codec
-				flv->video.codecid = flags & 0xf;
+	if(job->workspace != NULL)
+		lendFLVWorkspace(&flv, job->workspace);
 
-				switch(flv->video.codecid) {
-					case FLV_PACKET_H263VIDEO:
-						rv = analyzeFLVH263VideoPacket(flv, flvtag, fp);
-						break;
-					case FLV_PACKET_SCREENVIDEO:
-						rv = analyzeFLVScreenVideoPacket(flv, flvtag, fp);
-						break;
-					case FLV_PACKET_VP6VIDEO:
-						rv = analyzeFLVVP6VideoPacket(flv, flvtag, fp);
-						break;
-					case FLV_PACKET_VP6ALPHAVIDEO:
-						rv = analyzeFLVVP6AlphaVideoPacket(flv, flvtag, fp);
-						break;
-					case FLV_PACKET_SCREENV2VIDEO:
-						rv = analyzeFLVScreenVideoPacket(flv, flvtag, fp);
-						break;
-					case FLV_PACKET_H264VIDEO:
-						rv = analyzeFLVH264VideoPacket(flv, flvtag, fp);
-						break;
-					default:
-						rv = YAMDI_ERROR;
-						break;
-				}
+	// Read a small file at once and process it in memory. The writers that need the
+	// input file and --probe, which reads only a part of it, keep reading from the file.
+	if(flv.options.inmemory != 0 && flv.options.probe == 0 && split == 0 && flv.options.reflink == 0 && job->manifestfile == NULL && flv.options.directio == 0 && flv.options.dropcache == 0 && job->journalfile == NULL) {
+		statsBegin(YAMDI_PHASE_LOAD);
+		rv = loadFLV(&flv, &fp_infile);
+		statsEnd(YAMDI_PHASE_LOAD);
 
-				if(rv == YAMDI_OK)
-					flv->video.analyzed = 1;
+		// The threads of the other index modes don't pay off
+		if(rv == YAMDI_OK)
+			flv.options.indexmode = YAMDI_INDEX_SERIAL;
+	}
+
+	// Check if we have a valid FLV file
+	statsBegin(YAMDI_PHASE_VALIDATE);
+	rv = validateFLV(fp_infile);
+	statsEnd(YAMDI_PHASE_VALIDATE);
+
+	if(rv != YAMDI_OK)
+		goto cleanup;
+
+	// Open the outfile. The segments are opened when they are written.
+	if(outfile != NULL && split == 0) {
+		if(strcmp(outfile, "-")) {
+			fp_outfile = fopen(outfile, "wb");
+			if(fp_outfile == NULL) {
+				fprintf(stderr, "Couldn't open %s.\n", outfile);
+
+				rv = YAMDI_ERROR;
+				goto cleanup;
 			}
 		}
+		else
+			fp_outfile = stdout;
+	}
 
-		flv->lasttimestamp = flvtag->timestamp;
+	// Only look at the beginning and the end of the file. If that is not
+	// possible, e.g. because the file is truncated, index the whole file.
+	if(flv.options.probe == 1) {
+		statsBegin(YAMDI_PHASE_PROBE);
+		rv = probeFLV(&flv, fp_infile);
+		statsEnd(YAMDI_PHASE_PROBE);
+
+		if(rv == YAMDI_INVALID_PREVIOUSTAGSIZE)
+			flv.options.probe = 0;
+		else if(rv != YAMDI_OK)
+			goto cleanup;
+	}
+
+	if(flv.options.probe == 0) {
+		// Create an index of the FLV file
+		statsBegin(YAMDI_PHASE_INDEX);
+		rv = indexFLV(&flv, fp_infile);
+		statsEnd(YAMDI_PHASE_INDEX);
+
+		if(rv != YAMDI_OK)
+			goto cleanup;
+
+		if(metrics.file != NULL)
+			metricsIndex((uint64_t)flv.index.nflvtags * sizeof(FLVTag_t));
+
+		statsBegin(YAMDI_PHASE_ANALYZE);
+		rv = analyzeFLV(&flv, fp_infile);
+		statsEnd(YAMDI_PHASE_ANALYZE);
+
+		if(rv != YAMDI_OK)
+			goto cleanup;
+
+		// Keep only the tags between --start and --end and analyze them again
+		if(flv.options.start != 0 || flv.options.end != 0) {
+			statsBegin(YAMDI_PHASE_EXTRACT);
+
+			rv = clipFLV(&flv);
+			if(rv == YAMDI_OK)
+				rv = analyzeFLV(&flv, fp_infile);
+
+			statsEnd(YAMDI_PHASE_EXTRACT);
+
+			if(rv != YAMDI_OK)
+				goto cleanup;
+		}
+
+		rv = checkFLVBudget(&flv, NULL);
+		if(rv != YAMDI_OK)
+			goto cleanup;
+
+		// Every segment gets its own metadata and is written instead of the outfile
+		if(split == 1) {
+			statsBegin(YAMDI_PHASE_SPLIT);
+			rv = splitFLV(&flv, job, fp_infile);
+			statsEnd(YAMDI_PHASE_SPLIT);
+
+			if(rv == YAMDI_OK)
+				statsAddFLV(&flv);
+
+			goto cleanup;
+		}
+
+		// Share the blocks of the tags with the input instead of copying them, if it is possible
+		if(flv.options.reflink == 1 && fp_outfile != NULL && fp_outfile != stdout)
+			prepareFLVReflink(&flv, fp_infile, fp_outfile);
+
+		statsBegin(YAMDI_PHASE_FINALIZE);
+		rv = finalizeFLV(&flv, fp_infile);
+		statsEnd(YAMDI_PHASE_FINALIZE);
+
+		if(rv != YAMDI_OK)
+			goto cleanup;
+	}
 
 #ifdef DEBUG
-		if((i % 100) == 0)
-			fprintf(stderr, "[FLV] analyzing FLV (tag %d of %d)\r", i, flv->index.nflvtags);
+	fprintf(stderr, "[FLV] onmetadata = %d bytes (%d bytes allocated)\n", flv.onmetadata.used, flv.onmetadata.size);
+	fprintf(stderr, "[FLV] onlastsecond = %d bytes (%d bytes allocated)\n", flv.onlastsecond.used, flv.onlastsecond.size);
+	fprintf(stderr, "[FLV] onlastkeyframe = %d bytes (%d bytes allocated)\n", flv.onlastkeyframe.used, flv.onlastkeyframe.size);
 #endif
+
+	// A rewrite in place is not interrupted once it has begun
+	rv = checkFLVBudget(&flv, NULL);
+	if(rv != YAMDI_OK)
+		goto cleanup;
+
+	// Move the tags within the input file to make room for the new header
+	if(job->journalfile != NULL) {
+		statsBegin(YAMDI_PHASE_WRITE);
+		rv = rewriteFLVInPlace(&flv, fp_infile, job->journalfile);
+		statsEnd(YAMDI_PHASE_WRITE);
+
+		if(rv != YAMDI_OK)
+			goto cleanup;
 	}
 
+	if(fp_outfile != NULL) {
+		statsBegin(YAMDI_PHASE_WRITE);
+
+		// If the filesystem can't clone, start over and copy the tags as usual
+		if(flv.reflink.blocksize != 0 && writeFLVReflink(fp_outfile, &flv, fp_infile) != YAMDI_OK) {
 #ifdef DEBUG
-	fprintf(stderr, "[FLV] analyzing FLV (tag %d of %d)\n", i, flv->index.nflvtags);
+			fprintf(stderr, "[FLV] cloning failed, copying the tags\n");
+#endif
+			flv.reflink.blocksize = 0;
+			finalizeFLV(&flv, fp_infile);
 
-	fprintf(stderr, "[FLV] lasttimestamp = %d ms\n", flv->lasttimestamp);
+			rewind(fp_outfile);
+			if(ftruncate(fileno(fp_outfile), 0) != 0) {
+				rv = YAMDI_ERROR;
+				goto cleanup;
+			}
+		}
+
+		// Only the bytes that are not in the input go into the blob file
+		if(job->manifestfile != NULL)
+			flv.manifest = &manifest;
+
+		// The checksums are computed from the bytes as they are written
+		if(flv.options.checksums != 0) {
+			checksumInit(&flv.checksum, flv.options.checksums);
+			outputchecksum = &flv.checksum;
+		}
+
+		if(flv.options.preallocate == 1 && fp_outfile != stdout)
+			preallocateFile(fileno(fp_outfile), (off_t)flv.filesize);
+
+#ifndef __MINGW32__
+		// Write an input in memory with writev(). Otherwise write with pread() and write(), such that
+		// the output can bypass the page cache or the pages of both files can be dropped behind the cursors.
+		if(flv.reflink.blocksize == 0 && (flv.memory.data != NULL || flv.options.directio == 1 || flv.options.dropcache == 1)) {
+			progressBegin("write", flv.index.nflvtags, flv.filesize);
+
+			memset(&io, 0, sizeof(iostats_t));
+
+			fflush(fp_outfile);
+
+			if(flv.memory.data != NULL)
+				rv = writeFLVMemory(fileno(fp_outfile), &flv, &io);
+			else
+				rv = writeFLVDescriptor(fileno(fp_outfile), &flv, fileno(fp_infile), &io);
+
+			stats.nreads += io.nreads;
+			stats.bytesread += io.bytesread;
+			stats.nwrites += io.nwrites;
+			stats.byteswritten += io.byteswritten;
+
+			progressEnd(flv.index.nflvtags, flv.filesize);
+		}
+		else
 #endif
+		if(flv.reflink.blocksize == 0)
+			rv = writeFLV(fp_outfile, &flv, fp_infile);
 
-	// Calculate the last second
-	if(flv->lasttimestamp >= 1000) {
-		flv->lastsecond = flv->lasttimestamp - 1000;
-		i = flv->index.nflvtags;
-		while(i != 0) {
-			flvtag = &flv->index.flvtag[i - 1];
+		if(outputchecksum != NULL) {
+			checksumFinal(outputchecksum);
+			outputchecksum = NULL;
+		}
 
-			if(flvtag->timestamp <= flv->lastsecond) {
-				flv->lastsecond += 1;
-				flv->lastsecondindex = (i - 1);
+		if(flv.manifest != NULL)
+			syncFLVManifest(fp_outfile, flv.manifest);
 
-				break;
-			}
+		if(fflush(fp_outfile) != 0 && rv == YAMDI_OK)
+			rv = YAMDI_ERROR;
 
-			i--;
+		statsEnd(YAMDI_PHASE_WRITE);
+
+		// The last part of the output may have exceeded the limits
+		if(rv == YAMDI_OK)
+			rv = checkFLVBudget(&flv, NULL);
+
+		if(rv != YAMDI_OK) {
+			if(rv != YAMDI_LIMIT_EXCEEDED)
+				fprintf(stderr, "Couldn't write %s.\n", outfile);
+
+			removeoutput = 1;
+			goto cleanup;
 		}
 	}
-	else
-		flv->options.addonlastsecond = 0;
 
-#ifdef DEBUG
-	fprintf(stderr, "[FLV] lastsecond = %d ms\n", flv->lastsecond);
-	fprintf(stderr, "[FLV] lastsecondindex = %d\n", flv->lastsecondindex);
-#endif
+	if(job->xml != NULL) {
+		statsBegin(YAMDI_PHASE_XML);
+		writeBufferXMLMetadata(job->xml, infile, outfile, &flv);
+		statsEnd(YAMDI_PHASE_XML);
+	}
 
-	// Calculate audio datarate
-	if(flv->audio.datasize != 0)
-		flv->audio.datarate = (double)flv->audio.datasize * 8.0 / 1024.0 / (double)flv->audio.lasttimestamp * 1000.0;
+	if(job->json != NULL) {
+		statsBegin(YAMDI_PHASE_JSON);
+		writeBufferJSONMetadata(job->json, infile, outfile, &flv);
+		statsEnd(YAMDI_PHASE_JSON);
+	}
 
-#ifdef DEBUG
-	fprintf(stderr, "[FLV] audio.codecid = %d\n", flv->audio.codecid);
-	fprintf(stderr, "[FLV] audio.lasttimestamp = %d ms\n", flv->audio.lasttimestamp);
-	fprintf(stderr, "[FLV] audio.lastframeindex = %d\n", flv->audio.lastframeindex);
-	fprintf(stderr, "[FLV] audio.ntags = %d\n", flv->audio.ntags);
-	fprintf(stderr, "[FLV] audio.datasize = %" PRIu64 " kb\n", flv->audio.datasize);
-	fprintf(stderr, "[FLV] audio.datarate = %f kbit/s\n", flv->audio.datarate);
-#endif
+	// With -w the output gets the name of the input
+	if(job->checksums != NULL && flv.checksum.algorithms != 0)
+		writeBufferChecksumLines(job->checksums, (job->finalfile != NULL) ? job->finalfile : outfile, &flv.checksum);
 
-	// Calculate video framerate
-	if(flv->video.ntags != 0)
-		flv->video.framerate = (double)flv->video.ntags / (double)flv->video.lasttimestamp * 1000.0;
+	if(job->seektablefile != NULL) {
+		statsBegin(YAMDI_PHASE_SEEKTABLE);
 
-	// Calculate video datarate
-	if(flv->video.datasize != 0)
-		flv->video.datarate = (double)flv->video.datasize * 8.0 / 1024.0 / (double)flv->lasttimestamp * 1000.0;
+		bufferInit(&seektable);
+		writeBufferSeekTable(&seektable, &flv);
+		rv = writeBufferToFile(&seektable, job->seektablefile);
+		bufferFree(&seektable);
 
-#ifdef DEBUG
-	fprintf(stderr, "[FLV] video.codecid = %d\n", flv->video.codecid);
-	fprintf(stderr, "[FLV] video.lasttimestamp = %d ms\n", flv->video.lasttimestamp);
-	fprintf(stderr, "[FLV] video.lastframeindex = %d\n", flv->video.lastframeindex);
-	fprintf(stderr, "[FLV] video.ntags = %d\n", flv->video.ntags);
-	fprintf(stderr, "[FLV] video.framerate = %f fps\n", flv->video.framerate);
-	fprintf(stderr, "[FLV] video.datasize = %" PRIu64 " kb\n", flv->video.datasize);
-	fprintf(stderr, "[FLV] video.datarate = %f kbit/s\n", flv->video.datarate);
-	fprintf(stderr, "[FLV] video.width = %d\n", flv->video.width);
-	fprintf(stderr, "[FLV] video.height = %d\n", flv->video.height);
+		statsEnd(YAMDI_PHASE_SEEKTABLE);
+
+		if(rv != YAMDI_OK)
+			goto cleanup;
+	}
+
+	if(job->manifestfile != NULL) {
+		statsBegin(YAMDI_PHASE_MANIFEST);
+
+		bufferInit(&b);
+		writeBufferManifest(&b, infile, outfile, &manifest);
+		rv = writeBufferToFile(&b, job->manifestfile);
+		bufferFree(&b);
+
+		statsEnd(YAMDI_PHASE_MANIFEST);
+
+		if(rv != YAMDI_OK)
+			goto cleanup;
+	}
+
+	statsAddFLV(&flv);
+
+	rv = YAMDI_OK;
+
+cleanup:
+	if(fp_infile != NULL)
+		fclose(fp_infile);
+
+	if(rv == YAMDI_LIMIT_EXCEEDED) {
+		fprintf(stderr, "Aborted %s, the time or I/O limit has been exceeded.\n", infile);
+		removeoutput = 1;
+	}
+
+	// Don't leave the part of the output behind that has been written so far,
+	// but only if it is a file and not e.g. /dev/full
+	if(fp_outfile != NULL && fp_outfile != stdout) {
+		if(removeoutput == 1 && fstat(fileno(fp_outfile), &st) == 0 && S_ISREG(st.st_mode))
+			unlink(outfile);
+
+		fclose(fp_outfile);
+	}
+
+	free(manifest.ranges);
+
+	if(flv.workspace != NULL)
+		returnFLVWorkspace(&flv);
+
+	freeFLV(&flv);
+
+	if(metrics.file != NULL)
+		metricsAddFLV(&before, rv, insize, wallClock() - start);
+
+	return rv;
+}
+
+char *batchPath(const char *dir, const char *infile, const char *suffix) {
+	char *path;
+	const char *basename = batchBasename(infile);
+
+	path = (char *)malloc(strlen(dir) + strlen(basename) + strlen(suffix) + 2);
+	if(path == NULL)
+		exit(YAMDI_OUT_OF_MEMORY);
+
+	sprintf(path, "%s/%s%s", dir, basename, suffix);
+
+	return path;
+}
+
+const char *batchBasename(const char *infile) {
+	return (strrchr(infile, '/') != NULL) ? strrchr(infile, '/') + 1 : infile;
+}
+
+int batchFLV(FLVOptions_t *options, FLVJob_t *jobs, size_t njobs) {
+	size_t i, j, ndevices;
+	FLVLayout_t *layout;
+#ifndef __MINGW32__
+	size_t k, nreaders;
+	FLVDevice_t *devices;
+	FLVDeviceReader_t *readers;
+	pthread_t *threads;
 #endif
 
-	// Calculate datasize
-	flv->datasize = flv->audio.size + (flv->audio.ntags * FLV_SIZE_PREVIOUSTAGSIZE) + flv->video.size + (flv->video.ntags * FLV_SIZE_PREVIOUSTAGSIZE);
+	layout = (FLVLayout_t *)calloc(njobs, sizeof(FLVLayout_t));
+	if(layout == NULL)
+		exit(YAMDI_OUT_OF_MEMORY);
+
+	// The files are read in the order in which they are stored on their device
+	for(i = 0; i < njobs; i++) {
+		layout[i].job = i;
+		layoutFLV(jobs[i].infile, &layout[i]);
+	}
+
+	qsort(layout, njobs, sizeof(FLVLayout_t), compareFLVLayout);
+
+	for(ndevices = 0, i = 0; i < njobs; i++) {
+		if(i == 0 || layout[i].device != layout[i - 1].device)
+			ndevices++;
+	}
 
 #ifdef DEBUG
-	fprintf(stderr, "[FLV] datasize = %" PRIu64 " kb\n", flv->datasize);
+	for(i = 0; i < njobs; i++)
+		fprintf(stderr, "[batch] %s: device %" PRIu64 ", %s %" PRIu64 "\n", jobs[layout[i].job].infile, (uint64_t)layout[i].device, (layout[i].mapped == 1) ? "offset" : "inode", layout[i].position);
 #endif
 
-	// Fake keyframes if we have only audio and the corresponding option has been set
-	if(flv->options.addaudiokeyframes == 1 && flv->hasaudio == 1 && flv->hasvideo == 0) {
-		// Add a keyframe at least every x milliseconds
-		flv->audio.keyframerate = (int)((double)flv->audio.keyframedistance / (double)flv->audio.lasttimestamp * (double)flv->audio.ntags);
+#ifndef __MINGW32__
+	if(options->devicereaders != 0) {
+		devices = (FLVDevice_t *)calloc(ndevices, sizeof(FLVDevice_t));
+		if(devices == NULL)
+			exit(YAMDI_OUT_OF_MEMORY);
 
-		// If every frame is longer than the intervalthen add every frame a keyframe
-		if(flv->audio.keyframerate == 0)
-			flv->audio.keyframerate = 1;
-		else if(flv->audio.keyframerate >= flv->audio.ntags)
-			flv->audio.keyframerate = flv->audio.ntags;
+		// Every device gets its own range of the layout and its own readers
+		for(i = 0, j = 0, nreaders = 0; i < njobs; i++) {
+			if(i != 0 && layout[i].device != layout[i - 1].device)
+				j++;
+
+			if(devices[j].njobs == 0) {
+				devices[j].layout = &layout[i];
+				pthread_mutex_init(&devices[j].lock, NULL);
+			}
+
+			devices[j].njobs++;
+
+			if(devices[j].njobs <= (size_t)options->devicereaders)
+				nreaders++;
+		}
+
+		readers = (FLVDeviceReader_t *)calloc(nreaders, sizeof(FLVDeviceReader_t));
+		threads = (pthread_t *)calloc(nreaders, sizeof(pthread_t));
+		if(readers == NULL || threads == NULL)
+			exit(YAMDI_OUT_OF_MEMORY);
+
+		for(j = 0, k = 0; j < ndevices; j++) {
+			for(i = 0; i < devices[j].njobs && i < (size_t)options->devicereaders; i++, k++) {
+				readers[k].device = &devices[j];
+				readers[k].options = options;
+				readers[k].jobs = jobs;
+
+				if(pthread_create(&threads[k], NULL, readDeviceFLV, &readers[k]) != 0)
+					exit(YAMDI_ERROR);
+			}
+		}
+
+#ifdef DEBUG
+		fprintf(stderr, "[batch] %zu files on %zu devices with %zu readers\n", njobs, ndevices, nreaders);
+#endif
+
+		for(k = 0; k < nreaders; k++) {
+			pthread_join(threads[k], NULL);
+
+			statsMerge(&readers[k].stats);
+			freeFLVWorkspace(&readers[k].workspace);
+		}
+
+		for(j = 0; j < ndevices; j++)
+			pthread_mutex_destroy(&devices[j].lock);
+
+		free(devices);
+		free(readers);
+		free(threads);
+		free(layout);
+
+		return YAMDI_OK;
+	}
+#endif
+
+	for(i = 0; i < njobs; i++) {
+		metricsQueue(-1);
+		jobs[layout[i].job].rv = processFLV(options, &jobs[layout[i].job]);
+	}
+
+	free(layout);
+
+	return YAMDI_OK;
+}
+
+int layoutFLV(const char *file, FLVLayout_t *layout) {
+	struct stat st;
+#ifdef __linux__
+	int fd;
+	union {
+		struct fiemap fiemap;
+		unsigned char bytes[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+	} map;
+#endif
+
+	layout->device = 0;
+	layout->mapped = 0;
+	layout->position = 0;
+
+	// processFLV() reports the file that can't be opened
+	if(stat(file, &st) != 0)
+		return YAMDI_ERROR;
+
+	// Without the extents the inode is the best guess where the file is
+	layout->device = st.st_dev;
+	layout->position = (uint64_t)st.st_ino;
+
+#ifdef __linux__
+	fd = open(file, O_RDONLY);
+	if(fd == -1)
+		return YAMDI_OK;
+
+	// Only the first extent. The extents of files that have not been written back yet are unknown.
+	memset(&map, 0, sizeof(map));
+	map.fiemap.fm_start = 0;
+	map.fiemap.fm_length = FIEMAP_MAX_OFFSET;
+	map.fiemap.fm_extent_count = 1;
+
+	if(ioctl(fd, FS_IOC_FIEMAP, &map.fiemap) == 0 && map.fiemap.fm_mapped_extents != 0 && (map.fiemap.fm_extents[0].fe_flags & FIEMAP_EXTENT_UNKNOWN) == 0) {
+		layout->mapped = 1;
+		layout->position = map.fiemap.fm_extents[0].fe_physical;
+	}
+
+	close(fd);
+#endif
+
+	return YAMDI_OK;
+}
+
+int compareFLVLayout(const void *a, const void *b) {
+	const FLVLayout_t *x = (const FLVLayout_t *)a, *y = (const FLVLayout_t *)b;
+
+	if(x->device != y->device)
+		return (x->device < y->device) ? -1 : 1;
+
+	// The mapped files first, offsets and inodes can't be compared
+	if(x->mapped != y->mapped)
+		return (x->mapped > y->mapped) ? -1 : 1;
+
+	if(x->position != y->position)
+		return (x->position < y->position) ? -1 : 1;
+
+	// Same file, keep the order of the command line
+	if(x->job != y->job)
+		return (x->job < y->job) ? -1 : 1;
+
+	return 0;
+}
+
+void *readDeviceFLV(void *arg) {
+#ifndef __MINGW32__
+	FLVDeviceReader_t *reader = (FLVDeviceReader_t *)arg;
+	FLVDevice_t *device = reader->device;
+	FLVJob_t *job;
+	size_t i;
+
+	for(;;) {
+		pthread_mutex_lock(&device->lock);
+
+		i = device->next;
+		if(i < device->njobs)
+			device->next++;
+
+		pthread_mutex_unlock(&device->lock);
+
+		if(i == device->njobs)
+			break;
+
+		job = &reader->jobs[device->layout[i].job];
+
+		metricsQueue(-1);
+
+		job->workspace = &reader->workspace;
+		job->rv = processFLV(reader->options, job);
+		job->workspace = NULL;
+	}
+
+	memcpy(&reader->stats, &stats, sizeof(stats_t));
+#endif
+
+	return NULL;
+}
+
+int serveFLV(const char *socketfile, FLVOptions_t *options) {
+#ifndef __MINGW32__
+	int fd, probe, conn, rv, i, nworkers;
+	struct sockaddr_un address;
+	struct sigaction action;
+	struct stat st;
+	sigset_t signals, oldsignals;
+	FLVServer_t server;
+	FLVServeWorker_t *workers;
+	pthread_t *threads;
+
+	if(strlen(socketfile) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "The path of the socket %s is too long.\n", socketfile);
+		return YAMDI_ERROR;
+	}
+
+	memset(&address, 0, sizeof(struct sockaddr_un));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socketfile);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd == -1) {
+		fprintf(stderr, "Couldn't create the socket %s.\n", socketfile);
+		return YAMDI_ERROR;
+	}
+
+	rv = bind(fd, (struct sockaddr *)&address, sizeof(struct sockaddr_un));
+
+	// A socket that is left over from a server that is gone is replaced, one that is in use is not
+	if(rv != 0 && errno == EADDRINUSE && stat(socketfile, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		probe = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(probe != -1) {
+			if(connect(probe, (struct sockaddr *)&address, sizeof(struct sockaddr_un)) != 0 && errno == ECONNREFUSED) {
+				unlink(socketfile);
+				rv = bind(fd, (struct sockaddr *)&address, sizeof(struct sockaddr_un));
+			}
+
+			close(probe);
+		}
+	}
+
+	if(rv != 0 || listen(fd, YAMDI_SERVE_BACKLOG) != 0) {
+		fprintf(stderr, "Couldn't listen on the socket %s.\n", socketfile);
+		close(fd);
+		return YAMDI_ERROR;
+	}
+
+	nworkers = options->threads;
+	if(nworkers <= 0)
+		nworkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if(nworkers <= 0)
+		nworkers = 1;
+
+	memset(&server, 0, sizeof(FLVServer_t));
+	server.fd = fd;
+	server.options = options;
+
+	server.active = (int *)malloc(nworkers * sizeof(int));
+	workers = (FLVServeWorker_t *)calloc(nworkers, sizeof(FLVServeWorker_t));
+	threads = (pthread_t *)calloc(nworkers, sizeof(pthread_t));
+	if(server.active == NULL || workers == NULL || threads == NULL)
+		exit(YAMDI_OUT_OF_MEMORY);
+
+	pthread_mutex_init(&server.lock, NULL);
+	pthread_cond_init(&server.ready, NULL);
+	pthread_cond_init(&server.room, NULL);
+
+	// SIGINT and SIGTERM interrupt accept() in this thread. A client that goes away doesn't stop the server.
+	memset(&action, 0, sizeof(struct sigaction));
+	action.sa_handler = serveSignal;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, &oldsignals);
+
+	for(i = 0; i < nworkers; i++) {
+		server.active[i] = -1;
+
+		workers[i].server = &server;
+		workers[i].id = i;
+		bufferInit(&workers[i].json);
+		bufferInit(&workers[i].response);
+
+		if(pthread_create(&threads[i], NULL, serveFLVWorker, &workers[i]) != 0)
+			exit(YAMDI_ERROR);
+	}
+
+	pthread_sigmask(SIG_SETMASK, &oldsignals, NULL);
+
+#ifdef DEBUG
+	fprintf(stderr, "[serve] listening on %s with %d workers\n", socketfile, nworkers);
+#endif
+
+	while(servestop == 0) {
+		conn = accept(fd, NULL, NULL);
+		if(conn == -1) {
+			if(errno != EINTR && errno != ECONNABORTED) {
+				// Out of file descriptors or memory, wait for the workers to close some connections
+				fprintf(stderr, "Couldn't accept a connection on %s.\n", socketfile);
+				sleep(1);
+			}
+
+			continue;
+		}
+
+		pthread_mutex_lock(&server.lock);
+
+		while(server.nconnections == YAMDI_SERVE_BACKLOG)
+			pthread_cond_wait(&server.room, &server.lock);
+
+		server.connections[(server.first + server.nconnections) % YAMDI_SERVE_BACKLOG] = conn;
+		server.nconnections++;
+		metricsQueue(1);
+
+		pthread_cond_signal(&server.ready);
+		pthread_mutex_unlock(&server.lock);
+	}
+
+	close(fd);
+	unlink(socketfile);
+
+	// The workers finish the request they are working on and then see the end of their connection
+	pthread_mutex_lock(&server.lock);
+
+	server.stop = 1;
+
+	for(i = 0; i < nworkers; i++) {
+		if(server.active[i] != -1)
+			shutdown(server.active[i], SHUT_RD);
+	}
+
+	for(; server.nconnections != 0; server.nconnections--) {
+		close(server.connections[server.first]);
+		metricsQueue(-1);
+		server.first = (server.first + 1) % YAMDI_SERVE_BACKLOG;
+	}
+
+	pthread_cond_broadcast(&server.ready);
+	pthread_mutex_unlock(&server.lock);
+
+	for(i = 0; i < nworkers; i++) {
+		pthread_join(threads[i], NULL);
+
+		freeFLVWorkspace(&workers[i].workspace);
+		bufferFree(&workers[i].json);
+		bufferFree(&workers[i].response);
+	}
+
+	pthread_mutex_destroy(&server.lock);
+	pthread_cond_destroy(&server.ready);
+	pthread_cond_destroy(&server.room);
+
+	free(server.active);
+	free(workers);
+	free(threads);
+
+	return YAMDI_OK;
+#else
+	fprintf(stderr, "--serve is not available on this platform.\n");
+
+	return YAMDI_ERROR;
+#endif
+}
+
+void *serveFLVWorker(void *arg) {
+#ifndef __MINGW32__
+	FLVServeWorker_t *worker = (FLVServeWorker_t *)arg;
+	FLVServer_t *server = worker->server;
+	FILE *fp;
+	char *line = NULL;
+	size_t linesize = 0;
+	ssize_t length;
+	int conn;
+	short stop;
+
+	for(;;) {
+		pthread_mutex_lock(&server->lock);
+
+		while(server->nconnections == 0 && server->stop == 0)
+			pthread_cond_wait(&server->ready, &server->lock);
+
+		if(server->stop == 1) {
+			pthread_mutex_unlock(&server->lock);
+			break;
+		}
+
+		conn = server->connections[server->first];
+		server->first = (server->first + 1) % YAMDI_SERVE_BACKLOG;
+		server->nconnections--;
+		metricsQueue(-1);
+		server->active[worker->id] = conn;
+
+		pthread_cond_signal(&server->room);
+		pthread_mutex_unlock(&server->lock);
+
+		fp = fdopen(conn, "rb");
+
+		// One request per line, every request gets one line back
+		while(fp != NULL && (length = getline(&line, &linesize, fp)) > 0) {
+			bufferReset(&worker->response);
+
+			if(length > YAMDI_SERVE_MAXREQUEST) {
+				bufferAppendString(&worker->response, (unsigned char *)"{\"status\":1,\"error\":\"ERROR\",\"message\":\"The request is too long.\"}\n");
+				writeDescriptor(conn, worker->response.data, worker->response.used);
+				break;
+			}
+
+			serveFLVRequest(worker, line, &worker->response);
+
+			if(worker->response.used != 0 && writeDescriptor(conn, worker->response.data, worker->response.used) != YAMDI_OK)
+				break;
+
+			pthread_mutex_lock(&server->lock);
+			stop = server->stop;
+			pthread_mutex_unlock(&server->lock);
+
+			if(stop == 1)
+				break;
+		}
+
+		// The server doesn't shut down the connection after it is closed
+		pthread_mutex_lock(&server->lock);
+		server->active[worker->id] = -1;
+		pthread_mutex_unlock(&server->lock);
+
+		if(fp != NULL)
+			fclose(fp);
+		else
+			close(conn);
+	}
+
+	free(line);
+#endif
+
+	return NULL;
+}
+
+int serveFLVRequest(FLVServeWorker_t *worker, char *line, buffer_t *response) {
+	char *words[YAMDI_SERVE_MAXWORDS], message[256], *end, *c;
+	const char *infile = NULL, *outfile = NULL, *seektablefile = NULL;
+	int i, nwords, rv;
+	short overwriteinput = 0;
+	double seconds;
+	FLVOptions_t options;
+	FLVJob_t job;
+
+	nwords = splitRequest(line, words, YAMDI_SERVE_MAXWORDS);
+
+	// Empty lines are not answered
+	if(nwords == 0)
+		return YAMDI_OK;
+
+	// The options of the server are the defaults of every request
+	options = *worker->server->options;
+
+	message[0] = '\0';
+
+	if(nwords < 0)
+		snprintf(message, sizeof(message), "Too many words or a quote is not closed.");
+
+	for(i = 0; i < nwords && message[0] == '\0'; i++) {
+		// The options with a parameter
+		if(!strcmp(words[i], "-i") || !strcmp(words[i], "-o") || !strcmp(words[i], "-c") || !strcmp(words[i], "-a") || !strcmp(words[i], "--start") || !strcmp(words[i], "--end") || !strcmp(words[i], "--seektable") || !strcmp(words[i], "--time-limit") || !strcmp(words[i], "--io-limit")) {
+			if(i + 1 == nwords) {
+				snprintf(message, sizeof(message), "The option %s expects a parameter.", words[i]);
+				break;
+			}
+
+			if(!strcmp(words[i], "-i"))
+				infile = words[i + 1];
+			else if(!strcmp(words[i], "-o"))
+				outfile = words[i + 1];
+			else if(!strcmp(words[i], "-c")) {
+				strncpy(options.creator, words[i + 1], sizeof(options.creator) - 1);
+				options.creator[sizeof(options.creator) - 1] = '\0';
+			}
+			else if(!strcmp(words[i], "-a")) {
+				options.keyframedistance = (int)strtol(words[i + 1], (char **)NULL, 10);
+				options.addaudiokeyframes = (options.keyframedistance > 0);
+				if(options.keyframedistance <= 0)
+					options.keyframedistance = 0;
+			}
+			else if(!strcmp(words[i], "--seektable"))
+				seektablefile = words[i + 1];
+			else if(!strcmp(words[i], "--io-limit")) {
+				if(parseSize(words[i + 1], &options.iolimit) != YAMDI_OK || options.iolimit == 0) {
+					snprintf(message, sizeof(message), "Invalid size: %s.", words[i + 1]);
+					break;
+				}
+			}
+			else if(!strcmp(words[i], "--time-limit")) {
+				seconds = strtod(words[i + 1], &end);
+				if(end == words[i + 1] || *end != '\0' || !(seconds > 0.0 && seconds < 2147483.0) || (int)(seconds * 1000.0 + 0.5) == 0) {
+					snprintf(message, sizeof(message), "Invalid time: %s.", words[i + 1]);
+					break;
+				}
+
+				options.timelimit = (int)(seconds * 1000.0 + 0.5);
+			}
+			else {
+				seconds = strtod(words[i + 1], &end);
+				if(end == words[i + 1] || *end != '\0' || !(seconds >= 0.0 && seconds < 2147483.0)) {
+					snprintf(message, sizeof(message), "Invalid time: %s.", words[i + 1]);
+					break;
+				}
+
+				if(!strcmp(words[i], "--start"))
+					options.start = (int)(seconds * 1000.0 + 0.5);
+				else
+					options.end = (int)(seconds * 1000.0 + 0.5);
+			}
+
+			i++;
+		}
+		else if(!strcmp(words[i], "--idr-keyframes"))
+			options.idrkeyframes = 1;
+		else if(words[i][0] == '-' && words[i][1] != '-' && words[i][1] != '\0' && strspn(words[i] + 1, "lskMXw") == strlen(words[i] + 1)) {
+			for(c = words[i] + 1; *c != '\0'; c++) {
+				switch(*c) {
+					case 'l':
+					case 's':
+						options.addonlastsecond = 1;
+						break;
+					case 'k':
+						options.addonlastkeyframe = 1;
+						break;
+					case 'M':
+						options.stripmetadata = 1;
+						break;
+					case 'X':
+						options.xmlomitkeyframes = 1;
+						break;
+					case 'w':
+						overwriteinput = 1;
+						break;
+				}
+			}
+		}
+		else
+			snprintf(message, sizeof(message), "Unknown option: %s.", words[i]);
+	}
+
+	if(message[0] == '\0') {
+		if(infile == NULL || !strcmp(infile, "-"))
+			snprintf(message, sizeof(message), "Please use -i to provide an input file.");
+		else if(outfile != NULL && !strcmp(outfile, "-"))
+			snprintf(message, sizeof(message), "The output can't be written to stdout.");
+		else if(outfile != NULL && !strcmp(infile, outfile))
+			snprintf(message, sizeof(message), "The input file and the output file must not be the same.");
+		else if(seektablefile != NULL && (!strcmp(seektablefile, "-") || !strcmp(infile, seektablefile) || (outfile != NULL && !strcmp(outfile, seektablefile))))
+			snprintf(message, sizeof(message), "The seek table file must not be the same as any other file.");
+		else if(overwriteinput == 1 && outfile == NULL)
+			snprintf(message, sizeof(message), "Please use -o together with -w.");
+		else if(options.end != 0 && options.end <= options.start)
+			snprintf(message, sizeof(message), "The end must be after the start.");
+	}
+
+	if(message[0] != '\0') {
+		bufferAppendString(response, (unsigned char *)"{\"status\":1,\"error\":\"ERROR\"");
+		writeBufferJSONName(response, "message");
+		writeBufferJSONString(response, message);
+		bufferAppendString(response, (unsigned char *)"}\n");
+
+		return YAMDI_ERROR;
+	}
+
+	if(options.stripmetadata == 1) {
+		options.addonlastkeyframe = 0;
+		options.addonlastsecond = 0;
+		options.addonmetadata = 0;
+	}
+	else
+		options.addonmetadata = 1;
+
+	memset(&job, 0, sizeof(FLVJob_t));
+
+	bufferReset(&worker->json);
+
+	job.infile = infile;
+	job.outfile = outfile;
+	job.finalfile = (overwriteinput == 1) ? infile : NULL;
+	job.seektablefile = seektablefile;
+	job.json = &worker->json;
+	job.workspace = &worker->workspace;
+
+	rv = processFLV(&options, &job);
+
+	if(rv == YAMDI_OK && overwriteinput == 1 && rename(outfile, infile) != 0)
+		rv = YAMDI_RENAME_OUTPUT;
+
+	bufferAppendString(response, (unsigned char *)"{\"status\":");
+	bufferAppendUInt64(response, (uint64_t)rv);
+	writeBufferJSONName(response, "error");
+
+	if(rv == YAMDI_OK) {
+		bufferAppendString(response, (unsigned char *)"null");
+		writeBufferJSONName(response, "flv");
+		bufferAppendBuffer(response, &worker->json);
+	}
+	else
+		writeBufferJSONString(response, (rv < YAMDI_NERRORS) ? errornames[rv] : errornames[YAMDI_ERROR]);
+
+	bufferAppendString(response, (unsigned char *)"}\n");
+
+	return rv;
+}
+
+// Split a request into words in place. Words are separated by blanks, double quotes
+// keep the blanks in a word and a backslash in quotes escapes the next character.
+int splitRequest(char *line, char **words, int maxwords) {
+	char *src = line, *dst;
+	int nwords = 0;
+	short quoted;
+
+	for(;;) {
+		while(*src == ' ' || *src == '\t' || *src == '\r' || *src == '\n')
+			src++;
+
+		if(*src == '\0')
+			break;
+
+		if(nwords == maxwords)
+			return -1;
+
+		words[nwords++] = dst = src;
+		quoted = 0;
+
+		while(*src != '\0') {
+			if(quoted == 0 && (*src == ' ' || *src == '\t' || *src == '\r' || *src == '\n'))
+				break;
+
+			if(*src == '"')
+				quoted = !quoted;
+			else if(quoted == 1 && *src == '\\' && *(src + 1) != '\0')
+				*dst++ = *++src;
+			else
+				*dst++ = *src;
+
+			src++;
+		}
+
+		if(quoted == 1)
+			return -1;
+
+		if(*src != '\0')
+			src++;
+
+		*dst = '\0';
+	}
+
+	return nwords;
+}
+
+int watchFLV(const char *spooldir, const char *outdir, FLVOptions_t *options) {
+#ifdef __linux__
+	int fd, wd, i, nworkers;
+	ssize_t nbytes, offset;
+	struct sigaction action;
+	struct inotify_event *event;
+	sigset_t signals, oldsignals;
+	FLVWatcher_t watcher;
+	FLVWatchWorker_t *workers;
+	pthread_t *threads;
+	union {
+		struct inotify_event event;
+		char bytes[YAMDI_WATCH_BUFFERSIZE];
+	} events;
+
+	fd = inotify_init();
+	if(fd == -1) {
+		fprintf(stderr, "Couldn't watch %s.\n", spooldir);
+		return YAMDI_ERROR;
+	}
+
+	// A file is complete when it is closed after writing or moved into the directory
+	wd = inotify_add_watch(fd, spooldir, IN_CLOSE_WRITE | IN_MOVED_TO);
+	if(wd == -1) {
+		fprintf(stderr, "Couldn't watch %s.\n", spooldir);
+		close(fd);
+		return YAMDI_ERROR;
+	}
+
+	nworkers = options->threads;
+	if(nworkers <= 0)
+		nworkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if(nworkers <= 0)
+		nworkers = 1;
+
+	memset(&watcher, 0, sizeof(FLVWatcher_t));
+	watcher.spooldir = spooldir;
+	watcher.outdir = outdir;
+	watcher.options = options;
+
+	watcher.active = (char **)calloc(nworkers, sizeof(char *));
+	watcher.requeue = (short *)calloc(nworkers, sizeof(short));
+	watcher.nworkers = nworkers;
+	workers = (FLVWatchWorker_t *)calloc(nworkers, sizeof(FLVWatchWorker_t));
+	threads = (pthread_t *)calloc(nworkers, sizeof(pthread_t));
+	if(watcher.active == NULL || watcher.requeue == NULL || workers == NULL || threads == NULL)
+		exit(YAMDI_OUT_OF_MEMORY);
+
+	pthread_mutex_init(&watcher.lock, NULL);
+	pthread_cond_init(&watcher.ready, NULL);
+
+	// SIGINT and SIGTERM interrupt read() in this thread
+	memset(&action, 0, sizeof(struct sigaction));
+	action.sa_handler = serveSignal;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, &oldsignals);
+
+	for(i = 0; i < nworkers; i++) {
+		workers[i].watcher = &watcher;
+		workers[i].id = i;
+
+		if(pthread_create(&threads[i], NULL, watchFLVWorker, &workers[i]) != 0)
+			exit(YAMDI_ERROR);
+	}
+
+	pthread_sigmask(SIG_SETMASK, &oldsignals, NULL);
+
+	// The files that have been completed before the watch started
+	scanWatchedFLV(&watcher);
+
+#ifdef DEBUG
+	fprintf(stderr, "[watch] watching %s with %d workers\n", spooldir, nworkers);
+#endif
+
+	while(servestop == 0) {
+		nbytes = read(fd, events.bytes, sizeof(events.bytes));
+		if(nbytes <= 0) {
+			if(nbytes == -1 && errno == EINTR)
+				continue;
+
+			fprintf(stderr, "Couldn't read the events of %s.\n", spooldir);
+			break;
+		}
+
+		for(offset = 0; offset < nbytes; offset += sizeof(struct inotify_event) + event->len) {
+			event = (struct inotify_event *)(events.bytes + offset);
+
+			// Events have been lost, look at the whole directory again
+			if((event->mask & IN_Q_OVERFLOW) != 0) {
+				scanWatchedFLV(&watcher);
+				continue;
+			}
+
+			if((event->mask & IN_ISDIR) != 0 || event->len == 0)
+				continue;
+
+			queueWatchedFLV(&watcher, event->name);
+		}
+	}
+
+	close(fd);
+
+	// The workers finish the file they are working on. The files in the queue
+	// are still in the spool directory and are found by the next start.
+	pthread_mutex_lock(&watcher.lock);
+
+	watcher.stop = 1;
+
+	pthread_cond_broadcast(&watcher.ready);
+	pthread_mutex_unlock(&watcher.lock);
+
+	for(i = 0; i < nworkers; i++) {
+		pthread_join(threads[i], NULL);
+		freeFLVWorkspace(&workers[i].workspace);
+	}
+
+	for(; watcher.nnames != 0; watcher.nnames--) {
+		free(watcher.names[watcher.first++]);
+		metricsQueue(-1);
+	}
+
+	pthread_mutex_destroy(&watcher.lock);
+	pthread_cond_destroy(&watcher.ready);
+
+	free(watcher.names);
+	free(watcher.active);
+	free(watcher.requeue);
+	free(workers);
+	free(threads);
+
+	return YAMDI_OK;
+#else
+	fprintf(stderr, "--watch is only available on Linux.\n");
+
+	return YAMDI_ERROR;
+#endif
+}
+
+void *watchFLVWorker(void *arg) {
+#ifdef __linux__
+	FLVWatchWorker_t *worker = (FLVWatchWorker_t *)arg;
+	FLVWatcher_t *watcher = worker->watcher;
+	char *name;
+	short requeue;
+
+	for(;;) {
+		pthread_mutex_lock(&watcher->lock);
+
+		while(watcher->nnames == 0 && watcher->stop == 0)
+			pthread_cond_wait(&watcher->ready, &watcher->lock);
+
+		if(watcher->stop == 1) {
+			pthread_mutex_unlock(&watcher->lock);
+			break;
+		}
+
+		name = watcher->names[watcher->first++];
+		watcher->nnames--;
+		metricsQueue(-1);
+		watcher->active[worker->id] = name;
+
+		pthread_mutex_unlock(&watcher->lock);
+
+		processWatchedFLV(worker, name);
+
+		pthread_mutex_lock(&watcher->lock);
+		watcher->active[worker->id] = NULL;
+		requeue = watcher->requeue[worker->id];
+		watcher->requeue[worker->id] = 0;
+		pthread_mutex_unlock(&watcher->lock);
+
+		// The file has been completed again while we processed it
+		if(requeue == 1)
+			queueWatchedFLV(watcher, name);
+
+		free(name);
+	}
+#endif
+
+	return NULL;
+}
+
+int processWatchedFLV(FLVWatchWorker_t *worker, const char *name) {
+	int rv;
+	short changed = 0;
+	char *infile, *outfile, *tempfile;
+	struct stat before, after;
+	FLVWatcher_t *watcher = worker->watcher;
+	FLVJob_t job;
+
+	infile = batchPath(watcher->spooldir, name, "");
+	outfile = batchPath(watcher->outdir, name, "");
+
+	// The output is written next to its final name and only gets it when it is complete
+	tempfile = (char *)malloc(strlen(watcher->outdir) + strlen(name) + strlen(YAMDI_WATCH_SUFFIX) + 3);
+	if(tempfile == NULL)
+		exit(YAMDI_OUT_OF_MEMORY);
+
+	sprintf(tempfile, "%s/.%s%s", watcher->outdir, name, YAMDI_WATCH_SUFFIX);
+
+	memset(&job, 0, sizeof(FLVJob_t));
+
+	job.infile = infile;
+	job.outfile = tempfile;
+	job.workspace = &worker->workspace;
+
+	if(stat(infile, &before) != 0)
+		memset(&before, 0, sizeof(struct stat));
+
+	rv = processFLV(watcher->options, &job);
+
+	if(rv == YAMDI_OK && rename(tempfile, outfile) != 0)
+		rv = YAMDI_RENAME_OUTPUT;
+
+	if(rv != YAMDI_OK) {
+		unlink(tempfile);
+		fprintf(stderr, "Couldn't process %s (%s).\n", infile, errornames[(rv < YAMDI_NERRORS) ? rv : YAMDI_ERROR]);
+	}
+	else if(watcher->options->removeinput == 1) {
+#ifndef __MINGW32__
+		pthread_mutex_lock(&watcher->lock);
+		changed = watcher->requeue[worker->id];
+		pthread_mutex_unlock(&watcher->lock);
+#endif
+
+		// A file that has been written again while we processed it is removed after the next time
+		if(stat(infile, &after) != 0 || after.st_ino != before.st_ino || after.st_size != before.st_size || after.st_mtime != before.st_mtime)
+			changed = 1;
+
+		if(changed == 0 && unlink(infile) != 0)
+			fprintf(stderr, "Couldn't remove %s.\n", infile);
+	}
+
+	free(infile);
+	free(outfile);
+	free(tempfile);
+
+	return rv;
+}
+
+// Queue a file of the spool directory unless it is hidden, e.g. an upload in
+// progress, or it is already waiting for a worker. A file that is being
+// processed is queued again by its worker when it is done.
+int queueWatchedFLV(FLVWatcher_t *watcher, const char *name) {
+#ifdef __linux__
+	size_t i, size;
+	char **names;
+
+	if(name[0] == '.')
+		return YAMDI_OK;
+
+	pthread_mutex_lock(&watcher->lock);
+
+	for(i = 0; i < watcher->nnames; i++) {
+		if(!strcmp(watcher->names[watcher->first + i], name)) {
+			pthread_mutex_unlock(&watcher->lock);
+			return YAMDI_OK;
+		}
+	}
+
+	for(i = 0; i < watcher->nworkers; i++) {
+		if(watcher->active[i] != NULL && !strcmp(watcher->active[i], name)) {
+			watcher->requeue[i] = 1;
+			pthread_mutex_unlock(&watcher->lock);
+			return YAMDI_OK;
+		}
+	}
+
+	// Move the waiting files to the front before the array grows
+	if(watcher->first + watcher->nnames == watcher->size) {
+		if(watcher->first != 0) {
+			memmove(watcher->names, watcher->names + watcher->first, watcher->nnames * sizeof(char *));
+			watcher->first = 0;
+		}
+		else {
+			size = (watcher->size == 0) ? 64 : 2 * watcher->size;
+
+			names = (char **)realloc(watcher->names, size * sizeof(char *));
+			if(names == NULL)
+				exit(YAMDI_OUT_OF_MEMORY);
+
+			watcher->names = names;
+			watcher->size = size;
+		}
+	}
+
+	watcher->names[watcher->first + watcher->nnames] = strdup(name);
+	if(watcher->names[watcher->first + watcher->nnames] == NULL)
+		exit(YAMDI_OUT_OF_MEMORY);
+
+	watcher->nnames++;
+	metricsQueue(1);
+
+	pthread_cond_signal(&watcher->ready);
+	pthread_mutex_unlock(&watcher->lock);
+#endif
+
+	return YAMDI_OK;
+}
+
+// Queue the files of the spool directory that don't have an output that is newer
+int scanWatchedFLV(FLVWatcher_t *watcher) {
+#ifndef __MINGW32__
+	DIR *dir;
+	struct dirent *entry;
+	struct stat in, out;
+	char *infile, *outfile;
+	int uptodate;
+
+	dir = opendir(watcher->spooldir);
+	if(dir == NULL) {
+		fprintf(stderr, "Couldn't read %s.\n", watcher->spooldir);
+		return YAMDI_ERROR;
+	}
+
+	while((entry = readdir(dir)) != NULL) {
+#ifdef _DIRENT_HAVE_D_TYPE
+		if(entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN)
+			continue;
+#endif
+
+		if(entry->d_name[0] == '.')
+			continue;
+
+		infile = batchPath(watcher->spooldir, entry->d_name, "");
+		outfile = batchPath(watcher->outdir, entry->d_name, "");
+
+		uptodate = (stat(infile, &in) == 0 && stat(outfile, &out) == 0 && out.st_mtime >= in.st_mtime);
+
+		free(infile);
+		free(outfile);
+
+		if(uptodate == 0)
+			queueWatchedFLV(watcher, entry->d_name);
+	}
+
+	closedir(dir);
+#endif
+
+	return YAMDI_OK;
+}
+
+int writeDescriptor(int fd, const unsigned char *bytes, size_t size) {
+	ssize_t nbytes;
+
+	while(size > 0) {
+		nbytes = write(fd, bytes, size);
+		if(nbytes == -1 && errno == EINTR)
+			continue;
+
+		if(nbytes <= 0)
+			return YAMDI_ERROR;
+
+		bytes += nbytes;
+		size -= (size_t)nbytes;
+	}
+
+	return YAMDI_OK;
+}
+
+void serveSignal(int signum) {
+#ifndef __MINGW32__
+	servestop = 1;
+#endif
+
+	return;
+}
+
+int writeBufferToFile(buffer_t *buffer, const char *file) {
+	FILE *fp;
+	int rv = YAMDI_OK;
+
+	if(strcmp(file, "-")) {
+		fp = fopen(file, "wb");
+		if(fp == NULL) {
+			fprintf(stderr, "Couldn't open %s.\n", file);
+			return YAMDI_ERROR;
+		}
+	}
+	else
+		fp = stdout;
+
+	if(writeBytes(buffer->data, buffer->used, fp) != YAMDI_OK)
+		rv = YAMDI_ERROR;
+
+	if(fflush(fp) != 0)
+		rv = YAMDI_ERROR;
+
+	if(fp != stdout && fclose(fp) != 0)
+		rv = YAMDI_ERROR;
+
+	if(rv != YAMDI_OK)
+		fprintf(stderr, "Couldn't write %s.\n", file);
+
+	return rv;
+}
+
+int validateFLV(FILE *fp) {
+	unsigned char buffer[FLV_SIZE_HEADER + FLV_SIZE_PREVIOUSTAGSIZE];
+	off_t filesize;
+
+	seekBytes(fp, 0, SEEK_END);
+	filesize = ftello(fp);
+
+	// Check for minimal FLV file length
+	if(filesize < (FLV_SIZE_HEADER + FLV_SIZE_PREVIOUSTAGSIZE))
+		return YAMDI_FILE_TOO_SMALL;
+
+	rewind(fp);
+
+	if(readBytes(buffer, FLV_SIZE_HEADER + FLV_SIZE_PREVIOUSTAGSIZE, fp) != YAMDI_OK)
+		return YAMDI_READ_ERROR;
+
+	// Check the FLV signature
+	if(buffer[0] != 'F' || buffer[1] != 'L' || buffer[2] != 'V')
+		return YAMDI_INVALID_SIGNATURE;
+
+	// Check the FLV version
+	if(FLV_UI8(&buffer[3]) != 1)
+		return YAMDI_INVALID_FLVVERSION;
+
+	// Check the DataOffset
+	if(FLV_UI32(&buffer[5]) != FLV_SIZE_HEADER)
+		return YAMDI_INVALID_DATASIZE;
+
+	// Check the PreviousTagSize0 value
+	if(FLV_UI32(&buffer[FLV_SIZE_HEADER]) != 0)
+		return YAMDI_INVALID_PREVIOUSTAGSIZE;
+
+	return YAMDI_OK;
+}
+
+int initFLV(FLV_t *flv) {
+	if(flv == NULL)
+		return YAMDI_ERROR;
+
+	memset(flv, 0, sizeof(FLV_t));
+
+	return YAMDI_OK;
+}
+
+void lendFLVWorkspace(FLV_t *flv, FLVWorkspace_t *workspace) {
+	flv->workspace = workspace;
+
+	// The buffers move into the FLV and back after the file is done
+	flv->onmetadata = workspace->onmetadata;
+	flv->onlastkeyframe = workspace->onlastkeyframe;
+	flv->onlastsecond = workspace->onlastsecond;
+	flv->onfiller = workspace->onfiller;
+	flv->rbsp = workspace->rbsp;
+
+	bufferInit(&workspace->onmetadata);
+	bufferInit(&workspace->onlastkeyframe);
+	bufferInit(&workspace->onlastsecond);
+	bufferInit(&workspace->onfiller);
+	bufferInit(&workspace->rbsp);
+
+	bufferReset(&flv->onmetadata);
+	bufferReset(&flv->onlastkeyframe);
+	bufferReset(&flv->onlastsecond);
+	bufferReset(&flv->onfiller);
+	bufferReset(&flv->rbsp);
+
+	return;
+}
+
+void returnFLVWorkspace(FLV_t *flv) {
+	FLVWorkspace_t *workspace = flv->workspace;
+
+	workspace->onmetadata = flv->onmetadata;
+	workspace->onlastkeyframe = flv->onlastkeyframe;
+	workspace->onlastsecond = flv->onlastsecond;
+	workspace->onfiller = flv->onfiller;
+	workspace->rbsp = flv->rbsp;
+
+	bufferInit(&flv->onmetadata);
+	bufferInit(&flv->onlastkeyframe);
+	bufferInit(&flv->onlastsecond);
+	bufferInit(&flv->onfiller);
+	bufferInit(&flv->rbsp);
+
+	return;
+}
+
+void freeFLVWorkspace(FLVWorkspace_t *workspace) {
+	free(workspace->flvtag);
+	free(workspace->memory);
+
+	bufferFree(&workspace->onmetadata);
+	bufferFree(&workspace->onlastkeyframe);
+	bufferFree(&workspace->onlastsecond);
+	bufferFree(&workspace->onfiller);
+	bufferFree(&workspace->rbsp);
+
+	memset(workspace, 0, sizeof(FLVWorkspace_t));
+
+	return;
+}
+
+// Allocate the index of the serial index mode, from the workspace if there is one
+FLVTag_t *allocFLVIndex(FLV_t *flv, size_t nflvtags) {
+	FLVWorkspace_t *workspace = flv->workspace;
+
+	if(workspace == NULL || nflvtags > YAMDI_WORKSPACE_MAXTAGS)
+		return (FLVTag_t *)calloc(nflvtags, sizeof(FLVTag_t));
+
+	if(workspace->ntags < nflvtags) {
+		free(workspace->flvtag);
+
+		workspace->flvtag = (FLVTag_t *)malloc(nflvtags * sizeof(FLVTag_t));
+		workspace->ntags = (workspace->flvtag != NULL) ? nflvtags : 0;
+
+		if(workspace->flvtag == NULL)
+			return NULL;
+	}
+
+	memset(workspace->flvtag, 0, nflvtags * sizeof(FLVTag_t));
+
+	return workspace->flvtag;
+}
+
+int checkFLVBudget(FLV_t *flv, iostats_t *io) {
+	uint64_t iobytes;
+
+	if(flv->budget.deadline != 0.0 && wallClock() >= flv->budget.deadline)
+		return YAMDI_LIMIT_EXCEEDED;
+
+	if(flv->budget.iolimit != 0) {
+		iobytes = stats.bytesread + stats.bytesloaded + stats.byteswritten - flv->budget.iostart;
+
+		// The writers count in io until they are done
+		if(io != NULL)
+			iobytes += io->bytesread + io->byteswritten;
+
+		if(iobytes > flv->budget.iolimit)
+			return YAMDI_LIMIT_EXCEEDED;
+	}
+
+	return YAMDI_OK;
+}
+
+// The scanners run in threads of their own and can't see the stats of this
+// thread. They get the deadline and a share of the bytes that are left.
+void limitFLVScanner(FLV_t *flv, FLVScanner_t *scanner, int nscanners) {
+	uint64_t iobytes;
+
+	scanner->deadline = flv->budget.deadline;
+	scanner->iolimit = 0;
+
+	if(flv->budget.iolimit != 0) {
+		iobytes = stats.bytesread + stats.bytesloaded + stats.byteswritten - flv->budget.iostart;
+
+		if(iobytes < flv->budget.iolimit)
+			scanner->iolimit = (flv->budget.iolimit - iobytes) / (uint64_t)nscanners;
+
+		// 0 would be unlimited
+		if(scanner->iolimit == 0)
+			scanner->iolimit = 1;
+	}
+
+	return;
+}
+
+int checkFLVScanner(FLVScanner_t *scanner) {
+	uint64_t iobytes = scanner->bytesread;
+
+	if(scanner->deadline != 0.0 && wallClock() >= scanner->deadline)
+		return YAMDI_LIMIT_EXCEEDED;
+
+	// A mapped chunk reads what it walks over
+	if(scanner->data != NULL)
+		iobytes += (uint64_t)(scanner->next - scanner->first);
+
+	if(scanner->iolimit != 0 && iobytes > scanner->iolimit)
+		return YAMDI_LIMIT_EXCEEDED;
+
+	return YAMDI_OK;
+}
+
+int loadFLV(FLV_t *flv, FILE **fp) {
+#ifndef __MINGW32__
+	size_t offset, size;
+	ssize_t nbytes;
+	struct stat st;
+	FILE *memory;
+
+	if(fstat(fileno(*fp), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 || (uint64_t)st.st_size > flv->options.inmemory)
+		return YAMDI_ERROR;
+
+	size = (size_t)st.st_size;
+
+	if(flv->workspace != NULL) {
+		if(flv->workspace->memorysize < size) {
+			free(flv->workspace->memory);
+
+			flv->workspace->memory = (unsigned char *)malloc(size);
+			flv->workspace->memorysize = (flv->workspace->memory != NULL) ? size : 0;
+		}
+
+		flv->memory.data = flv->workspace->memory;
+	}
+	else
+		flv->memory.data = (unsigned char *)malloc(size);
+
+	if(flv->memory.data == NULL)
+		return YAMDI_OUT_OF_MEMORY;
+
+	// Usually one read() gets the whole file
+	for(offset = 0; offset < size; offset += (size_t)nbytes) {
+		nbytes = pread(fileno(*fp), flv->memory.data + offset, size - offset, (off_t)offset);
+		if(nbytes <= 0)
+			break;
+	}
+
+	// Everything else reads from the memory through the usual stream functions
+	if(offset != 0)
+		memory = fmemopen(flv->memory.data, offset, "rb");
+	else
+		memory = NULL;
+
+	if(memory == NULL) {
+		if(flv->workspace == NULL)
+			free(flv->memory.data);
+
+		flv->memory.data = NULL;
+
+		return YAMDI_READ_ERROR;
+	}
+
+#ifdef DEBUG
+	fprintf(stderr, "[FLV] read %d bytes into memory\n", (int)offset);
+#endif
+
+	flv->memory.size = offset;
+
+	stats.bytesloaded += (uint64_t)offset;
+
+	fclose(*fp);
+	*fp = memory;
+
+	return YAMDI_OK;
+#else
+	return YAMDI_ERROR;
+#endif
+}
+
+int indexFLV(FLV_t *flv, FILE *fp) {
+	int rv;
+	off_t offset, filesize = 0;
+	size_t nflvtags;
+	FLVTag_t flvtag;
+	tracespan_t span;
+
+	if(progress.fd != -1) {
+		seekBytes(fp, 0, SEEK_END);
+		filesize = ftello(fp);
+	}
+
+	// Try the faster modes first. If they don't agree on the tags, fall back to the serial mode.
+	// Their threads don't report any progress, only when they are done.
+	if(flv->options.indexmode == YAMDI_INDEX_BIDIRECTIONAL) {
+		progressBegin("index", 0, (uint64_t)filesize);
+		rv = indexFLVBidirectional(flv, fp);
+		if(rv == YAMDI_OK)
+			progressEnd(flv->index.nflvtags, (uint64_t)filesize);
+
+		if(rv == YAMDI_OK || rv == YAMDI_LIMIT_EXCEEDED)
+			return rv;
+	}
+	else if(flv->options.indexmode == YAMDI_INDEX_PARALLEL) {
+		progressBegin("index", 0, (uint64_t)filesize);
+		rv = indexFLVParallel(flv, fp);
+		if(rv == YAMDI_OK)
+			progressEnd(flv->index.nflvtags, (uint64_t)filesize);
+
+		if(rv == YAMDI_OK || rv == YAMDI_LIMIT_EXCEEDED)
+			return rv;
+	}
+
+#ifdef DEBUG
+	fprintf(stderr, "[FLV] indexing file ...\n");
+#endif
+
+	// Count how many tags are there in this FLV
+	offset = FLV_SIZE_HEADER + FLV_SIZE_PREVIOUSTAGSIZE;
+	nflvtags = 0;
+	progressBegin("count", 0, (uint64_t)filesize);
+	traceSpanBegin(&span);
+	while(readFLVTag(&flvtag, offset, fp) == YAMDI_OK) {
+		offset += (flvtag.tagsize + FLV_SIZE_PREVIOUSTAGSIZE);
+
+		nflvtags++;
+		traceSpanStep(&span, "count tags", YAMDI_TRACE_MAINTID, flvtag.tagsize + FLV_SIZE_PREVIOUSTAGSIZE);
+		progressUpdate(nflvtags, (uint64_t)offset);
+
+		if((nflvtags % YAMDI_BUDGET_NTAGS) == 0 && checkFLVBudget(flv, NULL) != YAMDI_OK) {
+			traceSpanEnd(&span, "count tags", YAMDI_TRACE_MAINTID);
+			return YAMDI_LIMIT_EXCEEDED;
+		}
+	}
+	traceSpanEnd(&span, "count tags", YAMDI_TRACE_MAINTID);
+	progressEnd(nflvtags, (uint64_t)offset);
+
+	flv->index.nflvtags = nflvtags;
+
+#ifdef DEBUG
+	fprintf(stderr, "[FLV] nflvtags = %d\n", flv->index.nflvtags);
+#endif
+
+	if(nflvtags == 0)
+		return YAMDI_OK;
+
+	// Allocate memory for the tag metadata index
+	flv->index.flvtag = allocFLVIndex(flv, flv->index.nflvtags);
+	if(flv->index.flvtag == NULL)
+		return YAMDI_OUT_OF_MEMORY;
+
+	// Store the tag metadata in the index
+	progressBegin("index", flv->index.nflvtags, (uint64_t)offset);
+
+	offset = FLV_SIZE_HEADER + FLV_SIZE_PREVIOUSTAGSIZE;
+	nflvtags = 0;
+	traceSpanBegin(&span);
+	while(readFLVTag(&flvtag, offset, fp) == YAMDI_OK) {
+		traceSpanStep(&span, "store tags", YAMDI_TRACE_MAINTID, flvtag.tagsize + FLV_SIZE_PREVIOUSTAGSIZE);
+		progressUpdate(nflvtags, (uint64_t)offset);
+
+		if((nflvtags % YAMDI_BUDGET_NTAGS) == 0 && checkFLVBudget(flv, NULL) != YAMDI_OK) {
+			traceSpanEnd(&span, "store tags", YAMDI_TRACE_MAINTID);
+			return YAMDI_LIMIT_EXCEEDED;
+		}
+
+		flv->index.flvtag[nflvtags].offset = flvtag.offset;
+		flv->index.flvtag[nflvtags].tagtype = flvtag.tagtype;
+		flv->index.flvtag[nflvtags].datasize = flvtag.datasize;
+		flv->index.flvtag[nflvtags].timestamp = flvtag.timestamp;
+		flv->index.flvtag[nflvtags].tagsize = flvtag.tagsize;
+		flv->index.flvtag[nflvtags].canonical = flvtag.canonical;
+
+		offset += (flv->index.flvtag[nflvtags].tagsize + FLV_SIZE_PREVIOUSTAGSIZE);
+
+		nflvtags++;
+#ifdef DEBUG
+		if((nflvtags % 100) == 0)
+			fprintf(stderr, "[FLV] storing metadata (tag %d of %d)\r", nflvtags, flv->index.nflvtags);
+#endif
+	}
+
+	traceSpanEnd(&span, "store tags", YAMDI_TRACE_MAINTID);
+	progressEnd(nflvtags, (uint64_t)offset);
+
+#ifdef DEBUG
+	fprintf(stderr, "[FLV] storing metadata (tag %d of %d)\n", nflvtags, flv->index.nflvtags);
+#endif
+
+	return YAMDI_OK;
+}
+
+int indexFLVBidirectional(FLV_t *flv, FILE *fp) {
+#ifndef __MINGW32__
+	size_t i;
+	off_t filesize;
+	pthread_t thread;
+	FLVScanner_t forward, backward;
+
+#ifdef DEBUG
+	fprintf(stderr, "[FLV] indexing file from both ends ...\n");
+#endif
+
+	if(checkFLVBudget(flv, NULL) != YAMDI_OK)
+		return YAMDI_LIMIT_EXCEEDED;
+
+	seekBytes(fp, 0, SEEK_END);
+	filesize = ftello(fp);
+
+	memset(&forward, 0, sizeof(FLVScanner_t));
+	memset(&backward, 0, sizeof(FLVScanner_t));
+
+	limitFLVScanner(flv, &forward, 2);
+	limitFLVScanner(flv, &backward, 2);
+
+	// Both scanners meet in the middle of the file. The forward scanner indexes
+	// all tags that start before the middle, the backward scanner all the others.
+	forward.fd = fileno(fp);
+	forward.start = FLV_SIZE_HEADER + FLV_SIZE_PREVIOUSTAGSIZE;
+	forward.end = filesize / 2;
+	forward.filesize = filesize;
+	forward.tid = YAMDI_TRACE_MAINTID;
+
+	backward.fd = fileno(fp);
+	backward.start = filesize;
+	backward.end = filesize / 2;
+	backward.filesize = filesize;
+	backward.tid = YAMDI_TRACE_MAINTID + 1;
+
+	if(pthread_create(&thread, NULL, scanFLVBackward, &backward) != 0)
+		return YAMDI_ERROR;
+
+	scanFLVForward(&forward);
+
+	pthread_join(thread, NULL);
+
+	stats.nreads += forward.nreads + backward.nreads;
+	stats.bytesread += forward.bytesread + backward.bytesread;
+
+	if(forward.rv != YAMDI_OK || backward.rv != YAMDI_OK) {
+		free(forward.index.flvtag);
+		free(backward.index.flvtag);
+
+		if(forward.rv == YAMDI_LIMIT_EXCEEDED || backward.rv == YAMDI_LIMIT_EXCEEDED)
+			return YAMDI_LIMIT_EXCEEDED;
+
+		return YAMDI_ERROR;
+	}
+
+	// If the tag chain ended before the middle, the serial scan would have
+	// stopped there as well. Otherwise both scanners have to agree on the
+	// offset of the first tag behind the middle.
+	if(forward.next >= forward.end && forward.next != backward.next) {
+#ifdef DEBUG
+		fprintf(stderr, "[FLV] forward and backward scan disagree (%" PRIi64 " != %" PRIi64 ")\n", (int64_t)forward.next, (int64_t)backward.next);
+#endif
+		free(forward.index.flvtag);
+		free(backward.index.flvtag);
+
+		return YAMDI_ERROR;
+	}
+
+	if(forward.next < forward.end)
+		backward.index.nflvtags = 0;
+
+	// Merge the tags. The backward scanner has them in reverse order.
+	for(i = backward.index.nflvtags; i != 0; i--) {
+		if(appendFLVIndex(&forward.index, &backward.index.flvtag[i - 1]) != YAMDI_OK) {
+			free(forward.index.flvtag);
+			free(backward.index.flvtag);
+
+			return YAMDI_OUT_OF_MEMORY;
+		}
+	}
+
+	free(backward.index.flvtag);
+
+	flv->index = forward.index;
+
+#ifdef DEBUG
+	fprintf(stderr, "[FLV] nflvtags = %d\n", (int)flv->index.nflvtags);
+#endif
+
+	return YAMDI_OK;
+#else
+	return YAMDI_ERROR;
+#endif
+}
+
+void *scanFLVForward(void *arg) {
+	FLVScanner_t *scanner = (FLVScanner_t *)arg;
+	FLVTag_t flvtag, *last;
+	tracespan_t span;
+	unsigned char buffer[FLV_SIZE_PREVIOUSTAGSIZE + FLV_SIZE_TAGHEADER];
+
+	scanner->rv = YAMDI_OK;
+	scanner->next = scanner->start;
+
+	traceSpanBegin(&span);
+
+	// Same as the serial scan in indexFLV(), but stop at the end. The PreviousTagSize
+	// of the last tag is read together with the header of the next tag.
+	while(scanner->next < scanner->end) {
+		if((scanner->index.nflvtags % YAMDI_BUDGET_NTAGS) == 0 && checkFLVScanner(scanner) != YAMDI_OK) {
+			scanner->rv = YAMDI_LIMIT_EXCEEDED;
+			break;
+		}
+
+		scanner->nreads++;
+		if(pread(scanner->fd, buffer, sizeof(buffer), scanner->next - FLV_SIZE_PREVIOUSTAGSIZE) != sizeof(buffer))
+			break;
+
+		scanner->bytesread += sizeof(buffer);
+
+		if(scanner->index.nflvtags != 0) {
+			last = &scanner->index.flvtag[scanner->index.nflvtags - 1];
+			if(FLV_UI32(buffer) != last->tagsize)
+				last->canonical = 0;
+		}
+
+		if(parseFLVTagHeader(&flvtag, &buffer[FLV_SIZE_PREVIOUSTAGSIZE], scanner->next) != YAMDI_OK)
+			break;
+
+		if(appendFLVIndex(&scanner->index, &flvtag) != YAMDI_OK) {
+			scanner->rv = YAMDI_OUT_OF_MEMORY;
+			break;
+		}
+
+		scanner->next += (flvtag.tagsize + FLV_SIZE_PREVIOUSTAGSIZE);
+
+		traceSpanStep(&span, "scan forward", scanner->tid, flvtag.tagsize + FLV_SIZE_PREVIOUSTAGSIZE);
+	}
+
+	traceSpanEnd(&span, "scan forward", scanner->tid);
+
+	// Nobody has looked at the PreviousTagSize of the last tag
+	if(scanner->index.nflvtags != 0)
+		scanner->index.flvtag[scanner->index.nflvtags - 1].canonical = 0;
+
+	return NULL;
+}
+
+void *scanFLVBackward(void *arg) {
+	FLVScanner_t *scanner = (FLVScanner_t *)arg;
+	off_t offset;
+	FLVTag_t flvtag;
+	tracespan_t span;
+	unsigned char buffer[FLV_SIZE_TAGHEADER];
+
+	scanner->rv = YAMDI_OK;
+	scanner->next = scanner->start;
+
+	traceSpanBegin(&span);
+
+	// Follow the PreviousTagSize fields from the end of the file. Every tag is
+	// checked against its header, otherwise we can't trust the chain.
+	while(scanner->next - FLV_SIZE_PREVIOUSTAGSIZE > FLV_SIZE_HEADER + FLV_SIZE_PREVIOUSTAGSIZE) {
+		if((scanner->index.nflvtags % YAMDI_BUDGET_NTAGS) == 0 && checkFLVScanner(scanner) != YAMDI_OK) {
+			scanner->rv = YAMDI_LIMIT_EXCEEDED;
+			break;
+		}
+
+		scanner->nreads++;
+		if(pread(scanner->fd, buffer, FLV_SIZE_PREVIOUSTAGSIZE, scanner->next - FLV_SIZE_PREVIOUSTAGSIZE) != FLV_SIZE_PREVIOUSTAGSIZE) {
+			scanner->rv = YAMDI_READ_ERROR;
+			break;
+		}
+
+		scanner->bytesread += FLV_SIZE_PREVIOUSTAGSIZE;
+
+		offset = scanner->next - FLV_SIZE_PREVIOUSTAGSIZE - FLV_UI32(buffer);
+		if(offset < scanner->end)
+			break;
+
+		scanner->nreads++;
+		if(pread(scanner->fd, buffer, FLV_SIZE_TAGHEADER, offset) != FLV_SIZE_TAGHEADER) {
+			scanner->rv = YAMDI_READ_ERROR;
+			break;
+		}
+
+		scanner->bytesread += FLV_SIZE_TAGHEADER;
+
+		if(parseFLVTagHeader(&flvtag, buffer, offset) != YAMDI_OK || offset + flvtag.tagsize + FLV_SIZE_PREVIOUSTAGSIZE != scanner->next) {
+			scanner->rv = YAMDI_INVALID_PREVIOUSTAGSIZE;
+			break;
+		}
+
+		if(appendFLVIndex(&scanner->index, &flvtag) != YAMDI_OK) {
+			scanner->rv = YAMDI_OUT_OF_MEMORY;
+			break;
+		}
+
+		scanner->next = offset;
+
+		traceSpanStep(&span, "scan backward", scanner->tid, flvtag.tagsize + FLV_SIZE_PREVIOUSTAGSIZE);
+	}
+
+	traceSpanEnd(&span, "scan backward", scanner->tid);
+
+	return NULL;
+}
+
+int indexFLVParallel(FLV_t *flv, FILE *fp) {
+#ifndef __MINGW32__
+	int k, nchunks, nmerged, nthreads, rv;
+	size_t nflvtags;
+	off_t filesize, next;
+	struct stat st;
+	unsigned char *data;
+	pthread_t *threads;
+	FLVScanner_t *chunks;
+
+	if(fstat(fileno(fp), &st) != 0)
+		return YAMDI_READ_ERROR;
+
+	filesize = st.st_size;
+	if(filesize <= FLV_SIZE_HEADER + FLV_SIZE_PREVIOUSTAGSIZE)
+		return YAMDI_ERROR;
+
+	// Split the file in chunks, one for each thread, but not too small ones
+	nchunks = flv->options.threads;
+	if(nchunks == 0)
+		nchunks = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+	if((off_t)nchunks * YAMDI_INDEX_CHUNKSIZE > filesize)
+		nchunks = (int)(filesize / YAMDI_INDEX_CHUNKSIZE);
+
+	if(nchunks <= 1)
+		return YAMDI_ERROR;
+
+	if(checkFLVBudget(flv, NULL) != YAMDI_OK)
+		return YAMDI_LIMIT_EXCEEDED;
+
+#ifdef DEBUG
+	fprintf(stderr, "[FLV] indexing file in %d chunks ...\n", nchunks);
+#endif
+
+	data = (unsigned char *)mmap(NULL, (size_t)filesize, PROT_READ, MAP_SHARED, fileno(fp), 0);
+	if(data == MAP_FAILED)
+		return YAMDI_READ_ERROR;
+
+	stats.bytesmapped += (uint64_t)filesize;
+
+	chunks = (FLVScanner_t *)calloc(nchunks, sizeof(FLVScanner_t));
+	threads = (pthread_t *)calloc(nchunks, sizeof(pthread_t));
+	if(chunks == NULL || threads == NULL) {
+		free(chunks);
+		free(threads);
+		munmap(data, (size_t)filesize);
+
+		return YAMDI_OUT_OF_MEMORY;
+	}
+
+	for(k = 0; k < nchunks; k++) {
+		chunks[k].data = data;
+		chunks[k].filesize = filesize;
+		chunks[k].start = FLV_SIZE_HEADER + FLV_SIZE_PREVIOUSTAGSIZE + (filesize - FLV_SIZE_HEADER - FLV_SIZE_PREVIOUSTAGSIZE) / nchunks * k;
+		chunks[k].end = FLV_SIZE_HEADER + FLV_SIZE_PREVIOUSTAGSIZE + (filesize - FLV_SIZE_HEADER - FLV_SIZE_PREVIOUSTAGSIZE) / nchunks * (k + 1);
+		chunks[k].tid = YAMDI_TRACE_MAINTID + k;
+
+		limitFLVScanner(flv, &chunks[k], nchunks);
+	}
+
+	chunks[nchunks - 1].end = filesize;
+
+	// The first chunk is scanned by this thread
+	for(nthreads = 1; nthreads < nchunks; nthreads++) {
+		if(pthread_create(&threads[nthreads], NULL, scanFLVChunk, &chunks[nthreads]) != 0)
+			break;
+	}
+
+	walkFLVChunk(&chunks[0], chunks[0].start);
+
+	// The chunks we couldn't start a thread for
+	for(k = nthreads; k < nchunks; k++)
+		scanFLVChunk(&chunks[k]);
+
+	for(k = 1; k < nthreads; k++)
+		pthread_join(threads[k], NULL);
+
+	// Stitch the chunks together. Every chunk has to start where the previous
+	// one ended. If it doesn't, the chunk found a wrong tag boundary and we
+	// have to follow the tags from the end of the previous chunk ourselves.
+	rv = YAMDI_OK;
+	nflvtags = 0;
+	for(k = 0; k < nchunks; k++) {
+		if(chunks[k].rv != YAMDI_OK) {
+			rv = chunks[k].rv;
+			break;
+		}
+
+		if(k > 0) {
+			next = chunks[k - 1].next;
+
+			// The tags ended in the previous chunk
+			if(next < chunks[k - 1].end)
+				break;
+
+			if(chunks[k].first != next) {
+#ifdef DEBUG
+				fprintf(stderr, "[FLV] chunk %d starts at %" PRIi64 " instead of %" PRIi64 "\n", k, (int64_t)chunks[k].first, (int64_t)next);
+#endif
+				chunks[k].index.nflvtags = 0;
+				walkFLVChunk(&chunks[k], next);
+
+				if(chunks[k].rv != YAMDI_OK) {
+					rv = chunks[k].rv;
+					break;
+				}
+			}
+		}
+
+		nflvtags += chunks[k].index.nflvtags;
+	}
+
+	// The chunks after the end of the tags are only freed
+	nmerged = k;
+
+	if(rv == YAMDI_OK && nflvtags != 0) {
+		flv->index.flvtag = (FLVTag_t *)calloc(nflvtags, sizeof(FLVTag_t));
+		if(flv->index.flvtag == NULL)
+			rv = YAMDI_OUT_OF_MEMORY;
+		else {
+			for(k = 0; k < nmerged; k++) {
+				memcpy(&flv->index.flvtag[flv->index.nflvtags], chunks[k].index.flvtag, chunks[k].index.nflvtags * sizeof(FLVTag_t));
+				flv->index.nflvtags += chunks[k].index.nflvtags;
+			}
+
+			flv->index.size = nflvtags;
+		}
+	}
+
+#ifdef DEBUG
+	fprintf(stderr, "[FLV] nflvtags = %d\n", (int)flv->index.nflvtags);
+#endif
+
+	for(k = 0; k < nchunks; k++)
+		free(chunks[k].index.flvtag);
+
+	free(chunks);
+	free(threads);
+
+	munmap(data, (size_t)filesize);
+
+	return rv;
+#else
+	return YAMDI_ERROR;
+#endif
+}
+
+void *scanFLVChunk(void *arg) {
+	off_t offset;
+	double start = 0.0;
+	FLVScanner_t *scanner = (FLVScanner_t *)arg;
+
+	if(trace.enabled == 1)
+		start = wallClock();
+
+	// Find the first tag boundary in this chunk
+	for(offset = scanner->start; offset < scanner->end; offset++) {
+		if(isFLVTagBoundary(scanner->data, scanner->filesize, offset) == 1)
+			break;
+	}
+
+	if(trace.enabled == 1)
+		traceEvent("sync", "index", scanner->tid, start, wallClock(), 0, (uint64_t)(offset - scanner->start));
+
+	// No tag starts in this chunk
+	if(offset == scanner->end) {
+		scanner->rv = YAMDI_OK;
+		scanner->first = -1;
+		scanner->next = offset;
+
+		return NULL;
+	}
+
+	walkFLVChunk(scanner, offset);
+
+	return NULL;
+}
+
+void walkFLVChunk(FLVScanner_t *scanner, off_t offset) {
+	FLVTag_t flvtag;
+	tracespan_t span;
+
+	scanner->rv = YAMDI_OK;
+	scanner->first = offset;
+	scanner->next = offset;
+
+	traceSpanBegin(&span);
+
+	// Same as the serial scan in indexFLV(), but stop at the end of the chunk
+	while(scanner->next < scanner->end) {
+		if((scanner->index.nflvtags % YAMDI_BUDGET_NTAGS) == 0 && checkFLVScanner(scanner) != YAMDI_OK) {
+			scanner->rv = YAMDI_LIMIT_EXCEEDED;
+			break;
+		}
+
+		if(scanner->next + FLV_SIZE_TAGHEADER > scanner->filesize)
+			break;
+
+		if(parseFLVTagHeader(&flvtag, &scanner->data[scanner->next], scanner->next) != YAMDI_OK)
+			break;
+
+		if(scanner->next + flvtag.tagsize + FLV_SIZE_PREVIOUSTAGSIZE <= scanner->filesize && FLV_UI32(&scanner->data[scanner->next + flvtag.tagsize]) != flvtag.tagsize)
+			flvtag.canonical = 0;
+
+		if(appendFLVIndex(&scanner->index, &flvtag) != YAMDI_OK) {
+			scanner->rv = YAMDI_OUT_OF_MEMORY;
+			break;
+		}
+
+		scanner->next += (flvtag.tagsize + FLV_SIZE_PREVIOUSTAGSIZE);
+
+		traceSpanStep(&span, "scan chunk", scanner->tid, flvtag.tagsize + FLV_SIZE_PREVIOUSTAGSIZE);
+	}
+
+	traceSpanEnd(&span, "scan chunk", scanner->tid);
+
+	return;
+}
+
+int isFLVTagBoundary(const unsigned char *data, off_t filesize, off_t offset) {
+	int i;
+	off_t next;
+	size_t datasize;
+
+	// A tag boundary has a known tag type, a StreamID of 0 and a PreviousTagSize
+	// that matches the DataSize. Check a few consecutive tags to be sure.
+	for(i = 0; i < YAMDI_INDEX_SYNCTAGS; i++) {
+		if(offset == filesize)
+			return 1;
+
+		if(offset + FLV_SIZE_TAGHEADER > filesize)
+			return 0;
+
+		switch(data[offset]) {
+			case FLV_TAG_VIDEO:
+			case FLV_TAG_AUDIO:
+			case FLV_TAG_SCRIPTDATA:
+				break;
+			default:
+				return 0;
+		}
+
+		if(FLV_UI24(&data[offset + 8]) != 0)
+			return 0;
+
+		datasize = FLV_UI24(&data[offset + 1]);
+
+		next = offset + FLV_SIZE_TAGHEADER + datasize;
+		if(next + FLV_SIZE_PREVIOUSTAGSIZE > filesize)
+			return 0;
+
+		if(FLV_UI32(&data[next]) != FLV_SIZE_TAGHEADER + datasize)
+			return 0;
+
+		offset = next + FLV_SIZE_PREVIOUSTAGSIZE;
+	}
+
+	return 1;
+}
+
+int appendFLVIndex(FLVIndex_t *index, FLVTag_t *flvtag) {
+	size_t size;
+	FLVTag_t *t;
+
+	if(index->nflvtags == index->size) {
+		size = (index->size == 0) ? 1024 : 2 * index->size;
+
+		t = (FLVTag_t *)realloc(index->flvtag, size * sizeof(FLVTag_t));
+		if(t == NULL)
+			return YAMDI_OUT_OF_MEMORY;
+
+		index->flvtag = t;
+		index->size = size;
+	}
+
+	index->flvtag[index->nflvtags++] = *flvtag;
+
+	return YAMDI_OK;
+}
+
+int probeFLV(FLV_t *flv, FILE *fp) {
+	int rv;
+	off_t offset, filesize, headend;
+	size_t i, nhead, ntail;
+	uint64_t samplesize;
+	double factor;
+	unsigned char buffer[FLV_SIZE_PREVIOUSTAGSIZE];
+	FLVTag_t flvtag, *tail;
+
+#ifdef DEBUG
+	fprintf(stderr, "[FLV] probing file ...\n");
+#endif
+
+	seekBytes(fp, 0, SEEK_END);
+	filesize = ftello(fp);
+
+	flv->index.flvtag = (FLVTag_t *)calloc(2 * YAMDI_PROBE_NTAGS, sizeof(FLVTag_t));
+	if(flv->index.flvtag == NULL)
+		return YAMDI_OUT_OF_MEMORY;
+
+	// The first tags contain the codec specs
+	offset = FLV_SIZE_HEADER + FLV_SIZE_PREVIOUSTAGSIZE;
+	nhead = 0;
+	while(nhead < YAMDI_PROBE_NTAGS && readFLVTag(&flvtag, offset, fp) == YAMDI_OK) {
+		flv->index.flvtag[nhead++] = flvtag;
+
+		offset += (flvtag.tagsize + FLV_SIZE_PREVIOUSTAGSIZE);
+	}
+
+	headend = offset;
+
+	// The last tags contain the timestamps. Walk backwards from the end
+	// of the file with the help of the PreviousTagSize fields.
+	tail = &flv->index.flvtag[YAMDI_PROBE_NTAGS];
+	ntail = 0;
+	if(nhead == YAMDI_PROBE_NTAGS) {
+		offset = filesize;
+		while(ntail < YAMDI_PROBE_NTAGS) {
+			if(offset - FLV_SIZE_PREVIOUSTAGSIZE <= headend)
+				break;
+
+			if(seekBytes(fp, offset - FLV_SIZE_PREVIOUSTAGSIZE, SEEK_SET) != 0)
+				break;
+
+			if(readBytes(buffer, FLV_SIZE_PREVIOUSTAGSIZE, fp) != YAMDI_OK)
+				break;
+
+			offset -= (FLV_UI32(buffer) + FLV_SIZE_PREVIOUSTAGSIZE);
+			if(offset < headend)
+				break;
+
+			if(readFLVTag(&flvtag, offset, fp) != YAMDI_OK || flvtag.tagsize != FLV_UI32(buffer))
+				break;
+
+			tail[ntail++] = flvtag;
+		}
+
+		// The end of the file is not where the last tag ends
+		if(ntail == 0) {
+			free(flv->index.flvtag);
+			flv->index.flvtag = NULL;
+
+			return YAMDI_INVALID_PREVIOUSTAGSIZE;
+		}
+	}
+
+	// Put the tail in file order behind the head
+	for(i = 0; i < ntail / 2; i++) {
+		flvtag = tail[i];
+		tail[i] = tail[ntail - 1 - i];
+		tail[ntail - 1 - i] = flvtag;
+	}
+
+	memmove(&flv->index.flvtag[nhead], tail, ntail * sizeof(FLVTag_t));
+	flv->index.nflvtags = nhead + ntail;
+
+#ifdef DEBUG
+	fprintf(stderr, "[FLV] probed %d tags at the beginning and %d tags at the end\n", (int)nhead, (int)ntail);
+#endif
+
+	// Keyframes can't be faked from a sample
+	flv->options.addaudiokeyframes = 0;
+
+	rv = analyzeFLV(flv, fp);
+	if(rv != YAMDI_OK)
+		return rv;
+
+	// The keyframe index would be incomplete. The last keyframe is known
+	// only if it is in the tail or the head contains the whole file.
+	if(flv->haskeyframes == 1) {
+		flv->keyframes.lastkeyframetimestamp = -1;
+
+		for(i = (ntail != 0) ? nhead : 0; i < flv->index.nflvtags; i++) {
+			if(flv->index.flvtag[i].keyframe == 1)
+				flv->keyframes.lastkeyframetimestamp = flv->index.flvtag[i].timestamp;
+		}
+
+		free(flv->keyframes.keyframelocations);
+		free(flv->keyframes.keyframetimestamps);
+
+		flv->keyframes.keyframelocations = NULL;
+		flv->keyframes.keyframetimestamps = NULL;
+		flv->keyframes.nkeyframes = 0;
+		flv->haskeyframes = 0;
+	}
+
+	flv->filesize = filesize;
+
+	// Nothing in between the head and the tail
+	if(ntail == 0)
+		return YAMDI_OK;
+
+	// Extrapolate the sizes from the sample to the whole file
+	samplesize = 0;
+	for(i = 0; i < flv->index.nflvtags; i++)
+		samplesize += flv->index.flvtag[i].tagsize + FLV_SIZE_PREVIOUSTAGSIZE;
+
+	factor = (double)(filesize - FLV_SIZE_HEADER - FLV_SIZE_PREVIOUSTAGSIZE) / (double)samplesize;
+
+	flv->audio.ntags = (size_t)((double)flv->audio.ntags * factor);
+	flv->audio.datasize = (uint64_t)((double)flv->audio.datasize * factor);
+	flv->audio.size = (uint64_t)((double)flv->audio.size * factor);
+
+	flv->video.ntags = (size_t)((double)flv->video.ntags * factor);
+	flv->video.datasize = (uint64_t)((double)flv->video.datasize * factor);
+	flv->video.size = (uint64_t)((double)flv->video.size * factor);
+
+	// Same as in analyzeFLV()
+	if(flv->audio.datasize != 0)
+		flv->audio.datarate = (double)flv->audio.datasize * 8.0 / 1024.0 / (double)(flv->audio.lasttimestamp - flv->firsttimestamp) * 1000.0;
+
+	if(flv->video.ntags != 0)
+		flv->video.framerate = (double)flv->video.ntags / (double)(flv->video.lasttimestamp - flv->firsttimestamp) * 1000.0;
+
+	if(flv->video.datasize != 0)
+		flv->video.datarate = (double)flv->video.datasize * 8.0 / 1024.0 / (double)(flv->lasttimestamp - flv->firsttimestamp) * 1000.0;
+
+	flv->datasize = flv->audio.size + (flv->audio.ntags * FLV_SIZE_PREVIOUSTAGSIZE) + flv->video.size + (flv->video.ntags * FLV_SIZE_PREVIOUSTAGSIZE);
+
+	return YAMDI_OK;
+}
+
+void storeFLVFromStdin(FILE *fp) {
+	char buf[4096];
+	size_t bytes;
+
+	while((bytes = fread(buf, 1, sizeof(buf), stdin)) > 0)
+		fwrite(buf, 1, bytes, fp);
+
+	return;
+}
+
+int freeFLV(FLV_t *flv) {
+	// The index and the input in memory of a workspace are kept for the next file
+	if(flv->index.flvtag != NULL && (flv->workspace == NULL || flv->index.flvtag != flv->workspace->flvtag))
+		free(flv->index.flvtag);
+
+	if(flv->keyframes.keyframelocations != NULL)
+		free(flv->keyframes.keyframelocations);
+
+	if(flv->keyframes.keyframetimestamps != NULL)
+		free(flv->keyframes.keyframetimestamps);
+
+	bufferFree(&flv->onmetadata);
+	bufferFree(&flv->onlastsecond);
+	bufferFree(&flv->onlastkeyframe);
+	bufferFree(&flv->onfiller);
+	bufferFree(&flv->rbsp);
+
+	if(flv->memory.data != NULL && (flv->workspace == NULL || flv->memory.data != flv->workspace->memory))
+		free(flv->memory.data);
+
+	memset(flv, 0, sizeof(FLV_t));
+
+	return YAMDI_OK;
+}
+
+int analyzeFLV(FLV_t *flv, FILE *fp) {
+	int rv;
+	size_t i, index;
+	unsigned char flags, bytes[2];
+	FLVTag_t *flvtag;
+
+#ifdef DEBUG
+	fprintf(stderr, "[FLV] analyzing FLV ...\n");
+#endif
+
+	if(flv->index.nflvtags != 0) {
+		flvtag = &flv->index.flvtag[flv->index.nflvtags - 1];
+		progressBegin("analyze", flv->index.nflvtags, (uint64_t)(flvtag->offset + flvtag->tagsize + FLV_SIZE_PREVIOUSTAGSIZE));
+	}
+	else
+		progressBegin("analyze", 0, 0);
+
+	for(i = 0; i < flv->index.nflvtags; i++) {
+		flvtag = &flv->index.flvtag[i];
+		progressUpdate(i, (uint64_t)flvtag->offset);
+
+		if((i % YAMDI_BUDGET_NTAGS) == 0 && checkFLVBudget(flv, NULL) != YAMDI_OK)
+			return YAMDI_LIMIT_EXCEEDED;
+
+		flv->lasttimestamp = flvtag->timestamp;
+
+		if(flvtag->tagtype == FLV_TAG_AUDIO) {
+			flv->hasaudio = 1;
+
+			flv->audio.ntags++;
+			flv->audio.datasize += flvtag->datasize;
+			flv->audio.size += flvtag->tagsize;
+
+			flv->audio.lasttimestamp = flvtag->timestamp;
+			flv->audio.lastframeindex = i;
+
+			// Without a file the tags and the audio specs are already known, e.g. for the segments of splitFLV()
+			if(fp == NULL)
+				continue;
+
+			// The second byte is the AACPacketType
+			readFLVTagData(bytes, (flvtag->datasize >= 2) ? 2 : 1, flvtag, fp);
+			flags = bytes[0];
+
+			flvtag->config = (((flags >> 4) & 0xf) == 10 && flvtag->datasize >= 2 && bytes[1] == 0);
+
+			if(flv->audio.analyzed == 0) {
+				// SoundFormat
+				flv->audio.codecid = (flags >> 4) & 0xf;
+
+				// SoundRate
+				flv->audio.samplerate = (flags >> 2) & 0x3;
+
+				// SoundSize
+				flv->audio.samplesize = (flags >> 1) & 0x1;
+
+				// SoundType
+				flv->audio.stereo = flags & 0x1;
+
+				if(flv->audio.codecid == 4 || flv->audio.codecid == 5 || flv->audio.codecid == 6) {
+					// Nellymoser
+					flv->audio.stereo = 0;
+				}
+				else if(flv->audio.codecid == 10) {
+					// AAC
+					flv->audio.samplerate = 3;
+					flv->audio.stereo = 1;
+				}
+
+				flv->audio.analyzed = 1;
+			}
+		}
+		else if(flvtag->tagtype == FLV_TAG_VIDEO) {
+			flv->hasvideo = 1;
+
+			flv->video.ntags++;
+			flv->video.datasize += flvtag->datasize;
+			flv->video.size += flvtag->tagsize;
+
+			flv->video.lasttimestamp = flvtag->timestamp;
+			flv->video.lastframeindex = i;
+
+			// Without a file the keyframes and the video specs are already known
+			if(fp != NULL) {
+				// The second byte is the AVCPacketType
+				readFLVTagData(bytes, (flvtag->datasize >= 2) ? 2 : 1, flvtag, fp);
+				flags = bytes[0];
+
+				flvtag->config = ((flags & 0xf) == FLV_PACKET_H264VIDEO && flvtag->datasize >= 2 && bytes[1] == 0);
+
+				// Keyframes
+				flvtag->keyframe = (flags >> 4) & 0xf;
+
+				// Only trust the IDR slices and not the FrameType if the corresponding option has been set
+				if(flv->options.idrkeyframes == 1 && (flags & 0xf) == FLV_PACKET_H264VIDEO)
+					flvtag->keyframe = analyzeFLVH264Keyframe(flv, flvtag, flvtag->keyframe, fp);
+			}
+
+			if(flvtag->keyframe == 1) {
+				flv->canseektoend = 1;
+				flv->keyframes.nkeyframes++;
+				flv->keyframes.lastkeyframeindex = i;
+			}
+			else
+				flv->canseektoend = 0;
+
+			if(fp != NULL && flvtag->keyframe == 1 && flv->video.analyzed == 0) {
+				// Video Codec
+				flv->video.codecid = flags & 0xf;
+
+				switch(flv->video.codecid) {
+					case FLV_PACKET_H263VIDEO:
+						rv = analyzeFLVH263VideoPacket(flv, flvtag, fp);
+						break;
+					case FLV_PACKET_SCREENVIDEO:
+						rv = analyzeFLVScreenVideoPacket(flv, flvtag, fp);
+						break;
+					case FLV_PACKET_VP6VIDEO:
+						rv = analyzeFLVVP6VideoPacket(flv, flvtag, fp);
+						break;
+					case FLV_PACKET_VP6ALPHAVIDEO:
+						rv = analyzeFLVVP6AlphaVideoPacket(flv, flvtag, fp);
+						break;
+					case FLV_PACKET_SCREENV2VIDEO:
+						rv = analyzeFLVScreenVideoPacket(flv, flvtag, fp);
+						break;
+					case FLV_PACKET_H264VIDEO:
+						rv = analyzeFLVH264VideoPacket(flv, flvtag, fp);
+						break;
+					default:
+						rv = YAMDI_ERROR;
+						break;
+				}
+
+				if(rv == YAMDI_OK)
+					flv->video.analyzed = 1;
+			}
+		}
+
+#ifdef DEBUG
+		if((i % 100) == 0)
+			fprintf(stderr, "[FLV] analyzing FLV (tag %d of %d)\r", i, flv->index.nflvtags);
+#endif
+	}
+
+	progressEnd(i, progress.totalbytes);
+
+#ifdef DEBUG
+	fprintf(stderr, "[FLV] analyzing FLV (tag %d of %d)\n", i, flv->index.nflvtags);
+
+	fprintf(stderr, "[FLV] lasttimestamp = %d ms\n", flv->lasttimestamp);
+#endif
+
+	// Calculate the last second
+	if(flv->lasttimestamp - flv->firsttimestamp >= 1000) {
+		flv->lastsecond = flv->lasttimestamp - 1000;
+		i = flv->index.nflvtags;
+		while(i != 0) {
+			flvtag = &flv->index.flvtag[i - 1];
+
+			if(flvtag->timestamp <= flv->lastsecond) {
+				flv->lastsecond += 1;
+				flv->lastsecondindex = (i - 1);
+
+				break;
+			}
+
+			i--;
+		}
+	}
+	else
+		flv->options.addonlastsecond = 0;
+
+#ifdef DEBUG
+	fprintf(stderr, "[FLV] lastsecond = %d ms\n", flv->lastsecond);
+	fprintf(stderr, "[FLV] lastsecondindex = %d\n", flv->lastsecondindex);
+#endif
+
+	// Calculate audio datarate
+	if(flv->audio.datasize != 0)
+		flv->audio.datarate = (double)flv->audio.datasize * 8.0 / 1024.0 / (double)(flv->audio.lasttimestamp - flv->firsttimestamp) * 1000.0;
+
+#ifdef DEBUG
+	fprintf(stderr, "[FLV] audio.codecid = %d\n", flv->audio.codecid);
+	fprintf(stderr, "[FLV] audio.lasttimestamp = %d ms\n", flv->audio.lasttimestamp);
+	fprintf(stderr, "[FLV] audio.lastframeindex = %d\n", flv->audio.lastframeindex);
+	fprintf(stderr, "[FLV] audio.ntags = %d\n", flv->audio.ntags);
+	fprintf(stderr, "[FLV] audio.datasize = %" PRIu64 " kb\n", flv->audio.datasize);
+	fprintf(stderr, "[FLV] audio.datarate = %f kbit/s\n", flv->audio.datarate);
+#endif
+
+	// Calculate video framerate
+	if(flv->video.ntags != 0)
+		flv->video.framerate = (double)flv->video.ntags / (double)(flv->video.lasttimestamp - flv->firsttimestamp) * 1000.0;
+
+	// Calculate video datarate
+	if(flv->video.datasize != 0)
+		flv->video.datarate = (double)flv->video.datasize * 8.0 / 1024.0 / (double)(flv->lasttimestamp - flv->firsttimestamp) * 1000.0;
+
+#ifdef DEBUG
+	fprintf(stderr, "[FLV] video.codecid = %d\n", flv->video.codecid);
+	fprintf(stderr, "[FLV] video.lasttimestamp = %d ms\n", flv->video.lasttimestamp);
+	fprintf(stderr, "[FLV] video.lastframeindex = %d\n", flv->video.lastframeindex);
+	fprintf(stderr, "[FLV] video.ntags = %d\n", flv->video.ntags);
+	fprintf(stderr, "[FLV] video.framerate = %f fps\n", flv->video.framerate);
+	fprintf(stderr, "[FLV] video.datasize = %" PRIu64 " kb\n", flv->video.datasize);
+	fprintf(stderr, "[FLV] video.datarate = %f kbit/s\n", flv->video.datarate);
+	fprintf(stderr, "[FLV] video.width = %d\n", flv->video.width);
+	fprintf(stderr, "[FLV] video.height = %d\n", flv->video.height);
+#endif
+
+	// Calculate datasize
+	flv->datasize = flv->audio.size + (flv->audio.ntags * FLV_SIZE_PREVIOUSTAGSIZE) + flv->video.size + (flv->video.ntags * FLV_SIZE_PREVIOUSTAGSIZE);
+
+#ifdef DEBUG
+	fprintf(stderr, "[FLV] datasize = %" PRIu64 " kb\n", flv->datasize);
+#endif
+
+	// Fake keyframes if we have only audio and the corresponding option has been set
+	if(flv->options.addaudiokeyframes == 1 && flv->hasaudio == 1 && flv->hasvideo == 0) {
+		// Add a keyframe at least every x milliseconds
+		flv->audio.keyframerate = (int)((double)flv->audio.keyframedistance / (double)(flv->audio.lasttimestamp - flv->firsttimestamp) * (double)flv->audio.ntags);
+
+		// If every frame is longer than the intervalthen add every frame a keyframe
+		if(flv->audio.keyframerate == 0)
+			flv->audio.keyframerate = 1;
+		else if(flv->audio.keyframerate >= flv->audio.ntags)
+			flv->audio.keyframerate = flv->audio.ntags;
+
+#ifdef DEBUG
+		fprintf(stderr, "[FLV] audio.keyframerate = %d\n", flv->audio.keyframerate);
+#endif
+
+		// Mark all audio tags that should be considered as a keyframe
+		index = 0;
+		for(i = 0; i < flv->index.nflvtags; i++) {
+			flvtag = &flv->index.flvtag[i];
+
+			if(flvtag->tagtype == FLV_TAG_AUDIO) {
+				if((index % flv->audio.keyframerate) == 0) {
+					flvtag->keyframe = 1;
+					flv->keyframes.nkeyframes++;
+				}
+
+				index++;
+			}
+		}
+
+		// Add an extra keyframe for the last frame
+		if(flv->index.flvtag[flv->audio.lastframeindex].keyframe == 0) {
+			flv->index.flvtag[flv->audio.lastframeindex].keyframe = 1;
+			flv->keyframes.nkeyframes++;
+		}
+
+		flv->canseektoend = 1;
+		flv->keyframes.lastkeyframeindex = flv->audio.lastframeindex;
+	}
+	else
+		flv->options.addaudiokeyframes = 0;
+
+#ifdef DEBUG
+	fprintf(stderr, "[FLV] keyframes.nkeyframes = %d\n", flv->keyframes.nkeyframes);
+	fprintf(stderr, "[FLV] keyframes.lastkeyframeindex = %d\n", flv->keyframes.lastkeyframeindex);
+#endif
+
+	// Allocate some memory for the keyframe index
+	if(flv->keyframes.nkeyframes != 0) {
+		flv->haskeyframes = 1;
+
+		flv->keyframes.keyframelocations = (off_t *)calloc(flv->keyframes.nkeyframes, sizeof(off_t));
+		if(flv->keyframes.keyframelocations == NULL)
+			return YAMDI_OUT_OF_MEMORY;
+
+		flv->keyframes.keyframetimestamps = (int *)calloc(flv->keyframes.nkeyframes, sizeof(int));
+		if(flv->keyframes.keyframetimestamps == NULL)
+			return YAMDI_OUT_OF_MEMORY;
+	}
+
+	return YAMDI_OK;
+}
+
+int clipFLV(FLV_t *flv) {
+	size_t i, s, e, lo, hi, mid, nkeyframes = 0, nflvtags = 0;
+	size_t *keyframes = NULL, memorysize;
+	int keyframedistance, base = 0;
+	unsigned char *memory;
+	FLVTag_t *flvtag, *audioconfig = NULL, *videoconfig = NULL;
+	FLVIndex_t index;
+	FLVOptions_t options;
+	FLVWorkspace_t *workspace;
+	FLVBudget_t budget;
+	buffer_t rbsp;
+
+	// The tags of all keyframes. Their timestamps are ascending like the ones of all tags.
+	if(flv->keyframes.nkeyframes != 0) {
+		keyframes = (size_t *)calloc(flv->keyframes.nkeyframes, sizeof(size_t));
+		if(keyframes == NULL)
+			return YAMDI_OUT_OF_MEMORY;
+
+		for(i = 0; i < flv->index.nflvtags && nkeyframes < flv->keyframes.nkeyframes; i++) {
+			flvtag = &flv->index.flvtag[i];
+
+			if((flvtag->tagtype == FLV_TAG_AUDIO || flvtag->tagtype == FLV_TAG_VIDEO) && flvtag->keyframe == 1)
+				keyframes[nkeyframes++] = i;
+		}
+	}
+
+	// Start at the last keyframe before the start time, without keyframes at the first tag after it
+	s = 0;
+	if(flv->options.start != 0) {
+		if(nkeyframes != 0) {
+			lo = 0;
+			hi = nkeyframes;
+			while(lo < hi) {
+				mid = lo + (hi - lo) / 2;
+
+				if(flv->index.flvtag[keyframes[mid]].timestamp <= flv->options.start)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+
+			s = keyframes[(lo != 0) ? lo - 1 : 0];
+		}
+		else
+			s = searchFLVIndex(&flv->index, 0, flv->options.start);
+	}
+
+	free(keyframes);
+
+	// Stop before the first tag at or after the end time
+	e = flv->index.nflvtags;
+	if(flv->options.end != 0)
+		e = searchFLVIndex(&flv->index, s, flv->options.end);
+
+	if(e < s)
+		e = s;
+
+	// The part begins with its first audio or video tag
+	for(i = s; i < e; i++) {
+		flvtag = &flv->index.flvtag[i];
+
+		if((flvtag->tagtype == FLV_TAG_AUDIO || flvtag->tagtype == FLV_TAG_VIDEO) && flvtag->config == 0) {
+			base = flvtag->timestamp;
+			break;
+		}
+	}
+
+	// The decoders need the last sequence headers before the start
+	for(i = s; i != 0 && (audioconfig == NULL || videoconfig == NULL); i--) {
+		flvtag = &flv->index.flvtag[i - 1];
+
+		if(flvtag->config == 0)
+			continue;
+
+		if(flvtag->tagtype == FLV_TAG_AUDIO && audioconfig == NULL)
+			audioconfig = flvtag;
+		else if(flvtag->tagtype == FLV_TAG_VIDEO && videoconfig == NULL)
+			videoconfig = flvtag;
+	}
+
+#ifdef DEBUG
+	fprintf(stderr, "[FLV] extracting tags %d to %d of %d\n", (int)s, (int)e, (int)flv->index.nflvtags);
+#endif
+
+	memset(&index, 0, sizeof(FLVIndex_t));
+
+	index.size = (e - s) + 2;
+	index.flvtag = (FLVTag_t *)calloc(index.size, sizeof(FLVTag_t));
+	if(index.flvtag == NULL)
+		return YAMDI_OUT_OF_MEMORY;
+
+	// Keep the sequence headers in the order of the input file
+	if(audioconfig != NULL && videoconfig != NULL && audioconfig->offset > videoconfig->offset) {
+		flvtag = audioconfig;
+		audioconfig = videoconfig;
+		videoconfig = flvtag;
+	}
+
+	if(audioconfig != NULL)
+		index.flvtag[nflvtags++] = *audioconfig;
+
+	if(videoconfig != NULL)
+		index.flvtag[nflvtags++] = *videoconfig;
+
+	// The sequence headers get the time of the start, such that the part doesn't seem to begin earlier
+	for(i = 0; i < nflvtags; i++) {
+		if(index.flvtag[i].timestamp != base) {
+			index.flvtag[i].timestamp = base;
+			index.flvtag[i].canonical = 0;
+		}
+	}
+
+	for(i = s; i < e; i++)
+		index.flvtag[nflvtags++] = flv->index.flvtag[i];
+
+	index.nflvtags = nflvtags;
+
+	// analyzeFLV() marks the audio keyframes again
+	for(i = 0; i < index.nflvtags; i++) {
+		if(index.flvtag[i].tagtype == FLV_TAG_AUDIO)
+			index.flvtag[i].keyframe = 0;
+	}
+
+	// Forget everything about the whole file
+	options = flv->options;
+	keyframedistance = flv->audio.keyframedistance;
+	rbsp = flv->rbsp;
+
+	// The input in memory is still needed to analyze the tags again
+	memory = flv->memory.data;
+	memorysize = flv->memory.size;
+	workspace = flv->workspace;
+	budget = flv->budget;
+
+	bufferInit(&flv->rbsp);
+	flv->memory.data = NULL;
+	freeFLV(flv);
+
+	flv->index = index;
+	flv->options = options;
+	flv->audio.keyframedistance = keyframedistance;
+	flv->rbsp = rbsp;
+	flv->memory.data = memory;
+	flv->memory.size = memorysize;
+	flv->workspace = workspace;
+	flv->budget = budget;
+	flv->firsttimestamp = base;
+
+	return YAMDI_OK;
+}
+
+size_t searchFLVIndex(FLVIndex_t *index, size_t first, int timestamp) {
+	size_t lo, hi, mid;
+
+	// Index of the first tag at or after first with a timestamp at or after timestamp
+	lo = first;
+	hi = index->nflvtags;
+	while(lo < hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if(index->flvtag[mid].timestamp < timestamp)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+int finalizeFLV(FLV_t *flv, FILE *fp) {
+	size_t i, index, size;
+	FLVTag_t *flvtag;
+
+	// 2 passes
+	// 1. create onmetadata event to get the size of it (it doesn't matter if the values are not yet correct)
+	// 2. calculate the new keyframelocations and the final filesize
+	//    pay attention to the size of these events
+	//        onmetadata
+	//        onlastsecond
+	//        onlastkeyframe
+	//        (oncuepoint) keep them from the input flv?
+	// 3. recreate the onmetadata event with the correct values
+	// filesize
+	// keyframelocations
+	// lastkeyframelocation
+
+	// Create the metadata tags. Even though we don't have all values,
+	// the size will not change. We need the size.
+	createFLVEvents(flv);
+
+	// Start calculating the final filesize
+	flv->filesize = 0;
+
+	// FLV header + PreviousTagSize
+	flv->filesize += FLV_SIZE_HEADER + FLV_SIZE_PREVIOUSTAGSIZE;
+
+	// onMetaData event
+	if(flv->options.addonmetadata == 1)
+		flv->filesize += flv->onmetadata.used;
+
+	// onFiller event. The first block boundary of the input has to be at a block boundary of the output.
+	if(flv->reflink.blocksize != 0) {
+		size = (flv->reflink.blocksize - (size_t)((flv->filesize + (uint64_t)(flv->reflink.offset - flv->reflink.first)) % flv->reflink.blocksize)) % flv->reflink.blocksize;
+		if(size != 0 && size < YAMDI_REFLINK_MINFILLER)
+			size += flv->reflink.blocksize;
+
+		createFLVEventOnFiller(flv, size);
+
+		flv->filesize += flv->onfiller.used;
+	}
+	else
+		bufferReset(&flv->onfiller);
+
+	// Calculate the final filesize and update the keyframe index
+	index = 0;
+	for(i = 0; i < flv->index.nflvtags; i++) {
+		flvtag = &flv->index.flvtag[i];
+
+		// Skip every script tag (subject to change if we want to keep existing events)
+		if(flvtag->tagtype != FLV_TAG_AUDIO && flvtag->tagtype != FLV_TAG_VIDEO)
+			continue;
+
+		// Take care of the onlastsecond event
+		if(flv->options.addonlastsecond == 1 && flv->lastsecondindex == i)
+			flv->filesize += flv->onlastsecond.used;
+
+		// Update the keyframe index only if there are keyframes ...
+		if(flv->haskeyframes == 1) {
+			if(flvtag->tagtype == FLV_TAG_VIDEO || flvtag->tagtype == FLV_TAG_AUDIO) {
+				// Keyframes
+				if(flvtag->keyframe == 1) {
+					// Take care of the onlastkeyframe event
+					if(flv->options.addonlastkeyframe == 1 && flv->keyframes.lastkeyframeindex == i)
+						flv->filesize += flv->onlastkeyframe.used;
+
+					flv->keyframes.keyframelocations[index] = flv->filesize;
+					flv->keyframes.keyframetimestamps[index] = flvtag->timestamp;
+
+					index++;
+				}
+			}
+		}
+
+		flv->filesize += flvtag->tagsize + FLV_SIZE_PREVIOUSTAGSIZE;
+	}
+
+	if(flv->haskeyframes == 1) {
+		flv->keyframes.lastkeyframetimestamp = flv->keyframes.keyframetimestamps[flv->keyframes.nkeyframes - 1];
+		flv->keyframes.lastkeyframelocation = flv->keyframes.keyframelocations[flv->keyframes.nkeyframes - 1];
+	}
+
+#ifdef DEBUG
+	fprintf(stderr, "[FLV] keyframes.lastkeyframetimestamp = %d ms\n", flv->keyframes.lastkeyframetimestamp);
+	fprintf(stderr, "[FLV] keyframes.lastkeyframelocation = %" PRIi64 "\n", flv->keyframes.lastkeyframelocation);
+
+	fprintf(stderr, "[FLV] filesize = %" PRIu64 " kb\n", flv->filesize);
+#endif
+
+	// Create the metadata tags with the correct values
+	createFLVEvents(flv);
+
+	return YAMDI_OK;
+}
+
+int writeFLV(FILE *out, FLV_t *flv, FILE *fp) {
+	size_t i, datasize = 0;
+	int events, rv = YAMDI_OK;
+	off_t filesize = 0;
+	unsigned char *data = NULL, *d;
+	FLVTag_t *flvtag, *first = NULL, *last = NULL;
+	tracespan_t span;
+	struct stat st;
+
+	if(fp == NULL)
+		return YAMDI_ERROR;
+
+	// Only complete tags are copied as they are
+	if(fstat(fileno(fp), &st) == 0)
+		filesize = st.st_size;
+
+	// Write the header
+	writeFLVHeader(out, flv->hasaudio, flv->hasvideo);
+	writeFLVPreviousTagSize(out, 0);
+
+	// Write the onMetaData tag
+	if(flv->options.addonmetadata == 1 && writeBytes(flv->onmetadata.data, flv->onmetadata.used, out) != YAMDI_OK)
+		return YAMDI_ERROR;
+
+	// Copy the audio and video tags
+	if(flv->index.nflvtags != 0) {
+		flvtag = &flv->index.flvtag[flv->index.nflvtags - 1];
+		progressBegin("write", flv->index.nflvtags, (uint64_t)(flvtag->offset + flvtag->tagsize + FLV_SIZE_PREVIOUSTAGSIZE));
+	}
+	else
+		progressBegin("write", 0, 0);
+
+	traceSpanBegin(&span);
+	for(i = 0; i < flv->index.nflvtags && rv == YAMDI_OK; i++) {
+		flvtag = &flv->index.flvtag[i];
+		progressUpdate(i, (uint64_t)flvtag->offset);
+
+		if((i % YAMDI_BUDGET_NTAGS) == 0 && checkFLVBudget(flv, NULL) != YAMDI_OK) {
+			rv = YAMDI_LIMIT_EXCEEDED;
+			break;
+		}
+
+		// Skip every script tag (subject to change if we want to keep existing events)
+		if(flvtag->tagtype != FLV_TAG_AUDIO && flvtag->tagtype != FLV_TAG_VIDEO)
+			continue;
+
+		events = (flv->options.addonlastsecond == 1 && flv->lastsecondindex == i) || (flv->options.addonlastkeyframe == 1 && flv->keyframes.lastkeyframeindex == i);
+
+		// Copy the run of unchanged tags if this tag doesn't continue it
+		if(first != NULL && (events == 1 || flvtag->canonical == 0 || flvtag->offset + (off_t)flvtag->tagsize > filesize || flvtag->offset != last->offset + (off_t)last->tagsize + FLV_SIZE_PREVIOUSTAGSIZE)) {
+			rv = writeFLVRun(out, flv, first, last, fp);
+			if(rv != YAMDI_OK)
+				break;
+
+			first = NULL;
+		}
+
+		// Write the onlastsecond event
+		if(flv->options.addonlastsecond == 1 && flv->lastsecondindex == i && writeBytes(flv->onlastsecond.data, flv->onlastsecond.used, out) != YAMDI_OK) {
+			rv = YAMDI_ERROR;
+			break;
+		}
+
+		// Write the onlastkeyframe event
+		if(flv->options.addonlastkeyframe == 1 && flv->keyframes.lastkeyframeindex == i && writeBytes(flv->onlastkeyframe.data, flv->onlastkeyframe.used, out) != YAMDI_OK) {
+			rv = YAMDI_ERROR;
+			break;
+		}
+
+		if(flvtag->canonical == 1 && flvtag->offset + (off_t)flvtag->tagsize <= filesize) {
+			if(first == NULL)
+				first = flvtag;
+
+			last = flvtag;
+
+			traceSpanStep(&span, "copy tags", YAMDI_TRACE_MAINTID, flvtag->tagsize + FLV_SIZE_PREVIOUSTAGSIZE);
+			continue;
+		}
+
+		writeFLVDataTag(out, flvtag->tagtype, flvtag->timestamp, flvtag->datasize);
+
+		// The manifest refers to the data in the input. A truncated input is not an error.
+		if(flv->manifest != NULL) {
+			if(flvtag->offset + (off_t)flvtag->tagsize > filesize)
+				break;
+
+			rv = copyFLVRange(out, flv, fp, flvtag->offset + FLV_SIZE_TAGHEADER, (off_t)flvtag->datasize);
+			if(rv != YAMDI_OK)
+				break;
+
+			writeFLVPreviousTagSize(out, flvtag->tagsize);
+
+			traceSpanStep(&span, "copy tags", YAMDI_TRACE_MAINTID, flvtag->tagsize + FLV_SIZE_PREVIOUSTAGSIZE);
+			continue;
+		}
+
+		// Read the data
+		if(flvtag->datasize > datasize) {
+			d = (unsigned char *)realloc(data, flvtag->datasize);
+			if(d == NULL) {
+				rv = YAMDI_OUT_OF_MEMORY;
+				break;
+			}
+
+			data = d;
+			datasize = flvtag->datasize;
+		}
+
+		// Keep the header of the first incomplete tag, like the other writers
+		if(readFLVTagData(data, flvtag->datasize, flvtag, fp) != YAMDI_OK) {
+			if(ferror(fp))
+				rv = YAMDI_READ_ERROR;
+
+			break;
+		}
+
+		if(writeBytes(data, flvtag->datasize, out) != YAMDI_OK) {
+			rv = YAMDI_ERROR;
+			break;
+		}
+
+		writeFLVPreviousTagSize(out, flvtag->tagsize);
+
+		traceSpanStep(&span, "copy tags", YAMDI_TRACE_MAINTID, flvtag->tagsize + FLV_SIZE_PREVIOUSTAGSIZE);
+	}
+
+	if(rv == YAMDI_OK && first != NULL)
+		rv = writeFLVRun(out, flv, first, last, fp);
+
+	traceSpanEnd(&span, "copy tags", YAMDI_TRACE_MAINTID);
+
+	if(rv == YAMDI_OK)
+		progressEnd(i, progress.totalbytes);
+
+	if(data != NULL)
+		free(data);
+
+	// The header and the PreviousTagSize fields may have failed in the buffer
+	if(rv == YAMDI_OK && (fflush(out) != 0 || ferror(out)))
+		rv = YAMDI_ERROR;
+
+	// We are done!
+
+	return rv;
+}
+
+int writeFLVRun(FILE *out, FLV_t *flv, FLVTag_t *first, FLVTag_t *last, FILE *fp) {
+	int rv;
+
+	// The tags from first to last are consecutive in the input and yamdi would
+	// write them exactly like this. Only the last PreviousTagSize is written anew.
+	rv = copyFLVRange(out, flv, fp, first->offset, last->offset + (off_t)last->tagsize - first->offset);
+	if(rv != YAMDI_OK)
+		return rv;
+
+	writeFLVPreviousTagSize(out, last->tagsize);
+
+	return YAMDI_OK;
+}
+
+int copyFLVRange(FILE *out, FLV_t *flv, FILE *fp, off_t offset, off_t size) {
+	if(flv->manifest == NULL)
+		return copyBytes(out, fp, offset, size);
+
+	// Everything that has been written so far comes from the blob file
+	if(syncFLVManifest(out, flv->manifest) != YAMDI_OK)
+		return YAMDI_ERROR;
+
+	return appendFLVManifest(flv->manifest, 1, offset, size);
+}
+
+int appendFLVManifest(FLVManifest_t *manifest, short input, off_t offset, off_t size) {
+	size_t n;
+	FLVRange_t *range;
+
+	if(size == 0)
+		return YAMDI_OK;
+
+	// Continue the last range if possible
+	if(manifest->nranges != 0) {
+		range = &manifest->ranges[manifest->nranges - 1];
+
+		if(range->input == input && range->offset + range->size == offset) {
+			range->size += size;
+			return YAMDI_OK;
+		}
+	}
+
+	if(manifest->nranges == manifest->size) {
+		n = (manifest->size == 0) ? 64 : 2 * manifest->size;
+
+		range = (FLVRange_t *)realloc(manifest->ranges, n * sizeof(FLVRange_t));
+		if(range == NULL)
+			return YAMDI_OUT_OF_MEMORY;
+
+		manifest->ranges = range;
+		manifest->size = n;
+	}
+
+	range = &manifest->ranges[manifest->nranges++];
+
+	range->input = input;
+	range->offset = offset;
+	range->size = size;
+
+	return YAMDI_OK;
+}
+
+int syncFLVManifest(FILE *out, FLVManifest_t *manifest) {
+	off_t position;
+
+	position = ftello(out);
+	if(position < 0)
+		return YAMDI_ERROR;
+
+	if(position > manifest->blob) {
+		if(appendFLVManifest(manifest, 0, manifest->blob, position - manifest->blob) != YAMDI_OK)
+			return YAMDI_OUT_OF_MEMORY;
+
+		manifest->blob = position;
+	}
+
+	return YAMDI_OK;
+}
+
+int splitFLV(FLV_t *flv, FLVJob_t *job, FILE *fp) {
+	size_t i, k, e, s, nsegments = 0, nflvtags;
+	size_t *starts;
+	int base = 0, timestamp, rv, cut;
+	short started = 0;
+	uint64_t size = 0, totalbytes = 0;
+	off_t filesize = 0;
+	struct stat st;
+	FLVTag_t *flvtag, *audioconfig = NULL, *videoconfig = NULL, *config[2];
+	FLVIndex_t *index;
+	FLVSegment_t *segments, *segment;
+#ifndef __MINGW32__
+	int n, nthreads;
+	pthread_t *threads;
+	FLVSplitter_t splitter;
+	FLVSplitWriter_t *writers;
+#else
+	FILE *out;
+#endif
+
+	// Tags that are cut off at the end of the file are left out
+	if(fstat(fileno(fp), &st) == 0)
+		filesize = st.st_size;
+
+	starts = (size_t *)calloc(flv->index.nflvtags + 1, sizeof(size_t));
+	if(starts == NULL)
+		return YAMDI_OUT_OF_MEMORY;
+
+	// A segment begins at a video keyframe, or at any audio tag if there's no video,
+	// as soon as the current segment is long or large enough. The sequence headers
+	// at the beginning don't count.
+	starts[nsegments++] = 0;
+	for(i = 0; i < flv->index.nflvtags; i++) {
+		flvtag = &flv->index.flvtag[i];
+
+		if(flvtag->tagtype != FLV_TAG_AUDIO && flvtag->tagtype != FLV_TAG_VIDEO)
+			continue;
+
+		if(flv->hasvideo == 1)
+			cut = (flvtag->tagtype == FLV_TAG_VIDEO && flvtag->keyframe == 1 && flvtag->config == 0);
+		else
+			cut = (flvtag->config == 0);
+
+		if(cut == 1 && started == 1) {
+			if(flv->options.splitduration != 0 && flvtag->timestamp - base >= flv->options.splitduration)
+				cut = 2;
+
+			if(flv->options.splitsize != 0 && size >= flv->options.splitsize)
+				cut = 2;
+
+			if(cut == 2) {
+				starts[nsegments++] = i;
+				size = 0;
+				started = 0;
+			}
+		}
+
+		if(flvtag->config == 0 && started == 0) {
+			base = flvtag->timestamp;
+			started = 1;
+		}
+
+		size += flvtag->tagsize + FLV_SIZE_PREVIOUSTAGSIZE;
+	}
+
+#ifdef DEBUG
+	fprintf(stderr, "[FLV] splitting into %d segments\n", (int)nsegments);
+#endif
+
+	segments = (FLVSegment_t *)calloc(nsegments, sizeof(FLVSegment_t));
+	if(segments == NULL) {
+		free(starts);
+		return YAMDI_OUT_OF_MEMORY;
+	}
+
+	// Every segment is analyzed on its own, only with the index of the whole file
+	rv = YAMDI_OK;
+	for(k = 0; k < nsegments && rv == YAMDI_OK; k++) {
+		segment = &segments[k];
+
+		s = starts[k];
+		e = (k + 1 < nsegments) ? starts[k + 1] : flv->index.nflvtags;
+
+		initFLV(&segment->flv);
+
+		segment->flv.options = flv->options;
+		segment->flv.audio.keyframedistance = flv->audio.keyframedistance;
+
+		checksumInit(&segment->flv.checksum, flv->options.checksums);
+
+		segment->flv.audio.analyzed = flv->audio.analyzed;
+		segment->flv.audio.codecid = flv->audio.codecid;
+		segment->flv.audio.samplerate = flv->audio.samplerate;
+		segment->flv.audio.samplesize = flv->audio.samplesize;
+		segment->flv.audio.stereo = flv->audio.stereo;
+
+		segment->flv.video.analyzed = flv->video.analyzed;
+		segment->flv.video.codecid = flv->video.codecid;
+		segment->flv.video.width = flv->video.width;
+		segment->flv.video.height = flv->video.height;
+
+		segment->outfile = segmentPath(job->outfile, k);
+
+		index = &segment->flv.index;
+		index->size = (e - s) + 2;
+		index->flvtag = (FLVTag_t *)calloc(index->size, sizeof(FLVTag_t));
+		if(index->flvtag == NULL) {
+			rv = YAMDI_OUT_OF_MEMORY;
+			break;
+		}
+
+		// The decoders need the last sequence headers before the segment, in the order of the input file
+		config[0] = audioconfig;
+		config[1] = videoconfig;
+		if(audioconfig != NULL && videoconfig != NULL && audioconfig->offset > videoconfig->offset) {
+			config[0] = videoconfig;
+			config[1] = audioconfig;
+		}
+
+		for(i = 0; i < 2; i++) {
+			if(config[i] != NULL)
+				index->flvtag[index->nflvtags++] = *config[i];
+		}
+
+		// The timestamps start at the first tag that is not a sequence header
+		base = flv->index.flvtag[s].timestamp;
+		for(i = s; i < e; i++) {
+			flvtag = &flv->index.flvtag[i];
+
+			if((flvtag->tagtype == FLV_TAG_AUDIO || flvtag->tagtype == FLV_TAG_VIDEO) && flvtag->config == 0) {
+				base = flvtag->timestamp;
+				break;
+			}
+		}
+
+		for(i = s; i < e; i++) {
+			flvtag = &flv->index.flvtag[i];
+
+			if(flvtag->tagtype != FLV_TAG_AUDIO && flvtag->tagtype != FLV_TAG_VIDEO)
+				continue;
+
+			if(flvtag->config == 1) {
+				if(flvtag->tagtype == FLV_TAG_AUDIO)
+					audioconfig = flvtag;
+				else
+					videoconfig = flvtag;
+			}
+
+			if(flvtag->offset + (off_t)flvtag->tagsize > filesize)
+				continue;
+
+			index->flvtag[index->nflvtags++] = *flvtag;
+		}
+
+		nflvtags = index->nflvtags;
+		for(i = 0; i < nflvtags; i++) {
+			flvtag = &index->flvtag[i];
+
+			timestamp = (flvtag->timestamp > base) ? flvtag->timestamp - base : 0;
+			if(timestamp != flvtag->timestamp) {
+				flvtag->timestamp = timestamp;
+				flvtag->canonical = 0;
+			}
+
+			// analyzeFLV() marks the audio keyframes again
+			if(flvtag->tagtype == FLV_TAG_AUDIO)
+				flvtag->keyframe = 0;
+		}
+
+		rv = analyzeFLV(&segment->flv, NULL);
+		if(rv == YAMDI_OK)
+			rv = finalizeFLV(&segment->flv, NULL);
+
+		totalbytes += segment->flv.filesize;
+	}
+
+	free(starts);
+
+	if(rv == YAMDI_OK) {
+		progressBegin("split", nsegments, totalbytes);
+
+#ifndef __MINGW32__
+		// The writers take the next segment until all are written
+		memset(&splitter, 0, sizeof(FLVSplitter_t));
+
+		splitter.fd = fileno(fp);
+		splitter.segments = segments;
+		splitter.nsegments = nsegments;
+
+		nthreads = flv->options.threads;
+		if(nthreads == 0)
+			nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+		if(nthreads > (int)nsegments)
+			nthreads = (int)nsegments;
+
+		if(nthreads < 1)
+			nthreads = 1;
+
+		writers = (FLVSplitWriter_t *)calloc(nthreads, sizeof(FLVSplitWriter_t));
+		threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+		if(writers == NULL || threads == NULL) {
+			free(writers);
+			free(threads);
+
+			rv = YAMDI_OUT_OF_MEMORY;
+		}
+		else {
+			pthread_mutex_init(&splitter.lock, NULL);
+
+			for(n = 0; n < nthreads; n++) {
+				writers[n].splitter = &splitter;
+				writers[n].tid = YAMDI_TRACE_MAINTID + n;
+			}
+
+			for(n = 1; n < nthreads; n++) {
+				if(pthread_create(&threads[n], NULL, writeFLVSegments, &writers[n]) != 0)
+					break;
+			}
+
+			// This thread writes too and reports the progress
+			writeFLVSegments(&writers[0]);
+
+			for(k = 1; k < (size_t)n; k++)
+				pthread_join(threads[k], NULL);
+
+			pthread_mutex_destroy(&splitter.lock);
+
+			free(writers);
+			free(threads);
+		}
+#else
+		for(k = 0; k < nsegments; k++) {
+			segment = &segments[k];
+
+			out = fopen(segment->outfile, "wb");
+			if(out == NULL) {
+				fprintf(stderr, "Couldn't open %s.\n", segment->outfile);
+				segment->rv = YAMDI_ERROR;
+				continue;
+			}
+
+			outputchecksum = &segment->flv.checksum;
+			segment->rv = writeFLV(out, &segment->flv, fp);
+			outputchecksum = NULL;
+
+			checksumFinal(&segment->flv.checksum);
+			fclose(out);
+
+			progressUpdate(k + 1, 0);
+		}
+#endif
+
+		progressEnd(nsegments, totalbytes);
+	}
+
+	for(k = 0; k < nsegments; k++) {
+		segment = &segments[k];
+
+		stats.nreads += segment->io.nreads;
+		stats.bytesread += segment->io.bytesread;
+		stats.nwrites += segment->io.nwrites;
+		stats.byteswritten += segment->io.byteswritten;
+
+		if(rv == YAMDI_OK && segment->rv != YAMDI_OK)
+			rv = segment->rv;
+	}
+
+	// Every segment is an entry of its own in the XML and JSON output
+	for(k = 0; k < nsegments && rv == YAMDI_OK; k++) {
+		segment = &segments[k];
+
+		if(job->xml != NULL)
+			writeBufferXMLMetadata(job->xml, job->infile, segment->outfile, &segment->flv);
+
+		if(job->json != NULL)
+			writeBufferJSONMetadata(job->json, job->infile, segment->outfile, &segment->flv);
+
+		if(job->checksums != NULL && segment->flv.checksum.algorithms != 0)
+			writeBufferChecksumLines(job->checksums, segment->outfile, &segment->flv.checksum);
+	}
+
+	for(k = 0; k < nsegments; k++) {
+		free(segments[k].outfile);
+		freeFLV(&segments[k].flv);
+	}
+
+	free(segments);
+
+	return rv;
+}
+
+char *segmentPath(const char *outfile, size_t n) {
+	char *path;
+	const char *basename, *extension;
+	size_t length;
+
+	// movie.flv becomes movie-000.flv, movie-001.flv, ...
+	basename = (strrchr(outfile, '/') != NULL) ? strrchr(outfile, '/') + 1 : outfile;
+
+	extension = strrchr(basename, '.');
+	if(extension == NULL || extension == basename)
+		extension = outfile + strlen(outfile);
+
+	length = (size_t)(extension - outfile);
+
+	path = (char *)malloc(length + strlen(extension) + 32);
+	if(path == NULL)
+		exit(YAMDI_OUT_OF_MEMORY);
+
+	sprintf(path, "%.*s-%03lu%s", (int)length, outfile, (unsigned long)n, extension);
+
+	return path;
+}
+
+void *writeFLVSegments(void *arg) {
+#ifndef __MINGW32__
+	size_t ndone;
+	uint64_t bytesdone;
+	double start = 0.0;
+	FLVSplitWriter_t *writer = (FLVSplitWriter_t *)arg;
+	FLVSplitter_t *splitter = writer->splitter;
+	FLVSegment_t *segment;
+
+	for(;;) {
+		pthread_mutex_lock(&splitter->lock);
+		segment = (splitter->next < splitter->nsegments) ? &splitter->segments[splitter->next++] : NULL;
+		pthread_mutex_unlock(&splitter->lock);
+
+		if(segment == NULL)
+			break;
+
+		if(trace.enabled == 1)
+			start = wallClock();
+
+		segment->rv = writeFLVSegment(segment, splitter->fd);
+
+		if(trace.enabled == 1)
+			traceEvent("segment", "split", writer->tid, start, wallClock(), segment->flv.index.nflvtags, segment->io.byteswritten);
+
+		pthread_mutex_lock(&splitter->lock);
+		ndone = ++splitter->ndone;
+		bytesdone = (splitter->bytesdone += segment->flv.filesize);
+		pthread_mutex_unlock(&splitter->lock);
+
+		// The progress is not thread safe
+		if(writer->tid == YAMDI_TRACE_MAINTID)
+			progressUpdate(ndone, bytesdone);
+	}
+#endif
+
+	return NULL;
+}
+
+int writeFLVSegment(FLVSegment_t *segment, int fd) {
+#ifndef __MINGW32__
+	int out, rv;
+
+	out = open(segment->outfile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(out == -1) {
+		fprintf(stderr, "Couldn't open %s.\n", segment->outfile);
+		return YAMDI_ERROR;
+	}
+
+	if(segment->flv.options.preallocate == 1)
+		preallocateFile(out, (off_t)segment->flv.filesize);
+
+	rv = writeFLVDescriptor(out, &segment->flv, fd, &segment->io);
+
+	checksumFinal(&segment->flv.checksum);
+
+	if(close(out) != 0 && rv == YAMDI_OK)
+		rv = YAMDI_ERROR;
+
+	return rv;
+#else
+	return YAMDI_ERROR;
+#endif
+}
+
+int writeFLVDescriptor(int out, FLV_t *flv, int fd, iostats_t *io) {
+#ifndef __MINGW32__
+	int rv = YAMDI_OK;
+	size_t i, j, n, offset;
+	ssize_t nbytes;
+	unsigned char *data;
+	off_t end = 0, dropped = 0;
+	FLVTag_t *flvtag;
+	FLVOutput_t output;
+	buffer_t b;
+
+	// The same as writeFLV(), but with pread() and write() on a buffer of its own, such that
+	// several segments can be written at the same time. The tags are read as they are and
+	// get their new timestamp, StreamID and PreviousTagSize in the buffer.
+	initFLVOutput(&output, out, flv);
+	bufferInit(&b);
+
+	writeBufferFLVHeader(&b, flv->hasaudio, flv->hasvideo);
+	writeBufferFLVPreviousTagSize(&b, 0);
+
+	if(flv->options.addonmetadata == 1)
+		bufferAppendBuffer(&b, &flv->onmetadata);
+
+	for(i = 0; i < flv->index.nflvtags && rv == YAMDI_OK; i = j) {
+		// Every pass reads up to YAMDI_WRITE_BUFFERSIZE bytes
+		if(checkFLVBudget(flv, io) != YAMDI_OK) {
+			rv = YAMDI_LIMIT_EXCEEDED;
+			break;
+		}
+
+		// Write out the buffer if it is full. With O_DIRECT only whole blocks are
+		// written and the rest stays in the buffer.
+		if(b.used >= YAMDI_WRITE_BUFFERSIZE) {
+			rv = writeFLVOutput(&output, b.data, b.used, &n);
+			if(rv != YAMDI_OK)
+				break;
+
+			memmove(b.data, b.data + n, b.used - n);
+			b.used -= n;
+		}
+
+		flvtag = &flv->index.flvtag[i];
+
+		// Skip every script tag, like writeFLV()
+		if(flvtag->tagtype != FLV_TAG_AUDIO && flvtag->tagtype != FLV_TAG_VIDEO) {
+			j = i + 1;
+			continue;
+		}
+
+		if(flv->options.addonlastsecond == 1 && flv->lastsecondindex == i)
+			bufferAppendBuffer(&b, &flv->onlastsecond);
+
+		if(flv->options.addonlastkeyframe == 1 && flv->keyframes.lastkeyframeindex == i)
+			bufferAppendBuffer(&b, &flv->onlastkeyframe);
+
+		// Read the following tags that are consecutive in the input at once
+		n = flvtag->tagsize + FLV_SIZE_PREVIOUSTAGSIZE;
+
+		for(j = i + 1; j < flv->index.nflvtags && n < YAMDI_WRITE_BUFFERSIZE; j++) {
+			if(flv->index.flvtag[j].tagtype != FLV_TAG_AUDIO && flv->index.flvtag[j].tagtype != FLV_TAG_VIDEO)
+				break;
+
+			if(flv->options.addonlastsecond == 1 && flv->lastsecondindex == j)
+				break;
+
+			if(flv->options.addonlastkeyframe == 1 && flv->keyframes.lastkeyframeindex == j)
+				break;
+
+			if(flv->index.flvtag[j].offset != flvtag->offset + (off_t)n)
+				break;
+
+			n += flv->index.flvtag[j].tagsize + FLV_SIZE_PREVIOUSTAGSIZE;
+		}
+
+		// Make room for the tags after the bytes that are already in the buffer
+		if(b.used + n > b.size) {
+			data = (unsigned char *)realloc(b.data, b.used + n);
+			if(data == NULL) {
+				rv = YAMDI_OUT_OF_MEMORY;
+				break;
+			}
+
+			b.data = data;
+			b.size = b.used + n;
+		}
+
+		// The last PreviousTagSize may be missing in the input, it is written anew anyways
+		for(offset = 0; offset < n; offset += (size_t)nbytes) {
+			nbytes = pread(fd, b.data + b.used + offset, n - offset, flvtag->offset + (off_t)offset);
+			if(nbytes <= 0)
+				break;
+
+			io->nreads++;
+			io->bytesread += (uint64_t)nbytes;
+		}
+
+		// Like writeFLV(), keep the complete tags and the header of the first incomplete one
+		if(offset + FLV_SIZE_PREVIOUSTAGSIZE < n) {
+			for(n = 0; i < j && n + flv->index.flvtag[i].tagsize <= offset; i++) {
+				rewriteFLVTag(b.data + b.used + n, &flv->index.flvtag[i]);
+				n += flv->index.flvtag[i].tagsize + FLV_SIZE_PREVIOUSTAGSIZE;
+			}
+
+			rewriteFLVTag(b.data + b.used + n, &flv->index.flvtag[i]);
+			b.used += n + FLV_SIZE_TAGHEADER;
+
+			// A truncated input ends the output, only a failed read is an error
+			if(nbytes < 0)
+				rv = YAMDI_READ_ERROR;
+
+			break;
+		}
+
+		// Drop the input behind the read cursor from the page cache. Skipped script tags
+		// don't matter, but a jump, e.g. from the sequence headers of a segment to its
+		// first tag, starts over, such that the tags of other segments are left alone.
+		if(flv->options.dropcache == 1) {
+			if(flvtag->offset < end || flvtag->offset > end + YAMDI_DROPCACHE_INTERVAL) {
+				if(end > dropped)
+					dropCache(fd, dropped, ALIGNUP(end, YAMDI_DROPCACHE_ALIGNMENT) - dropped);
+
+				dropped = ALIGNDOWN(flvtag->offset, YAMDI_DROPCACHE_ALIGNMENT);
+			}
+
+			end = flvtag->offset + (off_t)offset;
+
+			// Not beyond the cursor, the following tags may already be read ahead
+			if(end - dropped >= YAMDI_DROPCACHE_INTERVAL) {
+				dropCache(fd, dropped, ALIGNDOWN(end, YAMDI_DROPCACHE_ALIGNMENT) - dropped);
+				dropped = ALIGNDOWN(end, YAMDI_DROPCACHE_ALIGNMENT);
+			}
+		}
+
+		for(offset = 0; i < j; i++) {
+			rewriteFLVTag(b.data + b.used + offset, &flv->index.flvtag[i]);
+			offset += flv->index.flvtag[i].tagsize + FLV_SIZE_PREVIOUSTAGSIZE;
+		}
+
+		b.used += n;
+	}
+
+	// Everything up to an error is written, like writeFLV() does
+	if(rv != YAMDI_ERROR && rv != YAMDI_LIMIT_EXCEEDED && finishFLVOutput(&output, b.data, b.used) != YAMDI_OK)
+		rv = YAMDI_ERROR;
+
+	if(flv->options.dropcache == 1 && end > dropped)
+		dropCache(fd, dropped, ALIGNUP(end, YAMDI_DROPCACHE_ALIGNMENT) - dropped);
+
+	io->nwrites += output.nwrites;
+	io->byteswritten += output.byteswritten;
+
+	free(output.staging);
+	bufferFree(&b);
+
+	return rv;
+#else
+	return YAMDI_ERROR;
+#endif
+}
+
+void initFLVOutput(FLVOutput_t *output, int fd, FLV_t *flv) {
+#if defined(O_DIRECT) && !defined(__MINGW32__)
+	int flags;
+#endif
+
+	memset(output, 0, sizeof(FLVOutput_t));
+
+	output->fd = fd;
+	output->dropcache = flv->options.dropcache;
+	output->checksum = (flv->checksum.algorithms != 0) ? &flv->checksum : NULL;
+
+	output->offset = lseek(fd, 0, SEEK_CUR);
+	if(output->offset < 0)
+		output->offset = 0;
+
+	output->flushed = output->offset;
+	output->dropped = output->offset;
+
+#if defined(O_DIRECT) && !defined(__MINGW32__)
+	// O_DIRECT needs aligned buffers and file offsets. If the filesystem doesn't
+	// support it, the output is written through the page cache as usual.
+	if(flv->options.directio == 1 && (output->offset % YAMDI_DIRECTIO_ALIGNMENT) == 0) {
+		if(posix_memalign((void **)&output->staging, YAMDI_DIRECTIO_ALIGNMENT, YAMDI_WRITE_BUFFERSIZE) != 0)
+			output->staging = NULL;
+
+		flags = fcntl(fd, F_GETFL);
+		if(output->staging != NULL && flags != -1 && fcntl(fd, F_SETFL, flags | O_DIRECT) == 0)
+			output->direct = 1;
+	}
+
+#ifdef DEBUG
+	fprintf(stderr, "[FLV] O_DIRECT = %d\n", output->direct);
+#endif
+#endif
+
+	return;
+}
+
+int writeFLVOutput(FLVOutput_t *output, const unsigned char *bytes, size_t size, size_t *written) {
+	size_t n, offset;
+	ssize_t nbytes;
+	const unsigned char *data;
+
+	*written = 0;
+
+	// O_DIRECT only takes whole blocks
+	if(output->direct == 1)
+		size -= size % YAMDI_DIRECTIO_ALIGNMENT;
+
+	while(*written < size) {
+		n = size - *written;
+		data = bytes + *written;
+
+		// ... from an aligned buffer
+		if(output->direct == 1) {
+			if(n > YAMDI_WRITE_BUFFERSIZE)
+				n = YAMDI_WRITE_BUFFERSIZE;
+
+			memcpy(output->staging, data, n);
+			data = output->staging;
+		}
+
+		for(offset = 0; offset < n; offset += (size_t)nbytes) {
+			nbytes = write(output->fd, data + offset, n - offset);
+			if(nbytes <= 0)
+				return YAMDI_ERROR;
+
+			output->nwrites++;
+			output->byteswritten += (uint64_t)nbytes;
+		}
+
+		if(output->checksum != NULL)
+			checksumUpdate(output->checksum, bytes + *written, n);
+
+		*written += n;
+		output->offset += (off_t)n;
+	}
+
+	if(output->dropcache == 1 && output->offset - output->flushed >= YAMDI_DROPCACHE_INTERVAL)
+		dropFLVOutput(output, 0);
+
+	return YAMDI_OK;
+}
+
+int finishFLVOutput(FLVOutput_t *output, const unsigned char *bytes, size_t size) {
+	int flags;
+	size_t n;
+
+	if(writeFLVOutput(output, bytes, size, &n) != YAMDI_OK)
+		return YAMDI_ERROR;
+
+	// The end of the file is not a whole block, it is written without O_DIRECT
+	if(output->direct == 1) {
+#ifdef O_DIRECT
+		flags = fcntl(output->fd, F_GETFL);
+		if(flags == -1 || fcntl(output->fd, F_SETFL, flags & ~O_DIRECT) != 0)
+			return YAMDI_ERROR;
+#endif
+
+		output->direct = 0;
+
+		bytes += n;
+		size -= n;
+
+		if(writeFLVOutput(output, bytes, size, &n) != YAMDI_OK)
+			return YAMDI_ERROR;
+	}
+
+	if(output->dropcache == 1)
+		dropFLVOutput(output, 1);
+
+	return YAMDI_OK;
+}
+
+void dropFLVOutput(FLVOutput_t *output, int wait) {
+#ifdef __linux__
+	// Only clean pages can be dropped. The writeback of the new bytes is started and the bytes
+	// of the previous round, which should be on the disk by now, are dropped. That way writing
+	// doesn't have to wait for the disk most of the time.
+	if(output->flushed > output->dropped) {
+		sync_file_range(output->fd, output->dropped, output->flushed - output->dropped, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		dropCache(output->fd, output->dropped, output->flushed - output->dropped);
+
+		output->dropped = output->flushed;
+	}
+
+	if(output->offset > output->flushed) {
+		sync_file_range(output->fd, output->flushed, output->offset - output->flushed, (wait == 1) ? (SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) : SYNC_FILE_RANGE_WRITE);
+
+		output->flushed = output->offset;
+	}
+
+	if(wait == 1 && output->offset > output->dropped) {
+		dropCache(output->fd, output->dropped, output->offset - output->dropped);
+
+		output->dropped = output->offset;
+	}
+#else
+	if(wait == 1) {
+		fsync(output->fd);
+		dropCache(output->fd, output->dropped, output->offset - output->dropped);
+
+		output->dropped = output->offset;
+		output->flushed = output->offset;
+	}
+#endif
+
+	return;
+}
+
+void dropCache(int fd, off_t offset, off_t size) {
+#ifdef POSIX_FADV_DONTNEED
+	posix_fadvise(fd, offset, size, POSIX_FADV_DONTNEED);
+#endif
+
+	return;
+}
+
+int preallocateFile(int fd, off_t size) {
+#ifdef __linux__
+	// The size of the file stays the same, so it doesn't end with zeros if it is cut short
+	if(fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) == 0)
+		return YAMDI_OK;
+#endif
+
+	return YAMDI_ERROR;
+}
+
+int writeFLVMemory(int out, FLV_t *flv, iostats_t *io) {
+#ifndef __MINGW32__
+	int rv = YAMDI_OK, events;
+	size_t i, k, n;
+	ssize_t nbytes;
+	off_t size = (off_t)flv->memory.size;
+	FLVTag_t *flvtag, *first = NULL, *last = NULL;
+	FLVManifest_t ranges;
+	FLVRange_t *range;
+	struct iovec iov[YAMDI_INMEMORY_IOVECS];
+	buffer_t b;
+
+	// The same as writeFLV(), but for an input in memory. The output is put together from
+	// ranges of the input and of a buffer with the headers, the events and the PreviousTagSizes
+	// and then written with as few writev() as possible. Every byte is written only once.
+	memset(&ranges, 0, sizeof(FLVManifest_t));
+	bufferInit(&b);
+
+	writeBufferFLVHeader(&b, flv->hasaudio, flv->hasvideo);
+	writeBufferFLVPreviousTagSize(&b, 0);
+
+	if(flv->options.addonmetadata == 1)
+		bufferAppendBuffer(&b, &flv->onmetadata);
+
+	for(i = 0; i < flv->index.nflvtags && rv == YAMDI_OK; i++) {
+		flvtag = &flv->index.flvtag[i];
+
+		if((i % YAMDI_BUDGET_NTAGS) == 0 && checkFLVBudget(flv, io) != YAMDI_OK) {
+			rv = YAMDI_LIMIT_EXCEEDED;
+			break;
+		}
+
+		// Skip every script tag, like writeFLV()
+		if(flvtag->tagtype != FLV_TAG_AUDIO && flvtag->tagtype != FLV_TAG_VIDEO)
+			continue;
+
+		events = (flv->options.addonlastsecond == 1 && flv->lastsecondindex == i) || (flv->options.addonlastkeyframe == 1 && flv->keyframes.lastkeyframeindex == i);
+
+		if(first != NULL && (events == 1 || flvtag->canonical == 0 || flvtag->offset + (off_t)flvtag->tagsize > size || flvtag->offset != last->offset + (off_t)last->tagsize + FLV_SIZE_PREVIOUSTAGSIZE)) {
+			rv = appendFLVMemory(&ranges, &b, first->offset, last->offset + (off_t)last->tagsize - first->offset);
+			writeBufferFLVPreviousTagSize(&b, last->tagsize);
+
+			first = NULL;
+		}
+
+		if(flv->options.addonlastsecond == 1 && flv->lastsecondindex == i)
+			bufferAppendBuffer(&b, &flv->onlastsecond);
+
+		if(flv->options.addonlastkeyframe == 1 && flv->keyframes.lastkeyframeindex == i)
+			bufferAppendBuffer(&b, &flv->onlastkeyframe);
+
+		if(flvtag->canonical == 1 && flvtag->offset + (off_t)flvtag->tagsize <= size) {
+			if(first == NULL)
+				first = flvtag;
+
+			last = flvtag;
+
+			continue;
+		}
+
+		writeBufferFLVDataTag(&b, flvtag->tagtype, flvtag->timestamp, flvtag->datasize);
+
+		// Like writeFLV(), keep the header of the first incomplete tag. A truncated input is not an error.
+		if(flvtag->offset + (off_t)flvtag->tagsize > size)
+			break;
+
+		rv = appendFLVMemory(&ranges, &b, flvtag->offset + FLV_SIZE_TAGHEADER, (off_t)flvtag->datasize);
+
+		writeBufferFLVPreviousTagSize(&b, flvtag->tagsize);
+	}
+
+	if(first != NULL && rv == YAMDI_OK) {
+		rv = appendFLVMemory(&ranges, &b, first->offset, last->offset + (off_t)last->tagsize - first->offset);
+		writeBufferFLVPreviousTagSize(&b, last->tagsize);
+	}
+
+	// The rest of the buffer
+	if(rv != YAMDI_OUT_OF_MEMORY && (off_t)b.used > ranges.blob) {
+		if(appendFLVManifest(&ranges, 0, ranges.blob, (off_t)b.used - ranges.blob) != YAMDI_OK)
+			rv = YAMDI_OUT_OF_MEMORY;
+	}
+
+	// Everything up to an error is written, like writeFLV() does
+	for(i = 0; i < ranges.nranges && rv != YAMDI_OUT_OF_MEMORY && rv != YAMDI_LIMIT_EXCEEDED; i += n) {
+		if(checkFLVBudget(flv, io) != YAMDI_OK) {
+			rv = YAMDI_LIMIT_EXCEEDED;
+			break;
+		}
+
+		for(n = 0; n < YAMDI_INMEMORY_IOVECS && i + n < ranges.nranges; n++) {
+			range = &ranges.ranges[i + n];
+
+			iov[n].iov_base = ((range->input == 1) ? flv->memory.data : b.data) + range->offset;
+			iov[n].iov_len = (size_t)range->size;
+		}
+
+		for(k = 0; k < n; ) {
+			nbytes = writev(out, &iov[k], (int)(n - k));
+			if(nbytes < 0 && errno == EINTR)
+				continue;
+
+			if(nbytes <= 0) {
+				rv = YAMDI_ERROR;
+				break;
+			}
+
+			io->nwrites++;
+			io->byteswritten += (uint64_t)nbytes;
+
+			// Continue after the bytes that have been written, only they go into the checksum
+			while(k < n && (size_t)nbytes >= iov[k].iov_len) {
+				if(outputchecksum != NULL)
+					checksumUpdate(outputchecksum, (unsigned char *)iov[k].iov_base, iov[k].iov_len);
+
+				nbytes -= (ssize_t)iov[k].iov_len;
+				k++;
+			}
+
+			if(k < n) {
+				if(outputchecksum != NULL)
+					checksumUpdate(outputchecksum, (unsigned char *)iov[k].iov_base, (size_t)nbytes);
+
+				iov[k].iov_base = (unsigned char *)iov[k].iov_base + nbytes;
+				iov[k].iov_len -= (size_t)nbytes;
+			}
+		}
+
+		if(rv == YAMDI_ERROR)
+			break;
+	}
+
+#ifdef DEBUG
+	fprintf(stderr, "[FLV] wrote %d ranges in %d calls\n", (int)ranges.nranges, (int)io->nwrites);
+#endif
+
+	free(ranges.ranges);
+	bufferFree(&b);
+
+	return rv;
+#else
+	return YAMDI_ERROR;
+#endif
+}
+
+int appendFLVMemory(FLVManifest_t *ranges, buffer_t *buffer, off_t offset, off_t size) {
+	// The bytes that have been added to the buffer so far come first
+	if((off_t)buffer->used > ranges->blob) {
+		if(appendFLVManifest(ranges, 0, ranges->blob, (off_t)buffer->used - ranges->blob) != YAMDI_OK)
+			return YAMDI_OUT_OF_MEMORY;
+
+		ranges->blob = (off_t)buffer->used;
+	}
+
+	return appendFLVManifest(ranges, 1, offset, size);
+}
+
+void rewriteFLVTag(unsigned char *bytes, FLVTag_t *flvtag) {
+	size_t tagsize = flvtag->tagsize;
+
+	bytes[ 0] = flvtag->tagtype;
+
+	// DataSize
+	bytes[ 1] = ((flvtag->datasize >> 16) & 0xff);
+	bytes[ 2] = ((flvtag->datasize >>  8) & 0xff);
+	bytes[ 3] = ((flvtag->datasize >>  0) & 0xff);
+
+	// Timestamp
+	bytes[ 4] = ((flvtag->timestamp >> 16) & 0xff);
+	bytes[ 5] = ((flvtag->timestamp >>  8) & 0xff);
+	bytes[ 6] = ((flvtag->timestamp >>  0) & 0xff);
+
+	// TimestampExtended
+	bytes[ 7] = ((flvtag->timestamp >> 24) & 0xff);
+
+	// StreamID
+	bytes[ 8] = 0;
+	bytes[ 9] = 0;
+	bytes[10] = 0;
+
+	// PreviousTagSize
+	bytes[tagsize + 0] = ((tagsize >> 24) & 0xff);
+	bytes[tagsize + 1] = ((tagsize >> 16) & 0xff);
+	bytes[tagsize + 2] = ((tagsize >>  8) & 0xff);
+	bytes[tagsize + 3] = ((tagsize >>  0) & 0xff);
+
+	return;
+}
+
+int prepareFLVReflink(FLV_t *flv, FILE *fp, FILE *out) {
+#if defined(__linux__) && defined(FICLONERANGE)
+	size_t i, first;
+	unsigned char bytes[FLV_SIZE_TAGHEADER];
+	struct stat stin, stout;
+	FLVTag_t *flvtag, *last;
+
+	flv->reflink.blocksize = 0;
+
+	// Both files have to be regular files on the same filesystem
+	if(fstat(fileno(fp), &stin) != 0 || fstat(fileno(out), &stout) != 0)
+		return YAMDI_ERROR;
+
+	if(!S_ISREG(stin.st_mode) || !S_ISREG(stout.st_mode) || stin.st_dev != stout.st_dev)
+		return YAMDI_ERROR;
+
+	if(stout.st_blksize <= 0 || stout.st_blksize > YAMDI_REFLINK_MAXBLOCKSIZE)
+		return YAMDI_ERROR;
+
+	// The events between the tags would break the run
+	if(flv->options.addonlastsecond == 1 || flv->options.addonlastkeyframe == 1)
+		return YAMDI_ERROR;
+
+	for(first = 0; first < flv->index.nflvtags; first++) {
+		flvtag = &flv->index.flvtag[first];
+
+		if(flvtag->tagtype == FLV_TAG_AUDIO || flvtag->tagtype == FLV_TAG_VIDEO)
+			break;
+	}
+
+	if(first == flv->index.nflvtags)
+		return YAMDI_ERROR;
+
+	// From the first audio or video tag on, the input has to be exactly what writeFLV() would write
+	last = &flv->index.flvtag[first];
+	for(i = first + 1; i < flv->index.nflvtags; i++) {
+		flvtag = &flv->index.flvtag[i];
+
+		if(flvtag->tagtype != FLV_TAG_AUDIO && flvtag->tagtype != FLV_TAG_VIDEO)
+			return YAMDI_ERROR;
+
+		if(last->canonical == 0 || flvtag->offset != last->offset + (off_t)last->tagsize + FLV_SIZE_PREVIOUSTAGSIZE)
+			return YAMDI_ERROR;
+
+		last = flvtag;
+	}
+
+	// Not every index mode checks the StreamID and the PreviousTagSize of the last tag
+	if(last->offset + (off_t)last->tagsize + FLV_SIZE_PREVIOUSTAGSIZE != stin.st_size)
+		return YAMDI_ERROR;
+
+	if(seekBytes(fp, last->offset, SEEK_SET) != 0 || readBytes(bytes, FLV_SIZE_TAGHEADER, fp) != YAMDI_OK || FLV_UI24(&bytes[8]) != 0)
+		return YAMDI_ERROR;
+
+	if(seekBytes(fp, last->offset + (off_t)last->tagsize, SEEK_SET) != 0 || readBytes(bytes, FLV_SIZE_PREVIOUSTAGSIZE, fp) != YAMDI_OK)
+		return YAMDI_ERROR;
+
+	if(FLV_UI32(bytes) != last->tagsize)
+		return YAMDI_ERROR;
+
+	flv->reflink.first = flv->index.flvtag[first].offset;
+	flv->reflink.offset = (flv->reflink.first + stout.st_blksize - 1) / stout.st_blksize * stout.st_blksize;
+	flv->reflink.filesize = stin.st_size;
+
+	// Nothing to clone
+	if(flv->reflink.offset >= flv->reflink.filesize)
+		return YAMDI_ERROR;
+
+	flv->reflink.blocksize = (size_t)stout.st_blksize;
+
+#ifdef DEBUG
+	fprintf(stderr, "[FLV] cloning from %" PRIi64 " with a block size of %d\n", (int64_t)flv->reflink.offset, (int)flv->reflink.blocksize);
+#endif
+
+	return YAMDI_OK;
+#else
+	return YAMDI_ERROR;
+#endif
+}
+
+int writeFLVReflink(FILE *out, FLV_t *flv, FILE *fp) {
+#if defined(__linux__) && defined(FICLONERANGE)
+	int rv;
+	struct file_clone_range range;
+
+	writeFLVHeader(out, flv->hasaudio, flv->hasvideo);
+	writeFLVPreviousTagSize(out, 0);
+
+	// The cloned blocks would end up at the wrong offsets after a short write
+	if(flv->options.addonmetadata == 1 && writeBytes(flv->onmetadata.data, flv->onmetadata.used, out) != YAMDI_OK)
+		return YAMDI_ERROR;
+
+	if(writeBytes(flv->onfiller.data, flv->onfiller.used, out) != YAMDI_OK)
+		return YAMDI_ERROR;
+
+	// The tags up to the first block boundary of the input are copied ...
+	rv = copyBytes(out, fp, flv->reflink.first, flv->reflink.offset - flv->reflink.first);
+	if(rv != YAMDI_OK)
+		return rv;
+
+	if(fflush(out) != 0 || ferror(out))
+		return YAMDI_ERROR;
+
+	// ... and the rest shares the blocks of the input
+	memset(&range, 0, sizeof(range));
+
+	range.src_fd = fileno(fp);
+	range.src_offset = (uint64_t)flv->reflink.offset;
+	range.src_length = 0;			// Up to the end of the input
+	range.dest_offset = (uint64_t)ftello(out);
+
+	if(range.dest_offset % flv->reflink.blocksize != 0)
+		return YAMDI_ERROR;
+
+	if(ioctl(fileno(out), FICLONERANGE, &range) != 0)
+		return YAMDI_ERROR;
+
+	stats.bytescloned += (uint64_t)(flv->reflink.filesize - flv->reflink.offset);
+
+	if(seekBytes(out, 0, SEEK_END) != 0)
+		return YAMDI_ERROR;
+
+	return YAMDI_OK;
+#else
+	return YAMDI_ERROR;
+#endif
+}
+
+/*
+ * The journal of a rewrite in place is a little endian file next to the input file:
+ *
+ *   0  char[8]  magic "YAMDIJNL"
+ *   8  uint32   version
+ *  12  uint32   reserved
+ *  16  uint64   size of the file before the rewrite
+ *  24  uint64   size of the file after the rewrite
+ *  32  uint64   # of ranges (n)
+ *  40  uint64   size of the blob (m)
+ *  48  uint64   input, offset and size of every range (uint64[3][n]), in the order of the new file
+ *      uint8    blob (uint8[m]), the new bytes that are not in the file before the rewrite
+ *      uint32   CRC-32C of everything before
+ *
+ * Then there are two slots of YAMDI_INPLACE_RECORDSIZE bytes for the records, which are
+ * written alternately. The valid record with the highest sequence number is the last one:
+ *
+ *   0  char[8]  magic "YAMDIREC"
+ *   8  uint64   sequence number
+ *  16  uint32   pass, reserved
+ *  24  uint64   range
+ *  32  uint64   position, where the block begins (forward) or ends (backward) before the rewrite
+ *  40  uint64   size of the block
+ *  48  uint64   size of the copy of the block (0 or the size of the block)
+ *  56  uint8    copy of the block
+ *      uint32   CRC-32C of everything before
+ *
+ * A record is on the disk before its block is moved and the block is on the disk before the
+ * next record is written. After a crash the block of the last record is moved again and the
+ * rewrite continues with the next one. If a block overlaps itself, its bytes in the file may
+ * already be overwritten, so the record keeps a copy of them.
+ */
+int rewriteFLVInPlace(FLV_t *flv, FILE *fp, const char *journalfile) {
+#ifndef __MINGW32__
+	int rv;
+	size_t i;
+	char *blob = NULL;
+	size_t blobsize = 0;
+	struct stat st;
+	FILE *out;
+	FLVManifest_t manifest;
+	FLVJournal_t journal;
+	buffer_t b;
+
+	// Describe the new file like --manifest does, with a blob in memory
+	memset(&manifest, 0, sizeof(FLVManifest_t));
+
+	out = open_memstream(&blob, &blobsize);
+	if(out == NULL)
+		return YAMDI_OUT_OF_MEMORY;
+
+	flv->manifest = &manifest;
+
+	// Up to an error the tags are written like writeFLV() does
+	rv = YAMDI_OK;
+	if(writeFLV(out, flv, fp) == YAMDI_OUT_OF_MEMORY || syncFLVManifest(out, &manifest) != YAMDI_OK)
+		rv = YAMDI_OUT_OF_MEMORY;
+
+	flv->manifest = NULL;
+
+	if(fclose(out) != 0 && rv == YAMDI_OK)
+		rv = YAMDI_OUT_OF_MEMORY;
+
+	if(rv != YAMDI_OK || fstat(fileno(fp), &st) != 0) {
+		free(manifest.ranges);
+		free(blob);
+
+		return (rv != YAMDI_OK) ? rv : YAMDI_READ_ERROR;
+	}
+
+	memset(&journal, 0, sizeof(FLVJournal_t));
+
+	journal.fd = -1;
+	journal.filesize = st.st_size;
+	journal.manifest = manifest;
+	journal.blob = (unsigned char *)blob;
+	journal.blobsize = blobsize;
+
+	for(i = 0; i < manifest.nranges; i++)
+		journal.newsize += manifest.ranges[i].size;
+
+	// Reserve the space first, such that a full disk stops the rewrite before the file is touched
+	if(journal.newsize > journal.filesize && preallocateFile(fileno(fp), journal.newsize) != YAMDI_OK && errno == ENOSPC) {
+		fprintf(stderr, "There is not enough space to rewrite the file in place.\n");
+		freeFLVJournal(&journal);
+
+		return YAMDI_ERROR;
+	}
+
+	// The journal must be on the disk before anything is moved
+	bufferInit(&b);
+
+	bufferAppendBytes(&b, (unsigned char *)YAMDI_INPLACE_MAGIC, 8);
+	bufferAppendLE(&b, YAMDI_INPLACE_VERSION, 4);
+	bufferAppendLE(&b, 0, 4);
+	bufferAppendLE(&b, (uint64_t)journal.filesize, 8);
+	bufferAppendLE(&b, (uint64_t)journal.newsize, 8);
+	bufferAppendLE(&b, (uint64_t)manifest.nranges, 8);
+	bufferAppendLE(&b, (uint64_t)blobsize, 8);
+
+	for(i = 0; i < manifest.nranges; i++) {
+		bufferAppendLE(&b, (uint64_t)manifest.ranges[i].input, 8);
+		bufferAppendLE(&b, (uint64_t)manifest.ranges[i].offset, 8);
+		bufferAppendLE(&b, (uint64_t)manifest.ranges[i].size, 8);
+	}
+
+	bufferAppendBytes(&b, journal.blob, blobsize);
+	bufferAppendLE(&b, crc32cUpdate(0xffffffff, b.data, b.used) ^ 0xffffffff, 4);
+
+	journal.headersize = (off_t)b.used;
+
+	journal.fd = open(journalfile, O_WRONLY | O_CREAT | O_EXCL, 0666);
+	if(journal.fd == -1) {
+		fprintf(stderr, "Couldn't open %s.\n", journalfile);
+		bufferFree(&b);
+		freeFLVJournal(&journal);
+
+		return YAMDI_ERROR;
+	}
+
+	rv = YAMDI_OK;
+	if(writeFLVJournalBlock(journal.fd, 0, b.data, b.used) != YAMDI_OK || syncDirectory(journalfile) != YAMDI_OK)
+		rv = YAMDI_ERROR;
+
+	bufferFree(&b);
+
+	if(rv == YAMDI_OK)
+		rv = replayFLVJournal(fileno(fp), &journal, NULL);
+
+	if(rv == YAMDI_OK)
+		rv = finishFLVJournal(&journal, journalfile);
+	else
+		fprintf(stderr, "Couldn't rewrite the file in place. Use --in-place again to finish it with %s.\n", journalfile);
+
+	freeFLVJournal(&journal);
+
+	return rv;
+#else
+	return YAMDI_ERROR;
+#endif
+}
+
+int recoverFLVInPlace(const char *file, const char *journalfile) {
+#ifndef __MINGW32__
+	int fd, rv;
+	struct stat st;
+	FLVJournal_t journal;
+	FLVJournalRecord_t record;
+
+	fd = open(file, O_RDWR);
+	if(fd == -1) {
+		fprintf(stderr, "Couldn't open %s.\n", file);
+		return YAMDI_ERROR;
+	}
+
+	rv = readFLVJournal(&journal, &record, journalfile);
+
+	// Without a complete header the file has not been touched
+	if(rv == YAMDI_INVALID_DATASIZE) {
+		close(fd);
+		freeFLVJournal(&journal);
+		free(record.copy);
+
+		if(unlink(journalfile) != 0)
+			return YAMDI_ERROR;
+
+		return YAMDI_OK;
+	}
+
+	// The file is as big as before, as after, or in between if it grows
+	if(rv == YAMDI_OK && (fstat(fd, &st) != 0 || (st.st_size != journal.filesize && st.st_size != journal.newsize))) {
+		fprintf(stderr, "The journal %s doesn't belong to %s.\n", journalfile, file);
+		rv = YAMDI_ERROR;
+	}
+
+	if(rv == YAMDI_OK)
+		rv = replayFLVJournal(fd, &journal, (record.pass != 0) ? &record : NULL);
+
+	if(rv == YAMDI_OK)
+		rv = finishFLVJournal(&journal, journalfile);
+
+	if(close(fd) != 0 && rv == YAMDI_OK)
+		rv = YAMDI_ERROR;
+
+	freeFLVJournal(&journal);
+	free(record.copy);
+
+	return rv;
+#else
+	return YAMDI_ERROR;
+#endif
+}
+
+int readFLVJournal(FLVJournal_t *journal, FLVJournalRecord_t *record, const char *journalfile) {
+#ifndef __MINGW32__
+	int slot;
+	size_t i, n;
+	uint64_t sequence = 0, size;
+	unsigned char header[YAMDI_INPLACE_RECORDHEADERSIZE], *bytes;
+	struct stat st;
+
+	memset(journal, 0, sizeof(FLVJournal_t));
+	memset(record, 0, sizeof(FLVJournalRecord_t));
+
+	journal->fd = -1;
+
+	journal->fd = open(journalfile, O_RDWR);
+	if(journal->fd == -1 || fstat(journal->fd, &st) != 0)
+		return YAMDI_READ_ERROR;
+
+	if(readFLVJournalBlock(journal->fd, 0, header, YAMDI_INPLACE_HEADERSIZE) != YAMDI_OK || memcmp(header, YAMDI_INPLACE_MAGIC, 8) != 0 || readLE(&header[8], 4) != YAMDI_INPLACE_VERSION)
+		return YAMDI_INVALID_DATASIZE;
+
+	journal->filesize = (off_t)readLE(&header[16], 8);
+	journal->newsize = (off_t)readLE(&header[24], 8);
+	n = (size_t)readLE(&header[32], 8);
+	journal->blobsize = (size_t)readLE(&header[40], 8);
+
+	size = YAMDI_INPLACE_HEADERSIZE + (uint64_t)n * 24 + journal->blobsize + 4;
+	if(size > (uint64_t)st.st_size)
+		return YAMDI_INVALID_DATASIZE;
+
+	journal->headersize = (off_t)size;
+
+	bytes = (unsigned char *)malloc((size_t)size);
+	if(bytes == NULL)
+		return YAMDI_OUT_OF_MEMORY;
+
+	if(readFLVJournalBlock(journal->fd, 0, bytes, (size_t)size) != YAMDI_OK || readLE(bytes + size - 4, 4) != (crc32cUpdate(0xffffffff, bytes, (size_t)size - 4) ^ 0xffffffff)) {
+		free(bytes);
+		return YAMDI_INVALID_DATASIZE;
+	}
+
+	journal->manifest.ranges = (FLVRange_t *)calloc((n != 0) ? n : 1, sizeof(FLVRange_t));
+	journal->blob = (unsigned char *)malloc((journal->blobsize != 0) ? journal->blobsize : 1);
+	if(journal->manifest.ranges == NULL || journal->blob == NULL) {
+		free(bytes);
+		return YAMDI_OUT_OF_MEMORY;
+	}
+
+	journal->manifest.nranges = n;
+	journal->manifest.size = n;
+
+	for(i = 0; i < n; i++) {
+		journal->manifest.ranges[i].input = (short)readLE(&bytes[YAMDI_INPLACE_HEADERSIZE + i * 24], 8);
+		journal->manifest.ranges[i].offset = (off_t)readLE(&bytes[YAMDI_INPLACE_HEADERSIZE + i * 24 + 8], 8);
+		journal->manifest.ranges[i].size = (off_t)readLE(&bytes[YAMDI_INPLACE_HEADERSIZE + i * 24 + 16], 8);
+	}
+
+	memcpy(journal->blob, bytes + YAMDI_INPLACE_HEADERSIZE + n * 24, journal->blobsize);
+
+	free(bytes);
+
+	journal->block = (unsigned char *)malloc(YAMDI_INPLACE_RECORDSIZE);
+	if(journal->block == NULL)
+		return YAMDI_OUT_OF_MEMORY;
+
+	// The last valid record. A torn one is ignored, its block has not been touched yet.
+	for(slot = 0; slot < 2; slot++) {
+		if(readFLVJournalBlock(journal->fd, journal->headersize + (off_t)slot * YAMDI_INPLACE_RECORDSIZE, header, YAMDI_INPLACE_RECORDHEADERSIZE) != YAMDI_OK || memcmp(header, YAMDI_INPLACE_RECORDMAGIC, 8) != 0)
+			continue;
+
+		size = readLE(&header[48], 8);
+		if(size > YAMDI_INPLACE_BLOCKSIZE || readLE(&header[8], 8) <= sequence)
+			continue;
+
+		if(readFLVJournalBlock(journal->fd, journal->headersize + (off_t)slot * YAMDI_INPLACE_RECORDSIZE, journal->block, YAMDI_INPLACE_RECORDHEADERSIZE + (size_t)size + 4) != YAMDI_OK)
+			continue;
+
+		if(readLE(journal->block + YAMDI_INPLACE_RECORDHEADERSIZE + size, 4) != (crc32cUpdate(0xffffffff, journal->block, YAMDI_INPLACE_RECORDHEADERSIZE + (size_t)size) ^ 0xffffffff))
+			continue;
+
+		sequence = readLE(&header[8], 8);
+
+		record->pass = (int)readLE(&header[16], 4);
+		record->range = (size_t)readLE(&header[24], 8);
+		record->position = (off_t)readLE(&header[32], 8);
+		record->size = (off_t)readLE(&header[40], 8);
+		record->data = NULL;
+
+		// Keep the copy of the block out of the way of the next slot
+		if(size != 0) {
+			if(record->copy == NULL)
+				record->copy = (unsigned char *)malloc(YAMDI_INPLACE_BLOCKSIZE);
+
+			if(record->copy == NULL)
+				return YAMDI_OUT_OF_MEMORY;
+
+			memcpy(record->copy, journal->block + YAMDI_INPLACE_RECORDHEADERSIZE, (size_t)size);
+			record->data = record->copy;
+		}
+	}
+
+	journal->sequence = sequence;
+
+	if(record->pass < 0 || record->pass > YAMDI_INPLACE_BLOB || (record->pass != 0 && record->pass != YAMDI_INPLACE_BLOB && record->range >= n))
+		return YAMDI_INVALID_DATASIZE;
+
+	return YAMDI_OK;
+#else
+	return YAMDI_ERROR;
+#endif
+}
+
+int replayFLVJournal(int fd, FLVJournal_t *journal, FLVJournalRecord_t *record) {
+#ifndef __MINGW32__
+	size_t k;
+	off_t position, start, end, size, delta, moved = 0, total = 0;
+	FLVRange_t *range;
+
+	// Where every range goes and how many bytes are moved
+	journal->offsets = (off_t *)calloc((journal->manifest.nranges != 0) ? journal->manifest.nranges : 1, sizeof(off_t));
+	if(journal->offsets == NULL)
+		return YAMDI_OUT_OF_MEMORY;
+
+	for(k = 0, position = 0; k < journal->manifest.nranges; k++) {
+		journal->offsets[k] = position;
+		position += journal->manifest.ranges[k].size;
+
+		if(journal->manifest.ranges[k].input == 1 && journal->offsets[k] != journal->manifest.ranges[k].offset)
+			total += journal->manifest.ranges[k].size;
+	}
+
+	if(journal->block == NULL)
+		journal->block = (unsigned char *)malloc(YAMDI_INPLACE_RECORDSIZE);
+
+	if(journal->block == NULL)
+		return YAMDI_OUT_OF_MEMORY;
+
+	if(journal->newsize > journal->filesize && ftruncate(fd, journal->newsize) != 0)
+		return YAMDI_ERROR;
+
+	progressBegin("rewrite", 0, (uint64_t)total);
+
+	// Move the block of the last record again
+	if(record != NULL && record->pass != YAMDI_INPLACE_BLOB) {
+		range = &journal->manifest.ranges[record->range];
+		delta = journal->offsets[record->range] - range->offset;
+		start = (record->pass == YAMDI_INPLACE_FORWARD) ? record->position : record->position - record->size;
+
+		if(record->data != NULL) {
+			if(writeFLVJournalBlock(fd, start + delta, record->data, (size_t)record->size) != YAMDI_OK)
+				return YAMDI_ERROR;
+		}
+		else if(moveFLVJournalBlock(fd, journal, 0, record->range, record->position, record->size) != YAMDI_OK)
+			return YAMDI_ERROR;
+	}
+
+	// The ranges that move towards the beginning, front to back. Their blocks are moved
+	// front to back, too, such that no block overwrites one that has not been moved yet.
+	for(k = 0; k < journal->manifest.nranges; k++) {
+		range = &journal->manifest.ranges[k];
+
+		if(record != NULL && record->pass > YAMDI_INPLACE_FORWARD)
+			break;
+
+		if(range->input != 1 || journal->offsets[k] >= range->offset)
+			continue;
+
+		start = range->offset;
+		end = range->offset + range->size;
+
+		if(record != NULL && record->pass == YAMDI_INPLACE_FORWARD) {
+			if(k < record->range)
+				continue;
+			else if(k == record->range)
+				start = record->position + record->size;
+		}
+
+		for(position = start; position < end; position += size) {
+			size = (end - position > YAMDI_INPLACE_BLOCKSIZE) ? YAMDI_INPLACE_BLOCKSIZE : end - position;
+
+			if(moveFLVJournalBlock(fd, journal, YAMDI_INPLACE_FORWARD, k, position, size) != YAMDI_OK)
+				return YAMDI_ERROR;
+
+			moved += size;
+			progressUpdate(0, (uint64_t)moved);
+		}
+	}
+
+	// The ranges that move towards the end, back to front, starting at the end of the file
+	for(k = journal->manifest.nranges; k > 0; k--) {
+		range = &journal->manifest.ranges[k - 1];
+
+		if(record != NULL && record->pass > YAMDI_INPLACE_BACKWARD)
+			break;
+
+		if(range->input != 1 || journal->offsets[k - 1] <= range->offset)
+			continue;
+
+		start = range->offset;
+		end = range->offset + range->size;
+
+		if(record != NULL && record->pass == YAMDI_INPLACE_BACKWARD) {
+			if(k - 1 > record->range)
+				continue;
+			else if(k - 1 == record->range)
+				end = record->position - record->size;
+		}
+
+		for(position = end; position > start; position -= size) {
+			size = (position - start > YAMDI_INPLACE_BLOCKSIZE) ? YAMDI_INPLACE_BLOCKSIZE : position - start;
+
+			if(moveFLVJournalBlock(fd, journal, YAMDI_INPLACE_BACKWARD, k - 1, position, size) != YAMDI_OK)
+				return YAMDI_ERROR;
+
+			moved += size;
+			progressUpdate(0, (uint64_t)moved);
+		}
+	}
+
+	// All tags are in place. The new bytes are in the journal and can be written again.
+	if(appendFLVJournal(journal, YAMDI_INPLACE_BLOB, 0, 0, 0, 0) != YAMDI_OK)
+		return YAMDI_ERROR;
+
+	for(k = 0; k < journal->manifest.nranges; k++) {
+		range = &journal->manifest.ranges[k];
+
+		if(range->input == 0 && pwriteBytes(fd, journal->blob + range->offset, (size_t)range->size, journal->offsets[k]) != YAMDI_OK)
+			return YAMDI_ERROR;
+	}
+
+	if(ftruncate(fd, journal->newsize) != 0 || fdatasync(fd) != 0)
+		return YAMDI_ERROR;
+
+	progressEnd(0, (uint64_t)moved);
+
+	return YAMDI_OK;
+#else
+	return YAMDI_ERROR;
+#endif
+}
+
+int moveFLVJournalBlock(int fd, FLVJournal_t *journal, int pass, size_t k, off_t position, off_t size) {
+#ifndef __MINGW32__
+	off_t start, delta;
+	ssize_t nbytes;
+	size_t offset;
+	unsigned char *data = journal->block + YAMDI_INPLACE_RECORDHEADERSIZE;
+
+	delta = journal->offsets[k] - journal->manifest.ranges[k].offset;
+
+	// A backward block ends at the position, a forward block begins there. Without a pass
+	// the block of the last record is moved again, its pass is known from the direction.
+	if(pass == YAMDI_INPLACE_BACKWARD || (pass == 0 && delta > 0))
+		start = position - size;
+	else
+		start = position;
+
+	for(offset = 0; offset < (size_t)size; offset += (size_t)nbytes) {
+		nbytes = pread(fd, data + offset, (size_t)size - offset, start + (off_t)offset);
+		if(nbytes <= 0)
+			return YAMDI_READ_ERROR;
+
+		stats.nreads++;
+		stats.bytesread += (uint64_t)nbytes;
+	}
+
+	// If the block overlaps itself, it can't be read again after it has been written halfway
+	if(pass != 0 && appendFLVJournal(journal, pass, k, position, size, ((delta < 0) ? -delta : delta) < size) != YAMDI_OK)
+		return YAMDI_ERROR;
+
+	return writeFLVJournalBlock(fd, start + delta, data, (size_t)size);
+#else
+	return YAMDI_ERROR;
+#endif
+}
+
+int appendFLVJournal(FLVJournal_t *journal, int pass, size_t k, off_t position, off_t size, int copy) {
+	int rv;
+	size_t datasize = (copy == 1) ? (size_t)size : 0;
+	off_t offset;
+	buffer_t b;
+
+	offset = journal->headersize + (off_t)((journal->sequence + 1) % 2) * YAMDI_INPLACE_RECORDSIZE;
+
+	bufferInit(&b);
+
+	bufferAppendBytes(&b, (unsigned char *)YAMDI_INPLACE_RECORDMAGIC, 8);
+	bufferAppendLE(&b, ++journal->sequence, 8);
+	bufferAppendLE(&b, (uint64_t)pass, 4);
+	bufferAppendLE(&b, 0, 4);
+	bufferAppendLE(&b, (uint64_t)k, 8);
+	bufferAppendLE(&b, (uint64_t)position, 8);
+	bufferAppendLE(&b, (uint64_t)size, 8);
+	bufferAppendLE(&b, (uint64_t)datasize, 8);
+
+	if(b.used != YAMDI_INPLACE_RECORDHEADERSIZE) {
+		bufferFree(&b);
+		return YAMDI_OUT_OF_MEMORY;
+	}
+
+	if(copy == 0) {
+		bufferAppendLE(&b, crc32cUpdate(0xffffffff, b.data, b.used) ^ 0xffffffff, 4);
+		rv = writeFLVJournalBlock(journal->fd, offset, b.data, b.used);
+
+		bufferFree(&b);
+
+		return rv;
+	}
+
+	// The block is already in the block buffer, behind the room for the header. The
+	// CRC-32C goes behind the block, where it doesn't get into the way of moving it.
+	memcpy(journal->block, b.data, YAMDI_INPLACE_RECORDHEADERSIZE);
+
+	bufferReset(&b);
+	bufferAppendLE(&b, crc32cUpdate(0xffffffff, journal->block, YAMDI_INPLACE_RECORDHEADERSIZE + datasize) ^ 0xffffffff, 4);
+
+	memcpy(journal->block + YAMDI_INPLACE_RECORDHEADERSIZE + datasize, b.data, 4);
+	bufferFree(&b);
+
+	return writeFLVJournalBlock(journal->fd, offset, journal->block, YAMDI_INPLACE_RECORDHEADERSIZE + datasize + 4);
+}
+
+int finishFLVJournal(FLVJournal_t *journal, const char *journalfile) {
+#ifndef __MINGW32__
+	int rv = YAMDI_OK;
+
+	if(close(journal->fd) != 0)
+		rv = YAMDI_ERROR;
+
+	journal->fd = -1;
+
+	if(unlink(journalfile) != 0 || syncDirectory(journalfile) != YAMDI_OK)
+		rv = YAMDI_ERROR;
+
+	return rv;
+#else
+	return YAMDI_ERROR;
+#endif
+}
+
+void freeFLVJournal(FLVJournal_t *journal) {
+#ifndef __MINGW32__
+	if(journal->fd != -1)
+		close(journal->fd);
+#endif
+
+	free(journal->manifest.ranges);
+	free(journal->blob);
+	free(journal->block);
+	free(journal->offsets);
+
+	memset(journal, 0, sizeof(FLVJournal_t));
+
+	journal->fd = -1;
+
+	return;
+}
+
+int readFLVJournalBlock(int fd, off_t offset, unsigned char *bytes, size_t size) {
+#ifndef __MINGW32__
+	ssize_t nbytes;
+	size_t n;
+
+	for(n = 0; n < size; n += (size_t)nbytes) {
+		nbytes = pread(fd, bytes + n, size - n, offset + (off_t)n);
+		if(nbytes <= 0)
+			return YAMDI_READ_ERROR;
+	}
+
+	return YAMDI_OK;
+#else
+	return YAMDI_ERROR;
+#endif
+}
+
+int writeFLVJournalBlock(int fd, off_t offset, const unsigned char *bytes, size_t size) {
+#ifndef __MINGW32__
+	// Nothing goes on before the bytes are on the disk
+	if(pwriteBytes(fd, bytes, size, offset) != YAMDI_OK || fdatasync(fd) != 0)
+		return YAMDI_ERROR;
+
+	return YAMDI_OK;
+#else
+	return YAMDI_ERROR;
+#endif
+}
+
+int pwriteBytes(int fd, const unsigned char *bytes, size_t size, off_t offset) {
+#ifndef __MINGW32__
+	ssize_t nbytes;
+	size_t n;
+
+	for(n = 0; n < size; n += (size_t)nbytes) {
+		nbytes = pwrite(fd, bytes + n, size - n, offset + (off_t)n);
+		if(nbytes <= 0)
+			return YAMDI_ERROR;
+
+		stats.nwrites++;
+		stats.byteswritten += (uint64_t)nbytes;
+	}
+
+	return YAMDI_OK;
+#else
+	return YAMDI_ERROR;
+#endif
+}
+
+int syncDirectory(const char *file) {
+#ifndef __MINGW32__
+	int fd, rv = YAMDI_OK;
+	char *dir;
+
+	// A new or removed file is only on the disk with its directory
+	dir = strdup(file);
+	if(dir == NULL)
+		return YAMDI_OUT_OF_MEMORY;
+
+	if(strrchr(dir, '/') != NULL)
+		*(strrchr(dir, '/') + 1) = '\0';
+	else
+		strcpy(dir, ".");
+
+	fd = open(dir, O_RDONLY);
+	if(fd == -1 || fsync(fd) != 0)
+		rv = YAMDI_ERROR;
+
+	if(fd != -1)
+		close(fd);
+
+	free(dir);
+
+	return rv;
+#else
+	return YAMDI_OK;
+#endif
+}
+
+int writeFLVHeader(FILE *fp, int hasaudio, int hasvideo) {
+	unsigned char bytes[FLV_SIZE_HEADER];
+
+	// Signature
+	bytes[0] = 'F';
+	bytes[1] = 'L';
+	bytes[2] = 'V';
+
+	// Version
+	bytes[3] = 1;
+
+	// Flags
+	bytes[4] = 0;
+
+	if(hasaudio == 1)
+		bytes[4] |= 0x4;
+
+	if(hasvideo == 1)
+		bytes[4] |= 0x1;
+
+	// DataOffset
+	bytes[5] = ((FLV_SIZE_HEADER >> 24) & 0xff);
+	bytes[6] = ((FLV_SIZE_HEADER >> 16) & 0xff);
+	bytes[7] = ((FLV_SIZE_HEADER >>  8) & 0xff);
+	bytes[8] = ((FLV_SIZE_HEADER >>  0) & 0xff);
+
+	writeBytes(bytes, FLV_SIZE_HEADER, fp);
+
+	return YAMDI_OK;
+}
+
+int writeBufferFLVHeader(buffer_t *buffer, int hasaudio, int hasvideo) {
+	unsigned char bytes[FLV_SIZE_HEADER];
+
+	// Signature
+	bytes[0] = 'F';
+	bytes[1] = 'L';
+	bytes[2] = 'V';
+
+	// Version
+	bytes[3] = 1;
+
+	// Flags
+	bytes[4] = 0;
+
+	if(hasaudio == 1)
+		bytes[4] |= 0x4;
+
+	if(hasvideo == 1)
+		bytes[4] |= 0x1;
+
+	// DataOffset
+	bytes[5] = ((FLV_SIZE_HEADER >> 24) & 0xff);
+	bytes[6] = ((FLV_SIZE_HEADER >> 16) & 0xff);
+	bytes[7] = ((FLV_SIZE_HEADER >>  8) & 0xff);
+	bytes[8] = ((FLV_SIZE_HEADER >>  0) & 0xff);
+
+	bufferAppendBytes(buffer, bytes, FLV_SIZE_HEADER);
+
+	return YAMDI_OK;
+}
+
+int createFLVEvents(FLV_t *flv) {
+	if(flv->options.addonmetadata == 1)
+		createFLVEventOnMetaData(flv);
+
+	if(flv->options.addonlastkeyframe == 1)
+		createFLVEventOnLastKeyframe(flv);
+
+	if(flv->options.addonlastsecond == 1)
+		createFLVEventOnLastSecond(flv);
+
+	return YAMDI_OK;
+}
+
+int createFLVEventOnMetaData(FLV_t *flv) {
+	int pass = 0;
+	size_t i, length = 0;
+	buffer_t b;
+
+	bufferInit(&b);
+
+onmetadatapass:
+	bufferReset(&b);
+
+	// ScriptDataObject
+	writeBufferFLVScriptDataObject(&b);
+
+	writeBufferFLVScriptDataECMAArray(&b, "onMetaData", length);
+
+	length = 0;
+
+	if(strlen(flv->options.creator) != 0) {
+		writeBufferFLVScriptDataValueString(&b, "creator", flv->options.creator); length++;
+	}
+
+	writeBufferFLVScriptDataValueString(&b, "metadatacreator", "Yet Another Metadata Injector for FLV - Version " YAMDI_VERSION "\0"); length++;
+	writeBufferFLVScriptDataValueBool(&b, "hasKeyframes", flv->haskeyframes); length++;
+	writeBufferFLVScriptDataValueBool(&b, "hasVideo", flv->hasvideo); length++;
+	writeBufferFLVScriptDataValueBool(&b, "hasAudio", flv->hasaudio); length++;
+	writeBufferFLVScriptDataValueBool(&b, "hasMetadata", 1); length++;
+	writeBufferFLVScriptDataValueBool(&b, "canSeekToEnd", flv->canseektoend); length++;
+
+	writeBufferFLVScriptDataValueDouble(&b, "duration", (double)(flv->lasttimestamp - flv->firsttimestamp) / 1000.0); length++;
+	writeBufferFLVScriptDataValueDouble(&b, "datasize", (double)flv->datasize); length++;
+
+	if(flv->hasvideo == 1) {
+		writeBufferFLVScriptDataValueDouble(&b, "videosize", (double)flv->video.size); length++;
+		writeBufferFLVScriptDataValueDouble(&b, "framerate", (double)flv->video.framerate); length++;
+		writeBufferFLVScriptDataValueDouble(&b, "videodatarate", (double)flv->video.datarate); length++;
+
+		if(flv->video.analyzed == 1) {
+			writeBufferFLVScriptDataValueDouble(&b, "videocodecid", (double)flv->video.codecid); length++;
+			writeBufferFLVScriptDataValueDouble(&b, "width", (double)flv->video.width); length++;
+			writeBufferFLVScriptDataValueDouble(&b, "height", (double)flv->video.height); length++;
+		}
+	}
+
+	if(flv->hasaudio == 1) {
+		writeBufferFLVScriptDataValueDouble(&b, "audiosize", (double)flv->audio.size); length++;
+		writeBufferFLVScriptDataValueDouble(&b, "audiodatarate", (double)flv->audio.datarate); length++;
+
+		if(flv->audio.analyzed == 1) {
+			writeBufferFLVScriptDataValueDouble(&b, "audiocodecid", (double)flv->audio.codecid); length++;
+			writeBufferFLVScriptDataValueDouble(&b, "audiosamplerate", (double)flv->audio.samplerate); length++;
+			writeBufferFLVScriptDataValueDouble(&b, "audiosamplesize", (double)flv->audio.samplesize); length++;
+			writeBufferFLVScriptDataValueBool(&b, "stereo", flv->audio.stereo); length++;
+		}
+	}
+
+	writeBufferFLVScriptDataValueDouble(&b, "filesize", (double)flv->filesize); length++;
+	writeBufferFLVScriptDataValueDouble(&b, "lasttimestamp", (double)flv->lasttimestamp / 1000.0); length++;
+
+	if(flv->haskeyframes == 1) {
+		writeBufferFLVScriptDataValueDouble(&b, "lastkeyframetimestamp", (double)flv->keyframes.lastkeyframetimestamp / 1000.0); length++;
+		writeBufferFLVScriptDataValueDouble(&b, "lastkeyframelocation", (double)flv->keyframes.lastkeyframelocation); length++;
+
+		writeBufferFLVScriptDataVariableArray(&b, "keyframes"); length++;
+
+			writeBufferFLVScriptDataValueArray(&b, "filepositions", flv->keyframes.nkeyframes);
+
+			for(i = 0; i < flv->keyframes.nkeyframes; i++)
+				writeBufferFLVScriptDataValueDouble(&b, NULL, (double)flv->keyframes.keyframelocations[i]);
+
+			writeBufferFLVScriptDataValueArray(&b, "times", flv->keyframes.nkeyframes);
+
+			for(i = 0; i < flv->keyframes.nkeyframes; i++)
+				writeBufferFLVScriptDataValueDouble(&b, NULL, (double)flv->keyframes.keyframetimestamps[i] / 1000.0);
+
+		writeBufferFLVScriptDataVariableArrayEnd(&b);
+	}
+
+	writeBufferFLVScriptDataVariableArrayEnd(&b);
+
+	if(pass == 0) {
+		pass = 1;
+		goto onmetadatapass;
+	}
+
+	// Write the onMetaData tag
+	bufferReset(&flv->onmetadata);
+
+	writeBufferFLVScriptDataTag(&flv->onmetadata, 0, b.used);
+	bufferAppendBuffer(&flv->onmetadata, &b);
+	writeBufferFLVPreviousTagSize(&flv->onmetadata, flv->onmetadata.used);
+
+	bufferFree(&b);
+
+	return YAMDI_OK;
+}
+
+int createFLVEventOnLastSecond(FLV_t *flv) {
+	buffer_t b;
+
+	bufferInit(&b);
+
+	// ScriptDataObject
+	writeBufferFLVScriptDataObject(&b);
+
+	writeBufferFLVScriptDataECMAArray(&b, "onLastSecond", 0);
+	writeBufferFLVScriptDataVariableArrayEnd(&b);
+
+	// Write the onLastSecond tag
+	bufferReset(&flv->onlastsecond);
+
+	writeBufferFLVScriptDataTag(&flv->onlastsecond, flv->lastsecond, b.used);
+	bufferAppendBuffer(&flv->onlastsecond, &b);
+	writeBufferFLVPreviousTagSize(&flv->onlastsecond, flv->onlastsecond.used);
+
+	bufferFree(&b);
+
+	return YAMDI_OK;
+}
+
+int createFLVEventOnLastKeyframe(FLV_t *flv) {
+	buffer_t b;
+
+	bufferInit(&b);
+
+	// ScriptDataObject
+	writeBufferFLVScriptDataObject(&b);
+
+	writeBufferFLVScriptDataECMAArray(&b, "onLastKeyframe", 0);
+	writeBufferFLVScriptDataVariableArrayEnd(&b);
+
+	// Write the onLastKeyframe tag
+	bufferReset(&flv->onlastkeyframe);
+
+	writeBufferFLVScriptDataTag(&flv->onlastkeyframe, flv->keyframes.lastkeyframetimestamp - 1, b.used);
+	bufferAppendBuffer(&flv->onlastkeyframe, &b);
+	writeBufferFLVPreviousTagSize(&flv->onlastkeyframe, flv->onlastkeyframe.used);
+
+	bufferFree(&b);
+
+	return YAMDI_OK;
+}
+
+int createFLVEventOnFiller(FLV_t *flv, size_t size) {
+	size_t n, k;
+	unsigned char bytes[5], padding[256];
+	buffer_t b;
+
+	bufferReset(&flv->onfiller);
+
+	if(size < YAMDI_REFLINK_MINFILLER)
+		return YAMDI_OK;
+
+	bufferInit(&b);
+
+	// ScriptDataObject
+	writeBufferFLVScriptDataObject(&b);
+	writeBufferFLVScriptDataString(&b, "onFiller");
+
+	// A long string that fills the tag up to the requested size
+	n = size - FLV_SIZE_TAGHEADER - FLV_SIZE_PREVIOUSTAGSIZE - b.used - 5;
+
+	bytes[0] = 12;
+	bytes[1] = ((n >> 24) & 0xff);
+	bytes[2] = ((n >> 16) & 0xff);
+	bytes[3] = ((n >>  8) & 0xff);
+	bytes[4] = ((n >>  0) & 0xff);
+
+	bufferAppendBytes(&b, bytes, 5);
+
+	memset(padding, ' ', sizeof(padding));
+	while(n != 0) {
+		k = (n > sizeof(padding)) ? sizeof(padding) : n;
+		bufferAppendBytes(&b, padding, k);
+		n -= k;
+	}
+
+	// Write the onFiller tag
+	writeBufferFLVScriptDataTag(&flv->onfiller, 0, b.used);
+	bufferAppendBuffer(&flv->onfiller, &b);
+	writeBufferFLVPreviousTagSize(&flv->onfiller, flv->onfiller.used);
+
+	bufferFree(&b);
+
+	return YAMDI_OK;
+}
+
+int writeBufferFLVScriptDataTag(buffer_t *buffer, int timestamp, size_t datasize) {
+	unsigned char bytes[FLV_SIZE_TAGHEADER];
+
+	bytes[ 0] = FLV_TAG_SCRIPTDATA;
+
+	// DataSize
+	bytes[ 1] = ((datasize >> 16) & 0xff);
+	bytes[ 2] = ((datasize >>  8) & 0xff);
+	bytes[ 3] = ((datasize >>  0) & 0xff);
+
+	// Timestamp
+	bytes[ 4] = ((timestamp >> 16) & 0xff);
+	bytes[ 5] = ((timestamp >>  8) & 0xff);
+	bytes[ 6] = ((timestamp >>  0) & 0xff);
+
+	// TimestampExtended
+	bytes[ 7] = ((timestamp >> 24) & 0xff);
+
+	// StreamID
+	bytes[ 8] = 0;
+	bytes[ 9] = 0;
+	bytes[10] = 0;
+
+	bufferAppendBytes(buffer, bytes, FLV_SIZE_TAGHEADER);
+
+	return YAMDI_OK;
+}
+
+int writeBufferFLVDataTag(buffer_t *buffer, int type, int timestamp, size_t datasize) {
+	unsigned char bytes[FLV_SIZE_TAGHEADER];
+
+	bytes[ 0] = type;
+
+	// DataSize
+	bytes[ 1] = ((datasize >> 16) & 0xff);
+	bytes[ 2] = ((datasize >>  8) & 0xff);
+	bytes[ 3] = ((datasize >>  0) & 0xff);
+
+	// Timestamp
+	bytes[ 4] = ((timestamp >> 16) & 0xff);
+	bytes[ 5] = ((timestamp >>  8) & 0xff);
+	bytes[ 6] = ((timestamp >>  0) & 0xff);
+
+	// TimestampExtended
+	bytes[ 7] = ((timestamp >> 24) & 0xff);
+
+	// StreamID
+	bytes[ 8] = 0;
+	bytes[ 9] = 0;
+	bytes[10] = 0;
+
+	bufferAppendBytes(buffer, bytes, FLV_SIZE_TAGHEADER);
+
+	return YAMDI_OK;
+}
+
+int writeFLVDataTag(FILE *fp, int type, int timestamp, size_t datasize) {
+	unsigned char bytes[FLV_SIZE_TAGHEADER];
+
+	bytes[ 0] = type;
+
+	// DataSize
+	bytes[ 1] = ((datasize >> 16) & 0xff);
+	bytes[ 2] = ((datasize >>  8) & 0xff);
+	bytes[ 3] = ((datasize >>  0) & 0xff);
+
+	// Timestamp
+	bytes[ 4] = ((timestamp >> 16) & 0xff);
+	bytes[ 5] = ((timestamp >>  8) & 0xff);
+	bytes[ 6] = ((timestamp >>  0) & 0xff);
+
+	// TimestampExtended
+	bytes[ 7] = ((timestamp >> 24) & 0xff);
+
+	// StreamID
+	bytes[ 8] = 0;
+	bytes[ 9] = 0;
+	bytes[10] = 0;
+
+	writeBytes(bytes, FLV_SIZE_TAGHEADER, fp);
+
+	return YAMDI_OK;
+}
+
+int writeBufferFLVPreviousTagSize(buffer_t *buffer, size_t tagsize) {
+	unsigned char bytes[4];
+
+	bytes[0] = ((tagsize >> 24) & 0xff);
+	bytes[1] = ((tagsize >> 16) & 0xff);
+	bytes[2] = ((tagsize >>  8) & 0xff);
+	bytes[3] = ((tagsize >>  0) & 0xff);
+
+	bufferAppendBytes(buffer, bytes, 4);
+
+	return YAMDI_OK;
+}
+
+int writeFLVPreviousTagSize(FILE *fp, size_t tagsize) {
+	unsigned char bytes[4];
+
+	bytes[0] = ((tagsize >> 24) & 0xff);
+	bytes[1] = ((tagsize >> 16) & 0xff);
+	bytes[2] = ((tagsize >>  8) & 0xff);
+	bytes[3] = ((tagsize >>  0) & 0xff);
+
+	writeBytes(bytes, 4, fp);
+
+	return YAMDI_OK;
+}
+
+int analyzeFLVH263VideoPacket(FLV_t *flv, FLVTag_t *flvtag, FILE *fp) {
+	int startcode, picturesize;
+	unsigned char *buffer, data[10];
+
+	readFLVTagData(data, sizeof(data), flvtag, fp);
+	// Skip the VIDEODATA header
+	buffer = &data[1];
+
+	// 8bit  |pppppppp|pppppppp|pvvvvvrr|rrrrrrss|swwwwwww|whhhhhhh|h
+	// 16bit |pppppppp|pppppppp|pvvvvvrr|rrrrrrss|swwwwwww|wwwwwwww|whhhhhhh|hhhhhhhh|h
+
+	startcode = FLV_UI24(buffer) >> 7;
+	if(startcode != 1)
+		return YAMDI_ERROR;
+
+	picturesize = ((buffer[3] & 0x3) << 1) + ((buffer[4] >> 7) & 0x1);
+
+	switch(picturesize) {
+		case 0: // Custom 8bit
+			flv->video.width = ((buffer[4] & 0x7f) << 1) + ((buffer[5] >> 7) & 0x1);
+			flv->video.height = ((buffer[5] & 0x7f) << 1) + ((buffer[6] >> 7) & 0x1);
+			break;
+		case 1: // Custom 16bit
+			flv->video.width = ((buffer[4] & 0x7f) << 9) + (buffer[5] << 1) + ((buffer[6] >> 7) & 0x1);
+			flv->video.height = ((buffer[6] & 0x7f) << 9) + (buffer[7] << 1) + ((buffer[8] >> 7) & 0x1);
+			break;
+		case 2: // CIF
+			flv->video.width = 352.0;
+			flv->video.height = 288.0;
+			break;
+		case 3: // QCIF
+			flv->video.width = 176.0;
+			flv->video.height = 144.0;
+			break;
+		case 4: // SQCIF
+			flv->video.width = 128.0;
+			flv->video.height = 96.0;
+			break;
+		case 5:
+			flv->video.width = 320.0;
+			flv->video.height = 240.0;
+			break;
+		case 6:
+			flv->video.width = 160.0;
+			flv->video.height = 120.0;
+			break;
+		default:
+			break;
+	}
+
+	return YAMDI_OK;
+}
+
+int analyzeFLVScreenVideoPacket(FLV_t *flv, FLVTag_t *flvtag, FILE *fp) {
+	unsigned char *buffer, data[5];
+
+	// |1111wwww|wwwwwwww|2222hhhh|hhhhhhhh|
+
+	readFLVTagData(data, sizeof(data), flvtag, fp);
+	// Skip the VIDEODATA header
+	buffer = &data[1];
+
+	flv->video.width = ((buffer[0] & 0xf) << 8) + buffer[1];
+	flv->video.height = ((buffer[2] & 0xf) << 8) + buffer[3];
+
+	return YAMDI_OK;
+}
+
+int analyzeFLVVP6VideoPacket(FLV_t *flv, FLVTag_t *flvtag, FILE *fp) {
+	int offset = 3;	// default buffer offset for dim_y
+	unsigned char *buffer, data[10];
+
+	readFLVTagData(data, sizeof(data), flvtag, fp);
+
+#if DEBUG
+	fprintf(stderr, "\n");
+
+	fprintf(stderr, "[VP6] ");
+	int i = 0;
+	for(i = 0; i < sizeof(data); i++)
+		fprintf(stderr, "%d=%d ", i, data[i]);
+	fprintf(stderr, "\n");
+#endif
+
+	// Skip the VIDEODATA header
+	buffer = &data[1];
+
+	// VP6FLVVIDEOPACKET header (as described in the SWF Specs v10, page 249)
+	int hadjust = ((buffer[0] >> 4) & 0x0f);
+	int vadjust = (buffer[0] & 0x0f);
+
+	// Raw vp6 video data (http://wiki.multimedia.cx/index.php?title=On2_VP6)
+	int frame_mode = ((buffer[1] >> 7) & 0x01);
+
+	if(frame_mode != 0)	// We need an iframe
+		return YAMDI_ERROR;
+
+	int marker = (buffer[1] & 0x01);	// Without checking this value, we support all VP6 variants
+
+	int version2 = ((buffer[2] >> 1) & 0x03);
+
+#if DEBUG
+	int version = ((buffer[2] >> 3) & 0x1f);
+	int interlace = (buffer[2] & 0x01);
+
+	fprintf(stderr, "[VP6] marker = %d\n", marker);
+	fprintf(stderr, "[VP6] version = %d\n", version);
+	fprintf(stderr, "[VP6] version2 = %d\n", version2);
+	fprintf(stderr, "[VP6] interlace = %d\n", interlace);
+#endif
+
+	// In these cases there are 2 more bytes that we have to skip
+	if(marker == 1 || version2 == 0)
+		offset += 2;
+
+#if DEBUG
+	fprintf(stderr, "[VP6] offset = %d\n", offset);
+	fprintf(stderr, "[VP6] dim_y = %d\n", buffer[offset]);
+	fprintf(stderr, "[VP6] dim_x = %d\n", buffer[offset + 1]);
+	fprintf(stderr, "[VP6] render_y = %d\n", buffer[offset + 2]);
+	fprintf(stderr, "[VP6] render_x = %d\n", buffer[offset + 3]);
+#endif
+
+	// Now offset points to the resolution values: [dim_y, dim_x, render_y, render_x]
+	// Values represent macroblocks
+	flv->video.height = (buffer[offset + 0] * 16) - vadjust;
+	flv->video.width = (buffer[offset + 1] * 16) - hadjust;
+
+	return YAMDI_OK;
+}
+
+int analyzeFLVVP6AlphaVideoPacket(FLV_t *flv, FLVTag_t *flvtag, FILE *fp) {
+	unsigned char *buffer, data[9];
+
+	readFLVTagData(data, sizeof(data), flvtag, fp);
+	// Skip the VIDEODATA header
+	buffer = &data[1];
+
+	flv->video.width = buffer[7] * 16 - (buffer[0] >> 4);
+	flv->video.height = buffer[6] * 16 - (buffer[0] & 0x0f);
+
+	return YAMDI_OK;
+}
+
+int analyzeFLVH264VideoPacket(FLV_t *flv, FLVTag_t *flvtag, FILE *fp) {
+	int avcpackettype;
+	int i, length, offset, nSPS;
+	unsigned char *avcc;
+	unsigned char *buffer, data[flvtag->datasize];
+	h264data_t h264data;
+
+	readFLVTagData(data, sizeof(data), flvtag, fp);
+	// Skip the VIDEODATA header
+	buffer = &data[1];
+
+	avcpackettype = buffer[0];
+
+#ifdef DEBUG
+	fprintf(stderr, "[FLV] AVCPacketType = %d\n", avcpackettype);
+#endif
+
+	if(avcpackettype != 0)
+		return YAMDI_ERROR;
+
+	// AVCDecoderConfigurationRecord (14496-15, 5.2.4.1.1)
+	avcc = (unsigned char *)&buffer[4];
+
+	nSPS = avcc[5] & 0x1f;
+
+#ifdef DEBUG
+	fprintf(stderr, "[AVC/H.264] AVCDecoderConfigurationRecord\n");
+	fprintf(stderr, "[AVC/H.264] configurationVersion = %d\n", avcc[0]);
+	fprintf(stderr, "[AVC/H.264] AVCProfileIndication = %d\n", avcc[1]);
+	fprintf(stderr, "[AVC/H.264] profile_compatibility = %d\n", avcc[2]);
+	fprintf(stderr, "[AVC/H.264] AVCLevelIndication = %d\n", avcc[3]);
+	fprintf(stderr, "[AVC/H.264] lengthSizeMinusOne = %d\n", avcc[4] & 0x3);
+	fprintf(stderr, "[AVC/H.264] numOfSequenceParameterSets = %d\n", nSPS);
+#endif
+
+	offset = 6;
+	for(i = 0; i < nSPS; i++) {
+		length = (avcc[offset] << 8) + avcc[offset + 1];
+#ifdef DEBUG
+		fprintf(stderr, "[AVC/H.264]\tsequenceParameterSetLength = %d bit\n", 8 * length);
+#endif
+		memset(&h264data, 0, sizeof(h264data_t));
+		if(readH264NALUnit(&h264data, &flv->rbsp, &avcc[offset + 2], length) == YAMDI_OK)
+			break;
+
+		offset += (2 + length);
+	}
+
+	// There would be some Picture Parameter Sets, but we don't need them. Bail out.
+/*
+	int nPPS = avcc[offset++];
+	fprintf(stderr, "numOfPictureParameterSets = %d\n", nPPS);
+
+	for(i = 0; i < nPPS; i++) {
+		length = (avcc[offset] << 8) + avcc[offset + 1];
+#ifdef DEBUG
+		fprintf(stderr, "[AVC/H.264]\tpictureParameterSetLength = %d bit\n", 8 * length);
+#endif
+		readH264NALUnit(&avcc[offset + 2], length);
+
+		offset += (2 + length);
+	}
+*/
+
+	if(h264data.valid == 0)
+		return YAMDI_ERROR;
+
+	flv->video.width = h264data.width;
+	flv->video.height = h264data.height;
+
+	return YAMDI_OK;
+}
+
+int analyzeFLVH264Keyframe(FLV_t *flv, FLVTag_t *flvtag, int keyframe, FILE *fp) {
+	int i, nal_unit_type, lengthsize;
+	size_t offset, start, length, nalulength;
+	unsigned char data[128];
+
+	// The NALUs are only looked at up to the first slice. Usually this is
+	// within the first few bytes of the tag, so one read is enough.
+	length = flvtag->datasize;
+	if(length > sizeof(data))
+		length = sizeof(data);
+
+	if(length < 5 || readFLVTagData(data, length, flvtag, fp) != YAMDI_OK)
+		return keyframe;
+
+	// AVCPacketType
+	if(data[1] == 0) {
+		// AVCDecoderConfigurationRecord (14496-15, 5.2.4.1.1). It tells us how long
+		// the NALU length fields are. The FrameType of this packet is left untouched.
+		if(length > 9)
+			flv->video.nalulengthsize = (data[9] & 0x3) + 1;
+
+		return keyframe;
+	}
+	else if(data[1] != 1)
+		return 0;
+
+	lengthsize = flv->video.nalulengthsize;
+	if(lengthsize == 0)
+		lengthsize = 4;
+
+	// Skip the VIDEODATA header, AVCPacketType and CompositionTime
+	offset = 5;
+	start = 0;
+
+	while(offset + lengthsize < flvtag->datasize) {
+		// Load the next NALU header if it is not in our buffer
+		if(offset + lengthsize + 1 > start + length) {
+			start = offset;
+
+			length = flvtag->datasize - start;
+			if(length > sizeof(data))
+				length = sizeof(data);
+
+			if(seekBytes(fp, flvtag->offset + FLV_SIZE_TAGHEADER + start, SEEK_SET) != 0)
+				return keyframe;
+
+			if(readBytes(data, length, fp) != YAMDI_OK)
+				return keyframe;
+		}
+
+		nalulength = 0;
+		for(i = 0; i < lengthsize; i++)
+			nalulength = (nalulength << 8) + data[offset - start + i];
+
+		nal_unit_type = data[offset - start + lengthsize] & 0x1f;
+
+		// The first slice tells whether this is an IDR picture (see 14496-10, Table 7-1)
+		if(nal_unit_type == 5)
+			return 1;
+
+		if(nal_unit_type >= 1 && nal_unit_type <= 4)
+			return 0;
+
+		offset += lengthsize + nalulength;
+	}
+
+	// No slice at all
+	return 0;
+}
+
+int writeBufferFLVScriptDataObject(buffer_t *buffer) {
+	unsigned char type = 2;
+
+	bufferAppendBytes(buffer, &type, 1);
+
+	return YAMDI_OK;
+}
+
+int writeBufferFLVScriptDataECMAArray(buffer_t *buffer, const char *name, size_t len) {
+	unsigned char type, bytes[4];
+
+	writeBufferFLVScriptDataString(buffer, name);
+
+	type = 8;	// ECMAArray
+	bufferAppendBytes(buffer, &type, 1);
+
+	bytes[0] = ((len >> 24) & 0xff);
+	bytes[1] = ((len >> 16) & 0xff);
+	bytes[2] = ((len >>  8) & 0xff);
+	bytes[3] = ((len >>  0) & 0xff);
+
+	bufferAppendBytes(buffer, bytes, 4);
+
+	return YAMDI_OK;
+}
+
+int writeBufferFLVScriptDataValueArray(buffer_t *buffer, const char *name, size_t len) {
+	unsigned char type, bytes[4];
+	
+	writeBufferFLVScriptDataString(buffer, name);
+
+	type = 10;	// Value Array
+	bufferAppendBytes(buffer, &type, 1);
+
+	bytes[0] = ((len >> 24) & 0xff);
+	bytes[1] = ((len >> 16) & 0xff);
+	bytes[2] = ((len >>  8) & 0xff);
+	bytes[3] = ((len >>  0) & 0xff);
+
+	bufferAppendBytes(buffer, bytes, 4);
+
+	return YAMDI_OK;
+}
+
+int writeBufferFLVScriptDataVariableArray(buffer_t *buffer, const char *name) {
+	unsigned char type;
+
+	writeBufferFLVScriptDataString(buffer, name);
+
+	type = 3;	// Variable Array
+	bufferAppendBytes(buffer, &type, 1);
+
+	return YAMDI_OK;
+}
+
+int writeBufferFLVScriptDataVariableArrayEnd(buffer_t *buffer) {
+	unsigned char bytes[3];
+
+	bytes[0] = 0;
+	bytes[1] = 0;
+	bytes[2] = 9;
+
+	bufferAppendBytes(buffer, bytes, 3);
+
+	return YAMDI_OK;
+}
+
+int writeBufferFLVScriptDataValueString(buffer_t *buffer, const char *name, const char *value) {
+	unsigned char type;
+
+	if(name != NULL)
+		writeBufferFLVScriptDataString(buffer, name);
+
+	type = 2;	// DataString
+	bufferAppendBytes(buffer, &type, 1);
+
+	writeBufferFLVScriptDataString(buffer, value);
+
+	return YAMDI_OK;
+}
+
+int writeBufferFLVScriptDataValueBool(buffer_t *buffer, const char *name, int value) {
+	unsigned char type;
+
+	if(name != NULL)
+		writeBufferFLVScriptDataString(buffer, name);
+
+	type = 1;	// Bool
+	bufferAppendBytes(buffer, &type, 1);
+
+	writeBufferFLVBool(buffer, value);
+
+	return YAMDI_OK;
+}
+
+int writeBufferFLVScriptDataValueDouble(buffer_t *buffer, const char *name, double value) {
+	unsigned char type;
+
+	if(name != NULL)
+		writeBufferFLVScriptDataString(buffer, name);
+
+	type = 0;	// Double
+	bufferAppendBytes(buffer, &type, 1);
+
+	writeBufferFLVDouble(buffer, value);
+
+	return YAMDI_OK;
+}
+
+int writeBufferFLVScriptDataString(buffer_t *buffer, const char *s) {
+	size_t len;
+	unsigned char bytes[2];
+
+	len = strlen(s);
+
+	// critical, if only DataString is expected?
+	if(len > 0xffff)
+		writeBufferFLVScriptDataLongString(buffer, s);
+	else {
+		bytes[0] = ((len >> 8) & 0xff);
+		bytes[1] = ((len >> 0) & 0xff);
+
+		bufferAppendBytes(buffer, bytes, 2);
+		bufferAppendString(buffer, (unsigned char*)s);
+	}
+
+	return YAMDI_OK;
+}
+
+int writeBufferFLVScriptDataLongString(buffer_t *buffer, const char *s) {
+	size_t len;
+	unsigned char bytes[4];
+
+	len = strlen(s);
+
+	if(len > 0xffffffff)
+		len = 0xffffffff;
+
+	bytes[0] = ((len >> 24) & 0xff);
+	bytes[1] = ((len >> 16) & 0xff);
+	bytes[2] = ((len >>  8) & 0xff);
+	bytes[3] = ((len >>  0) & 0xff);
+
+	bufferAppendBytes(buffer, bytes, 4);
+	bufferAppendString(buffer, (unsigned char *)s);
+
+	return YAMDI_OK;
+}
+
+int writeBufferFLVBool(buffer_t *buffer, int value) {
+	unsigned char b;
+
+	b = (value & 1);
+
+	bufferAppendBytes(buffer, &b, 1);
+
+	return YAMDI_OK;
+}
+
+int writeBufferFLVDouble(buffer_t *buffer, double value) {
+	union {
+		unsigned char dc[8];
+		double dd;
+	} d;
+	unsigned char b[8];
+
+	d.dd = value;
+
+	if(isBigEndian()) {
+		b[0] = d.dc[0];
+		b[1] = d.dc[1];
+		b[2] = d.dc[2];
+		b[3] = d.dc[3];
+		b[4] = d.dc[4];
+		b[5] = d.dc[5];
+		b[6] = d.dc[6];
+		b[7] = d.dc[7];
+	}
+	else {
+		b[0] = d.dc[7];
+		b[1] = d.dc[6];
+		b[2] = d.dc[5];
+		b[3] = d.dc[4];
+		b[4] = d.dc[3];
+		b[5] = d.dc[2];
+		b[6] = d.dc[1];
+		b[7] = d.dc[0];
+	}
+
+	bufferAppendBytes(buffer, b, 8);
+
+	return YAMDI_OK;
+}
+
+int readFLVTag(FLVTag_t *flvtag, off_t offset, FILE *fp) {
+	int rv;
+	unsigned char buffer[FLV_SIZE_TAGHEADER];
+
+	memset(flvtag, 0, sizeof(FLVTag_t));
+
+	rv = seekBytes(fp, offset, SEEK_SET);
+	if(rv != 0) {
+#ifdef DEBUG
+		fprintf(stderr, "[FLV] %s\n", strerror(errno));
+#endif
+		return YAMDI_READ_ERROR;
+	}
+
+	flvtag->offset = offset;
+
+	// Read the header
+	if(readBytes(buffer, FLV_SIZE_TAGHEADER, fp) != YAMDI_OK)
+		return YAMDI_READ_ERROR;
+
+	if(parseFLVTagHeader(flvtag, buffer, offset) != YAMDI_OK)
+		return YAMDI_INVALID_TAGTYPE;
+
+	// Skip the data and read the previous tag size
+	// A wrong one is only a reason not to copy the tag as it is.
+	if(readBytes(NULL, flvtag->datasize, fp) == YAMDI_OK && readBytes(buffer, FLV_SIZE_PREVIOUSTAGSIZE, fp) == YAMDI_OK && FLV_UI32(buffer) != flvtag->tagsize)
+		flvtag->canonical = 0;
+
+	// Check the previous tag size
+	// This is too picky. We don't need it.
+/*
+	if(FLV_UI32(buffer) != (FLV_SIZE_TAGHEADER + flvtag->datasize))
+		return YAMDI_INVALID_PREVIOUSTAGSIZE;
+*/
+
+	return YAMDI_OK;
+}
+
+int parseFLVTagHeader(FLVTag_t *flvtag, const unsigned char *buffer, off_t offset) {
+	memset(flvtag, 0, sizeof(FLVTag_t));
+
+	flvtag->offset = offset;
+	flvtag->tagtype = FLV_UI8(buffer);
+
+	// Assuming only known tags. Otherwise we only process the
+	// input file up to this point. It is not possible to detect
+	// where the next valid tag could be.
+	switch(flvtag->tagtype) {
+		case FLV_TAG_VIDEO:
+		case FLV_TAG_AUDIO:
+		case FLV_TAG_SCRIPTDATA:
+			break;
+		default:
+			return YAMDI_INVALID_TAGTYPE;
+	}
+
+	flvtag->datasize = (size_t)FLV_UI24(&buffer[1]);
+	flvtag->timestamp = FLV_TIMESTAMP(&buffer[4]);
+
+	flvtag->tagsize = FLV_SIZE_TAGHEADER + flvtag->datasize;
+
+	// yamdi writes every tag with a StreamID of 0
+	flvtag->canonical = (FLV_UI24(&buffer[8]) == 0);
+
+	return YAMDI_OK;
+}
+
+int readFLVTagData(unsigned char *ptr, size_t size, FLVTag_t *flvtag, FILE *stream) {
+	// check for size <= flvtag->datasize?
+
+	seekBytes(stream, flvtag->offset + FLV_SIZE_TAGHEADER, SEEK_SET);
+
+	return readBytes(ptr, size, stream);
+}
+
+int readBytes(unsigned char *ptr, size_t size, FILE *stream) {
+	size_t bytesread;
+
+	// A file can be seeked beyond its end, an input in memory can't
+	if(ptr == NULL) {
+		if(seekBytes(stream, (off_t)size, SEEK_CUR) != 0)
+			return YAMDI_READ_ERROR;
+
+		return YAMDI_OK;
+	}
+
+	bytesread = fread(ptr, 1, size, stream);
+
+	stats.nreads++;
+	stats.bytesread += bytesread;
+
+	if(bytesread < size)
+		return YAMDI_READ_ERROR;
+
+	return YAMDI_OK;
+}
+
+int seekBytes(FILE *stream, off_t offset, int whence) {
+	stats.nseeks++;
+
+	return fseeko(stream, offset, whence);
+}
+
+int writeBytes(const unsigned char *ptr, size_t size, FILE *stream) {
+	size_t byteswritten;
+
+	byteswritten = fwrite(ptr, 1, size, stream);
+
+	stats.nwrites++;
+	stats.byteswritten += byteswritten;
+
+	if(outputchecksum != NULL)
+		checksumUpdate(outputchecksum, ptr, byteswritten);
+
+	if(byteswritten < size)
+		return YAMDI_ERROR;
+
+	return YAMDI_OK;
+}
+
+int copyBytes(FILE *out, FILE *in, off_t offset, off_t size) {
+	size_t n;
+	unsigned char buffer[YAMDI_COPY_BUFFERSIZE];
+#ifdef __linux__
+	ssize_t bytescopied;
+
+	// Let the kernel move the bytes. This works for any output, but not for every input.
+	// The checksums need to see the bytes, so they go through the buffer then.
+	fflush(out);
+
+	while(size > 0 && outputchecksum == NULL) {
+		n = (size > YAMDI_COPY_MAXCHUNK) ? YAMDI_COPY_MAXCHUNK : (size_t)size;
+
+		bytescopied = sendfile(fileno(out), fileno(in), &offset, n);
+		if(bytescopied <= 0)
+			break;
+
+		stats.nwrites++;
+		stats.byteswritten += bytescopied;
+		stats.bytescopied += bytescopied;
+
+		size -= bytescopied;
+	}
+
+	if(size == 0)
+		return YAMDI_OK;
+#endif
+
+	// Copy the rest through a buffer
+	if(seekBytes(in, offset, SEEK_SET) != 0)
+		return YAMDI_READ_ERROR;
+
+	while(size > 0) {
+		n = (size > sizeof(buffer)) ? sizeof(buffer) : (size_t)size;
+
+		if(readBytes(buffer, n, in) != YAMDI_OK)
+			return YAMDI_READ_ERROR;
+
+		if(writeBytes(buffer, n, out) != YAMDI_OK)
+			return YAMDI_ERROR;
+
+		size -= n;
+	}
+
+	return YAMDI_OK;
+}
+
+int readH264NALUnit(h264data_t * h264data, buffer_t *rbsp, unsigned char *nalu, int length) {
+	int i, numBytesInRBSP;
+	int nal_unit_type;
+	unsigned char *bytes;
+	bitstream_t bitstream;
+
+	// See 14496-10, 7.3.1
+#ifdef DEBUG
+	fprintf(stderr, "[AVC/H.264]\tNALU Header: %02x\n", nalu[0]);
+	fprintf(stderr, "[AVC/H.264]\t\tforbidden_zero_bit = %d\n", (nalu[0] >> 7) & 0x1);
+	fprintf(stderr, "[AVC/H.264]\t\tnal_ref_idc = %d\n", (nalu[0] >> 5) & 0x3);
+	fprintf(stderr, "[AVC/H.264]\t\tnal_unit_type = %d\n", nalu[0] & 0x1f);
+	fprintf(stderr, "[AVC/H.264]\tRBSP: ");
+	for(i = 1; i < length; i++)
+		fprintf(stderr, "%02x ", nalu[i]);
+	fprintf(stderr, "\n");
+#endif
+
+	nal_unit_type = nalu[0] & 0x1f;
+
+	// We are only interested in NALUnits of type 7 (sequence parameter set, SPS)
+	if(nal_unit_type != 7)
+		return YAMDI_H264_USELESS_NALU;
+
+	// Remove the emulation prevention bytes into the scratch buffer. The
+	// buffer is kept between calls, so we only allocate if it has to grow.
+	if(bufferReserve(rbsp, length) != YAMDI_OK)
+		return YAMDI_OUT_OF_MEMORY;
+
+	bytes = rbsp->data;
+
+	numBytesInRBSP = 0;
+	for(i = 1; i < length; i++) {
+		if(i + 2 < length && nalu[i] == 0x00 && nalu[i + 1] == 0x00 && nalu[i + 2] == 0x03) {
+			bytes[numBytesInRBSP++] = nalu[i];
+			bytes[numBytesInRBSP++] = nalu[i + 1];
+
+			i += 2;
+		}
+		else
+			bytes[numBytesInRBSP++] = nalu[i];
+	}
+
+	rbsp->used = numBytesInRBSP;
+
+	bitstreamInit(&bitstream, bytes, numBytesInRBSP);
+
+#ifdef DEBUG
+	fprintf(stderr, "[AVC/H.264]\tSODB: ");
+	for(i = 0; i < numBytesInRBSP; i++)
+		fprintf(stderr, "%02x ", bytes[i]);
+	fprintf(stderr, "\n");
+#endif
+
+	readH264SPS(h264data, &bitstream);
+
+	return YAMDI_OK;
+}
+
+void readH264SPS(h264data_t *h264data, bitstream_t *bitstream) {
+	int i, j;
+	unsigned int profile_idc;
+	unsigned int chroma_format_idc = 1, separate_color_plane_flag = 0;
+
+	unsigned int pic_width_in_mbs_minus1, pic_height_in_map_units_minus1;
+	unsigned int frame_mbs_only_flag;
+	unsigned int frame_cropping_flag;
+	unsigned int frame_crop_left_offset = 0, frame_crop_right_offset = 0, frame_crop_top_offset = 0, frame_crop_bottom_offset = 0;
+
+	unsigned int chromaArrayType;
+/*
+	We need these values from SPS
+
+	chroma_format_idc
+	separate_color_plane_flag
+	pic_width_in_mbs_minus1
+	pic_height_in_map_units_minus1
+	frame_mbs_only_flag
+	frame_cropping_flag
+	frame_crop_left_offset
+	frame_crop_right_offset
+	frame_crop_top_offset
+	frame_crop_bottom_offset
+*/
+
+	profile_idc = readCodedU(bitstream, 8, "profile_idc");
+	readCodedU(bitstream, 1, "constraint_set0_flag");
+	readCodedU(bitstream, 1, "constraint_set1_flag");
+	readCodedU(bitstream, 1, "constraint_set2_flag");
+	readCodedU(bitstream, 1, "constraint_set3_flag");
+	readCodedU(bitstream, 4, "reserved_zero_4bits");
+	readCodedU(bitstream, 8, "level_idc");
+	readCodedUE(bitstream, "seq_parameter_set_id");
+
+	if(
+		profile_idc == 100 ||
+		profile_idc == 110 ||
+		profile_idc == 122 ||
+		profile_idc == 244 ||
+		profile_idc == 44 ||
+		profile_idc == 83 ||
+		profile_idc == 86
+	) {
+		chroma_format_idc = readCodedUE(bitstream, "chroma_format_idc");
+
+		if(chroma_format_idc == 3)
+			separate_color_plane_flag = readCodedU(bitstream, 1, "separate_color_plane_flag");
+
+		readCodedUE(bitstream, "bit_depth_luma_minus8");
+		readCodedUE(bitstream, "bit_depth_chroma_minus8");
+		readCodedU(bitstream, 1, "qpprime_y_zero_transform_bypass_flag");
+
+		unsigned int seq_scaling_matrix_present_flag = readCodedU(bitstream, 1, "seq_scaling_matrix_present_flag");
+		if(seq_scaling_matrix_present_flag == 1) {
+			int sizeOfScalingList, delta_scale, lastScale, nextScale;
+
+			int seq_scaling_matrix_count = (chroma_format_idc != 3) ? 8 : 12;
+			unsigned int seq_scaling_list_present_flag;
+			for(i = 0; i < seq_scaling_matrix_count; i++) {
+				seq_scaling_list_present_flag = readCodedU(bitstream, 1, "seq_scaling_list_present_flag");
+
+				if(seq_scaling_list_present_flag == 1) {
+					sizeOfScalingList = (i < 6) ? 16 : 64;
+					lastScale = nextScale = 8;
+					for(j = 0; j < sizeOfScalingList; j++) {
+						if(nextScale != 0) {
+							delta_scale = readCodedSE(bitstream, "delta_scale");
+
+							nextScale = (lastScale + delta_scale + 256) % 256;
+						}
+
+						lastScale = (nextScale == 0) ? lastScale : nextScale;
+					}
+				}
+			}
+		}
+	}
+
+	readCodedUE(bitstream, "log2_max_frame_num_minus4");
+	unsigned int pic_order_cnt_type = readCodedUE(bitstream, "pic_order_cnt_type");
+
+	if(pic_order_cnt_type == 1) {
+		readCodedU(bitstream, 1, "delta_pic_order_always_zero_flag");
+		readCodedSE(bitstream, "offset_for_non_ref_pic");
+		readCodedSE(bitstream, "offset_for_top_to_bottom_field");
+
+		unsigned int num_ref_frames_in_pic_order_cnt_cycle = readCodedUE(bitstream, "num_ref_frames_in_pic_order_cnt_cycle");
+		for(i = 0; i < num_ref_frames_in_pic_order_cnt_cycle; i++)
+			readCodedSE(bitstream, "offset_for_ref_frame");
+	}
+	else if(pic_order_cnt_type == 0)
+		readCodedUE(bitstream, "log2_max_pic_order_cnt_lsb_minus4");
+
+	readCodedUE(bitstream, "max_num_ref_frames");
+	readCodedU(bitstream, 1, "gaps_in_frame_num_value_allowed_flag");
+
+	pic_width_in_mbs_minus1 = readCodedUE(bitstream, "pic_width_in_mbs_minus1");
+	pic_height_in_map_units_minus1 = readCodedUE(bitstream, "pic_height_in_map_units_minus1");
+
+	frame_mbs_only_flag = readCodedU(bitstream, 1, "frame_mbs_only_flag");
+	if(frame_mbs_only_flag == 0)
+		readCodedU(bitstream, 1, "mb_adaptive_frame_field_flag");
+
+	readCodedU(bitstream, 1, "direct_8x8_inference_flag");
+
+	frame_cropping_flag = readCodedU(bitstream, 1, "frame_cropping_flag");
+	if(frame_cropping_flag == 1) {
+		frame_crop_left_offset = readCodedUE(bitstream, "frame_crop_left_offset");
+		frame_crop_right_offset = readCodedUE(bitstream, "frame_crop_right_offset");
+		frame_crop_top_offset = readCodedUE(bitstream, "frame_crop_top_offset");
+		frame_crop_bottom_offset = readCodedUE(bitstream, "frame_crop_bottom_offset");
+	}
+
+	readCodedU(bitstream, 1, "vui_parameters_present_flag");
+
+	// and so on ... VUI is not interesting for us. We have everything we need.
+
+	// Now we have enough information to compute the width and height of this video stream
+
+	unsigned int picWidthInMbs = (pic_width_in_mbs_minus1 + 1);
+	unsigned int picHeightInMapUnits = (pic_height_in_map_units_minus1 + 1);
+	unsigned int frameHeightInMbs = (2 - frame_mbs_only_flag) * picHeightInMapUnits;
+
+	unsigned int width = picWidthInMbs * 16;
+	unsigned int height = frameHeightInMbs * 16;
+
+#ifdef DEBUG
+	fprintf(stderr, "[AVC/H.264] width = %u (pre crop)\n", width);
+	fprintf(stderr, "[AVC/H.264] height = %u (pre crop)\n", height);
+#endif
+
+	// Cropping
+
+	int cropLeft, cropRight;
+	int cropTop, cropBottom;
+
+	if(frame_cropping_flag == 1) {
+		// See 14496-10, Table 6-1
+		int subWidthC[4] = {1, 2, 2, 1};
+		int subHeightC[4] = {1, 2, 1, 1};
+
+		unsigned int cropUnitX, cropUnitY;
+
+		if(separate_color_plane_flag == 0)
+			chromaArrayType = chroma_format_idc;
+		else
+			chromaArrayType = 0;
+
+		if(chromaArrayType == 0) {
+			cropUnitX = 1;
+			cropUnitY = 2 - frame_mbs_only_flag;
+		}
+		else {
+			cropUnitX = subWidthC[chroma_format_idc];
+			cropUnitY = subHeightC[chroma_format_idc] * (2 - frame_mbs_only_flag);
+		}
+
+		cropLeft = cropUnitX * frame_crop_left_offset;
+		cropRight = cropUnitX * frame_crop_right_offset;
+		cropTop = cropUnitY * frame_crop_top_offset;
+		cropBottom = cropUnitY * frame_crop_bottom_offset;
+	}
+	else {
+		cropLeft = 0;
+		cropRight = 0;
+		cropTop = 0;
+		cropBottom = 0;
+	}
+
+	width = width - cropLeft - cropRight;
+	height = height - cropTop - cropBottom;
+
+#ifdef DEBUG
+	fprintf(stderr, "[AVC/H.264] width = %u\n", width);
+	fprintf(stderr, "[AVC/H.264] height = %u\n", height);
+#endif
+
+	h264data->valid = 1;
+	h264data->width = width;
+	h264data->height = height;
+
+	return;
+}
+
+unsigned int readCodedU(bitstream_t *bitstream, int nbits, const char *name) {
+	// unsigned integer with n bits
+	unsigned int bits = (unsigned int)readBits(bitstream, nbits);
+
+#ifdef DEBUG
+	if(name != NULL)
+		fprintf(stderr, "[AVC/H.264]\t\t%s = %u\n", name, bits);
+#endif
+
+	return bits;
+}
+
+unsigned int readCodedUE(bitstream_t *bitstream, const char *name) {
+	// unsigned integer Exp-Golomb coded (see 14496-10, 9.1)
+	int leadingZeroBits;
+	unsigned int codeNum = 0;
+
+	if(bitstream->bits < 64)
+		bitstreamRefill(bitstream);
+
+	if(bitstream->cache == 0) {
+		// Either the end of the bitstream or more than 32 leading zero bits.
+		// Both are not valid, consume everything.
+		bitstream->cache = 0;
+		bitstream->bits = 0;
+		bitstream->byte = bitstream->length;
+	}
+	else {
+#if defined(__GNUC__)
+		leadingZeroBits = __builtin_clzll(bitstream->cache);
+#else
+		for(leadingZeroBits = 0; ((bitstream->cache << leadingZeroBits) & 0x8000000000000000ULL) == 0; leadingZeroBits++);
+#endif
+
+		if(leadingZeroBits > 31)
+			leadingZeroBits = 31;
+
+		// Skip the leading zero bits and the following 1 bit
+		readBits(bitstream, leadingZeroBits + 1);
+
+		codeNum = ((1U << leadingZeroBits) - 1 + (unsigned int)readBits(bitstream, leadingZeroBits));
+	}
+
+#ifdef DEBUG
+	if(name != NULL)
+		fprintf(stderr, "[AVC/H.264]\t\t%s = %u\n", name, codeNum);
+#endif
+
+	return codeNum;
+}
+
+int readCodedSE(bitstream_t *bitstream, const char *name) {
+	// signed integer Exp-Golomb coded (see 14496-10, 9.1 and 9.1.1)
+	unsigned int codeNum;
+	int codeNumSigned, sign;
+
+	codeNum = readCodedUE(bitstream, NULL);
+
+	sign = (codeNum % 2) + 1;
+	codeNumSigned = codeNum >> 1;
+	if(sign == 0)
+		codeNumSigned++;
+	else
+		codeNumSigned *= -1;
+
+#ifdef DEBUG
+	if(name != NULL)
+		fprintf(stderr, "[AVC/H.264]\t\t%s = %d\n", name, codeNumSigned);
+#endif
+
+	return codeNumSigned;
+}
+
+void bitstreamInit(bitstream_t *bitstream, const unsigned char *bytes, size_t length) {
+	bitstream->bytes = bytes;
+	bitstream->length = length;
+	bitstream->byte = 0;
+	bitstream->cache = 0;
+	bitstream->bits = 0;
+
+	bitstreamRefill(bitstream);
+
+	return;
+}
+
+void bitstreamRefill(bitstream_t *bitstream) {
+	int nbytes;
+	uint64_t word;
+	const unsigned char *b;
+
+	// Load as many whole bytes as fit into the cache
+	nbytes = (64 - bitstream->bits) >> 3;
+	if(nbytes == 0)
+		return;
+
+	if(bitstream->byte + 8 <= bitstream->length) {
+		// Fast path: read a whole word and keep only the bytes we need
+		b = &bitstream->bytes[bitstream->byte];
+
+		word = ((uint64_t)b[0] << 56) | ((uint64_t)b[1] << 48) | ((uint64_t)b[2] << 40) | ((uint64_t)b[3] << 32) |
+		       ((uint64_t)b[4] << 24) | ((uint64_t)b[5] << 16) | ((uint64_t)b[6] <<  8) | ((uint64_t)b[7] <<  0);
+
+		word &= ~(uint64_t)0 << (64 - 8 * nbytes);
+
+		bitstream->cache |= word >> bitstream->bits;
+		bitstream->bits += 8 * nbytes;
+		bitstream->byte += nbytes;
+	}
+	else {
+		// Near the end of the bitstream, load byte by byte
+		while(nbytes > 0 && bitstream->byte < bitstream->length) {
+			bitstream->cache |= (uint64_t)bitstream->bytes[bitstream->byte] << (56 - bitstream->bits);
+			bitstream->bits += 8;
+			bitstream->byte++;
+			nbytes--;
+		}
+	}
+
+	return;
+}
 
-#ifdef DEBUG
-		fprintf(stderr, "[FLV] audio.keyframerate = %d\n", flv->audio.keyframerate);
-#endif
+int readBits(bitstream_t *bitstream, int nbits) {
+	int rv;
 
-		// Mark all audio tags that should be considered as a keyframe
-		index = 0;
-		for(i = 0; i < flv->index.nflvtags; i++) {
-			flvtag = &flv->index.flvtag[i];
+	// At most 32 bits at a time
+	if(nbits <= 0)
+		return 0;
 
-			if(flvtag->tagtype == FLV_TAG_AUDIO) {
-				if((index % flv->audio.keyframerate) == 0) {
-					flvtag->keyframe = 1;
-					flv->keyframes.nkeyframes++;
-				}
+	if(bitstream->bits < nbits)
+		bitstreamRefill(bitstream);
 
-				index++;
-			}
-		}
+	rv = (int)(bitstream->cache >> (64 - nbits));
 
-		// Add an extra keyframe for the last frame
-		if(flv->index.flvtag[flv->audio.lastframeindex].keyframe == 0) {
-			flv->index.flvtag[flv->audio.lastframeindex].keyframe = 1;
-			flv->keyframes.nkeyframes++;
-		}
+	bitstream->cache <<= nbits;
 
-		flv->canseektoend = 1;
-		flv->keyframes.lastkeyframeindex = flv->audio.lastframeindex;
-	}
+	// Reading beyond the end of the bitstream yields zero bits
+	if(bitstream->bits < nbits)
+		bitstream->bits = 0;
 	else
-		flv->options.addaudiokeyframes = 0;
+		bitstream->bits -= nbits;
 
-#ifdef DEBUG
-	fprintf(stderr, "[FLV] keyframes.nkeyframes = %d\n", flv->keyframes.nkeyframes);
-	fprintf(stderr, "[FLV] keyframes.lastkeyframeindex = %d\n", flv->keyframes.lastkeyframeindex);
-#endif
+	return rv;
+}
 
-	// Allocate some memory for the keyframe index
-	if(flv->keyframes.nkeyframes != 0) {
-		flv->haskeyframes = 1;
+int readBit(bitstream_t *bitstream) {
+	return readBits(bitstream, 1);
+}
 
-		flv->keyframes.keyframelocations = (off_t *)calloc(flv->keyframes.nkeyframes, sizeof(off_t));
-		if(flv->keyframes.keyframelocations == NULL)
-			return YAMDI_OUT_OF_MEMORY;
+int bufferInit(buffer_t *buffer) {
+	if(buffer == NULL)
+		return YAMDI_ERROR;
 
-		flv->keyframes.keyframetimestamps = (int *)calloc(flv->keyframes.nkeyframes, sizeof(int));
-		if(flv->keyframes.keyframetimestamps == NULL)
-			return YAMDI_OUT_OF_MEMORY;
+	buffer->data = NULL;
+	buffer->size = 0;
+	buffer->used = 0;
+
+	return YAMDI_OK;
+}
+
+int bufferFree(buffer_t *buffer) {
+	if(buffer == NULL)
+		return YAMDI_ERROR;
+
+	if(buffer->data != NULL) {
+		free(buffer->data);
+		buffer->data = NULL;
 	}
 
 	return YAMDI_OK;
 }
 
-int finalizeFLV(FLV_t *flv, FILE *fp) {
-	size_t i, index;
-	FLVTag_t *flvtag;
+int bufferReset(buffer_t *buffer) {
+	if(buffer == NULL)
+		return YAMDI_ERROR;
 
-	// 2 passes
-	// 1. create onmetadata event to get the size of it (it doesn't matter if the values are not yet correct)
-	// 2. calculate the new keyframelocations and the final filesize
-	//    pay attention to the size of these events
-	//        onmetadata
-	//        onlastsecond
-	//        onlastkeyframe
-	//        (oncuepoint) keep them from the input flv?
-	// 3. recreate the onmetadata event with the correct values
-	// filesize
-	// keyframelocations
-	// lastkeyframelocation
+	buffer->used = 0;
 
-	// Create the metadata tags. Even though we don't have all values,
-	// the size will not change. We need the size.
-	createFLVEvents(flv);
+	return YAMDI_OK;
+}
 
-	// Start calculating the final filesize
-	flv->filesize = 0;
+int bufferAppendString(buffer_t *dst, const unsigned char *string) {
+	if(string == NULL)
+		return YAMDI_OK;
 
-	// FLV header + PreviousTagSize
-	flv->filesize += FLV_SIZE_HEADER + FLV_SIZE_PREVIOUSTAGSIZE;
+	return bufferAppendBytes(dst, string, strlen((char *)string));
+}
 
-	// onMetaData event
-	if(flv->options.addonmetadata == 1)
-		flv->filesize += flv->onmetadata.used;
+int bufferAppendBuffer(buffer_t *dst, buffer_t *src) {
+	if(src == NULL)
+		return YAMDI_OK;
 
-	// Calculate the final filesize and update the keyframe index
-	index = 0;
-	for(i = 0; i < flv->index.nflvtags; i++) {
-		flvtag = &flv->index.flvtag[i];
+	return bufferAppendBytes(dst, src->data, src->used);
+}
 
-		// Skip every script tag (subject to change if we want to keep existing events)
-		if(flvtag->tagtype != FLV_TAG_AUDIO && flvtag->tagtype != FLV_TAG_VIDEO)
-			continue;
+int bufferAppendBytes(buffer_t *dst, const unsigned char *bytes, size_t nbytes) {
+	size_t size;
+	unsigned char *data;
 
-		// Take care of the onlastsecond event
-		if(flv->options.addonlastsecond == 1 && flv->lastsecondindex == i)
-			flv->filesize += flv->onlastsecond.used;
+	if(dst == NULL)
+		return YAMDI_ERROR;
 
-		// Update the keyframe index only if there are keyframes ...
-		if(flv->haskeyframes == 1) {
-			if(flvtag->tagtype == FLV_TAG_VIDEO || flvtag->tagtype == FLV_TAG_AUDIO) {
-				// Keyframes
-				if(flvtag->keyframe == 1) {
-					// Take care of the onlastkeyframe event
-					if(flv->options.addonlastkeyframe == 1 && flv->keyframes.lastkeyframeindex == i)
-						flv->filesize += flv->onlastkeyframe.used;
+	if(bytes == NULL)
+		return YAMDI_OK;
 
-					flv->keyframes.keyframelocations[index] = flv->filesize;
-					flv->keyframes.keyframetimestamps[index] = flvtag->timestamp;
+	if(nbytes == 0)
+		return YAMDI_OK;
 
-					index++;
-				}
-			}
-		}
+	// Check if we have to increase the buffer size
+	if(dst->size < dst->used + nbytes) {
+		// Pre-allocating some memory. Round up to the next 1024 bound,
+		// but at least double the size for buffers that grow a lot (XML)
+		size = ((dst->used + nbytes) / 1024 + 1) * 1024;
+		if(size < 2 * dst->size)
+			size = 2 * dst->size;
 
-		flv->filesize += flvtag->tagsize + FLV_SIZE_PREVIOUSTAGSIZE;
-	}
+		data = (unsigned char *)realloc(dst->data, size);
+		if(data == NULL)
+			return YAMDI_ERROR;
 
-	if(flv->haskeyframes == 1) {
-		flv->keyframes.lastkeyframetimestamp = flv->keyframes.keyframetimestamps[flv->keyframes.nkeyframes - 1];
-		flv->keyframes.lastkeyframelocation = flv->keyframes.keyframelocations[flv->keyframes.nkeyframes - 1];
+		dst->data = data;
+		dst->size = size;
 	}
 
-#ifdef DEBUG
-	fprintf(stderr, "[FLV] keyframes.lastkeyframetimestamp = %d ms\n", flv->keyframes.lastkeyframetimestamp);
-	fprintf(stderr, "[FLV] keyframes.lastkeyframelocation = %" PRIi64 "\n", flv->keyframes.lastkeyframelocation);
-
-	fprintf(stderr, "[FLV] filesize = %" PRIu64 " kb\n", flv->filesize);
-#endif
+	// Copy the stuff into the buffer
+	memcpy(&dst->data[dst->used], bytes, nbytes);
 
-	// Create the metadata tags with the correct values
-	createFLVEvents(flv);
+	dst->used += nbytes;
 
 	return YAMDI_OK;
 }
 
-int writeFLV(FILE *out, FLV_t *flv, FILE *fp) {
-	size_t i, datasize = 0;
-	unsigned char *data = NULL, *d;
-	FLVTag_t *flvtag;
+int bufferAppendUInt64(buffer_t *dst, uint64_t value) {
+	int n;
+	unsigned char digits[20];
 
-	if(fp == NULL)
-		return YAMDI_ERROR;
+	// Same as printf("%" PRIu64)
+	n = sizeof(digits);
+	do {
+		digits[--n] = '0' + (unsigned char)(value % 10);
+		value /= 10;
+	} while(value != 0);
 
-	// Write the header
-	writeFLVHeader(out, flv->hasaudio, flv->hasvideo);
-	writeFLVPreviousTagSize(out, 0);
+	return bufferAppendBytes(dst, &digits[n], sizeof(digits) - n);
+}
 
-	// Write the onMetaData tag
-	if(flv->options.addonmetadata == 1)
-		fwrite(flv->onmetadata.data, flv->onmetadata.used, 1, out);
+int bufferAppendLE(buffer_t *dst, uint64_t value, int nbytes) {
+	int i;
+	unsigned char bytes[8];
 
-	// Copy the audio and video tags
-	for(i = 0; i < flv->index.nflvtags; i++) {
-		flvtag = &flv->index.flvtag[i];
+	for(i = 0; i < nbytes; i++) {
+		bytes[i] = (unsigned char)(value & 0xff);
+		value >>= 8;
+	}
 
-		// Skip every script tag (subject to change if we want to keep existing events)
-		if(flvtag->tagtype != FLV_TAG_AUDIO && flvtag->tagtype != FLV_TAG_VIDEO)
-			continue;
+	return bufferAppendBytes(dst, bytes, nbytes);
+}
 
-		// Write the onlastsecond event
-		if(flv->options.addonlastsecond == 1 && flv->lastsecondindex == i)
-			fwrite(flv->onlastsecond.data, flv->onlastsecond.used, 1, out);
+uint64_t readLE(const unsigned char *bytes, int nbytes) {
+	int i;
+	uint64_t value = 0;
 
-		// Write the onlastkeyframe event
-		if(flv->options.addonlastkeyframe == 1 && flv->keyframes.lastkeyframeindex == i)
-			fwrite(flv->onlastkeyframe.data, flv->onlastkeyframe.used, 1, out);
+	for(i = nbytes - 1; i >= 0; i--)
+		value = (value << 8) | bytes[i];
 
-		writeFLVDataTag(out, flvtag->tagtype, flvtag->timestamp, flvtag->datasize);
+	return value;
+}
 
-		// Read the data
-		if(flvtag->datasize > datasize) {
-			d = (unsigned char *)realloc(data, flvtag->datasize);
-			if(d == NULL)
-				return YAMDI_OUT_OF_MEMORY;
+int bufferAppendFixed2(buffer_t *dst, double value) {
+	int n;
+	double p, f;
+	int64_t k;
+	unsigned char digits[24];
+	char s[512];
+
+	// printf() for everything that doesn't fit into the exact integer range of a double
+	if(!(value > -1e13 && value < 1e13)) {
+		n = snprintf(s, sizeof(s), "%.2f", value);
+		if(n < 0 || n >= (int)sizeof(s))
+			return YAMDI_ERROR;
 
-			data = d;
-			datasize = flvtag->datasize;
-		}
+		return bufferAppendBytes(dst, (unsigned char *)s, n);
+	}
 
-		if(readFLVTagData(data, flvtag->datasize, flvtag, fp) != YAMDI_OK)
-			return YAMDI_READ_ERROR;
+	if(signbit(value)) {
+		bufferAppendBytes(dst, (unsigned char *)"-", 1);
+		value = -value;
+	}
 
-		fwrite(data, flvtag->datasize, 1, out);
+	// Same as printf("%.2f"): the exact binary value is rounded to the nearest
+	// hundredth, ties to even. The product with 100 is rounded itself, so it
+	// can only be trusted if it is far enough from a tie or an integer.
+	p = value * 100.0;
+	k = (int64_t)p;
+	f = p - (double)k;
 
-		writeFLVPreviousTagSize(out, flvtag->tagsize);
+	if(p < 1e9 && f > 1e-6 && f < 1.0 - 1e-6 && (f < 0.5 - 1e-6 || f > 0.5 + 1e-6)) {
+		if(f > 0.5)
+			k++;
+	}
+	else {
+		// fma() computes value * 100 - x with only one rounding, so the sign is exact
+		if(fma(value, 100.0, -(double)k) < 0.0)
+			k--;
+		else if(fma(value, 100.0, -(double)(k + 1)) >= 0.0)
+			k++;
+
+		f = fma(value, 100.0, -((double)k + 0.5));
+		if(f > 0.0 || (f == 0.0 && (k & 1) == 1))
+			k++;
 	}
 
-	if(data != NULL)
-		free(data);
+	n = sizeof(digits);
+	digits[--n] = '0' + (unsigned char)(k % 10);
+	digits[--n] = '0' + (unsigned char)((k / 10) % 10);
+	digits[--n] = '.';
 
-	// We are done!
+	k /= 100;
+	do {
+		digits[--n] = '0' + (unsigned char)(k % 10);
+		k /= 10;
+	} while(k != 0);
 
-	return YAMDI_OK;
+	return bufferAppendBytes(dst, &digits[n], sizeof(digits) - n);
 }
 
-int writeFLVHeader(FILE *fp, int hasaudio, int hasvideo) {
-	unsigned char bytes[FLV_SIZE_HEADER];
+int bufferReserve(buffer_t *buffer, size_t size) {
+	unsigned char *data;
 
-	// Signature
-	bytes[0] = 'F';
-	bytes[1] = 'L';
-	bytes[2] = 'V';
+	if(buffer == NULL)
+		return YAMDI_ERROR;
 
-	// Version
-	bytes[3] = 1;
+	// Make sure there is room for at least size bytes. The content is not preserved.
+	if(buffer->size < size) {
+		data = (unsigned char *)realloc(buffer->data, size);
+		if(data == NULL)
+			return YAMDI_OUT_OF_MEMORY;
 
-	// Flags
-	bytes[4] = 0;
+		buffer->data = data;
+		buffer->size = size;
+	}
 
-	if(hasaudio == 1)
-		bytes[4] |= 0x4;
+	buffer->used = 0;
 
-	if(hasvideo == 1)
-		bytes[4] |= 0x1;
+	return YAMDI_OK;
+}
 
-	// DataOffset
-	bytes[5] = ((FLV_SIZE_HEADER >> 24) & 0xff);
-	bytes[6] = ((FLV_SIZE_HEADER >> 16) & 0xff);
-	bytes[7] = ((FLV_SIZE_HEADER >>  8) & 0xff);
-	bytes[8] = ((FLV_SIZE_HEADER >>  0) & 0xff);
+int isBigEndian(void) {
+	long one = 1;
+	return !(*((char *)(&one)));
+}
+
+int parseSize(const char *s, uint64_t *size) {
+	char *end;
+
+	if(*s < '0' || *s > '9')
+		return YAMDI_ERROR;
+
+	*size = (uint64_t)strtoull(s, &end, 10);
+
+	// 512K, 64M or 2G
+	if(*end == 'k' || *end == 'K')
+		*size *= 1024ULL;
+	else if(*end == 'm' || *end == 'M')
+		*size *= 1024ULL * 1024ULL;
+	else if(*end == 'g' || *end == 'G')
+		*size *= 1024ULL * 1024ULL * 1024ULL;
+	else
+		end--;
 
-	fwrite(bytes, FLV_SIZE_HEADER, 1, fp);
+	if(*(end + 1) != '\0')
+		return YAMDI_ERROR;
 
 	return YAMDI_OK;
 }
 
-int createFLVEvents(FLV_t *flv) {
-	if(flv->options.addonmetadata == 1)
-		createFLVEventOnMetaData(flv);
+void writeXMLMetadata(FILE *fp, const char *infile, const char *outfile, FLV_t *flv) {
+	buffer_t buffer;
 
-	if(flv->options.addonlastkeyframe == 1)
-		createFLVEventOnLastKeyframe(flv);
+	bufferInit(&buffer);
+
+	writeBufferXMLHeader(&buffer);
+	writeBufferXMLMetadata(&buffer, infile, outfile, flv);
+	writeBufferXMLFooter(&buffer);
+
+	writeBytes(buffer.data, buffer.used, fp);
+
+	bufferFree(&buffer);
+
+	return;
+}
+
+int writeBufferXMLHeader(buffer_t *buffer) {
+	bufferAppendString(buffer, (unsigned char *)"<?xml version='1.0' encoding='UTF-8'?>\n");
+	bufferAppendString(buffer, (unsigned char *)"<fileset>\n");
+
+	return YAMDI_OK;
+}
 
-	if(flv->options.addonlastsecond == 1)
-		createFLVEventOnLastSecond(flv);
+int writeBufferXMLFooter(buffer_t *buffer) {
+	bufferAppendString(buffer, (unsigned char *)"</fileset>\n");
 
 	return YAMDI_OK;
 }
 
-int createFLVEventOnMetaData(FLV_t *flv) {
-	int pass = 0;
-	size_t i, length = 0;
-	buffer_t b;
+int writeBufferXMLMetadata(buffer_t *buffer, const char *infile, const char *outfile, FLV_t *flv) {
+	size_t i;
 
-	bufferInit(&b);
+	bufferAppendString(buffer, (unsigned char *)"<flv name=\"");
+	bufferAppendString(buffer, (unsigned char *)((outfile != NULL) ? outfile : infile));
+	bufferAppendString(buffer, (unsigned char *)"\">\n");
 
-onmetadatapass:
-	bufferReset(&b);
+	writeBufferXMLBool(buffer, "hasKeyframes", flv->haskeyframes);
+	writeBufferXMLBool(buffer, "hasVideo", flv->hasvideo);
+	writeBufferXMLBool(buffer, "hasAudio", flv->hasaudio);
+	writeBufferXMLBool(buffer, "hasMetadata", 1);
+	writeBufferXMLBool(buffer, "hasCuePoints", flv->hascuepoints);
+	writeBufferXMLBool(buffer, "canSeekToEnd", flv->canseektoend);
 
-	// ScriptDataObject
-	writeBufferFLVScriptDataObject(&b);
+	writeBufferXMLInt(buffer, "audiocodecid", flv->audio.codecid);
+	writeBufferXMLInt(buffer, "audiosamplerate", flv->audio.samplerate);
+	writeBufferXMLInt(buffer, "audiodatarate", (int)flv->audio.datarate);
+	writeBufferXMLInt(buffer, "audiosamplesize", flv->audio.samplesize);
+	writeBufferXMLDouble(buffer, "audiodelay", (double)flv->audio.delay);
+	writeBufferXMLBool(buffer, "stereo", flv->audio.stereo);
 
-	writeBufferFLVScriptDataECMAArray(&b, "onMetaData", length);
+	writeBufferXMLInt(buffer, "videocodecid", flv->video.codecid);
+	writeBufferXMLDouble(buffer, "framerate", flv->video.framerate);
+	writeBufferXMLInt(buffer, "videodatarate", (int)flv->video.datarate);
+	writeBufferXMLInt(buffer, "height", (int)flv->video.height);
+	writeBufferXMLInt(buffer, "width", (int)flv->video.width);
 
-	length = 0;
+	writeBufferXMLUInt64(buffer, "datasize", flv->datasize);
+	writeBufferXMLUInt64(buffer, "audiosize", flv->audio.size);
+	writeBufferXMLUInt64(buffer, "videosize", flv->video.size);
 
-	if(strlen(flv->options.creator) != 0) {
-		writeBufferFLVScriptDataValueString(&b, "creator", flv->options.creator); length++;
-	}
+	// --probe doesn't know the size of the output and the file positions in it
+	if(flv->options.probe == 0)
+		writeBufferXMLUInt64(buffer, "filesize", flv->filesize);
 
-	writeBufferFLVScriptDataValueString(&b, "metadatacreator", "Yet Another Metadata Injector for FLV - Version " YAMDI_VERSION "\0"); length++;
-	writeBufferFLVScriptDataValueBool(&b, "hasKeyframes", flv->haskeyframes); length++;
-	writeBufferFLVScriptDataValueBool(&b, "hasVideo", flv->hasvideo); length++;
-	writeBufferFLVScriptDataValueBool(&b, "hasAudio", flv->hasaudio); length++;
-	writeBufferFLVScriptDataValueBool(&b, "hasMetadata", 1); length++;
-	writeBufferFLVScriptDataValueBool(&b, "canSeekToEnd", flv->canseektoend); length++;
+	writeBufferXMLDouble(buffer, "lasttimestamp", (double)flv->lasttimestamp / 1000.0);
+	writeBufferXMLDouble(buffer, "lastvideoframetimestamp", (double)flv->video.lasttimestamp / 1000.0);
 
-	writeBufferFLVScriptDataValueDouble(&b, "duration", (double)flv->lasttimestamp / 1000.0); length++;
-	writeBufferFLVScriptDataValueDouble(&b, "datasize", (double)flv->datasize); length++;
+	if(flv->keyframes.lastkeyframetimestamp >= 0)
+		writeBufferXMLDouble(buffer, "lastkeyframetimestamp", (double)flv->keyframes.lastkeyframetimestamp / 1000.0);
 
-	if(flv->hasvideo == 1) {
-		writeBufferFLVScriptDataValueDouble(&b, "videosize", (double)flv->video.size); length++;
-		writeBufferFLVScriptDataValueDouble(&b, "framerate", (double)flv->video.framerate); length++;
-		writeBufferFLVScriptDataValueDouble(&b, "videodatarate", (double)flv->video.datarate); length++;
+	if(flv->options.probe == 0)
+		writeBufferXMLUInt64(buffer, "lastkeyframelocation", (uint64_t)flv->keyframes.lastkeyframelocation);
 
-		if(flv->video.analyzed == 1) {
-			writeBufferFLVScriptDataValueDouble(&b, "videocodecid", (double)flv->video.codecid); length++;
-			writeBufferFLVScriptDataValueDouble(&b, "width", (double)flv->video.width); length++;
-			writeBufferFLVScriptDataValueDouble(&b, "height", (double)flv->video.height); length++;
+	if(flv->options.xmlomitkeyframes == 0) {
+		bufferAppendString(buffer, (unsigned char *)"<keyframes>\n");
+		bufferAppendString(buffer, (unsigned char *)"<times>\n");
+
+		for(i = 0; i < flv->keyframes.nkeyframes; i++) {
+			bufferAppendString(buffer, (unsigned char *)"<value id=\"");
+			bufferAppendUInt64(buffer, (uint64_t)i);
+			bufferAppendString(buffer, (unsigned char *)"\">");
+			bufferAppendFixed2(buffer, (double)flv->keyframes.keyframetimestamps[i] / 1000.0);
+			bufferAppendString(buffer, (unsigned char *)"</value>\n");
 		}
-	}
 
-	if(flv->hasaudio == 1) {
-		writeBufferFLVScriptDataValueDouble(&b, "audiosize", (double)flv->audio.size); length++;
-		writeBufferFLVScriptDataValueDouble(&b, "audiodatarate", (double)flv->audio.datarate); length++;
+		bufferAppendString(buffer, (unsigned char *)"</times>\n");
+		bufferAppendString(buffer, (unsigned char *)"<filepositions>\n");
 
-		if(flv->audio.analyzed == 1) {
-			writeBufferFLVScriptDataValueDouble(&b, "audiocodecid", (double)flv->audio.codecid); length++;
-			writeBufferFLVScriptDataValueDouble(&b, "audiosamplerate", (double)flv->audio.samplerate); length++;
-			writeBufferFLVScriptDataValueDouble(&b, "audiosamplesize", (double)flv->audio.samplesize); length++;
-			writeBufferFLVScriptDataValueBool(&b, "stereo", flv->audio.stereo); length++;
+		for(i = 0; i < flv->keyframes.nkeyframes; i++) {
+			bufferAppendString(buffer, (unsigned char *)"<value id=\"");
+			bufferAppendUInt64(buffer, (uint64_t)i);
+			bufferAppendString(buffer, (unsigned char *)"\">");
+			bufferAppendUInt64(buffer, (uint64_t)flv->keyframes.keyframelocations[i]);
+			bufferAppendString(buffer, (unsigned char *)"</value>\n");
 		}
+
+		bufferAppendString(buffer, (unsigned char *)"</filepositions>\n");
+		bufferAppendString(buffer, (unsigned char *)"</keyframes>\n");
 	}
 
-	writeBufferFLVScriptDataValueDouble(&b, "filesize", (double)flv->filesize); length++;
-	writeBufferFLVScriptDataValueDouble(&b, "lasttimestamp", (double)flv->lasttimestamp / 1000.0); length++;
+	writeBufferXMLDouble(buffer, "duration", (double)(flv->lasttimestamp - flv->firsttimestamp) / 1000.0);
+	writeBufferChecksumXML(buffer, &flv->checksum);
+	bufferAppendString(buffer, (unsigned char *)"</flv>\n");
 
-	if(flv->haskeyframes == 1) {
-		writeBufferFLVScriptDataValueDouble(&b, "lastkeyframetimestamp", (double)flv->keyframes.lastkeyframetimestamp / 1000.0); length++;
-		writeBufferFLVScriptDataValueDouble(&b, "lastkeyframelocation", (double)flv->keyframes.lastkeyframelocation); length++;
+	return YAMDI_OK;
+}
 
-		writeBufferFLVScriptDataVariableArray(&b, "keyframes"); length++;
+int writeBufferXMLBool(buffer_t *buffer, const char *name, int value) {
+	bufferAppendBytes(buffer, (unsigned char *)"<", 1);
+	bufferAppendString(buffer, (unsigned char *)name);
+	bufferAppendString(buffer, (unsigned char *)((value != 0) ? ">true</" : ">false</"));
+	bufferAppendString(buffer, (unsigned char *)name);
+	bufferAppendBytes(buffer, (unsigned char *)">\n", 2);
 
-			writeBufferFLVScriptDataValueArray(&b, "filepositions", flv->keyframes.nkeyframes);
+	return YAMDI_OK;
+}
 
-			for(i = 0; i < flv->keyframes.nkeyframes; i++)
-				writeBufferFLVScriptDataValueDouble(&b, NULL, (double)flv->keyframes.keyframelocations[i]);
+int writeBufferXMLInt(buffer_t *buffer, const char *name, int value) {
+	bufferAppendBytes(buffer, (unsigned char *)"<", 1);
+	bufferAppendString(buffer, (unsigned char *)name);
+	bufferAppendBytes(buffer, (unsigned char *)">", 1);
 
-			writeBufferFLVScriptDataValueArray(&b, "times", flv->keyframes.nkeyframes);
+	if(value < 0) {
+		bufferAppendBytes(buffer, (unsigned char *)"-", 1);
+		bufferAppendUInt64(buffer, (uint64_t)(-(int64_t)value));
+	}
+	else
+		bufferAppendUInt64(buffer, (uint64_t)value);
 
-			for(i = 0; i < flv->keyframes.nkeyframes; i++)
-				writeBufferFLVScriptDataValueDouble(&b, NULL, (double)flv->keyframes.keyframetimestamps[i] / 1000.0);
+	bufferAppendBytes(buffer, (unsigned char *)"</", 2);
+	bufferAppendString(buffer, (unsigned char *)name);
+	bufferAppendBytes(buffer, (unsigned char *)">\n", 2);
 
-		writeBufferFLVScriptDataVariableArrayEnd(&b);
-	}
+	return YAMDI_OK;
+}
 
-	writeBufferFLVScriptDataVariableArrayEnd(&b);
+int writeBufferXMLUInt64(buffer_t *buffer, const char *name, uint64_t value) {
+	bufferAppendBytes(buffer, (unsigned char *)"<", 1);
+	bufferAppendString(buffer, (unsigned char *)name);
+	bufferAppendBytes(buffer, (unsigned char *)">", 1);
+	bufferAppendUInt64(buffer, value);
+	bufferAppendBytes(buffer, (unsigned char *)"</", 2);
+	bufferAppendString(buffer, (unsigned char *)name);
+	bufferAppendBytes(buffer, (unsigned char *)">\n", 2);
 
-	if(pass == 0) {
-		pass = 1;
-		goto onmetadatapass;
-	}
+	return YAMDI_OK;
+}
 
-	// Write the onMetaData tag
-	bufferReset(&flv->onmetadata);
+int writeBufferXMLDouble(buffer_t *buffer, const char *name, double value) {
+	bufferAppendBytes(buffer, (unsigned char *)"<", 1);
+	bufferAppendString(buffer, (unsigned char *)name);
+	bufferAppendBytes(buffer, (unsigned char *)">", 1);
+	bufferAppendFixed2(buffer, value);
+	bufferAppendBytes(buffer, (unsigned char *)"</", 2);
+	bufferAppendString(buffer, (unsigned char *)name);
+	bufferAppendBytes(buffer, (unsigned char *)">\n", 2);
 
-	writeBufferFLVScriptDataTag(&flv->onmetadata, 0, b.used);
-	bufferAppendBuffer(&flv->onmetadata, &b);
-	writeBufferFLVPreviousTagSize(&flv->onmetadata, flv->onmetadata.used);
+	return YAMDI_OK;
+}
 
-	bufferFree(&b);
+int writeBufferJSONHeader(buffer_t *buffer) {
+	bufferAppendString(buffer, (unsigned char *)"{\"fileset\":[");
 
 	return YAMDI_OK;
 }
 
-int createFLVEventOnLastSecond(FLV_t *flv) {
-	buffer_t b;
+int writeBufferJSONFooter(buffer_t *buffer) {
+	bufferAppendString(buffer, (unsigned char *)"]}\n");
 
-	bufferInit(&b);
+	return YAMDI_OK;
+}
 
-	// ScriptDataObject
-	writeBufferFLVScriptDataObject(&b);
+int writeBufferJSONMetadata(buffer_t *buffer, const char *infile, const char *outfile, FLV_t *flv) {
+	size_t i;
 
-	writeBufferFLVScriptDataECMAArray(&b, "onLastSecond", 0);
-	writeBufferFLVScriptDataVariableArrayEnd(&b);
+	// Separate the files in the fileset
+	if(buffer->used != 0 && buffer->data[buffer->used - 1] != '[')
+		bufferAppendBytes(buffer, (unsigned char *)",", 1);
 
-	// Write the onLastSecond tag
-	bufferReset(&flv->onlastsecond);
+	bufferAppendString(buffer, (unsigned char *)"{\"name\":");
+	writeBufferJSONString(buffer, (outfile != NULL) ? outfile : infile);
 
-	writeBufferFLVScriptDataTag(&flv->onlastsecond, flv->lastsecond, b.used);
-	bufferAppendBuffer(&flv->onlastsecond, &b);
-	writeBufferFLVPreviousTagSize(&flv->onlastsecond, flv->onlastsecond.used);
+	writeBufferJSONBool(buffer, "hasKeyframes", flv->haskeyframes);
+	writeBufferJSONBool(buffer, "hasVideo", flv->hasvideo);
+	writeBufferJSONBool(buffer, "hasAudio", flv->hasaudio);
+	writeBufferJSONBool(buffer, "hasMetadata", 1);
+	writeBufferJSONBool(buffer, "hasCuePoints", flv->hascuepoints);
+	writeBufferJSONBool(buffer, "canSeekToEnd", flv->canseektoend);
 
-	bufferFree(&b);
+	writeBufferJSONInt(buffer, "audiocodecid", flv->audio.codecid);
+	writeBufferJSONInt(buffer, "audiosamplerate", flv->audio.samplerate);
+	writeBufferJSONInt(buffer, "audiodatarate", (int)flv->audio.datarate);
+	writeBufferJSONInt(buffer, "audiosamplesize", flv->audio.samplesize);
+	writeBufferJSONDouble(buffer, "audiodelay", (double)flv->audio.delay);
+	writeBufferJSONBool(buffer, "stereo", flv->audio.stereo);
+
+	writeBufferJSONInt(buffer, "videocodecid", flv->video.codecid);
+	writeBufferJSONDouble(buffer, "framerate", flv->video.framerate);
+	writeBufferJSONInt(buffer, "videodatarate", (int)flv->video.datarate);
+	writeBufferJSONInt(buffer, "height", flv->video.height);
+	writeBufferJSONInt(buffer, "width", flv->video.width);
+
+	writeBufferJSONUInt64(buffer, "datasize", flv->datasize);
+	writeBufferJSONUInt64(buffer, "audiosize", flv->audio.size);
+	writeBufferJSONUInt64(buffer, "videosize", flv->video.size);
+
+	// Same as in writeBufferXMLMetadata()
+	if(flv->options.probe == 0)
+		writeBufferJSONUInt64(buffer, "filesize", flv->filesize);
+
+	writeBufferJSONDouble(buffer, "lasttimestamp", (double)flv->lasttimestamp / 1000.0);
+	writeBufferJSONDouble(buffer, "lastvideoframetimestamp", (double)flv->video.lasttimestamp / 1000.0);
+
+	if(flv->keyframes.lastkeyframetimestamp >= 0)
+		writeBufferJSONDouble(buffer, "lastkeyframetimestamp", (double)flv->keyframes.lastkeyframetimestamp / 1000.0);
+
+	if(flv->options.probe == 0)
+		writeBufferJSONUInt64(buffer, "lastkeyframelocation", (uint64_t)flv->keyframes.lastkeyframelocation);
+
+	if(flv->options.xmlomitkeyframes == 0) {
+		bufferAppendString(buffer, (unsigned char *)",\"keyframes\":{\"times\":[");
+
+		for(i = 0; i < flv->keyframes.nkeyframes; i++) {
+			if(i != 0)
+				bufferAppendBytes(buffer, (unsigned char *)",", 1);
+
+			bufferAppendFixed2(buffer, (double)flv->keyframes.keyframetimestamps[i] / 1000.0);
+		}
+
+		bufferAppendString(buffer, (unsigned char *)"],\"filepositions\":[");
+
+		for(i = 0; i < flv->keyframes.nkeyframes; i++) {
+			if(i != 0)
+				bufferAppendBytes(buffer, (unsigned char *)",", 1);
+
+			bufferAppendUInt64(buffer, (uint64_t)flv->keyframes.keyframelocations[i]);
+		}
+
+		bufferAppendString(buffer, (unsigned char *)"]}");
+	}
+
+	writeBufferJSONDouble(buffer, "duration", (double)(flv->lasttimestamp - flv->firsttimestamp) / 1000.0);
+	writeBufferChecksumJSON(buffer, &flv->checksum);
+	bufferAppendBytes(buffer, (unsigned char *)"}", 1);
 
 	return YAMDI_OK;
 }
 
-int createFLVEventOnLastKeyframe(FLV_t *flv) {
-	buffer_t b;
+int writeBufferJSONString(buffer_t *buffer, const char *s) {
+	unsigned char c, hex[6] = {'\\', 'u', '0', '0', '0', '0'};
+	const char *digits = "0123456789abcdef";
 
-	bufferInit(&b);
+	bufferAppendBytes(buffer, (unsigned char *)"\"", 1);
 
-	// ScriptDataObject
-	writeBufferFLVScriptDataObject(&b);
+	for(; *s != '\0'; s++) {
+		c = (unsigned char)*s;
 
-	writeBufferFLVScriptDataECMAArray(&b, "onLastKeyframe", 0);
-	writeBufferFLVScriptDataVariableArrayEnd(&b);
+		if(c == '"' || c == '\\') {
+			bufferAppendBytes(buffer, (unsigned char *)"\\", 1);
+			bufferAppendBytes(buffer, &c, 1);
+		}
+		else if(c < 0x20) {
+			hex[4] = digits[c >> 4];
+			hex[5] = digits[c & 0x0f];
+			bufferAppendBytes(buffer, hex, sizeof(hex));
+		}
+		else
+			bufferAppendBytes(buffer, &c, 1);
+	}
 
-	// Write the onLastKeyframe tag
-	bufferReset(&flv->onlastkeyframe);
+	bufferAppendBytes(buffer, (unsigned char *)"\"", 1);
 
-	writeBufferFLVScriptDataTag(&flv->onlastkeyframe, flv->keyframes.lastkeyframetimestamp - 1, b.used);
-	bufferAppendBuffer(&flv->onlastkeyframe, &b);
-	writeBufferFLVPreviousTagSize(&flv->onlastkeyframe, flv->onlastkeyframe.used);
+	return YAMDI_OK;
+}
 
-	bufferFree(&b);
+int writeBufferJSONName(buffer_t *buffer, const char *name) {
+	bufferAppendBytes(buffer, (unsigned char *)",\"", 2);
+	bufferAppendString(buffer, (unsigned char *)name);
+	bufferAppendBytes(buffer, (unsigned char *)"\":", 2);
 
 	return YAMDI_OK;
 }
 
-int writeBufferFLVScriptDataTag(buffer_t *buffer, int timestamp, size_t datasize) {
-	unsigned char bytes[FLV_SIZE_TAGHEADER];
-
-	bytes[ 0] = FLV_TAG_SCRIPTDATA;
+int writeBufferJSONBool(buffer_t *buffer, const char *name, int value) {
+	writeBufferJSONName(buffer, name);
+	bufferAppendString(buffer, (unsigned char *)((value != 0) ? "true" : "false"));
 
-	// DataSize
-	bytes[ 1] = ((datasize >> 16) & 0xff);
-	bytes[ 2] = ((datasize >>  8) & 0xff);
-	bytes[ 3] = ((datasize >>  0) & 0xff);
+	return YAMDI_OK;
+}
 
-	// Timestamp
-	bytes[ 4] = ((timestamp >> 16) & 0xff);
-	bytes[ 5] = ((timestamp >>  8) & 0xff);
-	bytes[ 6] = ((timestamp >>  0) & 0xff);
+int writeBufferJSONInt(buffer_t *buffer, const char *name, int value) {
+	writeBufferJSONName(buffer, name);
 
-	// TimestampExtended
-	bytes[ 7] = ((timestamp >> 24) & 0xff);
+	if(value < 0) {
+		bufferAppendBytes(buffer, (unsigned char *)"-", 1);
+		bufferAppendUInt64(buffer, (uint64_t)(-(int64_t)value));
+	}
+	else
+		bufferAppendUInt64(buffer, (uint64_t)value);
 
-	// StreamID
-	bytes[ 8] = 0;
-	bytes[ 9] = 0;
-	bytes[10] = 0;
+	return YAMDI_OK;
+}
 
-	bufferAppendBytes(buffer, bytes, FLV_SIZE_TAGHEADER);
+int writeBufferJSONUInt64(buffer_t *buffer, const char *name, uint64_t value) {
+	writeBufferJSONName(buffer, name);
+	bufferAppendUInt64(buffer, value);
 
 	return YAMDI_OK;
 }
 
-int writeFLVDataTag(FILE *fp, int type, int timestamp, size_t datasize) {
-	unsigned char bytes[FLV_SIZE_TAGHEADER];
+int writeBufferJSONDouble(buffer_t *buffer, const char *name, double value) {
+	writeBufferJSONName(buffer, name);
 
-	bytes[ 0] = type;
+	// JSON has no representation for NaN and infinity
+	if(isfinite(value))
+		bufferAppendFixed2(buffer, value);
+	else
+		bufferAppendString(buffer, (unsigned char *)"null");
 
-	// DataSize
-	bytes[ 1] = ((datasize >> 16) & 0xff);
-	bytes[ 2] = ((datasize >>  8) & 0xff);
-	bytes[ 3] = ((datasize >>  0) & 0xff);
+	return YAMDI_OK;
+}
 
-	// Timestamp
-	bytes[ 4] = ((timestamp >> 16) & 0xff);
-	bytes[ 5] = ((timestamp >>  8) & 0xff);
-	bytes[ 6] = ((timestamp >>  0) & 0xff);
+/*
+ * The seek table is a little endian binary file that can be mapped directly:
+ *
+ *   0  char[8]  magic "YAMDISTB"
+ *   8  uint32   version
+ *  12  uint32   size of the header
+ *  16  uint64   # of keyframes (n)
+ *  24  uint64   offset of the keyframe file positions (uint64[n])
+ *  32  uint64   offset of the keyframe timestamps in ms (int32[n])
+ *  40  uint8    hasAudio, hasVideo, hasKeyframes, canSeekToEnd, hasCuePoints, 3 reserved
+ *  48  uint16   audiocodecid, audiosamplerate, audiosamplesize, stereo
+ *  56  uint16   videocodecid, reserved
+ *  60  uint32   width, height
+ *  68  int32    audiodelay
+ *  72  double   framerate, audiodatarate, videodatarate
+ *  96  uint64   datasize, audiosize, videosize, filesize, lastkeyframelocation
+ * 136  int32    lasttimestamp, lastvideoframetimestamp, lastkeyframetimestamp in ms, reserved
+ * 152  uint64   reserved
+ *
+ * All offsets are from the beginning of the file and the arrays are naturally aligned.
+ * With --probe the filesize, the lastkeyframelocation and, if the last keyframe
+ * is not among the last tags, the lastkeyframetimestamp are unknown and 0.
+ */
+int writeBufferSeekTable(buffer_t *buffer, FLV_t *flv) {
+	size_t i, n;
+	union {
+		double d;
+		uint64_t u;
+	} v;
+
+	n = flv->keyframes.nkeyframes;
+
+	bufferAppendBytes(buffer, (unsigned char *)YAMDI_SEEKTABLE_MAGIC, 8);
+	bufferAppendLE(buffer, YAMDI_SEEKTABLE_VERSION, 4);
+	bufferAppendLE(buffer, YAMDI_SEEKTABLE_HEADERSIZE, 4);
+	bufferAppendLE(buffer, (uint64_t)n, 8);
+	bufferAppendLE(buffer, YAMDI_SEEKTABLE_HEADERSIZE, 8);
+	bufferAppendLE(buffer, YAMDI_SEEKTABLE_HEADERSIZE + 8 * (uint64_t)n, 8);
+
+	bufferAppendLE(buffer, flv->hasaudio != 0, 1);
+	bufferAppendLE(buffer, flv->hasvideo != 0, 1);
+	bufferAppendLE(buffer, flv->haskeyframes != 0, 1);
+	bufferAppendLE(buffer, flv->canseektoend != 0, 1);
+	bufferAppendLE(buffer, flv->hascuepoints != 0, 1);
+	bufferAppendLE(buffer, 0, 3);
+
+	bufferAppendLE(buffer, (uint16_t)flv->audio.codecid, 2);
+	bufferAppendLE(buffer, (uint16_t)flv->audio.samplerate, 2);
+	bufferAppendLE(buffer, (uint16_t)flv->audio.samplesize, 2);
+	bufferAppendLE(buffer, (uint16_t)flv->audio.stereo, 2);
+	bufferAppendLE(buffer, (uint16_t)flv->video.codecid, 2);
+	bufferAppendLE(buffer, 0, 2);
+	bufferAppendLE(buffer, (uint32_t)flv->video.width, 4);
+	bufferAppendLE(buffer, (uint32_t)flv->video.height, 4);
+	bufferAppendLE(buffer, (uint32_t)(int32_t)flv->audio.delay, 4);
+
+	v.d = flv->video.framerate;
+	bufferAppendLE(buffer, v.u, 8);
+	v.d = flv->audio.datarate;
+	bufferAppendLE(buffer, v.u, 8);
+	v.d = flv->video.datarate;
+	bufferAppendLE(buffer, v.u, 8);
+
+	bufferAppendLE(buffer, flv->datasize, 8);
+	bufferAppendLE(buffer, flv->audio.size, 8);
+	bufferAppendLE(buffer, flv->video.size, 8);
+	bufferAppendLE(buffer, (flv->options.probe == 0) ? flv->filesize : 0, 8);
+	bufferAppendLE(buffer, (uint64_t)flv->keyframes.lastkeyframelocation, 8);
+
+	bufferAppendLE(buffer, (uint32_t)flv->lasttimestamp, 4);
+	bufferAppendLE(buffer, (uint32_t)flv->video.lasttimestamp, 4);
+	bufferAppendLE(buffer, (uint32_t)((flv->keyframes.lastkeyframetimestamp >= 0) ? flv->keyframes.lastkeyframetimestamp : 0), 4);
+	bufferAppendLE(buffer, 0, 4);
+	bufferAppendLE(buffer, 0, 8);
+
+	for(i = 0; i < n; i++)
+		bufferAppendLE(buffer, (uint64_t)flv->keyframes.keyframelocations[i], 8);
+
+	for(i = 0; i < n; i++)
+		bufferAppendLE(buffer, (uint32_t)flv->keyframes.keyframetimestamps[i], 4);
 
-	// TimestampExtended
-	bytes[ 7] = ((timestamp >> 24) & 0xff);
+	return YAMDI_OK;
+}
 
-	// StreamID
-	bytes[ 8] = 0;
-	bytes[ 9] = 0;
-	bytes[10] = 0;
+/*
+ * The manifest describes the output of yamdi as a sequence of byte ranges of the
+ * input file and of the blob file (-o), which holds only the bytes that yamdi
+ * generates, e.g. the FLV header, the onMetaData tag and the PreviousTagSize fields:
+ *
+ *   {"input":"in.flv","blob":"out.blob","size":1234,"ranges":[["blob",0,1100],["input",1300,134],...]}
+ *
+ * Serving the ranges in this order, e.g. with sendfile(), gives the same bytes as -o without --manifest.
+ */
+int writeBufferManifest(buffer_t *buffer, const char *infile, const char *blobfile, FLVManifest_t *manifest) {
+	size_t i;
+	uint64_t size = 0;
+	FLVRange_t *range;
+
+	for(i = 0; i < manifest->nranges; i++)
+		size += (uint64_t)manifest->ranges[i].size;
+
+	bufferAppendString(buffer, (unsigned char *)"{\"input\":");
+	writeBufferJSONString(buffer, infile);
+	bufferAppendString(buffer, (unsigned char *)",\"blob\":");
+	writeBufferJSONString(buffer, blobfile);
+	writeBufferJSONUInt64(buffer, "size", size);
+	bufferAppendString(buffer, (unsigned char *)",\"ranges\":[");
+
+	for(i = 0; i < manifest->nranges; i++) {
+		range = &manifest->ranges[i];
+
+		if(i != 0)
+			bufferAppendBytes(buffer, (unsigned char *)",", 1);
+
+		bufferAppendString(buffer, (unsigned char *)((range->input == 1) ? "[\"input\"," : "[\"blob\","));
+		bufferAppendUInt64(buffer, (uint64_t)range->offset);
+		bufferAppendBytes(buffer, (unsigned char *)",", 1);
+		bufferAppendUInt64(buffer, (uint64_t)range->size);
+		bufferAppendBytes(buffer, (unsigned char *)"]", 1);
+	}
 
-	fwrite(bytes, FLV_SIZE_TAGHEADER, 1, fp);
+	bufferAppendString(buffer, (unsigned char *)"]}\n");
 
 	return YAMDI_OK;
 }
 
-int writeBufferFLVPreviousTagSize(buffer_t *buffer, size_t tagsize) {
-	unsigned char bytes[4];
+int writeBufferChecksumXML(buffer_t *buffer, checksum_t *checksum) {
+	int i;
 
-	bytes[0] = ((tagsize >> 24) & 0xff);
-	bytes[1] = ((tagsize >> 16) & 0xff);
-	bytes[2] = ((tagsize >>  8) & 0xff);
-	bytes[3] = ((tagsize >>  0) & 0xff);
+	for(i = 0; i < YAMDI_NCHECKSUMS; i++) {
+		if((checksum->algorithms & (1 << i)) == 0)
+			continue;
 
-	bufferAppendBytes(buffer, bytes, 4);
+		bufferAppendBytes(buffer, (unsigned char *)"<", 1);
+		bufferAppendString(buffer, (unsigned char *)checksumnames[i]);
+		bufferAppendBytes(buffer, (unsigned char *)">", 1);
+		writeBufferChecksumHex(buffer, checksum, 1 << i);
+		bufferAppendBytes(buffer, (unsigned char *)"</", 2);
+		bufferAppendString(buffer, (unsigned char *)checksumnames[i]);
+		bufferAppendBytes(buffer, (unsigned char *)">\n", 2);
+	}
 
 	return YAMDI_OK;
 }
 
-int writeFLVPreviousTagSize(FILE *fp, size_t tagsize) {
-	unsigned char bytes[4];
+int writeBufferChecksumJSON(buffer_t *buffer, checksum_t *checksum) {
+	int i;
 
-	bytes[0] = ((tagsize >> 24) & 0xff);
-	bytes[1] = ((tagsize >> 16) & 0xff);
-	bytes[2] = ((tagsize >>  8) & 0xff);
-	bytes[3] = ((tagsize >>  0) & 0xff);
+	for(i = 0; i < YAMDI_NCHECKSUMS; i++) {
+		if((checksum->algorithms & (1 << i)) == 0)
+			continue;
 
-	fwrite(bytes, 4, 1, fp);
+		writeBufferJSONName(buffer, checksumnames[i]);
+		bufferAppendBytes(buffer, (unsigned char *)"\"", 1);
+		writeBufferChecksumHex(buffer, checksum, 1 << i);
+		bufferAppendBytes(buffer, (unsigned char *)"\"", 1);
+	}
 
 	return YAMDI_OK;
 }
 
-int analyzeFLVH263VideoPacket(FLV_t *flv, FLVTag_t *flvtag, FILE *fp) {
-	int startcode, picturesize;
-	unsigned char *buffer, data[10];
+/*
+ * One line per file and checksum in the BSD style, e.g.
+ *
+ *   SHA256 (out.flv) = 9f86d081884c7d659a2feaa0c55ad015a3bf4f1b2b0b822cd15d6c15b0f00a08
+ *
+ * such that 'sha256sum -c' can check the SHA-256 lines.
+ */
+int writeBufferChecksumLines(buffer_t *buffer, const char *name, checksum_t *checksum) {
+	int i;
+	const char *tags[YAMDI_NCHECKSUMS] = {"CRC32C", "XXH64", "SHA256"};
 
-	readFLVTagData(data, sizeof(data), flvtag, fp);
-	// Skip the VIDEODATA header
-	buffer = &data[1];
+	for(i = 0; i < YAMDI_NCHECKSUMS; i++) {
+		if((checksum->algorithms & (1 << i)) == 0)
+			continue;
 
-	// 8bit  |pppppppp|pppppppp|pvvvvvrr|rrrrrrss|swwwwwww|whhhhhhh|h
-	// 16bit |pppppppp|pppppppp|pvvvvvrr|rrrrrrss|swwwwwww|wwwwwwww|whhhhhhh|hhhhhhhh|h
+		bufferAppendString(buffer, (unsigned char *)tags[i]);
+		bufferAppendBytes(buffer, (unsigned char *)" (", 2);
+		bufferAppendString(buffer, (unsigned char *)name);
+		bufferAppendBytes(buffer, (unsigned char *)") = ", 4);
+		writeBufferChecksumHex(buffer, checksum, 1 << i);
+		bufferAppendBytes(buffer, (unsigned char *)"\n", 1);
+	}
 
-	startcode = FLV_UI24(buffer) >> 7;
-	if(startcode != 1)
-		return YAMDI_ERROR;
+	return YAMDI_OK;
+}
 
-	picturesize = ((buffer[3] & 0x3) << 1) + ((buffer[4] >> 7) & 0x1);
+int writeBufferChecksumHex(buffer_t *buffer, checksum_t *checksum, int algorithm) {
+	int i, n = 0;
+	unsigned char bytes[32], hex[64];
+	const char *digits = "0123456789abcdef";
 
-	switch(picturesize) {
-		case 0: // Custom 8bit
-			flv->video.width = ((buffer[4] & 0x7f) << 1) + ((buffer[5] >> 7) & 0x1);
-			flv->video.height = ((buffer[5] & 0x7f) << 1) + ((buffer[6] >> 7) & 0x1);
-			break;
-		case 1: // Custom 16bit
-			flv->video.width = ((buffer[4] & 0x7f) << 9) + (buffer[5] << 1) + ((buffer[6] >> 7) & 0x1);
-			flv->video.height = ((buffer[6] & 0x7f) << 9) + (buffer[7] << 1) + ((buffer[8] >> 7) & 0x1);
-			break;
-		case 2: // CIF
-			flv->video.width = 352.0;
-			flv->video.height = 288.0;
-			break;
-		case 3: // QCIF
-			flv->video.width = 176.0;
-			flv->video.height = 144.0;
-			break;
-		case 4: // SQCIF
-			flv->video.width = 128.0;
-			flv->video.height = 96.0;
+	// The integer checksums are written in big endian, like the reference implementations print them
+	switch(algorithm) {
+		case YAMDI_CHECKSUM_CRC32C:
+			for(n = 0; n < 4; n++)
+				bytes[n] = (checksum->crc32c >> (24 - 8 * n)) & 0xff;
 			break;
-		case 5:
-			flv->video.width = 320.0;
-			flv->video.height = 240.0;
+		case YAMDI_CHECKSUM_XXH64:
+			for(n = 0; n < 8; n++)
+				bytes[n] = (checksum->xxh64digest >> (56 - 8 * n)) & 0xff;
 			break;
-		case 6:
-			flv->video.width = 160.0;
-			flv->video.height = 120.0;
+		case YAMDI_CHECKSUM_SHA256:
+			memcpy(bytes, checksum->sha256digest, 32);
+			n = 32;
 			break;
 		default:
 			break;
 	}
 
-	return YAMDI_OK;
-}
+	for(i = 0; i < n; i++) {
+		hex[2 * i] = digits[bytes[i] >> 4];
+		hex[2 * i + 1] = digits[bytes[i] & 0x0f];
+	}
 
-int analyzeFLVScreenVideoPacket(FLV_t *flv, FLVTag_t *flvtag, FILE *fp) {
-	unsigned char *buffer, data[5];
+	return bufferAppendBytes(buffer, hex, 2 * n);
+}
 
-	// |1111wwww|wwwwwwww|2222hhhh|hhhhhhhh|
+void checksumSetup(void) {
+	int i, j;
+	uint32_t crc;
 
-	readFLVTagData(data, sizeof(data), flvtag, fp);
-	// Skip the VIDEODATA header
-	buffer = &data[1];
+	// Reflected CRC-32C (Castagnoli) tables for slicing by 8
+	for(i = 0; i < 256; i++) {
+		crc = (uint32_t)i;
+		for(j = 0; j < 8; j++)
+			crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78 : (crc >> 1);
 
-	flv->video.width = ((buffer[0] & 0xf) << 8) + buffer[1];
-	flv->video.height = ((buffer[2] & 0xf) << 8) + buffer[3];
+		crc32ctable[0][i] = crc;
+	}
 
-	return YAMDI_OK;
-}
+	for(i = 0; i < 256; i++) {
+		for(j = 1; j < 8; j++)
+			crc32ctable[j][i] = (crc32ctable[j - 1][i] >> 8) ^ crc32ctable[0][crc32ctable[j - 1][i] & 0xff];
+	}
 
-int analyzeFLVVP6VideoPacket(FLV_t *flv, FLVTag_t *flvtag, FILE *fp) {
-	int offset = 3;	// default buffer offset for dim_y
-	unsigned char *buffer, data[10];
+	crc32cUpdate = crc32cSoftware;
 
-	readFLVTagData(data, sizeof(data), flvtag, fp);
+#ifdef YAMDI_CRC32C_SSE42
+	if(__builtin_cpu_supports("sse4.2"))
+		crc32cUpdate = crc32cSSE42;
+#endif
 
-#if DEBUG
-	fprintf(stderr, "\n");
+#ifdef YAMDI_CRC32C_ARMV8
+	if(getauxval(AT_HWCAP) & HWCAP_CRC32)
+		crc32cUpdate = crc32cARMv8;
+#endif
 
-	fprintf(stderr, "[VP6] ");
-	int i = 0;
-	for(i = 0; i < sizeof(data); i++)
-		fprintf(stderr, "%d=%d ", i, data[i]);
-	fprintf(stderr, "\n");
+#ifdef DEBUG
+	fprintf(stderr, "[checksum] crc32c = %s\n", (crc32cUpdate == crc32cSoftware) ? "software" : "hardware");
 #endif
 
-	// Skip the VIDEODATA header
-	buffer = &data[1];
+	return;
+}
 
-	// VP6FLVVIDEOPACKET header (as described in the SWF Specs v10, page 249)
-	int hadjust = ((buffer[0] >> 4) & 0x0f);
-	int vadjust = (buffer[0] & 0x0f);
+int parseChecksums(const char *list) {
+	int i, algorithms = 0;
+	size_t length;
+	const char *end;
 
-	// Raw vp6 video data (http://wiki.multimedia.cx/index.php?title=On2_VP6)
-	int frame_mode = ((buffer[1] >> 7) & 0x01);
+	// e.g. "crc32c,sha256"
+	for(;;) {
+		end = strchr(list, ',');
+		length = (end != NULL) ? (size_t)(end - list) : strlen(list);
 
-	if(frame_mode != 0)	// We need an iframe
-		return YAMDI_ERROR;
+		for(i = 0; i < YAMDI_NCHECKSUMS; i++) {
+			if(strlen(checksumnames[i]) == length && !strncmp(list, checksumnames[i], length))
+				break;
+		}
 
-	int marker = (buffer[1] & 0x01);	// Without checking this value, we support all VP6 variants
+		if(i == YAMDI_NCHECKSUMS)
+			return 0;
 
-	int version2 = ((buffer[2] >> 1) & 0x03);
+		algorithms |= (1 << i);
 
-#if DEBUG
-	int version = ((buffer[2] >> 3) & 0x1f);
-	int interlace = (buffer[2] & 0x01);
+		if(end == NULL)
+			break;
 
-	fprintf(stderr, "[VP6] marker = %d\n", marker);
-	fprintf(stderr, "[VP6] version = %d\n", version);
-	fprintf(stderr, "[VP6] version2 = %d\n", version2);
-	fprintf(stderr, "[VP6] interlace = %d\n", interlace);
-#endif
+		list = end + 1;
+	}
 
-	// In these cases there are 2 more bytes that we have to skip
-	if(marker == 1 || version2 == 0)
-		offset += 2;
+	return algorithms;
+}
 
-#if DEBUG
-	fprintf(stderr, "[VP6] offset = %d\n", offset);
-	fprintf(stderr, "[VP6] dim_y = %d\n", buffer[offset]);
-	fprintf(stderr, "[VP6] dim_x = %d\n", buffer[offset + 1]);
-	fprintf(stderr, "[VP6] render_y = %d\n", buffer[offset + 2]);
-	fprintf(stderr, "[VP6] render_x = %d\n", buffer[offset + 3]);
-#endif
+void checksumInit(checksum_t *checksum, int algorithms) {
+	memset(checksum, 0, sizeof(checksum_t));
 
-	// Now offset points to the resolution values: [dim_y, dim_x, render_y, render_x]
-	// Values represent macroblocks
-	flv->video.height = (buffer[offset + 0] * 16) - vadjust;
-	flv->video.width = (buffer[offset + 1] * 16) - hadjust;
+	checksum->algorithms = algorithms;
+	checksum->crc32c = 0xffffffff;
 
-	return YAMDI_OK;
+	xxh64Init(&checksum->xxh64);
+	sha256Init(&checksum->sha256);
+
+	return;
 }
 
-int analyzeFLVVP6AlphaVideoPacket(FLV_t *flv, FLVTag_t *flvtag, FILE *fp) {
-	unsigned char *buffer, data[9];
+void checksumUpdate(checksum_t *checksum, const unsigned char *bytes, size_t nbytes) {
+	if(checksum->algorithms & YAMDI_CHECKSUM_CRC32C)
+		checksum->crc32c = crc32cUpdate(checksum->crc32c, bytes, nbytes);
 
-	readFLVTagData(data, sizeof(data), flvtag, fp);
-	// Skip the VIDEODATA header
-	buffer = &data[1];
+	if(checksum->algorithms & YAMDI_CHECKSUM_XXH64)
+		xxh64Update(&checksum->xxh64, bytes, nbytes);
 
-	flv->video.width = buffer[7] * 16 - (buffer[0] >> 4);
-	flv->video.height = buffer[6] * 16 - (buffer[0] & 0x0f);
+	if(checksum->algorithms & YAMDI_CHECKSUM_SHA256)
+		sha256Update(&checksum->sha256, bytes, nbytes);
 
-	return YAMDI_OK;
+	return;
 }
 
-int analyzeFLVH264VideoPacket(FLV_t *flv, FLVTag_t *flvtag, FILE *fp) {
-	int avcpackettype;
-	int i, length, offset, nSPS;
-	unsigned char *avcc;
-	unsigned char *buffer, data[flvtag->datasize];
-	h264data_t h264data;
+void checksumFinal(checksum_t *checksum) {
+	if(checksum->algorithms == 0)
+		return;
 
-	readFLVTagData(data, sizeof(data), flvtag, fp);
-	// Skip the VIDEODATA header
-	buffer = &data[1];
+	checksum->crc32c ^= 0xffffffff;
+	checksum->xxh64digest = xxh64Final(&checksum->xxh64);
+	sha256Final(&checksum->sha256, checksum->sha256digest);
 
-	avcpackettype = buffer[0];
+	return;
+}
 
-#ifdef DEBUG
-	fprintf(stderr, "[FLV] AVCPacketType = %d\n", avcpackettype);
-#endif
+uint32_t crc32cSoftware(uint32_t crc, const unsigned char *bytes, size_t nbytes) {
+	uint32_t lo, hi;
 
-	if(avcpackettype != 0)
-		return YAMDI_ERROR;
+	for(; nbytes >= 8; nbytes -= 8, bytes += 8) {
+		lo = crc ^ ((uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24));
+		hi = (uint32_t)bytes[4] | ((uint32_t)bytes[5] << 8) | ((uint32_t)bytes[6] << 16) | ((uint32_t)bytes[7] << 24);
 
-	// AVCDecoderConfigurationRecord (14496-15, 5.2.4.1.1)
-	avcc = (unsigned char *)&buffer[4];
+		crc = crc32ctable[7][lo & 0xff] ^ crc32ctable[6][(lo >> 8) & 0xff] ^ crc32ctable[5][(lo >> 16) & 0xff] ^ crc32ctable[4][lo >> 24] ^
+		      crc32ctable[3][hi & 0xff] ^ crc32ctable[2][(hi >> 8) & 0xff] ^ crc32ctable[1][(hi >> 16) & 0xff] ^ crc32ctable[0][hi >> 24];
+	}
 
-	nSPS = avcc[5] & 0x1f;
+	for(; nbytes > 0; nbytes--, bytes++)
+		crc = (crc >> 8) ^ crc32ctable[0][(crc ^ *bytes) & 0xff];
 
-#ifdef DEBUG
-	fprintf(stderr, "[AVC/H.264] AVCDecoderConfigurationRecord\n");
-	fprintf(stderr, "[AVC/H.264] configurationVersion = %d\n", avcc[0]);
-	fprintf(stderr, "[AVC/H.264] AVCProfileIndication = %d\n", avcc[1]);
-	fprintf(stderr, "[AVC/H.264] profile_compatibility = %d\n", avcc[2]);
-	fprintf(stderr, "[AVC/H.264] AVCLevelIndication = %d\n", avcc[3]);
-	fprintf(stderr, "[AVC/H.264] lengthSizeMinusOne = %d\n", avcc[4] & 0x3);
-	fprintf(stderr, "[AVC/H.264] numOfSequenceParameterSets = %d\n", nSPS);
-#endif
+	return crc;
+}
 
-	offset = 6;
-	for(i = 0; i < nSPS; i++) {
-		length = (avcc[offset] << 8) + avcc[offset + 1];
-#ifdef DEBUG
-		fprintf(stderr, "[AVC/H.264]\tsequenceParameterSetLength = %d bit\n", 8 * length);
-#endif
-		memset(&h264data, 0, sizeof(h264data_t));
-		if(readH264NALUnit(&h264data, &avcc[offset + 2], length) == YAMDI_OK)
-			break;
+#ifdef YAMDI_CRC32C_SSE42
+__attribute__((target("sse4.2")))
+uint32_t crc32cSSE42(uint32_t crc, const unsigned char *bytes, size_t nbytes) {
+	uint64_t crc64 = crc, value;
 
-		offset += (2 + length);
+	for(; nbytes >= 8; nbytes -= 8, bytes += 8) {
+		memcpy(&value, bytes, 8);
+		crc64 = _mm_crc32_u64(crc64, value);
 	}
 
-	// There would be some Picture Parameter Sets, but we don't need them. Bail out.
-/*
-	int nPPS = avcc[offset++];
-	fprintf(stderr, "numOfPictureParameterSets = %d\n", nPPS);
+	crc = (uint32_t)crc64;
 
-	for(i = 0; i < nPPS; i++) {
-		length = (avcc[offset] << 8) + avcc[offset + 1];
-#ifdef DEBUG
-		fprintf(stderr, "[AVC/H.264]\tpictureParameterSetLength = %d bit\n", 8 * length);
+	for(; nbytes > 0; nbytes--, bytes++)
+		crc = _mm_crc32_u8(crc, *bytes);
+
+	return crc;
+}
 #endif
-		readH264NALUnit(&avcc[offset + 2], length);
 
-		offset += (2 + length);
+#ifdef YAMDI_CRC32C_ARMV8
+__attribute__((target("+crc")))
+uint32_t crc32cARMv8(uint32_t crc, const unsigned char *bytes, size_t nbytes) {
+	uint64_t value;
+
+	for(; nbytes >= 8; nbytes -= 8, bytes += 8) {
+		memcpy(&value, bytes, 8);
+		crc = __crc32cd(crc, value);
 	}
-*/
 
-	if(h264data.valid == 0)
-		return YAMDI_ERROR;
+	for(; nbytes > 0; nbytes--, bytes++)
+		crc = __crc32cb(crc, *bytes);
 
-	flv->video.width = h264data.width;
-	flv->video.height = h264data.height;
+	return crc;
+}
+#endif
 
-	return YAMDI_OK;
+#define XXH64_PRIME1	0x9e3779b185ebca87ULL
+#define XXH64_PRIME2	0xc2b2ae3d27d4eb4fULL
+#define XXH64_PRIME3	0x165667b19e3779f9ULL
+#define XXH64_PRIME4	0x85ebca77c2b2ae63ULL
+#define XXH64_PRIME5	0x27d4eb2f165667c5ULL
+
+#define XXH64_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+#define XXH64_ROUND(acc, input) XXH64_ROTL((acc) + (input) * XXH64_PRIME2, 31) * XXH64_PRIME1
+
+#define LE64(x) ((uint64_t)(x)[0] | ((uint64_t)(x)[1] << 8) | ((uint64_t)(x)[2] << 16) | ((uint64_t)(x)[3] << 24) | \
+		((uint64_t)(x)[4] << 32) | ((uint64_t)(x)[5] << 40) | ((uint64_t)(x)[6] << 48) | ((uint64_t)(x)[7] << 56))
+#define LE32(x) ((uint32_t)(x)[0] | ((uint32_t)(x)[1] << 8) | ((uint32_t)(x)[2] << 16) | ((uint32_t)(x)[3] << 24))
+
+void xxh64Init(xxh64_t *xxh64) {
+	memset(xxh64, 0, sizeof(xxh64_t));
+
+	// The seed is 0
+	xxh64->v[0] = XXH64_PRIME1 + XXH64_PRIME2;
+	xxh64->v[1] = XXH64_PRIME2;
+	xxh64->v[2] = 0;
+	xxh64->v[3] = -XXH64_PRIME1;
+
+	return;
 }
 
-int writeBufferFLVScriptDataObject(buffer_t *buffer) {
-	unsigned char type = 2;
+void xxh64Update(xxh64_t *xxh64, const unsigned char *bytes, size_t nbytes) {
+	size_t n;
+	uint64_t v0, v1, v2, v3;
 
-	bufferAppendBytes(buffer, &type, 1);
+	xxh64->length += nbytes;
 
-	return YAMDI_OK;
+	// Fill up the last stripe
+	if(xxh64->used != 0) {
+		n = 32 - xxh64->used;
+		if(n > nbytes)
+			n = nbytes;
+
+		memcpy(xxh64->block + xxh64->used, bytes, n);
+		xxh64->used += n;
+		bytes += n;
+		nbytes -= n;
+
+		if(xxh64->used < 32)
+			return;
+
+		xxh64->v[0] = XXH64_ROUND(xxh64->v[0], LE64(xxh64->block));
+		xxh64->v[1] = XXH64_ROUND(xxh64->v[1], LE64(xxh64->block + 8));
+		xxh64->v[2] = XXH64_ROUND(xxh64->v[2], LE64(xxh64->block + 16));
+		xxh64->v[3] = XXH64_ROUND(xxh64->v[3], LE64(xxh64->block + 24));
+
+		xxh64->used = 0;
+	}
+
+	v0 = xxh64->v[0];
+	v1 = xxh64->v[1];
+	v2 = xxh64->v[2];
+	v3 = xxh64->v[3];
+
+	for(; nbytes >= 32; nbytes -= 32, bytes += 32) {
+		v0 = XXH64_ROUND(v0, LE64(bytes));
+		v1 = XXH64_ROUND(v1, LE64(bytes + 8));
+		v2 = XXH64_ROUND(v2, LE64(bytes + 16));
+		v3 = XXH64_ROUND(v3, LE64(bytes + 24));
+	}
+
+	xxh64->v[0] = v0;
+	xxh64->v[1] = v1;
+	xxh64->v[2] = v2;
+	xxh64->v[3] = v3;
+
+	memcpy(xxh64->block, bytes, nbytes);
+	xxh64->used = nbytes;
+
+	return;
 }
 
-int writeBufferFLVScriptDataECMAArray(buffer_t *buffer, const char *name, size_t len) {
-	unsigned char type, bytes[4];
+uint64_t xxh64Final(xxh64_t *xxh64) {
+	int i;
+	uint64_t h;
+	const unsigned char *p = xxh64->block;
+	size_t n = xxh64->used;
 
-	writeBufferFLVScriptDataString(buffer, name);
+	if(xxh64->length >= 32) {
+		h = XXH64_ROTL(xxh64->v[0], 1) + XXH64_ROTL(xxh64->v[1], 7) + XXH64_ROTL(xxh64->v[2], 12) + XXH64_ROTL(xxh64->v[3], 18);
 
-	type = 8;	// ECMAArray
-	bufferAppendBytes(buffer, &type, 1);
+		for(i = 0; i < 4; i++) {
+			h ^= XXH64_ROUND(0, xxh64->v[i]);
+			h = h * XXH64_PRIME1 + XXH64_PRIME4;
+		}
+	}
+	else
+		h = XXH64_PRIME5;
 
-	bytes[0] = ((len >> 24) & 0xff);
-	bytes[1] = ((len >> 16) & 0xff);
-	bytes[2] = ((len >>  8) & 0xff);
-	bytes[3] = ((len >>  0) & 0xff);
+	h += xxh64->length;
 
-	bufferAppendBytes(buffer, bytes, 4);
+	for(; n >= 8; n -= 8, p += 8) {
+		h ^= XXH64_ROUND(0, LE64(p));
+		h = XXH64_ROTL(h, 27) * XXH64_PRIME1 + XXH64_PRIME4;
+	}
 
-	return YAMDI_OK;
+	if(n >= 4) {
+		h ^= (uint64_t)LE32(p) * XXH64_PRIME1;
+		h = XXH64_ROTL(h, 23) * XXH64_PRIME2 + XXH64_PRIME3;
+
+		n -= 4;
+		p += 4;
+	}
+
+	for(; n > 0; n--, p++) {
+		h ^= (uint64_t)(*p) * XXH64_PRIME5;
+		h = XXH64_ROTL(h, 11) * XXH64_PRIME1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH64_PRIME2;
+	h ^= h >> 29;
+	h *= XXH64_PRIME3;
+	h ^= h >> 32;
+
+	return h;
 }
 
-int writeBufferFLVScriptDataValueArray(buffer_t *buffer, const char *name, size_t len) {
-	unsigned char type, bytes[4];
-	
-	writeBufferFLVScriptDataString(buffer, name);
+void sha256Init(sha256_t *sha256) {
+	const uint32_t h[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
 
-	type = 10;	// Value Array
-	bufferAppendBytes(buffer, &type, 1);
+	memset(sha256, 0, sizeof(sha256_t));
+	memcpy(sha256->h, h, sizeof(h));
 
-	bytes[0] = ((len >> 24) & 0xff);
-	bytes[1] = ((len >> 16) & 0xff);
-	bytes[2] = ((len >>  8) & 0xff);
-	bytes[3] = ((len >>  0) & 0xff);
+	return;
+}
 
-	bufferAppendBytes(buffer, bytes, 4);
+void sha256Update(sha256_t *sha256, const unsigned char *bytes, size_t nbytes) {
+	size_t n;
 
-	return YAMDI_OK;
+	sha256->length += nbytes;
+
+	if(sha256->used != 0) {
+		n = 64 - sha256->used;
+		if(n > nbytes)
+			n = nbytes;
+
+		memcpy(sha256->block + sha256->used, bytes, n);
+		sha256->used += n;
+		bytes += n;
+		nbytes -= n;
+
+		if(sha256->used < 64)
+			return;
+
+		sha256Transform(sha256->h, sha256->block);
+		sha256->used = 0;
+	}
+
+	for(; nbytes >= 64; nbytes -= 64, bytes += 64)
+		sha256Transform(sha256->h, bytes);
+
+	memcpy(sha256->block, bytes, nbytes);
+	sha256->used = nbytes;
+
+	return;
 }
 
-int writeBufferFLVScriptDataVariableArray(buffer_t *buffer, const char *name) {
-	unsigned char type;
+void sha256Final(sha256_t *sha256, unsigned char *digest) {
+	int i;
+	uint64_t bits = sha256->length * 8;
 
-	writeBufferFLVScriptDataString(buffer, name);
+	// Padding: 0x80, zeros and the length in bits in big endian
+	sha256->block[sha256->used++] = 0x80;
 
-	type = 3;	// Variable Array
-	bufferAppendBytes(buffer, &type, 1);
+	if(sha256->used > 56) {
+		memset(sha256->block + sha256->used, 0, 64 - sha256->used);
+		sha256Transform(sha256->h, sha256->block);
+		sha256->used = 0;
+	}
 
-	return YAMDI_OK;
+	memset(sha256->block + sha256->used, 0, 56 - sha256->used);
+
+	for(i = 0; i < 8; i++)
+		sha256->block[56 + i] = (bits >> (56 - 8 * i)) & 0xff;
+
+	sha256Transform(sha256->h, sha256->block);
+
+	for(i = 0; i < 8; i++) {
+		digest[4 * i] = (sha256->h[i] >> 24) & 0xff;
+		digest[4 * i + 1] = (sha256->h[i] >> 16) & 0xff;
+		digest[4 * i + 2] = (sha256->h[i] >> 8) & 0xff;
+		digest[4 * i + 3] = sha256->h[i] & 0xff;
+	}
+
+	return;
 }
 
-int writeBufferFLVScriptDataVariableArrayEnd(buffer_t *buffer) {
-	unsigned char bytes[3];
+#define SHA256_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256Transform(uint32_t *h, const unsigned char *block) {
+	int i;
+	uint32_t a, b, c, d, e, f, g, k, t1, t2, w[64];
+	static const uint32_t K[64] = {
+		0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+		0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+		0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+		0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+		0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+		0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+		0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+	};
+
+	for(i = 0; i < 16; i++)
+		w[i] = ((uint32_t)block[4 * i] << 24) | ((uint32_t)block[4 * i + 1] << 16) | ((uint32_t)block[4 * i + 2] << 8) | (uint32_t)block[4 * i + 3];
+
+	for(i = 16; i < 64; i++) {
+		t1 = SHA256_ROTR(w[i - 2], 17) ^ SHA256_ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		t2 = SHA256_ROTR(w[i - 15], 7) ^ SHA256_ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		w[i] = t1 + w[i - 7] + t2 + w[i - 16];
+	}
 
-	bytes[0] = 0;
-	bytes[1] = 0;
-	bytes[2] = 9;
+	a = h[0]; b = h[1]; c = h[2]; d = h[3];
+	e = h[4]; f = h[5]; g = h[6]; k = h[7];
+
+	for(i = 0; i < 64; i++) {
+		t1 = k + (SHA256_ROTR(e, 6) ^ SHA256_ROTR(e, 11) ^ SHA256_ROTR(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+		t2 = (SHA256_ROTR(a, 2) ^ SHA256_ROTR(a, 13) ^ SHA256_ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+
+		k = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
 
-	bufferAppendBytes(buffer, bytes, 3);
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+	h[4] += e; h[5] += f; h[6] += g; h[7] += k;
 
-	return YAMDI_OK;
+	return;
 }
 
-int writeBufferFLVScriptDataValueString(buffer_t *buffer, const char *name, const char *value) {
-	unsigned char type;
+double wallClock(void) {
+#ifndef __MINGW32__
+	struct timespec ts;
 
-	if(name != NULL)
-		writeBufferFLVScriptDataString(buffer, name);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	type = 2;	// DataString
-	bufferAppendBytes(buffer, &type, 1);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#else
+	struct timeval tv;
 
-	writeBufferFLVScriptDataString(buffer, value);
+	gettimeofday(&tv, NULL);
 
-	return YAMDI_OK;
+	return (double)tv.tv_sec + (double)tv.tv_usec / 1e6;
+#endif
 }
 
-int writeBufferFLVScriptDataValueBool(buffer_t *buffer, const char *name, int value) {
-	unsigned char type;
+void statsClock(double *wall, double *cpu) {
+#ifndef __MINGW32__
+	struct timespec ts;
 
-	if(name != NULL)
-		writeBufferFLVScriptDataString(buffer, name);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	*cpu = (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#else
+	*cpu = (double)clock() / (double)CLOCKS_PER_SEC;
+#endif
 
-	type = 1;	// Bool
-	bufferAppendBytes(buffer, &type, 1);
+	*wall = wallClock();
 
-	writeBufferFLVBool(buffer, value);
+	return;
+}
 
-	return YAMDI_OK;
+void statsBegin(int phase) {
+	statsClock(&stats.phase[phase].startwall, &stats.phase[phase].startcpu);
+
+	return;
 }
 
-int writeBufferFLVScriptDataValueDouble(buffer_t *buffer, const char *name, double value) {
-	unsigned char type;
+void statsEnd(int phase) {
+	double wall, cpu;
 
-	if(name != NULL)
-		writeBufferFLVScriptDataString(buffer, name);
+	statsClock(&wall, &cpu);
 
-	type = 0;	// Double
-	bufferAppendBytes(buffer, &type, 1);
+	stats.phase[phase].wall += wall - stats.phase[phase].startwall;
+	stats.phase[phase].cpu += cpu - stats.phase[phase].startcpu;
 
-	writeBufferFLVDouble(buffer, value);
+	traceEvent(statsphases[phase], "phase", YAMDI_TRACE_MAINTID, stats.phase[phase].startwall, wall, 0, 0);
 
-	return YAMDI_OK;
+	return;
 }
 
-int writeBufferFLVScriptDataString(buffer_t *buffer, const char *s) {
-	size_t len;
-	unsigned char bytes[2];
+void statsAddFLV(FLV_t *flv) {
+	size_t nallocated;
+	uint64_t indexbytes;
 
-	len = strlen(s);
+	stats.ntags += flv->index.nflvtags;
 
-	// critical, if only DataString is expected?
-	if(len > 0xffff)
-		writeBufferFLVScriptDataLongString(buffer, s);
-	else {
-		bytes[0] = ((len >> 8) & 0xff);
-		bytes[1] = ((len >> 0) & 0xff);
+	// The index may have been allocated larger than it is used
+	nallocated = flv->index.size;
+	if(nallocated < flv->index.nflvtags)
+		nallocated = flv->index.nflvtags;
 
-		bufferAppendBytes(buffer, bytes, 2);
-		bufferAppendString(buffer, (unsigned char*)s);
-	}
+	indexbytes = (uint64_t)nallocated * sizeof(FLVTag_t);
+	indexbytes += (uint64_t)flv->keyframes.nkeyframes * (sizeof(off_t) + sizeof(int));
 
-	return YAMDI_OK;
-}
+	if(indexbytes > stats.indexbytes)
+		stats.indexbytes = indexbytes;
 
-int writeBufferFLVScriptDataLongString(buffer_t *buffer, const char *s) {
-	size_t len;
-	unsigned char bytes[4];
+	return;
+}
 
-	len = strlen(s);
+void statsMerge(stats_t *part) {
+	int i;
 
-	if(len > 0xffffffff)
-		len = 0xffffffff;
+	for(i = 0; i < YAMDI_NPHASES; i++) {
+		stats.phase[i].wall += part->phase[i].wall;
+		stats.phase[i].cpu += part->phase[i].cpu;
+	}
 
-	bytes[0] = ((len >> 24) & 0xff);
-	bytes[1] = ((len >> 16) & 0xff);
-	bytes[2] = ((len >>  8) & 0xff);
-	bytes[3] = ((len >>  0) & 0xff);
+	stats.nreads += part->nreads;
+	stats.nseeks += part->nseeks;
+	stats.nwrites += part->nwrites;
+	stats.bytesread += part->bytesread;
+	stats.byteswritten += part->byteswritten;
+	stats.bytesmapped += part->bytesmapped;
+	stats.bytescopied += part->bytescopied;
+	stats.bytescloned += part->bytescloned;
+	stats.bytesloaded += part->bytesloaded;
+	stats.ntags += part->ntags;
 
-	bufferAppendBytes(buffer, bytes, 4);
-	bufferAppendString(buffer, (unsigned char *)s);
+	if(part->indexbytes > stats.indexbytes)
+		stats.indexbytes = part->indexbytes;
 
-	return YAMDI_OK;
+	return;
 }
 
-int writeBufferFLVBool(buffer_t *buffer, int value) {
-	unsigned char b;
+void printStats(FILE *fp, int format) {
+	int i;
+	long peakrss = 0;
+	double wall = 0.0, cpu = 0.0, tagspersecond = 0.0;
+#ifndef __MINGW32__
+	struct rusage ru;
+
+	if(getrusage(RUSAGE_SELF, &ru) == 0) {
+#ifdef __APPLE__
+		peakrss = ru.ru_maxrss / 1024;
+#else
+		peakrss = ru.ru_maxrss;
+#endif
+	}
+#endif
 
-	b = (value & 1);
+	for(i = 0; i < YAMDI_NPHASES; i++) {
+		wall += stats.phase[i].wall;
+		cpu += stats.phase[i].cpu;
+	}
 
-	bufferAppendBytes(buffer, &b, 1);
+	if(wall > 0.0)
+		tagspersecond = (double)stats.ntags / wall;
 
-	return YAMDI_OK;
-}
+	if(format == YAMDI_STATS_JSON) {
+		fprintf(fp, "{\"phases\":{");
 
-int writeBufferFLVDouble(buffer_t *buffer, double value) {
-	union {
-		unsigned char dc[8];
-		double dd;
-	} d;
-	unsigned char b[8];
+		for(i = 0; i < YAMDI_NPHASES; i++)
+			fprintf(fp, "%s\"%s\":{\"wall\":%.6f,\"cpu\":%.6f}", (i != 0) ? "," : "", statsphases[i], stats.phase[i].wall, stats.phase[i].cpu);
 
-	d.dd = value;
+		fprintf(fp, "},\"wall\":%.6f,\"cpu\":%.6f", wall, cpu);
+		fprintf(fp, ",\"read\":{\"bytes\":%" PRIu64 ",\"calls\":%" PRIu64 ",\"seeks\":%" PRIu64 ",\"mapped\":%" PRIu64 ",\"loaded\":%" PRIu64 "}", stats.bytesread, stats.nreads, stats.nseeks, stats.bytesmapped, stats.bytesloaded);
+		fprintf(fp, ",\"write\":{\"bytes\":%" PRIu64 ",\"calls\":%" PRIu64 ",\"copied\":%" PRIu64 ",\"cloned\":%" PRIu64 "}", stats.byteswritten, stats.nwrites, stats.bytescopied, stats.bytescloned);
+		fprintf(fp, ",\"tags\":%" PRIu64 ",\"tagspersecond\":%.1f", stats.ntags, tagspersecond);
+		fprintf(fp, ",\"indexbytes\":%" PRIu64 ",\"peakrsskb\":%ld}\n", stats.indexbytes, peakrss);
 
-	if(isBigEndian()) {
-		b[0] = d.dc[0];
-		b[1] = d.dc[1];
-		b[2] = d.dc[2];
-		b[3] = d.dc[3];
-		b[4] = d.dc[4];
-		b[5] = d.dc[5];
-		b[6] = d.dc[6];
-		b[7] = d.dc[7];
-	}
-	else {
-		b[0] = d.dc[7];
-		b[1] = d.dc[6];
-		b[2] = d.dc[5];
-		b[3] = d.dc[4];
-		b[4] = d.dc[3];
-		b[5] = d.dc[2];
-		b[6] = d.dc[1];
-		b[7] = d.dc[0];
+		return;
 	}
 
-	bufferAppendBytes(buffer, b, 8);
+	fprintf(fp, "[stats] %-10s %12s %12s\n", "phase", "wall (s)", "cpu (s)");
 
-	return YAMDI_OK;
-}
+	for(i = 0; i < YAMDI_NPHASES; i++)
+		fprintf(fp, "[stats] %-10s %12.6f %12.6f\n", statsphases[i], stats.phase[i].wall, stats.phase[i].cpu);
 
-int readFLVTag(FLVTag_t *flvtag, off_t offset, FILE *fp) {
-	int rv;
-	unsigned char buffer[FLV_SIZE_TAGHEADER];
+	fprintf(fp, "[stats] %-10s %12.6f %12.6f\n", "total", wall, cpu);
 
-	memset(flvtag, 0, sizeof(FLVTag_t));
+	fprintf(fp, "[stats] read: %" PRIu64 " bytes in %" PRIu64 " calls, %" PRIu64 " seeks, %" PRIu64 " bytes mapped, %" PRIu64 " bytes loaded\n", stats.bytesread, stats.nreads, stats.nseeks, stats.bytesmapped, stats.bytesloaded);
+	fprintf(fp, "[stats] write: %" PRIu64 " bytes in %" PRIu64 " calls, %" PRIu64 " bytes copied by the kernel, %" PRIu64 " bytes cloned\n", stats.byteswritten, stats.nwrites, stats.bytescopied, stats.bytescloned);
+	fprintf(fp, "[stats] tags: %" PRIu64 " (%.1f tags/s)\n", stats.ntags, tagspersecond);
+	fprintf(fp, "[stats] index: %" PRIu64 " bytes\n", stats.indexbytes);
+	fprintf(fp, "[stats] peak RSS: %ld kB\n", peakrss);
 
-	rv = fseeko(fp, offset, SEEK_SET);
-	if(rv != 0) {
-#ifdef DEBUG
-		fprintf(stderr, "[FLV] %s\n", strerror(errno));
+	return;
+}
+
+void traceInit(void) {
+	memset(&trace, 0, sizeof(trace_t));
+
+#ifndef __MINGW32__
+	pthread_mutex_init(&trace.lock, NULL);
 #endif
-		return YAMDI_READ_ERROR;
-	}
 
-	flvtag->offset = offset;
+	trace.start = wallClock();
+	trace.ntids = YAMDI_TRACE_MAINTID;
+	trace.enabled = 1;
 
-	// Read the header
-	if(readBytes(buffer, FLV_SIZE_TAGHEADER, fp) != YAMDI_OK)
-		return YAMDI_READ_ERROR;
+	return;
+}
 
-	flvtag->tagtype = FLV_UI8(buffer);
+void traceEvent(const char *name, const char *cat, int tid, double start, double end, uint64_t ntags, uint64_t nbytes) {
+	size_t size;
+	traceevent_t *e;
 
-	// Assuming only known tags. Otherwise we only process the
-	// input file up to this point. It is not possible to detect
-	// where the next valid tag could be.
-	switch(flvtag->tagtype) {
-		case FLV_TAG_VIDEO:
-		case FLV_TAG_AUDIO:
-		case FLV_TAG_SCRIPTDATA:
-			break;
-		default:
-			return YAMDI_INVALID_TAGTYPE;
+	if(trace.enabled == 0)
+		return;
+
+#ifndef __MINGW32__
+	pthread_mutex_lock(&trace.lock);
+#endif
+
+	if(trace.nevents == trace.size) {
+		size = (trace.size == 0) ? 1024 : 2 * trace.size;
+
+		e = (traceevent_t *)realloc(trace.events, size * sizeof(traceevent_t));
+		if(e != NULL) {
+			trace.events = e;
+			trace.size = size;
+		}
 	}
 
-	flvtag->datasize = (size_t)FLV_UI24(&buffer[1]);
-	flvtag->timestamp = FLV_TIMESTAMP(&buffer[4]);
+	// Drop the event if there's no memory left
+	if(trace.nevents < trace.size) {
+		e = &trace.events[trace.nevents++];
 
-	// Skip the data
-	readBytes(NULL, flvtag->datasize, fp);
+		e->name = name;
+		e->cat = cat;
+		e->tid = tid;
+		e->start = start;
+		e->end = end;
+		e->ntags = ntags;
+		e->nbytes = nbytes;
 
-	// Read the previous tag size
-	readBytes(buffer, FLV_SIZE_PREVIOUSTAGSIZE, fp);
+		if(tid > trace.ntids)
+			trace.ntids = tid;
+	}
 
-	// Check the previous tag size
-	// This is too picky. We don't need it.
-/*
-	if(FLV_UI32(buffer) != (FLV_SIZE_TAGHEADER + flvtag->datasize))
-		return YAMDI_INVALID_PREVIOUSTAGSIZE;
-*/
+#ifndef __MINGW32__
+	pthread_mutex_unlock(&trace.lock);
+#endif
 
-	flvtag->tagsize = FLV_SIZE_TAGHEADER + flvtag->datasize;
+	return;
+}
 
-	return YAMDI_OK;
+// A span covers YAMDI_TRACE_SPANTAGS tags of a loop. Only the boundaries of the spans are timed.
+void traceSpanBegin(tracespan_t *span) {
+	span->start = (trace.enabled == 1) ? wallClock() : 0.0;
+	span->ntags = 0;
+	span->nbytes = 0;
+
+	return;
 }
 
-int readFLVTagData(unsigned char *ptr, size_t size, FLVTag_t *flvtag, FILE *stream) {
-	// check for size <= flvtag->datasize?
+void traceSpanStep(tracespan_t *span, const char *name, int tid, uint64_t nbytes) {
+	double now;
 
-	fseeko(stream, flvtag->offset + FLV_SIZE_TAGHEADER, SEEK_SET);
+	if(trace.enabled == 0)
+		return;
 
-	return readBytes(ptr, size, stream);
-}
+	span->ntags++;
+	span->nbytes += nbytes;
 
-int readBytes(unsigned char *ptr, size_t size, FILE *stream) {
-	size_t bytesread;
+	if(span->ntags == YAMDI_TRACE_SPANTAGS) {
+		now = wallClock();
 
-	if(ptr == NULL) {
-		fseeko(stream, (off_t)size, SEEK_CUR);
-		return YAMDI_OK;
-	}
+		traceEvent(name, "loop", tid, span->start, now, span->ntags, span->nbytes);
 
-	bytesread = fread(ptr, 1, size, stream);
-	if(bytesread < size)
-		return YAMDI_READ_ERROR;
+		span->start = now;
+		span->ntags = 0;
+		span->nbytes = 0;
+	}
 
-	return YAMDI_OK;
+	return;
 }
 
-int readH264NALUnit(h264data_t * h264data, unsigned char *nalu, int length) {
-	int i, numBytesInRBSP;
-	int nal_unit_type;
-	bitstream_t bitstream;
+void traceSpanEnd(tracespan_t *span, const char *name, int tid) {
+	if(trace.enabled == 0 || span->ntags == 0)
+		return;
 
-	// See 14496-10, 7.3.1
-#ifdef DEBUG
-	fprintf(stderr, "[AVC/H.264]\tNALU Header: %02x\n", nalu[0]);
-	fprintf(stderr, "[AVC/H.264]\t\tforbidden_zero_bit = %d\n", (nalu[0] >> 7) & 0x1);
-	fprintf(stderr, "[AVC/H.264]\t\tnal_ref_idc = %d\n", (nalu[0] >> 5) & 0x3);
-	fprintf(stderr, "[AVC/H.264]\t\tnal_unit_type = %d\n", nalu[0] & 0x1f);
-	fprintf(stderr, "[AVC/H.264]\tRBSP: ");
-	for(i = 1; i < length; i++)
-		fprintf(stderr, "%02x ", nalu[i]);
-	fprintf(stderr, "\n");
-#endif
+	traceEvent(name, "loop", tid, span->start, wallClock(), span->ntags, span->nbytes);
 
-	nal_unit_type = nalu[0] & 0x1f;
+	return;
+}
 
-	// We are only interested in NALUnits of type 7 (sequence parameter set, SPS)
-	if(nal_unit_type != 7)
-		return YAMDI_H264_USELESS_NALU;
+void writeTrace(FILE *fp) {
+	int tid, pid;
+	size_t i;
+	traceevent_t *e;
 
-	bitstream.bytes = (unsigned char *)calloc(1, length - 1);
+	pid = (int)getpid();
 
-	numBytesInRBSP = 0;
-	for(i = 1; i < length; i++) {
-		if(i + 2 < length && nalu[i] == 0x00 && nalu[i + 1] == 0x00 && nalu[i + 2] == 0x03) {
-			bitstream.bytes[numBytesInRBSP++] = nalu[i];
-			bitstream.bytes[numBytesInRBSP++] = nalu[i + 1];
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
 
-			i += 2;
-		}
+	// Name the tracks. The first one is the main thread, the others are the index scanners.
+	fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"yamdi\"}}", pid, YAMDI_TRACE_MAINTID);
+
+	for(tid = YAMDI_TRACE_MAINTID; tid <= trace.ntids; tid++) {
+		if(tid == YAMDI_TRACE_MAINTID)
+			fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"main\"}}", pid, tid);
 		else
-			bitstream.bytes[numBytesInRBSP++] = nalu[i];
+			fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"worker %d\"}}", pid, tid, tid - YAMDI_TRACE_MAINTID);
 	}
 
-	bitstream.length = numBytesInRBSP;
-	bitstream.byte = 0;
-	bitstream.bit = 0;
+	for(i = 0; i < trace.nevents; i++) {
+		e = &trace.events[i];
 
-#ifdef DEBUG
-	fprintf(stderr, "[AVC/H.264]\tSODB: ");
-	for(i = 0; i < bitstream.length; i++)
-		fprintf(stderr, "%02x ", bitstream.bytes[i]);
-	fprintf(stderr, "\n");
-#endif
+		fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f", e->name, e->cat, pid, e->tid, (e->start - trace.start) * 1e6, (e->end - e->start) * 1e6);
 
-	readH264SPS(h264data, &bitstream);
+		if(e->ntags != 0 || e->nbytes != 0)
+			fprintf(fp, ",\"args\":{\"tags\":%" PRIu64 ",\"bytes\":%" PRIu64 "}", e->ntags, e->nbytes);
+
+		fprintf(fp, "}");
+	}
 
-	free(bitstream.bytes);
+	fprintf(fp, "\n]}\n");
 
-	return YAMDI_OK;
+	return;
 }
 
-void readH264SPS(h264data_t *h264data, bitstream_t *bitstream) {
-	int i, j;
-	unsigned int profile_idc;
-	unsigned int chroma_format_idc = 1, separate_color_plane_flag = 0;
+void freeTrace(void) {
+	trace.enabled = 0;
 
-	unsigned int pic_width_in_mbs_minus1, pic_height_in_map_units_minus1;
-	unsigned int frame_mbs_only_flag;
-	unsigned int frame_cropping_flag;
-	unsigned int frame_crop_left_offset = 0, frame_crop_right_offset = 0, frame_crop_top_offset = 0, frame_crop_bottom_offset = 0;
+	free(trace.events);
+	trace.events = NULL;
+	trace.nevents = 0;
+	trace.size = 0;
 
-	unsigned int chromaArrayType;
-/*
-	We need these values from SPS
+#ifndef __MINGW32__
+	pthread_mutex_destroy(&trace.lock);
+#endif
 
-	chroma_format_idc
-	separate_color_plane_flag
-	pic_width_in_mbs_minus1
-	pic_height_in_map_units_minus1
-	frame_mbs_only_flag
-	frame_cropping_flag
-	frame_crop_left_offset
-	frame_crop_right_offset
-	frame_crop_top_offset
-	frame_crop_bottom_offset
-*/
+	return;
+}
 
-	profile_idc = readCodedU(bitstream, 8, "profile_idc");
-	readCodedU(bitstream, 1, "constraint_set0_flag");
-	readCodedU(bitstream, 1, "constraint_set1_flag");
-	readCodedU(bitstream, 1, "constraint_set2_flag");
-	readCodedU(bitstream, 1, "constraint_set3_flag");
-	readCodedU(bitstream, 4, "reserved_zero_4bits");
-	readCodedU(bitstream, 8, "level_idc");
-	readCodedUE(bitstream, "seq_parameter_set_id");
+void metricsStart(void) {
+#ifndef __MINGW32__
+	sigset_t signals, oldsignals;
+#endif
 
-	if(
-		profile_idc == 100 ||
-		profile_idc == 110 ||
-		profile_idc == 122 ||
-		profile_idc == 244 ||
-		profile_idc == 44 ||
-		profile_idc == 83 ||
-		profile_idc == 86
-	) {
-		chroma_format_idc = readCodedUE(bitstream, "chroma_format_idc");
+	if(metrics.interval == 0)
+		metrics.interval = YAMDI_METRICS_INTERVAL;
 
-		if(chroma_format_idc == 3)
-			separate_color_plane_flag = readCodedU(bitstream, 1, "separate_color_plane_flag");
+#ifndef __MINGW32__
+	pthread_mutex_init(&metrics.lock, NULL);
+	pthread_cond_init(&metrics.wakeup, NULL);
 
-		readCodedUE(bitstream, "bit_depth_luma_minus8");
-		readCodedUE(bitstream, "bit_depth_chroma_minus8");
-		readCodedU(bitstream, 1, "qpprime_y_zero_transform_bypass_flag");
+	// SIGINT and SIGTERM go to the thread that waits in --serve and --watch
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, &oldsignals);
 
-		unsigned int seq_scaling_matrix_present_flag = readCodedU(bitstream, 1, "seq_scaling_matrix_present_flag");
-		if(seq_scaling_matrix_present_flag == 1) {
-			int sizeOfScalingList, delta_scale, lastScale, nextScale;
+	if(pthread_create(&metrics.thread, NULL, metricsWorker, NULL) != 0)
+		exit(YAMDI_ERROR);
 
-			int seq_scaling_matrix_count = (chroma_format_idc != 3) ? 8 : 12;
-			unsigned int seq_scaling_list_present_flag;
-			for(i = 0; i < seq_scaling_matrix_count; i++) {
-				seq_scaling_list_present_flag = readCodedU(bitstream, 1, "seq_scaling_list_present_flag");
+	pthread_sigmask(SIG_SETMASK, &oldsignals, NULL);
+#endif
 
-				if(seq_scaling_list_present_flag == 1) {
-					sizeOfScalingList = (i < 6) ? 16 : 64;
-					lastScale = nextScale = 8;
-					for(j = 0; j < sizeOfScalingList; j++) {
-						if(nextScale != 0) {
-							delta_scale = readCodedSE(bitstream, "delta_scale");
+	return;
+}
 
-							nextScale = (lastScale + delta_scale + 256) % 256;
-						}
+void metricsStop(void) {
+	if(metrics.file == NULL)
+		return;
+
+#ifndef __MINGW32__
+	pthread_mutex_lock(&metrics.lock);
+
+	metrics.stop = 1;
+
+	pthread_cond_signal(&metrics.wakeup);
+	pthread_mutex_unlock(&metrics.lock);
+
+	pthread_join(metrics.thread, NULL);
+#endif
 
-						lastScale = (nextScale == 0) ? lastScale : nextScale;
-					}
-				}
-			}
-		}
-	}
+	// The final numbers
+	writeMetrics();
 
-	readCodedUE(bitstream, "log2_max_frame_num_minus4");
-	unsigned int pic_order_cnt_type = readCodedUE(bitstream, "pic_order_cnt_type");
+	return;
+}
 
-	if(pic_order_cnt_type == 1) {
-		readCodedU(bitstream, 1, "delta_pic_order_always_zero_flag");
-		readCodedSE(bitstream, "offset_for_non_ref_pic");
-		readCodedSE(bitstream, "offset_for_top_to_bottom_field");
+void *metricsWorker(void *arg) {
+#ifndef __MINGW32__
+	struct timespec ts;
 
-		unsigned int num_ref_frames_in_pic_order_cnt_cycle = readCodedUE(bitstream, "num_ref_frames_in_pic_order_cnt_cycle");
-		for(i = 0; i < num_ref_frames_in_pic_order_cnt_cycle; i++)
-			readCodedSE(bitstream, "offset_for_ref_frame");
-	}
-	else if(pic_order_cnt_type == 0)
-		readCodedUE(bitstream, "log2_max_pic_order_cnt_lsb_minus4");
+	pthread_mutex_lock(&metrics.lock);
 
-	readCodedUE(bitstream, "max_num_ref_frames");
-	readCodedU(bitstream, 1, "gaps_in_frame_num_value_allowed_flag");
+	while(metrics.stop == 0) {
+		clock_gettime(CLOCK_REALTIME, &ts);
 
-	pic_width_in_mbs_minus1 = readCodedUE(bitstream, "pic_width_in_mbs_minus1");
-	pic_height_in_map_units_minus1 = readCodedUE(bitstream, "pic_height_in_map_units_minus1");
+		ts.tv_sec += metrics.interval / 1000;
+		ts.tv_nsec += (long)(metrics.interval % 1000) * 1000000L;
+		if(ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
 
-	frame_mbs_only_flag = readCodedU(bitstream, 1, "frame_mbs_only_flag");
-	if(frame_mbs_only_flag == 0)
-		readCodedU(bitstream, 1, "mb_adaptive_frame_field_flag");
+		pthread_cond_timedwait(&metrics.wakeup, &metrics.lock, &ts);
 
-	readCodedU(bitstream, 1, "direct_8x8_inference_flag");
+		if(metrics.stop == 1)
+			break;
 
-	frame_cropping_flag = readCodedU(bitstream, 1, "frame_cropping_flag");
-	if(frame_cropping_flag == 1) {
-		frame_crop_left_offset = readCodedUE(bitstream, "frame_crop_left_offset");
-		frame_crop_right_offset = readCodedUE(bitstream, "frame_crop_right_offset");
-		frame_crop_top_offset = readCodedUE(bitstream, "frame_crop_top_offset");
-		frame_crop_bottom_offset = readCodedUE(bitstream, "frame_crop_bottom_offset");
+		pthread_mutex_unlock(&metrics.lock);
+		writeMetrics();
+		pthread_mutex_lock(&metrics.lock);
 	}
 
-	readCodedU(bitstream, 1, "vui_parameters_present_flag");
+	pthread_mutex_unlock(&metrics.lock);
+#endif
 
-	// and so on ... VUI is not interesting for us. We have everything we need.
+	return NULL;
+}
 
-	// Now we have enough information to compute the width and height of this video stream
+threadmetrics_t *metricsThread(void) {
+	if(threadmetrics != NULL)
+		return threadmetrics;
 
-	unsigned int picWidthInMbs = (pic_width_in_mbs_minus1 + 1);
-	unsigned int picHeightInMapUnits = (pic_height_in_map_units_minus1 + 1);
-	unsigned int frameHeightInMbs = (2 - frame_mbs_only_flag) * picHeightInMapUnits;
+	threadmetrics = (threadmetrics_t *)calloc(1, sizeof(threadmetrics_t));
+	if(threadmetrics == NULL)
+		exit(YAMDI_OUT_OF_MEMORY);
 
-	unsigned int width = picWidthInMbs * 16;
-	unsigned int height = frameHeightInMbs * 16;
+	// The counters outlive the thread, they are part of every file that is written until the end
+#ifndef __MINGW32__
+	pthread_mutex_lock(&metrics.lock);
+#endif
 
-#ifdef DEBUG
-	fprintf(stderr, "[AVC/H.264] width = %u (pre crop)\n", width);
-	fprintf(stderr, "[AVC/H.264] height = %u (pre crop)\n", height);
+	threadmetrics->next = metrics.threads;
+	metrics.threads = threadmetrics;
+
+#ifndef __MINGW32__
+	pthread_mutex_unlock(&metrics.lock);
 #endif
 
-	// Cropping
+	return threadmetrics;
+}
 
-	int cropLeft, cropRight;
-	int cropTop, cropBottom;
+void metricsAddFLV(stats_t *before, int rv, uint64_t insize, double wall) {
+	int i, bucket;
+	double seconds, throughput;
+	threadmetrics_t *m = metricsThread();
 
-	if(frame_cropping_flag == 1) {
-		// See 14496-10, Table 6-1
-		int subWidthC[4] = {1, 2, 2, 1};
-		int subHeightC[4] = {1, 2, 1, 1};
+	YAMDI_ATOMIC_ADD(m->files[(rv >= 0 && rv < YAMDI_NERRORS) ? rv : YAMDI_ERROR], 1);
 
-		unsigned int cropUnitX, cropUnitY;
+	YAMDI_ATOMIC_ADD(m->bytesread, (stats.bytesread + stats.bytesloaded) - (before->bytesread + before->bytesloaded));
+	YAMDI_ATOMIC_ADD(m->byteswritten, stats.byteswritten - before->byteswritten);
 
-		if(separate_color_plane_flag == 0)
-			chromaArrayType = chroma_format_idc;
-		else
-			chromaArrayType = 0;
+	// Only the phases that the file has gone through
+	for(i = 0; i < YAMDI_NPHASES; i++) {
+		seconds = stats.phase[i].wall - before->phase[i].wall;
+		if(seconds <= 0.0)
+			continue;
 
-		if(chromaArrayType == 0) {
-			cropUnitX = 1;
-			cropUnitY = 2 - frame_mbs_only_flag;
-		}
-		else {
-			cropUnitX = subWidthC[chroma_format_idc];
-			cropUnitY = subHeightC[chroma_format_idc] * (2 - frame_mbs_only_flag);
-		}
+		bucket = metricsBucket(metricsphasebuckets, seconds);
 
-		cropLeft = cropUnitX * frame_crop_left_offset;
-		cropRight = cropUnitX * frame_crop_right_offset;
-		cropTop = cropUnitY * frame_crop_top_offset;
-		cropBottom = cropUnitY * frame_crop_bottom_offset;
-	}
-	else {
-		cropLeft = 0;
-		cropRight = 0;
-		cropTop = 0;
-		cropBottom = 0;
+		YAMDI_ATOMIC_ADD(m->phase[i][bucket], 1);
+		YAMDI_ATOMIC_ADD(m->phasesum[i], (uint64_t)(seconds * 1e9));
 	}
 
-	width = width - cropLeft - cropRight;
-	height = height - cropTop - cropBottom;
+	if(rv == YAMDI_OK && wall > 0.0) {
+		throughput = (double)insize / wall;
+		bucket = metricsBucket(metricsthroughputbuckets, throughput);
 
-#ifdef DEBUG
-	fprintf(stderr, "[AVC/H.264] width = %u\n", width);
-	fprintf(stderr, "[AVC/H.264] height = %u\n", height);
-#endif
+		YAMDI_ATOMIC_ADD(m->throughput[bucket], 1);
+		YAMDI_ATOMIC_ADD(m->throughputsum, (uint64_t)throughput);
+	}
 
-	h264data->valid = 1;
-	h264data->width = width;
-	h264data->height = height;
+	YAMDI_ATOMIC_STORE(m->indexbytes, 0);
 
 	return;
 }
 
-unsigned int readCodedU(bitstream_t *bitstream, int nbits, const char *name) {
-	// unsigned integer with n bits
-	unsigned int bits = (unsigned int)readBits(bitstream, nbits);
+void metricsIndex(uint64_t indexbytes) {
+	YAMDI_ATOMIC_STORE(metricsThread()->indexbytes, indexbytes);
 
-#ifdef DEBUG
-	if(name != NULL)
-		fprintf(stderr, "[AVC/H.264]\t\t%s = %u\n", name, bits);
-#endif
+	return;
+}
 
-	return bits;
+void metricsQueue(int64_t n) {
+	if(metrics.file != NULL)
+		YAMDI_ATOMIC_ADD(metrics.queue, (uint64_t)n);
+
+	return;
 }
 
-unsigned int readCodedUE(bitstream_t *bitstream, const char *name) {
-	// unsigned integer Exp-Golomb coded (see 14496-10, 9.1)
-	int leadingZeroBits = -1;
-	int bit;
-	unsigned int codeNum = 0;
+int metricsBucket(const double *buckets, double value) {
+	int i;
 
-	for(bit = 0; bit == 0; leadingZeroBits++) {
-		bit = readBit(bitstream);
-		if (bitstream->byte == bitstream->length) break;
+	for(i = 0; i < YAMDI_METRICS_NBUCKETS; i++) {
+		if(value <= buckets[i])
+			break;
 	}
 
-	codeNum = ((1 << leadingZeroBits) - 1 + (unsigned int)readBits(bitstream, leadingZeroBits));
+	return i;
+}
 
-#ifdef DEBUG
-	if(name != NULL)
-		fprintf(stderr, "[AVC/H.264]\t\t%s = %u\n", name, codeNum);
+int writeMetrics(void) {
+	int i, j, rv = YAMDI_OK;
+	uint64_t files[YAMDI_NERRORS], phase[YAMDI_NPHASES][YAMDI_METRICS_NBUCKETS + 1], phasesum[YAMDI_NPHASES];
+	uint64_t throughput[YAMDI_METRICS_NBUCKETS + 1], throughputsum = 0, bytesread = 0, byteswritten = 0, indexbytes = 0, count;
+	char line[256], *tempfile;
+	threadmetrics_t *m;
+	buffer_t b;
+	FILE *fp;
+
+	memset(files, 0, sizeof(files));
+	memset(phase, 0, sizeof(phase));
+	memset(phasesum, 0, sizeof(phasesum));
+	memset(throughput, 0, sizeof(throughput));
+
+	// Add up the counters of all threads
+#ifndef __MINGW32__
+	pthread_mutex_lock(&metrics.lock);
 #endif
 
-	return codeNum;
-}
+	for(m = metrics.threads; m != NULL; m = m->next) {
+		for(i = 0; i < YAMDI_NERRORS; i++)
+			files[i] += YAMDI_ATOMIC_LOAD(m->files[i]);
 
-int readCodedSE(bitstream_t *bitstream, const char *name) {
-	// signed integer Exp-Golomb coded (see 14496-10, 9.1 and 9.1.1)
-	unsigned int codeNum;
-	int codeNumSigned, sign;
+		for(i = 0; i < YAMDI_NPHASES; i++) {
+			for(j = 0; j <= YAMDI_METRICS_NBUCKETS; j++)
+				phase[i][j] += YAMDI_ATOMIC_LOAD(m->phase[i][j]);
 
-	codeNum = readCodedUE(bitstream, NULL);
+			phasesum[i] += YAMDI_ATOMIC_LOAD(m->phasesum[i]);
+		}
 
-	sign = (codeNum % 2) + 1;
-	codeNumSigned = codeNum >> 1;
-	if(sign == 0)
-		codeNumSigned++;
-	else
-		codeNumSigned *= -1;
+		for(j = 0; j <= YAMDI_METRICS_NBUCKETS; j++)
+			throughput[j] += YAMDI_ATOMIC_LOAD(m->throughput[j]);
 
-#ifdef DEBUG
-	if(name != NULL)
-		fprintf(stderr, "[AVC/H.264]\t\t%s = %d\n", name, codeNumSigned);
+		throughputsum += YAMDI_ATOMIC_LOAD(m->throughputsum);
+		bytesread += YAMDI_ATOMIC_LOAD(m->bytesread);
+		byteswritten += YAMDI_ATOMIC_LOAD(m->byteswritten);
+		indexbytes += YAMDI_ATOMIC_LOAD(m->indexbytes);
+	}
+
+#ifndef __MINGW32__
+	pthread_mutex_unlock(&metrics.lock);
 #endif
 
-	return codeNumSigned;
-}
+	bufferInit(&b);
 
-int readBits(bitstream_t *bitstream, int nbits) {
-	int i, rv = 0;
+	bufferAppendString(&b, (unsigned char *)"# HELP yamdi_files_processed Files that have been processed.\n# TYPE yamdi_files_processed counter\n");
+	snprintf(line, sizeof(line), "yamdi_files_processed_total %" PRIu64 "\n", files[YAMDI_OK]);
+	bufferAppendString(&b, (unsigned char *)line);
 
-	for(i = 0; i < nbits; i++) {
-		rv = (rv << 1);
-		rv += readBit(bitstream);
+	bufferAppendString(&b, (unsigned char *)"# HELP yamdi_files_failed Files that couldn't be processed, by error.\n# TYPE yamdi_files_failed counter\n");
+	for(i = 1; i < YAMDI_NERRORS; i++) {
+		snprintf(line, sizeof(line), "yamdi_files_failed_total{error=\"%s\"} %" PRIu64 "\n", errornames[i], files[i]);
+		bufferAppendString(&b, (unsigned char *)line);
 	}
 
-	return rv;
-}
+	bufferAppendString(&b, (unsigned char *)"# HELP yamdi_read_bytes Bytes read from the input files.\n# TYPE yamdi_read_bytes counter\n");
+	snprintf(line, sizeof(line), "yamdi_read_bytes_total %" PRIu64 "\n", bytesread);
+	bufferAppendString(&b, (unsigned char *)line);
 
-int readBit(bitstream_t *bitstream) {
-	int bit;
+	bufferAppendString(&b, (unsigned char *)"# HELP yamdi_written_bytes Bytes written to the output files.\n# TYPE yamdi_written_bytes counter\n");
+	snprintf(line, sizeof(line), "yamdi_written_bytes_total %" PRIu64 "\n", byteswritten);
+	bufferAppendString(&b, (unsigned char *)line);
 
-	if(bitstream->byte == bitstream->length)
-		return 0;
+	bufferAppendString(&b, (unsigned char *)"# HELP yamdi_phase_seconds Wall clock time of the phases of a file.\n# TYPE yamdi_phase_seconds histogram\n");
+	for(i = 0; i < YAMDI_NPHASES; i++) {
+		for(j = 0, count = 0; j <= YAMDI_METRICS_NBUCKETS; j++) {
+			count += phase[i][j];
+
+			if(j < YAMDI_METRICS_NBUCKETS)
+				snprintf(line, sizeof(line), "yamdi_phase_seconds_bucket{phase=\"%s\",le=\"%g\"} %" PRIu64 "\n", statsphases[i], metricsphasebuckets[j], count);
+			else
+				snprintf(line, sizeof(line), "yamdi_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %" PRIu64 "\n", statsphases[i], count);
 
-	bit = (bitstream->bytes[bitstream->byte] >> (7 - bitstream->bit)) & 0x01;
+			bufferAppendString(&b, (unsigned char *)line);
+		}
 
-	bitstream->bit++;
-	if(bitstream->bit == 8) {
-		bitstream->byte++;
-		bitstream->bit = 0;
+		snprintf(line, sizeof(line), "yamdi_phase_seconds_sum{phase=\"%s\"} %.9f\nyamdi_phase_seconds_count{phase=\"%s\"} %" PRIu64 "\n", statsphases[i], (double)phasesum[i] / 1e9, statsphases[i], count);
+		bufferAppendString(&b, (unsigned char *)line);
 	}
 
-	return bit;
-}
-
-int bufferInit(buffer_t *buffer) {
-	if(buffer == NULL)
-		return YAMDI_ERROR;
+	bufferAppendString(&b, (unsigned char *)"# HELP yamdi_file_throughput_bytes_per_second Input bytes per second of the processed files.\n# TYPE yamdi_file_throughput_bytes_per_second histogram\n");
+	for(j = 0, count = 0; j <= YAMDI_METRICS_NBUCKETS; j++) {
+		count += throughput[j];
 
-	buffer->data = NULL;
-	buffer->size = 0;
-	buffer->used = 0;
+		if(j < YAMDI_METRICS_NBUCKETS)
+			snprintf(line, sizeof(line), "yamdi_file_throughput_bytes_per_second_bucket{le=\"%g\"} %" PRIu64 "\n", metricsthroughputbuckets[j], count);
+		else
+			snprintf(line, sizeof(line), "yamdi_file_throughput_bytes_per_second_bucket{le=\"+Inf\"} %" PRIu64 "\n", count);
 
-	return YAMDI_OK;
-}
+		bufferAppendString(&b, (unsigned char *)line);
+	}
 
-int bufferFree(buffer_t *buffer) {
-	if(buffer == NULL)
-		return YAMDI_ERROR;
+	snprintf(line, sizeof(line), "yamdi_file_throughput_bytes_per_second_sum %" PRIu64 "\nyamdi_file_throughput_bytes_per_second_count %" PRIu64 "\n", throughputsum, count);
+	bufferAppendString(&b, (unsigned char *)line);
 
-	if(buffer->data != NULL) {
-		free(buffer->data);
-		buffer->data = NULL;
-	}
+	bufferAppendString(&b, (unsigned char *)"# HELP yamdi_queue_depth Files or connections that wait for a thread.\n# TYPE yamdi_queue_depth gauge\n");
+	snprintf(line, sizeof(line), "yamdi_queue_depth %" PRIu64 "\n", YAMDI_ATOMIC_LOAD(metrics.queue));
+	bufferAppendString(&b, (unsigned char *)line);
 
-	return YAMDI_OK;
-}
+	bufferAppendString(&b, (unsigned char *)"# HELP yamdi_index_bytes Memory of the indexes of the files that are processed.\n# TYPE yamdi_index_bytes gauge\n");
+	snprintf(line, sizeof(line), "yamdi_index_bytes %" PRIu64 "\n", indexbytes);
+	bufferAppendString(&b, (unsigned char *)line);
 
-int bufferReset(buffer_t *buffer) {
-	if(buffer == NULL)
-		return YAMDI_ERROR;
+	bufferAppendString(&b, (unsigned char *)"# EOF\n");
 
-	buffer->used = 0;
+	// A scraper never sees a partial file
+	tempfile = (char *)malloc(strlen(metrics.file) + strlen(YAMDI_METRICS_SUFFIX) + 1);
+	if(tempfile == NULL)
+		exit(YAMDI_OUT_OF_MEMORY);
 
-	return YAMDI_OK;
-}
+	sprintf(tempfile, "%s%s", metrics.file, YAMDI_METRICS_SUFFIX);
 
-int bufferAppendString(buffer_t *dst, const unsigned char *string) {
-	if(string == NULL)
-		return YAMDI_OK;
+	fp = fopen(tempfile, "wb");
+	if(fp != NULL) {
+		if(fwrite(b.data, 1, b.used, fp) != b.used)
+			rv = YAMDI_ERROR;
 
-	return bufferAppendBytes(dst, string, strlen((char *)string));
-}
+		if(fclose(fp) != 0)
+			rv = YAMDI_ERROR;
+	}
+	else
+		rv = YAMDI_ERROR;
 
-int bufferAppendBuffer(buffer_t *dst, buffer_t *src) {
-	if(src == NULL)
-		return YAMDI_OK;
+	if(rv == YAMDI_OK && rename(tempfile, metrics.file) != 0)
+		rv = YAMDI_ERROR;
 
-	return bufferAppendBytes(dst, src->data, src->used);
-}
+	if(rv != YAMDI_OK) {
+		fprintf(stderr, "Couldn't write the metrics to %s.\n", metrics.file);
+		unlink(tempfile);
+	}
 
-int bufferAppendBytes(buffer_t *dst, const unsigned char *bytes, size_t nbytes) {
-	size_t size;
-	unsigned char *data;
+	free(tempfile);
+	bufferFree(&b);
 
-	if(dst == NULL)
-		return YAMDI_ERROR;
+	return rv;
+}
 
-	if(bytes == NULL)
-		return YAMDI_OK;
+void progressBegin(const char *phase, uint64_t totaltags, uint64_t totalbytes) {
+	if(progress.fd == -1)
+		return;
 
-	if(nbytes == 0)
-		return YAMDI_OK;
+	progress.phase = phase;
+	progress.totaltags = totaltags;
+	progress.totalbytes = totalbytes;
+	progress.start = wallClock();
+	progress.last = progress.start;
 
-	// Check if we have to increase the buffer size
-	if(dst->size < dst->used + nbytes) {
-		// Pre-allocating some memory. Round up to the next 1024 bound
-		size = ((dst->used + nbytes) / 1024 + 1) * 1024;
+	return;
+}
 
-		data = (unsigned char *)realloc(dst->data, size);
-		if(data == NULL)
-			return YAMDI_ERROR;
+void progressUpdate(uint64_t ntags, uint64_t nbytes) {
+	double now;
 
-		dst->data = data;
-		dst->size = size;
-	}
+	if(progress.fd == -1 || (ntags % YAMDI_PROGRESS_CHECKTAGS) != 0)
+		return;
 
-	// Copy the stuff into the buffer
-	memcpy(&dst->data[dst->used], bytes, nbytes);
+	now = wallClock();
+	if(now - progress.last < YAMDI_PROGRESS_INTERVAL)
+		return;
 
-	dst->used += nbytes;
+	writeProgress(ntags, nbytes, now, 0);
 
-	return YAMDI_OK;
+	return;
 }
 
-int isBigEndian(void) {
-	long one = 1;
-	return !(*((char *)(&one)));
-}
+void progressEnd(uint64_t ntags, uint64_t nbytes) {
+	if(progress.fd == -1)
+		return;
 
-void writeXMLMetadata(FILE *fp, const char *infile, const char *outfile, FLV_t *flv) {
-	size_t i;
+	writeProgress(ntags, nbytes, wallClock(), 1);
 
-	fprintf(fp, "<?xml version='1.0' encoding='UTF-8'?>\n");
-	fprintf(fp, "<fileset>\n");
+	return;
+}
 
-	if(outfile != NULL)
-		fprintf(fp, "<flv name=\"%s\">\n", outfile);
+void writeProgress(uint64_t ntags, uint64_t nbytes, double now, int done) {
+	int n;
+	ssize_t w;
+	double elapsed, rate = 0.0;
+	char eta[32], line[512];
+
+	elapsed = now - progress.start;
+	if(elapsed > 0.0)
+		rate = (double)nbytes / elapsed;
+
+	// The ETA is extrapolated from the bytes per second so far
+	if(done == 1)
+		snprintf(eta, sizeof(eta), "0");
+	else if(progress.totalbytes != 0 && nbytes != 0 && nbytes <= progress.totalbytes)
+		snprintf(eta, sizeof(eta), "%.1f", (double)(progress.totalbytes - nbytes) / rate);
 	else
-		fprintf(fp, "<flv name=\"%s\">\n", infile);
-
-	fprintf(fp, "<hasKeyframes>%s</hasKeyframes>\n", (flv->haskeyframes != 0) ? "true" : "false");
-	fprintf(fp, "<hasVideo>%s</hasVideo>\n", (flv->hasvideo != 0) ? "true" : "false");
-	fprintf(fp, "<hasAudio>%s</hasAudio>\n", (flv->hasaudio != 0) ? "true" : "false");
-	fprintf(fp, "<hasMetadata>true</hasMetadata>\n");
-	fprintf(fp, "<hasCuePoints>%s</hasCuePoints>\n", (flv->hascuepoints != 0) ? "true" : "false");
-	fprintf(fp, "<canSeekToEnd>%s</canSeekToEnd>\n", (flv->canseektoend != 0) ? "true" : "false");
-
-	fprintf(fp, "<audiocodecid>%d</audiocodecid>\n", flv->audio.codecid);      
-	fprintf(fp, "<audiosamplerate>%d</audiosamplerate>\n", flv->audio.samplerate);
-	fprintf(fp, "<audiodatarate>%d</audiodatarate>\n", (int)flv->audio.datarate);
-	fprintf(fp, "<audiosamplesize>%d</audiosamplesize>\n", flv->audio.samplesize);
-	fprintf(fp, "<audiodelay>%.2f</audiodelay>\n", (double)flv->audio.delay);
-	fprintf(fp, "<stereo>%s</stereo>\n", (flv->audio.stereo != 0) ? "true" : "false");
-
-	fprintf(fp, "<videocodecid>%d</videocodecid>\n", flv->video.codecid);
-	fprintf(fp, "<framerate>%.2f</framerate>\n", flv->video.framerate);
-	fprintf(fp, "<videodatarate>%d</videodatarate>\n", (int)flv->video.datarate);
-	fprintf(fp, "<height>%d</height>\n", (int)flv->video.height);
-	fprintf(fp, "<width>%d</width>\n", (int)flv->video.width);
-
-	fprintf(fp, "<datasize>%" PRIu64 "</datasize>\n", flv->datasize);
-	fprintf(fp, "<audiosize>%" PRIu64 "</audiosize>\n", flv->audio.size);
-	fprintf(fp, "<videosize>%" PRIu64 "</videosize>\n", flv->video.size);
-	fprintf(fp, "<filesize>%" PRIu64 "</filesize>\n", flv->filesize);
-
-	fprintf(fp, "<lasttimestamp>%.2f</lasttimestamp>\n", (double)flv->lasttimestamp / 1000.0);
-	fprintf(fp, "<lastvideoframetimestamp>%.2f</lastvideoframetimestamp>\n", (double)flv->video.lasttimestamp / 1000.0);
-	fprintf(fp, "<lastkeyframetimestamp>%.2f</lastkeyframetimestamp>\n", (double)flv->keyframes.lastkeyframetimestamp / 1000.0);
-	fprintf(fp, "<lastkeyframelocation>%" PRIu64 "</lastkeyframelocation>\n", (uint64_t)flv->keyframes.lastkeyframelocation);
+		snprintf(eta, sizeof(eta), "null");
 
-	if(flv->options.xmlomitkeyframes == 0) {
-		fprintf(fp, "<keyframes>\n");
-		fprintf(fp, "<times>\n");
+	n = snprintf(line, sizeof(line), "{\"phase\":\"%s\",\"tags\":%" PRIu64 ",\"totaltags\":%" PRIu64 ",\"bytes\":%" PRIu64 ",\"totalbytes\":%" PRIu64 ",\"elapsed\":%.3f,\"mbps\":%.2f,\"eta\":%s,\"done\":%s}\n", progress.phase, ntags, progress.totaltags, nbytes, progress.totalbytes, elapsed, rate / 1048576.0, eta, (done == 1) ? "true" : "false");
 
-		for(i = 0; i < flv->keyframes.nkeyframes; i++)
-			fprintf(fp, "<value id=\"%" PRIu64 "\">%.2f</value>\n", (uint64_t)i, (double)flv->keyframes.keyframetimestamps[i] / 1000.0);
+	// Nothing we can do if the reader went away
+	while(n > 0) {
+		w = write(progress.fd, line + strlen(line) - n, (size_t)n);
+		if(w <= 0) {
+			if(w == -1 && errno == EINTR)
+				continue;
 
-		fprintf(fp, "</times>\n");
-		fprintf(fp, "<filepositions>\n");
+			// Don't bother the reader again
+			if(w == -1 && errno == EPIPE)
+				progress.fd = -1;
 
-		for(i = 0; i < flv->keyframes.nkeyframes; i++)
-			fprintf(fp, "<value id=\"%" PRIu64 "\">%" PRIu64 "</value>\n", (uint64_t)i, (uint64_t)flv->keyframes.keyframelocations[i]);
+			break;
+		}
 
-		fprintf(fp, "</filepositions>\n");
-		fprintf(fp, "</keyframes>\n");
+		n -= (int)w;
 	}
 
-	fprintf(fp, "<duration>%.2f</duration>\n", (double)flv->lasttimestamp / 1000.0);
-	fprintf(fp, "</flv>\n");
-	fprintf(fp, "</fileset>\n");
+	progress.last = now;
 
 	return;
 }
@@ -2334,6 +10116,20 @@ void printUsage(void) {
 	fprintf(stderr, "SYNOPSIS\n");
 	fprintf(stderr, "\tyamdi -i input file [-x xml file | -o output file [-x xml file]]\n");
 	fprintf(stderr, "\t      [-t temporary file] [-c creator] [-a interval] [-skMXw] [-h]\n");
+	fprintf(stderr, "\t      [--idr-keyframes] [--probe] [--index-mode mode] [--threads n]\n");
+	fprintf(stderr, "\t      [--stats[=format]] [--trace trace file] [--progress-fd n]\n");
+	fprintf(stderr, "\t      [-j json file] [--seektable seek table file]\n");
+	fprintf(stderr, "\t      [--start seconds] [--end seconds]\n");
+	fprintf(stderr, "\t      [--split-duration seconds] [--split-size bytes] [--reflink]\n");
+	fprintf(stderr, "\t      [--manifest manifest file] [--checksum list]\n");
+	fprintf(stderr, "\t      [--checksum-file checksum file] [--preallocate] [--direct-io]\n");
+	fprintf(stderr, "\t      [--drop-cache] [--in-memory bytes] [--in-place]\n");
+	fprintf(stderr, "\t      [--physical-order] [--device-readers n]\n");
+	fprintf(stderr, "\t      [--time-limit seconds] [--io-limit bytes]\n");
+	fprintf(stderr, "\t      [--metrics metrics file] [--metrics-interval seconds]\n");
+	fprintf(stderr, "\tyamdi --serve socket [-c creator] [-a interval] [-skMX] [options]\n");
+	fprintf(stderr, "\tyamdi --watch spool directory -o output directory [--remove-input]\n");
+	fprintf(stderr, "\t      [-c creator] [-a interval] [-skMX] [options]\n");
 	fprintf(stderr, "\n");
 
 	fprintf(stderr, "DESCRIPTION\n");
@@ -2343,7 +10139,9 @@ void printUsage(void) {
 	fprintf(stderr, "\n");
 	fprintf(stderr, "\t-i\tThe source FLV file. If the file name is '-' the input\n");
 	fprintf(stderr, "\t\tfile will be read from stdin. Use the -t option to specify\n");
-	fprintf(stderr, "\t\ta temporary file.\n");
+	fprintf(stderr, "\t\ta temporary file. Use -i more than once to process several\n");
+	fprintf(stderr, "\t\tfiles. Then -o and --seektable are directories for the output\n");
+	fprintf(stderr, "\t\tfiles and -x and -j contain the metadata of all files.\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "\t-o\tThe resulting FLV file with the metatags. If the file\n");
 	fprintf(stderr, "\t\tname is '-' the output will be written to stdout.\n");
@@ -2351,6 +10149,13 @@ void printUsage(void) {
 	fprintf(stderr, "\t-x\tAn XML file with the resulting metadata information. If the\n");
 	fprintf(stderr, "\t\toutput file is ommited, only metadata will be generated.\n");
 	fprintf(stderr, "\n");
+	fprintf(stderr, "\t-j\tA JSON file with the same metadata information as -x.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\t--seektable seek table file\n");
+	fprintf(stderr, "\t\tA little endian binary file with a header, the stream fields\n");
+	fprintf(stderr, "\t\tand the packed file positions (uint64) and timestamps in ms\n");
+	fprintf(stderr, "\t\t(int32) of the keyframes, ready to be mapped into memory.\n");
+	fprintf(stderr, "\n");
 	fprintf(stderr, "\t-t\tA temporary file to store the source FLV file in if the\n");
 	fprintf(stderr, "\t\tinput file is read from stdin.\n");
 	fprintf(stderr, "\n");
@@ -2370,7 +10175,7 @@ void printUsage(void) {
 	fprintf(stderr, "\t-M\tStrip all metadata from the FLV. The -s and -k options will\n");
 	fprintf(stderr, "\t\tbe ignored.\n");
 	fprintf(stderr, "\n");
-	fprintf(stderr, "\t-X\tOmit the keyframes tag in the XML output.\n");
+	fprintf(stderr, "\t-X\tOmit the keyframes tag in the XML and JSON output.\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "\t-a\tTime in milliseconds between keyframes if there is only audio.\n");
 	fprintf(stderr, "\t\tThis option will be ignored if there is a video stream. No\n");
@@ -2380,6 +10185,143 @@ void printUsage(void) {
 	fprintf(stderr, "\t\trequired to be different files otherwise this option will be\n");
 	fprintf(stderr, "\t\tignored.\n");
 	fprintf(stderr, "\n");
+	fprintf(stderr, "\t--idr-keyframes\n");
+	fprintf(stderr, "\t\tOnly mark AVC/H.264 video frames as keyframes if they contain\n");
+	fprintf(stderr, "\t\tan IDR slice. The FrameType of the video tags is ignored.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\t--probe\tOnly read the first and the last tags of the input file.\n");
+	fprintf(stderr, "\t\tThe sizes and datarates in the XML output are approximated\n");
+	fprintf(stderr, "\t\tand the keyframes are omitted. Only -x, -j and --seektable\n");
+	fprintf(stderr, "\t\tare allowed.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\t--start seconds\n");
+	fprintf(stderr, "\t\tOnly write the tags from the last keyframe at or before this\n");
+	fprintf(stderr, "\t\ttime on. The AVC and AAC sequence headers are kept. The\n");
+	fprintf(stderr, "\t\ttimestamps stay the same and the metadata describes only the\n");
+	fprintf(stderr, "\t\twritten tags.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\t--end seconds\n");
+	fprintf(stderr, "\t\tOnly write the tags before this time.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\t--split-duration seconds\n");
+	fprintf(stderr, "\t\tCut the file at keyframes into segments of at least this\n");
+	fprintf(stderr, "\t\tduration. -o movie.flv writes movie-000.flv, movie-001.flv\n");
+	fprintf(stderr, "\t\tand so on. Every segment has its own metadata and starts at\n");
+	fprintf(stderr, "\t\ttimestamp 0. The segments are written in parallel.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\t--split-size bytes\n");
+	fprintf(stderr, "\t\tCut the file at keyframes into segments of about this size,\n");
+	fprintf(stderr, "\t\te.g. 512K, 64M or 2G.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\t--reflink\n");
+	fprintf(stderr, "\t\tClone the audio and video tags from the input instead of\n");
+	fprintf(stderr, "\t\tcopying them, e.g. on XFS or Btrfs. An onFiller tag aligns\n");
+	fprintf(stderr, "\t\tthem to the blocks of the output. The tags are copied as\n");
+	fprintf(stderr, "\t\tusual if this is not possible.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\t--manifest manifest file\n");
+	fprintf(stderr, "\t\tDon't copy the tags. -o only receives the bytes that yamdi\n");
+	fprintf(stderr, "\t\tgenerates and the manifest file is a JSON list of the byte\n");
+	fprintf(stderr, "\t\tranges of the input and the -o file that make up the output.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\t--checksum list\n");
+	fprintf(stderr, "\t\tCompute checksums of the output while it is written, e.g.\n");
+	fprintf(stderr, "\t\tcrc32c,xxh64,sha256. They are added to the XML and JSON\n");
+	fprintf(stderr, "\t\toutput.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\t--checksum-file checksum file\n");
+	fprintf(stderr, "\t\tWrite the checksums as lines like 'SHA256 (out.flv) = ...'.\n");
+	fprintf(stderr, "\t\tWithout --checksum this is SHA-256.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\t--preallocate\n");
+	fprintf(stderr, "\t\tAllocate the size of the output file on the disk before it\n");
+	fprintf(stderr, "\t\tis written (Linux only).\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\t--direct-io\n");
+	fprintf(stderr, "\t\tWrite the output with O_DIRECT, past the page cache.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\t--drop-cache\n");
+	fprintf(stderr, "\t\tDrop the input and the output from the page cache behind\n");
+	fprintf(stderr, "\t\tthe read and write cursors.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\t--in-memory bytes\n");
+	fprintf(stderr, "\t\tRead input files up to this size at once and process them\n");
+	fprintf(stderr, "\t\tin memory, e.g. 512K or 16M. The default is 8M, 0 turns it off.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\t--in-place\n");
+	fprintf(stderr, "\t\tRewrite the input file in place instead of writing a new file.\n");
+	fprintf(stderr, "\t\tThe changes are recorded in <input file>.journal first, an\n");
+	fprintf(stderr, "\t\tinterrupted rewrite is finished by running yamdi again.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\t--serve socket\n");
+	fprintf(stderr, "\t\tStay resident and take requests on the UNIX socket, one per\n");
+	fprintf(stderr, "\t\tline, e.g. -i in.flv -o out.flv -k. The answer is one line of\n");
+	fprintf(stderr, "\t\tJSON with the status and the metadata. The other options are\n");
+	fprintf(stderr, "\t\tthe defaults for all requests.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\t--watch spool directory\n");
+	fprintf(stderr, "\t\tStay resident and process every file that is written or moved\n");
+	fprintf(stderr, "\t\tinto the spool directory into the directory given with -o\n");
+	fprintf(stderr, "\t\t(Linux only). Files starting with a dot are left alone.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\t--remove-input\n");
+	fprintf(stderr, "\t\tRemove a file from the spool directory after it has been\n");
+	fprintf(stderr, "\t\tprocessed by --watch.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\t--physical-order\n");
+	fprintf(stderr, "\t\tProcess the input files in the order in which they are stored\n");
+	fprintf(stderr, "\t\ton their devices instead of the order of -i. The output is\n");
+	fprintf(stderr, "\t\tthe same.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\t--device-readers n\n");
+	fprintf(stderr, "\t\tProcess n files of every device at the same time, in the\n");
+	fprintf(stderr, "\t\torder of --physical-order.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\t--time-limit seconds\n");
+	fprintf(stderr, "\t\tAbort a file that takes longer than this and remove its\n");
+	fprintf(stderr, "\t\toutput. The exit code is 12.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\t--io-limit bytes\n");
+	fprintf(stderr, "\t\tAbort a file that needs more than this many bytes to be read,\n");
+	fprintf(stderr, "\t\tloaded and written, e.g. 512M, and remove its output.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\t--metrics metrics file\n");
+	fprintf(stderr, "\t\tWrite counters and histograms of the processed files in the\n");
+	fprintf(stderr, "\t\tPrometheus text format, e.g. for the textfile collector of\n");
+	fprintf(stderr, "\t\tnode_exporter.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\t--metrics-interval seconds\n");
+	fprintf(stderr, "\t\tHow often the metrics file is written. Defaults to 15.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\t--index-mode mode\n");
+	fprintf(stderr, "\t\tHow to find the tags in the input file. 'serial' (default)\n");
+	fprintf(stderr, "\t\tfollows the tags from the beginning of the file.\n");
+	fprintf(stderr, "\t\t'bidirectional' scans from both ends of the file in two\n");
+	fprintf(stderr, "\t\tthreads at the same time. 'parallel' splits the file into\n");
+	fprintf(stderr, "\t\tchunks and scans every chunk in its own thread.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\t--threads n\n");
+	fprintf(stderr, "\t\tThe number of threads for --index-mode parallel, for writing\n");
+	fprintf(stderr, "\t\tthe segments and for --serve and --watch. Defaults to the number\n");
+	fprintf(stderr, "\t\tof CPUs.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\t--stats[=format]\n");
+	fprintf(stderr, "\t\tPrint the wall and CPU time of every phase, the bytes and\n");
+	fprintf(stderr, "\t\tcalls for reading, seeking and writing, the tags per second,\n");
+	fprintf(stderr, "\t\tthe size of the index and the peak RSS to stderr. The format\n");
+	fprintf(stderr, "\t\tis 'text' (default) or 'json'.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\t--trace trace file\n");
+	fprintf(stderr, "\t\tWrite the phases and spans of the index and copy loops in\n");
+	fprintf(stderr, "\t\tthe Chrome trace event format, e.g. for chrome://tracing or\n");
+	fprintf(stderr, "\t\tPerfetto. Every index and split thread gets its own track.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "\t--progress-fd n\n");
+	fprintf(stderr, "\t\tWrite the progress as one JSON object per line to the open\n");
+	fprintf(stderr, "\t\tfile descriptor n, at most every 0.5 seconds and at the end\n");
+	fprintf(stderr, "\t\tof every phase. A record has the phase, the tags and bytes\n");
+	fprintf(stderr, "\t\tprocessed so far, the throughput in MB/s and the ETA.\n");
+	fprintf(stderr, "\n");
 	fprintf(stderr, "\t-h\tThis description.\n");
 	fprintf(stderr, "\n");
 